@@ -29,6 +29,7 @@ run "make"
 echo "[+] Preparing ISO directory..."
 run "mkdir -p isodir/boot/grub"
 run "cp kernel.bin isodir/boot/kernel.bin"
+run "cp initrd.tar isodir/boot/initrd.tar"
 
 echo "[+] Creating GRUB config..."
 cat > isodir/boot/grub/grub.cfg <<EOF
@@ -37,6 +38,7 @@ set default=0
 
 menuentry \"AmitX Kernel\" {
     multiboot /boot/kernel.bin
+    module /boot/initrd.tar initrd
     boot
 }
 EOF
@@ -44,9 +46,19 @@ EOF
 echo "[+] Creating bootable ISO..."
 run "grub-mkrescue -o amitx.iso isodir"
 
+if [[ ! -f disk.img ]]; then
+    echo "[+] Creating 32 MB disk image..."
+    run "dd if=/dev/zero of=disk.img bs=1M count=32"
+    # FAT16, mounted at /Disk. Copy files in and out from the host with
+    # mcopy -i disk.img <file> ::  and  mcopy -i disk.img ::<file> .
+    if command -v mkfs.fat >/dev/null; then
+        run "mkfs.fat -F 16 -n AMITX disk.img"
+    fi
+fi
+
 echo "[+] Launching QEMU..."
 set +e
-qemu-system-i386 -cdrom amitx.iso -m 256 -no-reboot -serial stdio -monitor none -device isa-debug-exit,iobase=0xf4,iosize=0x04 -full-screen
+qemu-system-i386 -cdrom amitx.iso -drive file=disk.img,format=raw,index=0,media=disk -m 256 -smp 4 -no-reboot -serial stdio -monitor none -device isa-debug-exit,iobase=0xf4,iosize=0x04 -full-screen
 QEMU_EXIT=$?
 run "make clean"
 
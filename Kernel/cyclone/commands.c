@@ -3,19 +3,46 @@
 #include "cyclone.h"
 #include "screen.h"
 #include "string.h"
+#include "heap.h"
 #include "utils.h"
 #include "kernel.h"
 #include "fs.h"
 #include "time.h"
 #include "tests.h"
+#include "irqstat.h"
+#include "task.h"
+#include "smp.h"
+#include "load.h"
+#include "top.h"
+#include "app.h"
+#include "process.h"
+#include "timer.h"
+#include "cpu.h"
+#include "ata.h"
+#include "bcache.h"
+#include "blkq.h"
+#include "fat.h"
+#include "vfs.h"
+#include "pcache.h"
+#include "zcache.h"
 
 extern int tick_count;
 extern int load_cyclone;
 extern int version;
 
+// Relative paths start here. /Saved, so `read hello.txt` works as before.
+static char cwd[FS_PATH_MAX] = "/Saved";
 
-void execute_command(const char* input) {
-    puts(">> ");
+// arg made absolute against cwd; complains and returns 0 if it is too long
+static int resolve(const char* arg, char* path) {
+    if (fs_normalize(cwd, arg, path, FS_PATH_MAX) < 0) {
+        puts("Path too long");
+        return 0;
+    }
+    return 1;
+}
+
+static void run_command(const char* input) {
     if (starts_with(input, "echo ") || starts_with(input, "hoot ")) {
         const char* message = input + 5;  // Skip "echo "
         puts(message);
@@ -24,8 +51,49 @@ void execute_command(const char* input) {
         uint32_t number = atoi(num);
         puthex(number);
     } else if (starts_with(input, "touch ")) {
-        const char* file = input + 6;
-        fs_add(file, "");
+        char path[FS_PATH_MAX];
+        if (resolve(input + 6, path) && !fs_add(path, "")) {
+            puts("Could not create file");
+        }
+    } else if (starts_with(input, "mkdir ")) {
+        char path[FS_PATH_MAX];
+        if (resolve(input + 6, path) && fs_mkdir(path) < 0) {
+            puts("Could not create directory");
+        }
+    } else if (strcmp(input, "cd") == 0 || starts_with(input, "cd ")) {
+        char path[FS_PATH_MAX];
+        FsStat st;
+        if (resolve(input[2] ? input + 3 : "/", path)) {
+            if (fs_stat(path, &st) < 0 || st.type != FS_DIR) {
+                puts("No such directory");
+            } else {
+                strcpy(cwd, path);
+                puts(cwd);
+            }
+        }
+    } else if (strcmp(input, "pwd") == 0) {
+        puts(cwd);
+    } else if (starts_with(input, "write ") || starts_with(input, "append ")) {
+        int append = input[0] == 'a';
+        char name[FS_PATH_MAX], path[FS_PATH_MAX];
+        const char* arg = input + (append ? 7 : 6);
+        size_t len = 0;
+        while (*arg && *arg != ' ' && len < sizeof(name) - 1) name[len++] = *arg++;
+        name[len] = '\0';
+        while (*arg == ' ') arg++;
+        if (!resolve(name, path)) return;
+
+        int err = append ? fs_append(path, arg, strlen(arg)) : fs_write(path, arg, strlen(arg));
+        if (err < 0) {
+            puts("Could not write file");
+        } else {
+            FsStat st;
+            fs_stat(path, &st);
+            puts(path);
+            puts(": ");
+            putuint(st.size);
+            puts(" bytes");
+        }
     } else if (starts_with(input, "test ")) {
         const char* num = input + 5;
         int n = atoi(num);
@@ -33,28 +101,179 @@ void execute_command(const char* input) {
         test(n);
 
     } else if (starts_with(input, "read ")) {
-        const char* file = input + 5;
-        puts(file);
-        newline();
-
-
-        char path[64];
-        strcpy(path, "/Saved/");  // Copy folder path into buffer
-        strcat(path, file);       // Safely append the filename
-        
+        char path[FS_PATH_MAX];
+        if (!resolve(input + 5, path)) return;
         puts(path);
         newline();
 
-        const char* content = fs_read(path);
-        puts(content);
+        char chunk[129];
+        uint32_t offset = 0;
+        int n;
+        while ((n = pcache_read(path, offset, chunk, sizeof(chunk) - 1)) > 0) {
+            chunk[n] = '\0';
+            puts(chunk);
+            offset += n;
+        }
+        if (n < 0) puts("No such file");
+    } else if (starts_with(input, "irqstat")) {
+        const char* arg = input + 7;
+        while (*arg == ' ') arg++;
+        if (strcmp(arg, "serial") == 0) {
+            irqstat_dump_serial();
+            puts("irqstat written to serial");
+        } else if (strcmp(arg, "reset") == 0) {
+            irqstat_reset();
+            puts("irqstat counters cleared");
+        } else if (*arg) {
+            puts("\n");
+            irqstat_print_hist(atoi(arg));
+        } else {
+            puts("\n");
+            irqstat_print();
+        }
+    } else if (starts_with(input, "spawn ")) {
+        const char* name = input + 6;
+        int id = -1;
+        if (strcmp(name, "counter") == 0) {
+            id = register_task("counter", task_counter);
+        } else if (strcmp(name, "heartbeat") == 0) {
+            id = register_task("heartbeat", task_heartbeat);
+        }
+        if (id < 0) {
+            puts("Could not spawn task");
+        } else {
+            puts("Spawned task ");
+            putint(id);
+        }
+    } else if (starts_with(input, "kill ")) {
+        int id = atoi(input + 5);
+        puts(task_kill(id) == 0 ? "Task will exit at its next safe point" : "No such task");
+    } else if (starts_with(input, "prio ")) {
+        const char* arg = input + 5;
+        int id = atoi(arg);
+        while (*arg && *arg != ' ') arg++;
+        int prio = atoi(arg + (*arg == ' '));
+        puts(task_set_priority(id, prio) == 0 ? "Priority set" : "Bad task or priority (0-31)");
+    } else if (starts_with(input, "run ")) {
+        char path[FS_PATH_MAX];
+        if (!resolve(input + 4, path)) return;
+        int pid = process_spawn(path, 0);
+        if (pid == PROC_ENOENT) {
+            puts("No such program");
+        } else if (pid == PROC_ENOEXEC) {
+            puts("Not an executable");
+        } else if (pid < 0) {
+            puts("Could not start process");
+        } else {
+            newline();
+            ProcResult r;
+            process_wait(pid, &r);
+            puts("[pid ");
+            putint(pid);
+            puts(" exited with ");
+            putint(r.exit_code);
+            puts(", started in ");
+            putuint(time_cycles_to_us(r.start_cycles));
+            puts(" us]");
+        }
+    } else if (strcmp(input, "disk") == 0) {
+        const AtaDrive* d = ata_drive();
+        if (!d->present) {
+            puts("No disk attached");
+            return;
+        }
+        AtaStats as;
+        BcacheStats bs;
+        ata_stats(&as);
+        bcache_stats(&bs);
+        puts(d->model);
+        puts(", ");
+        putuint(d->sectors / 2048);
+        puts(d->dma ? " MB, DMA\n" : " MB, PIO\n");
+        puts("  device: "); putuint(as.reads); puts(" reads ("); putuint(as.sectors_read);
+        puts(" sectors), "); putuint(as.writes); puts(" writes ("); putuint(as.sectors_written);
+        puts(" sectors), "); putuint(as.errors); puts(" errors\n");
+        puts("  cache:  "); putuint(bs.hits); puts(" hits, "); putuint(bs.misses);
+        puts(" misses, "); putuint(bs.evictions); puts(" evicted, "); putuint(bs.dirty);
+        puts(" dirty, "); putuint(bs.writebacks); puts(" written back\n");
+        puts("  ahead:  "); putuint(bs.ra_sectors); puts(" sectors, "); putuint(bs.ra_hits);
+        puts(" used, "); putuint(bs.ra_wasted); puts(" wasted, window "); putuint(bs.ra_window); puts("\n");
+        BlkStats q;
+        blk_stats(&q);
+        puts("  queue:  "); putuint(q.bios); puts(" bios in "); putuint(q.requests);
+        puts(" requests, "); putuint(q.back_merges + q.front_merges + q.joins); puts(" merges, depth ");
+        putuint(q.depth); puts(" (max "); putuint(q.max_depth); puts(", avg ");
+        putuint(q.requests ? q.depth_sum / q.requests : 0); puts(")");
+        FatStats fs;
+        fat_stats(&fs);
+        if (fs.type) {
+            puts("\n  " FAT_MOUNT ":  FAT"); putuint(fs.type); puts(", "); putuint(fs.free);
+            puts(" of "); putuint(fs.clusters); puts(" clusters free ("); putuint(fs.cluster_size);
+            puts(" bytes), chains "); putuint(fs.chain_hits); puts("/"); putuint(fs.chain_misses);
+            puts(", dirs "); putuint(fs.dir_hits); puts("/"); putuint(fs.dir_misses); puts(" hit/miss");
+        }
+    } else if (strcmp(input, "mounts") == 0) {
+        vfs_print_mounts();
+    } else if (strcmp(input, "fsstat") == 0) {
+        PcacheStats ps;
+        pcache_stats(&ps);
+        puts("Page cache: "); putuint(ps.pages); puts(" of "); putuint(PCACHE_PAGES); puts(" pages, ");
+        putuint(ps.files); puts(" files, "); putuint(ps.mapped); puts(" mapped, "); putuint(ps.dirty); puts(" dirty\n");
+        puts("  "); putuint(ps.hits); puts(" hits, "); putuint(ps.misses); puts(" misses, ");
+        putuint(ps.evictions); puts(" evicted, "); putuint(ps.writebacks); puts(" written back\n");
+        ZcacheStats zs;
+        zcache_stats(&zs);
+        puts("LZ4: "); putuint(zs.files); puts(" packed files, "); putuint(zs.raw_bytes); puts(" bytes in ");
+        putuint(zs.packed_bytes); puts(" (");
+        putuint(zs.raw_bytes ? (uint32_t)div64_32((uint64_t)zs.packed_bytes * 100, zs.raw_bytes) : 0); puts("%)\n");
+        uint32_t us = time_cycles_to_us(zs.cycles);
+        puts("  "); putuint(zs.hits); puts(" hits, "); putuint(zs.misses); puts(" pages unpacked at ");
+        putuint(us ? (uint32_t)div64_32(zs.unpacked, us) : 0); puts(" MB/s");
+    } else if (starts_with(input, "compress ") || starts_with(input, "uncompress ")) {
+        char path[FS_PATH_MAX];
+        int on = input[0] == 'c';
+        if (!resolve(input + (on ? 9 : 11), path)) return;
+        int packed = fs_compress(path, on);
+        if (packed < 0) {
+            puts("No such file in memory");
+        } else if (on) {
+            FsStat st;
+            fs_stat(path, &st);
+            if (!packed) {
+                puts("Kept as is, it would not shrink");
+            } else {
+                putuint(st.size); puts(" bytes packed into "); putuint(st.packed);
+            }
+        } else {
+            puts(packed ? "Could not unpack" : "Unpacked");
+        }
+    } else if (strcmp(input, "sync") == 0) {
+        int err = pcache_sync(-1);
+        puts(bsync() == 0 && err == 0 ? "Synced" : "Write back failed");
+    } else if (strcmp(input, "procs") == 0) {
+        puts("\n");
+        process_print();
+    } else if (strcmp(input, "tasks") == 0) {
+        puts("\n");
+        task_print();
+    } else if (strcmp(input, "top") == 0) {
+        top_main();
+    } else if (strcmp(input, "cpus") == 0) {
+        puts("\n");
+        smp_print();
+    } else if (starts_with(input, "slice ")) {
+        task_set_timeslice(atoi(input + 6));
+        puts("Time slice: ");
+        putint(task_get_timeslice());
+        puts(" ticks");
     } else if (strcmp(input, "coffee") == 0) {
         uint32_t number = 12648430;
         puthex(number);
-    } else if (strcmp(input, "time") == 0) {
-        int time = tick_count / 100;
+    } else if (strcmp(input, "time") == 0 || strcmp(input, "uptime") == 0) {
         puts("Uptime: ");
-        putint(time);
-        puts(" seconds");
+        putint(tick_count / TIMER_HZ);
+        puts(" seconds\n");
+        load_print();
     } else if (strcmp(input, "back") == 0) {
         load_cyclone = 0;
         clear();
@@ -70,16 +289,50 @@ void execute_command(const char* input) {
         puts("Available commands:\n");
         puts("  echo/hoot <text>   - Print text\n");
         puts("  hex <number>       - Print number as hex\n");
-        puts("  time               - Show uptime\n");
+        puts("  time/uptime        - Uptime, load averages, CPU busy %\n");
         puts("  clear              - Clear screen\n");
         puts("  back               - Return to menu\n");
         puts("  quit               - Exit system\n");
         puts("  coffee             - Print 0xC0FFEE\n");
-        puts("  ls                 - Print files\n");
+        puts("  ls [dir], cd [dir], pwd, mkdir <dir> - Browse directories\n");
+        puts("  write/append <path> <text> - Replace or extend a file\n");
+        puts("  irqstat [n|serial|reset] - Interrupt cost stats\n");
+        puts("  spawn <counter|heartbeat>, kill <id>, tasks, slice <ticks>\n");
+        puts("  prio <id> <0-31>   - Set task priority (0 = most urgent)\n");
+        puts("  cpus               - List CPUs and their run queues\n");
+        puts("  top                - Live per-task CPU time, switches, latency\n");
+        puts("  run <path>         - Run a program in ring 3, e.g. run /Apps/hello\n");
+        puts("  procs              - List user processes\n");
+        puts("  disk, sync         - Disk, block cache and FAT stats, write back now\n");
+        puts("  ls /Disk           - Files on the FAT disk (8.3 names for new files)\n");
+        puts("  mounts             - Mounted filesystems\n");
+        puts("  fsstat             - Page cache and LZ4 stats\n");
+        puts("  compress/uncompress <path> - Keep a file in memory LZ4-packed, or not\n");
         puts("  switch logo        - Switch Owly ASCII art");
-    } else if (strcmp(input, "ls") == 0) {
+    } else if (strcmp(input, "ls") == 0 || starts_with(input, "ls ")) {
+        char path[FS_PATH_MAX];
+        FsStat st;
+        if (!resolve(input[2] ? input + 3 : ".", path)) return;
+        if (fs_stat(path, &st) < 0 || st.type != FS_DIR) {
+            puts("No such directory");
+            return;
+        }
         puts("\b\b\b");
-        fs_debug_list();
+        FsIter it = { 0 };
+        FsDirent e;
+        while (fs_readdir(path, &it, &e)) {
+            puts("-> ");
+            puts(e.name);
+            if (e.type == FS_DIR) {
+                puts("/  ");
+                putuint(e.size);
+                puts(" entries\n");
+            } else {
+                puts("  ");
+                putuint(e.size);
+                puts(" bytes\n");
+            }
+        }
     } else if (strcmp(input, "quit") == 0) {
         sleep(1);
         qemu_exit(0);
@@ -88,5 +341,10 @@ void execute_command(const char* input) {
     } else {
         puts("Unknown command");
     }
+}
+
+void execute_command(const char* input) {
+    puts(">> ");
+    run_command(input);
     newline();
 }
@@ -0,0 +1,155 @@
+
+#include "top.h"
+#include "screen.h"
+#include "keyboard.h"
+#include "task.h"
+#include "smp.h"
+#include "load.h"
+#include "time.h"
+#include "timer.h"
+#include "cpu.h"
+
+#define TOP_MAX_TASKS     18   // Visible list rows, minus the header
+#define TOP_REFRESH_TICKS 100
+#define TOP_ROW_WIDTH     78
+
+static TaskStats top_now[TOP_MAX_TASKS];
+static TaskStats top_prev[TOP_MAX_TASKS];
+static int top_prev_count = 0;
+static uint64_t top_prev_tsc = 0;
+
+static char top_rows[TOP_MAX_TASKS + 1][TOP_ROW_WIDTH + 1];
+static const char* top_items[TOP_MAX_TASKS + 1];
+
+// Left-aligned text padded to width
+static char* top_text(char* p, const char* s, int width) {
+    int i = 0;
+    for (; s[i] && i < width - 1; i++) p[i] = s[i];
+    for (; i < width; i++) p[i] = ' ';
+    return p + width;
+}
+
+// Right-aligned number, then one space
+static char* top_num(char* p, uint32_t v, int width) {
+    char digits[12];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v && n < 11);
+    for (int i = 0; i < width - 1; i++) {
+        int d = width - 2 - i;
+        p[i] = d < n ? digits[d] : ' ';
+    }
+    p[width - 1] = ' ';
+    return p + width;
+}
+
+static const TaskStats* top_find_prev(int id) {
+    for (int i = 0; i < top_prev_count; i++) {
+        if (top_prev[i].id == id) return &top_prev[i];
+    }
+    return 0;
+}
+
+static void top_build_rows(int count, uint64_t interval) {
+    // One letter each, by TASK_* value: queued, running, dead, sleeping
+    static const char* states[] = { "Q", "R", "Z", "S" };
+    char* p = top_rows[0];
+    p = top_text(p, "ID", 4);
+    p = top_text(p, "NAME", 12);
+    p = top_text(p, "CPU", 4);
+    p = top_text(p, "ST", 4);
+    p = top_text(p, "  %CPU", 7);
+    p = top_text(p, "  TIME ms", 10);
+    p = top_text(p, "    SW", 7);
+    p = top_text(p, "   VOL", 7);
+    p = top_text(p, " INVOL", 7);
+    p = top_text(p, "LAT avg", 8);
+    p = top_text(p, "max us", 8);
+    *p = '\0';
+    top_items[0] = top_rows[0];
+
+    uint32_t interval_us = time_cycles_to_us(interval);
+    for (int i = 0; i < count; i++) {
+        const TaskStats* s = &top_now[i];
+        const TaskStats* prev = top_find_prev(s->id);
+        uint64_t ran = s->runtime - (prev ? prev->runtime : 0);
+        uint32_t pct = interval_us ? (uint32_t)(time_cycles_to_us(ran) / (interval_us / 100 + 1)) : 0;
+        uint32_t lat_avg = s->lat_count ? (uint32_t)div64_32(s->lat_total, s->lat_count) : 0;
+
+        p = top_rows[i + 1];
+        p = top_num(p, s->id, 4);
+        p = top_text(p, s->name, 12);
+        p = top_num(p, s->cpu, 4);
+        p = top_text(p, states[s->state], 4);
+        p = top_num(p, pct > 100 ? 100 : pct, 7);
+        p = top_num(p, time_cycles_to_us(s->runtime) / 1000, 10);
+        p = top_num(p, s->switches, 7);
+        p = top_num(p, s->nvcsw, 7);
+        p = top_num(p, s->nivcsw, 7);
+        p = top_num(p, time_cycles_to_us(lat_avg), 8);
+        p = top_num(p, time_cycles_to_us(s->lat_max), 8);
+        *p = '\0';
+        top_items[i + 1] = top_rows[i + 1];
+    }
+}
+
+static void top_draw() {
+    extern volatile uint32_t tick_count;
+
+    uint64_t tsc = rdtsc();
+    int count = task_stats(top_now, TOP_MAX_TASKS);
+    top_build_rows(count, top_prev_tsc ? tsc - top_prev_tsc : 0);
+    for (int i = 0; i < count; i++) top_prev[i] = top_now[i];
+    top_prev_count = count;
+    top_prev_tsc = tsc;
+
+    clear();
+    draw_title_box(0, 0, VGA_WIDTH, 4, " top - q to quit ", 15, 0);
+
+    uint32_t avg[3];
+    load_get_avg(avg);
+    move_cursor(2, 1);
+    puts("up ");
+    putuint(tick_count / TIMER_HZ);
+    puts("s   load ");
+    for (int i = 0; i < 3; i++) {
+        putuint(avg[i] / 100);
+        putc('.');
+        if (avg[i] % 100 < 10) putc('0');
+        putuint(avg[i] % 100);
+        putc(' ');
+    }
+    puts("  tasks ");
+    putint(count);
+
+    move_cursor(2, 2);
+    for (int i = 0; i < cpu_count; i++) {
+        puts("cpu");
+        putint(i);
+        putc(' ');
+        putuint(load_cpu_busy(i));
+        puts("%  ");
+    }
+
+    draw_list(0, 4, VGA_WIDTH, VGA_HEIGHT - 4, top_items, count + 1, 0);
+}
+
+// Live task view, redrawn every second until 'q'
+void top_main() {
+    top_prev_count = 0;
+    top_prev_tsc = 0;
+    keyboard_poll();
+
+    while (1) {
+        top_draw();
+        for (int t = 0; t < TOP_REFRESH_TICKS; t += 10) {
+            sleep_t(10);
+            if (keyboard_poll() == 'q') {
+                clear();
+                return;
+            }
+        }
+    }
+}
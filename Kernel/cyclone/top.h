@@ -0,0 +1,7 @@
+
+#ifndef TOP_H
+#define TOP_H
+
+void top_main();
+
+#endif
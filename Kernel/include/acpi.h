@@ -0,0 +1,18 @@
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+#define ACPI_MAX_CPUS 8
+
+typedef struct {
+    uint32_t lapic_address;
+    int cpu_count;
+    uint8_t apic_ids[ACPI_MAX_CPUS];
+} AcpiMadtInfo;
+
+// Find the MADT through the RSDP/RSDT and collect the enabled local APICs
+int acpi_parse_madt(AcpiMadtInfo* info);
+
+#endif
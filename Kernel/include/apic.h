@@ -0,0 +1,24 @@
+
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+#define APIC_TIMER_VECTOR    0x40   // Per-CPU scheduler tick on the APs
+#define APIC_RESCHED_VECTOR  0x41   // "Look at your run queue" IPI
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+extern int lapic_available;
+
+void lapic_init(uint32_t base, int bsp);
+uint8_t lapic_id();
+void lapic_eoi();
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_sipi(uint8_t apic_id, uint8_t page);
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+uint32_t lapic_timer_calibrate(uint32_t ticks);
+void lapic_timer_start(uint32_t count_per_tick);
+
+#endif
@@ -0,0 +1,104 @@
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdint.h>
+
+// Stackless coroutines for drivers. An async task is a function that is
+// re-entered from the top each time it is resumed; ASYNC_BEGIN jumps back
+// to where it last suspended. Locals do NOT survive a suspension, keep
+// state in the task's data or in statics. All async tasks share one
+// executor thread, so a blocked handshake costs a list entry, not a stack.
+//
+//   static int probe(AsyncTask* t) {
+//       ASYNC_BEGIN(t);
+//       outb(PORT, CMD);
+//       ASYNC_WAIT_IRQ(t, 12, reply_ready, 10);
+//       if (t->timed_out) return ASYNC_DONE;
+//       ...
+//       ASYNC_END(t);
+//   }
+
+#define ASYNC_PENDING 0
+#define ASYNC_DONE    1
+
+// What a waiting task is woken by, besides its timeout
+#define ASYNC_NO_IRQ  0xFF   // Only the timeout
+#define ASYNC_POLL    0xFE   // Every timer tick, to re-check a condition
+
+// Task states
+#define ASYNC_RUNNABLE 0
+#define ASYNC_RUNNING  1
+#define ASYNC_WAITING  2
+#define ASYNC_FINISHED 3
+
+typedef struct AsyncTask AsyncTask;
+typedef int (*async_fn)(AsyncTask* t);
+
+struct AsyncTask {
+    const char* name;
+    async_fn fn;
+    void* data;
+    uint16_t resume;      // Where ASYNC_BEGIN jumps to, 0 = the top
+    uint8_t state;
+    uint8_t irq;          // IRQ line we wait for, or ASYNC_NO_IRQ / ASYNC_POLL
+    uint32_t deadline;    // tick_count at which the wait times out
+    int timed_out;        // Set when the last wait ended by its timeout
+    AsyncTask* next;
+};
+
+void async_init();
+int async_spawn(AsyncTask* t, const char* name, async_fn fn, void* data);
+void async_irq(int irq);           // From isr_handler, IRQ 0-15
+void async_tick(uint32_t now);     // From timer_callback
+int async_count();
+
+// Helpers for the macros below
+void async_set_timeout(AsyncTask* t, uint32_t ticks);
+void async_arm(AsyncTask* t, uint8_t irq);
+void async_disarm(AsyncTask* t);
+int async_expired(AsyncTask* t);
+
+#define ASYNC_BEGIN(t)  switch ((t)->resume) { case 0:
+#define ASYNC_END(t)    } (t)->resume = 0; return ASYNC_DONE
+
+// Each suspension point needs its own case label, so multi-await macros
+// get a fresh number from __COUNTER__ (expanded once per use)
+#define ASYNC_YIELD(t)  ASYNC_YIELD_AT(t, __COUNTER__ + 1)
+#define ASYNC_YIELD_AT(t, n)                                    \
+    do {                                                        \
+        (t)->resume = (n);                                      \
+        return ASYNC_PENDING;                                   \
+        case (n):;                                              \
+    } while (0)
+
+// Suspend until cond holds, re-checking whenever irq fires (or every tick
+// for ASYNC_POLL). Gives up after ticks timer ticks with t->timed_out set.
+// cond is checked after the task is armed, so an IRQ that races the
+// check is not lost.
+#define ASYNC_WAIT_AT(t, n, irq, cond, ticks)                   \
+    do {                                                        \
+        async_set_timeout((t), (ticks));                        \
+        (t)->resume = (n);                                      \
+        __attribute__((fallthrough));                           \
+        case (n):                                               \
+        async_arm((t), (irq));                                  \
+        if (cond) {                                             \
+            async_disarm(t);                                    \
+        } else if (async_expired(t)) {                          \
+            async_disarm(t);                                    \
+            (t)->timed_out = 1;                                 \
+        } else {                                                \
+            return ASYNC_PENDING;                               \
+        }                                                       \
+    } while (0)
+
+#define ASYNC_WAIT_IRQ(t, irq, cond, ticks) ASYNC_WAIT_AT(t, __COUNTER__ + 1, irq, cond, ticks)
+#define ASYNC_WAIT_UNTIL(t, cond, ticks)    ASYNC_WAIT_AT(t, __COUNTER__ + 1, ASYNC_POLL, cond, ticks)
+#define ASYNC_WAIT_TIMEOUT(t, ticks)                            \
+    do {                                                        \
+        ASYNC_WAIT_AT(t, __COUNTER__ + 1, ASYNC_NO_IRQ, 0, ticks); \
+        (t)->timed_out = 0;                                     \
+    } while (0)
+
+#endif
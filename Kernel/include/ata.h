@@ -0,0 +1,43 @@
+
+#ifndef ATA_H
+#define ATA_H
+
+#include <stdint.h>
+
+#define ATA_SECTOR_SIZE  512
+#define ATA_MAX_SECTORS  256   // Per command, the most LBA28 can ask for
+#define ATA_MAX_SEGS     128   // Buffers per command, well within one page of PRDs
+
+// A piece of a scatter/gather transfer
+typedef struct {
+    uint8_t* buf;
+    uint32_t count;          // Sectors
+} AtaSeg;
+
+// The primary master, the only drive we drive
+typedef struct {
+    int present;
+    int dma;                 // Bus-master DMA works; otherwise PIO
+    uint32_t sectors;        // LBA28 addressable sectors
+    char model[41];
+} AtaDrive;
+
+typedef struct {
+    uint32_t reads;          // Commands issued
+    uint32_t writes;
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t dma_ops;
+    uint32_t pio_ops;
+    uint32_t errors;
+    uint64_t busy_cycles;    // From issuing a command to its completion
+} AtaStats;
+
+void ata_init();
+int ata_transfer(uint32_t lba, const AtaSeg* segs, int nsegs, int write);
+int ata_flush();
+void ata_tick(uint32_t now);
+const AtaDrive* ata_drive();
+void ata_stats(AtaStats* out);
+
+#endif
@@ -0,0 +1,67 @@
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include <stdint.h>
+
+// Lock-prefixed read-modify-write on an int, safe across CPUs and against
+// interrupts. Plain loads and stores of an aligned int are already atomic
+// on x86; atomic_read/atomic_set only stop the compiler caching them.
+
+typedef struct {
+    volatile int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(n) { (n) }
+
+#define barrier()  __asm__ __volatile__ ("" ::: "memory")
+#define smp_mb()   __sync_synchronize()
+#define cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+
+static inline int atomic_read(const atomic_t* a) {
+    return a->counter;
+}
+
+static inline void atomic_set(atomic_t* a, int n) {
+    a->counter = n;
+}
+
+static inline void atomic_add(atomic_t* a, int n) {
+    __sync_fetch_and_add(&a->counter, n);
+}
+
+static inline void atomic_sub(atomic_t* a, int n) {
+    __sync_fetch_and_sub(&a->counter, n);
+}
+
+static inline void atomic_inc(atomic_t* a) {
+    __sync_fetch_and_add(&a->counter, 1);
+}
+
+static inline void atomic_dec(atomic_t* a) {
+    __sync_fetch_and_sub(&a->counter, 1);
+}
+
+// Returns the value before the add
+static inline int atomic_fetch_add(atomic_t* a, int n) {
+    return __sync_fetch_and_add(&a->counter, n);
+}
+
+static inline int atomic_add_return(atomic_t* a, int n) {
+    return __sync_add_and_fetch(&a->counter, n);
+}
+
+static inline int atomic_dec_and_test(atomic_t* a) {
+    return __sync_sub_and_fetch(&a->counter, 1) == 0;
+}
+
+static inline int atomic_xchg(atomic_t* a, int n) {
+    return __sync_lock_test_and_set(&a->counter, n);
+}
+
+// Returns the old value; the swap happened if it equals expected
+static inline int atomic_cmpxchg(atomic_t* a, int expected, int n) {
+    return __sync_val_compare_and_swap(&a->counter, expected, n);
+}
+
+#endif
@@ -0,0 +1,52 @@
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "blkq.h"
+
+#define BCACHE_BLOCKS       1024   // Cached sectors, 512 KB
+#define BCACHE_BUCKETS      256
+#define BCACHE_FLUSH_TICKS  100    // Writeback period, 1 s
+#define BCACHE_RA_MIN       8      // Read-ahead window, in sectors
+#define BCACHE_RA_MAX       128
+
+// One cached disk sector. Pinned between bread and brelse; the holder
+// may change data and then call bdirty.
+typedef struct Buf {
+    uint32_t lba;
+    uint8_t* data;
+    uint32_t refs;
+    volatile uint8_t valid;   // data holds the sector
+    volatile uint8_t dirty;   // Changed since it was last written
+    volatile uint8_t busy;    // Being read or written back
+    uint8_t ra;               // Read ahead and not asked for yet
+    BlkBio io;                // Its transfer while busy
+    struct Buf* hash_next;
+    struct Buf* lru_prev;     // Most recently released at the head
+    struct Buf* lru_next;
+} Buf;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;      // Sectors written back
+    uint32_t dirty;           // Right now
+    uint32_t pinned;
+    uint32_t ra_sectors;      // Read ahead
+    uint32_t ra_hits;         // ... and then asked for
+    uint32_t ra_wasted;       // ... and evicted unused
+    uint32_t ra_window;       // Current window
+} BcacheStats;
+
+void bcache_init();
+Buf* bread(uint32_t lba);
+Buf* bnew(uint32_t lba);
+void bdirty(Buf* b);
+void brelse(Buf* b);
+int bsync();
+void bcache_drop();
+void bcache_stats(BcacheStats* out);
+
+#endif
@@ -0,0 +1,43 @@
+
+#ifndef BLKQ_H
+#define BLKQ_H
+
+#include <stdint.h>
+
+#define BLK_MAX_REQUESTS    64
+#define BLK_READ_DEADLINE   10    // Ticks a read may wait behind the elevator
+#define BLK_WRITE_DEADLINE  50
+
+#define BLK_PENDING         1     // BlkBio.status until it completes
+
+// One caller's transfer. Bios for neighbouring sectors are merged into
+// one request, which the disk does as one command.
+typedef struct BlkBio {
+    uint32_t lba;
+    uint32_t count;              // Sectors
+    uint8_t* buf;
+    int write;
+    volatile int status;         // BLK_PENDING, then 0 or -1
+    void (*end)(struct BlkBio* bio);   // Completion callback, or NULL
+    void* priv;
+    struct BlkBio* next;         // Within its request
+} BlkBio;
+
+typedef struct {
+    uint32_t bios;               // Submitted
+    uint32_t requests;           // Sent to the disk
+    uint32_t back_merges;        // Bio appended to a request
+    uint32_t front_merges;       // Bio prepended
+    uint32_t joins;              // Two requests became one
+    uint32_t deadline_picks;     // Served out of elevator order
+    uint32_t depth;              // Queued requests right now
+    uint32_t max_depth;
+    uint32_t depth_sum;          // Depth at each dispatch, for the average
+    uint32_t sectors;
+} BlkStats;
+
+void blk_submit(BlkBio* bio);
+void blk_run();
+void blk_stats(BlkStats* out);
+
+#endif
@@ -0,0 +1,52 @@
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Read the time stamp counter (cycles since reset)
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__ ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ __volatile__ ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+#define EFLAGS_IF 0x200   // Interrupts enabled
+
+// Disable interrupts, returning the old EFLAGS for irq_restore()
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ __volatile__ ("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__ ("pushl %0; popfl" :: "r"(flags) : "memory", "cc");
+}
+
+// 64-by-32 division without libgcc's __udivdi3
+static inline uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t rem = hi % d;
+    uint32_t q_lo;
+    __asm__ ("divl %4" : "=a"(q_lo), "=d"(rem) : "a"(lo), "d"(rem), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+#endif
@@ -0,0 +1,61 @@
+
+#ifndef ELF_H
+#define ELF_H
+
+#include <stdint.h>
+
+#define ELF_MAGIC     0x464C457F   // "\x7FELF" read as a little-endian word
+#define ELFCLASS32    1
+#define ELFDATA2LSB   1
+#define ET_EXEC       2
+#define EM_386        3
+
+#define PT_LOAD       1
+
+#define PF_X          0x1
+#define PF_W          0x2
+#define PF_R          0x4
+
+typedef struct {
+    uint32_t e_magic;
+    uint8_t  e_class;
+    uint8_t  e_data;
+    uint8_t  e_version_ident;
+    uint8_t  e_pad[9];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} __attribute__((packed)) Elf32_Ehdr;
+
+typedef struct {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} __attribute__((packed)) Elf32_Phdr;
+
+// Error codes from elf_load
+#define ELF_OK           0
+#define ELF_BAD_HEADER  -1
+#define ELF_BAD_SEGMENT -2
+#define ELF_NO_MEMORY   -3
+
+// cacheable: the image never changes or goes away, so its read-only
+// segments may be shared by later instances
+int elf_load(const void* image, uint32_t size, uint32_t* dir, uint32_t* entry, int cacheable);
+
+#endif
@@ -0,0 +1,42 @@
+
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+#include "fs.h"
+
+#define FAT_MOUNT        "/Disk"
+#define FAT_CHAIN_CACHE  16    // Files whose cluster chains are kept
+#define FAT_DIR_CACHE    16    // Directories whose entries are kept hashed
+
+typedef struct {
+    uint32_t type;             // 16 or 32; 0 when nothing is mounted
+    uint32_t cluster_size;     // Bytes
+    uint32_t clusters;
+    uint32_t free;
+    uint32_t chain_hits;       // Cluster lookups served by a cached chain
+    uint32_t chain_misses;     // ... and chains walked from the FAT
+    uint32_t dir_hits;         // Directory lookups served by the hash
+    uint32_t dir_misses;       // ... and directory scans
+} FatStats;
+
+// Find a FAT16/32 volume on the disk (bare or first MBR partition) and
+// mount it at FAT_MOUNT. Needs the block cache up.
+int fat_mount();
+int fat_mounted();
+void fat_stats(FatStats* out);
+
+// The fs_* calls of the same names, for paths inside the volume, where
+// "/" is its root. The VFS routes FAT_MOUNT paths here. Names match
+// without regard to case; new names must fit 8.3.
+int fat_mkdir(const char* path);
+int fat_write(const char* path, const void* data, uint32_t size);
+int fat_write_at(const char* path, uint32_t offset, const void* data, uint32_t len);
+int fat_append(const char* path, const void* data, uint32_t size);
+int fat_truncate(const char* path, uint32_t size);
+int fat_read_at(const char* path, uint32_t offset, void* buf, uint32_t len);
+int fat_remove(const char* path);
+int fat_stat(const char* path, FsStat* st);
+int fat_readdir(const char* path, FsIter* it, FsDirent* out);
+
+#endif
@@ -2,15 +2,81 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+
+// File contents. Written data lives in page-sized extents owned by the
+// inode; data added with fs_add_static is borrowed from the kernel image
+// until the first write copies it into extents. A compressed file holds
+// an LZ4 pack instead (lz4.h), unpacked into extents on the first write.
+// The contents are guarded by a sleeping per-inode lock, not fs_lock,
+// so copying and packing them runs with interrupts on.
+typedef struct Inode {
+    uint32_t users;          // Calls holding it outside fs_lock (fs_lock)
+    volatile int busy;       // One of them owns the contents (sched_lock)
+    int removed;             // Unlinked: the last user frees it
+    uint32_t size;
+    uint32_t nextents;       // Pages in extents[]
+    uint32_t max_extents;    // Room in extents[] before it has to grow
+    uint8_t** extents;
+    const uint8_t* data;     // Borrowed read-only contents, or NULL
+    const uint8_t* packed;   // LZ4 pack, or NULL
+    uint32_t packed_pages;   // Frames the pack owns; 0 if it is borrowed
+    char* text;              // fs_read's terminated copy of data or packed, or NULL
+    int compress;            // Pack again after every fs_write
+} Inode;
+
+#define FS_FILE 1
+#define FS_DIR  2
+
+#define FS_PATH_MAX 128
+#define FS_NAME_MAX 256
+
+// One directory entry as fs_readdir hands it out
+typedef struct {
+    const char* name;
+    uint32_t type;
+    uint32_t size;           // Entries, for a directory
+} FsDirent;
+
 typedef struct {
-    const char* path;
-    const char* content;
-} File;
+    uint32_t type;
+    uint32_t size;           // Bytes, or entries for a directory
+    uint32_t pages;          // Extent pages owned; 0 for borrowed data
+    uint32_t packed;         // Bytes of the LZ4 pack, 0 if not compressed
+} FsStat;
 
+// Position for fs_readdir; zero it to start from the beginning
+typedef struct {
+    uint32_t index;
+    char name[FS_NAME_MAX];  // Holds out->name for mounted volumes
+} FsIter;
 
 void fs_init();
-const char* fs_read(const char* path);
-void fs_debug_list();
+uint32_t fs_hash(const char* path);
+
+// Paths are absolute. Files can only be created in existing directories.
+int fs_mkdir(const char* path);
 int fs_add(const char* path, const char* content);
+int fs_add_static(const char* path, const void* data, uint32_t size);
+int fs_add_packed(const char* path, const void* pack);
+int fs_compress(const char* path, int on);
+int fs_write(const char* path, const void* data, uint32_t size);
+int fs_append(const char* path, const void* data, uint32_t size);
+int fs_write_at(const char* path, uint32_t offset, const void* data, uint32_t len);
+int fs_truncate(const char* path, uint32_t size);
+int fs_read_at(const char* path, uint32_t offset, void* buf, uint32_t len);
+
+const char* fs_read(const char* path);
+const void* fs_read_static(const char* path, uint32_t* size);
+
+int fs_remove(const char* path);
+int fs_stat(const char* path, FsStat* st);
+int fs_readdir(const char* path, FsIter* it, FsDirent* out);
+int fs_normalize(const char* cwd, const char* path, char* out, uint32_t size);
+int fs_next_component(const char* path, uint32_t* pos, const char** name, uint32_t* len);
+void fs_mount_point(const char* path);
+uint32_t fs_count();
+void fs_dcache_stats(uint32_t* hits, uint32_t* misses);
+void fs_dcache_drop();
 
 #endif
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 void idt_install();
+void idt_reload();
 void idt_set_gate(int num, uint32_t base, uint16_t sel, uint8_t flags);
 
 struct IDTEntry {
@@ -0,0 +1,49 @@
+
+#ifndef INITRD_H
+#define INITRD_H
+
+#include <stdint.h>
+
+// ustar header, one 512-byte block before each member's data
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];           // Octal
+    char mtime[12];
+    char chksum[8];          // Octal sum of the header, this field as spaces
+    char typeflag;
+    char linkname[100];
+    char magic[6];           // "ustar\0" (or "ustar " from old GNU tar)
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];        // Prepended to name with a '/'
+    char pad[12];
+} __attribute__((packed)) TarHeader;
+
+#define TAR_BLOCK   512
+#define TAR_FILE    '0'
+#define TAR_OLDFILE '\0'
+#define TAR_DIR     '5'
+#define TAR_LZ4     'Z'   // Ours: a regular file holding an LZ4 pack (lz4.h)
+
+#define INITRD_MOUNT "/Initrd"
+
+typedef struct {
+    uint32_t start;          // Physical = virtual, 0 if there is no initrd
+    uint32_t size;
+    uint32_t files;
+    uint32_t packed;         // ... of which are LZ4 packs
+    uint32_t dirs;
+    int moved;               // Had to be copied away from the heap
+} InitrdInfo;
+
+void initrd_init();
+void initrd_populate();
+const InitrdInfo* initrd_info();
+
+#endif
@@ -2,8 +2,20 @@
 #ifndef INTERRUPTS_H
 #define INTERRUPTS_H
 
+#include <stdint.h>
+
+// What isr_common leaves on the stack, lowest address first. user_esp
+// and user_ss are only there when the interrupt came from ring 3.
+typedef struct {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t int_no, err_code;
+    uint32_t eip, cs, eflags;
+    uint32_t user_esp, user_ss;
+} IsrFrame;
+
 void isr0_handler();
 void pic_remap();
-void isr_handler(int interrupt_number);
+void isr_handler(IsrFrame* frame);
 void register_interrupt_handler(int n, void (*handler)());
 #endif
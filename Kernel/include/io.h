@@ -6,5 +6,11 @@
 
 uint8_t inb(uint16_t port);
 void outb(uint16_t port, uint8_t value);
+uint16_t inw(uint16_t port);
+void outw(uint16_t port, uint16_t value);
+uint32_t inl(uint16_t port);
+void outl(uint16_t port, uint32_t value);
+void insw(uint16_t port, void* buf, uint32_t count);
+void outsw(uint16_t port, const void* buf, uint32_t count);
 
 #endif
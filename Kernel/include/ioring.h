@@ -0,0 +1,114 @@
+
+#ifndef IORING_H
+#define IORING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "atomic.h"
+
+// Shared submission/completion ring between a task and the kernel.
+// The task fills SQEs and bumps sq_tail; the kernel consumes them on
+// SYSCALL_ENTER (or on its own for IORING_SETUP_POLL rings) and posts
+// one CQE per request.
+//
+// A process's ring lives in its own memory, and the pointers in its SQEs
+// are checked against its address space; a bad one completes with -1.
+// The kernel polls such a ring only while the process runs, and leaves
+// any SQE whose buffer isn't mapped in yet for SYSCALL_ENTER.
+
+#define IORING_ENTRIES 64   // Power of two
+#define IORING_MASK    (IORING_ENTRIES - 1)
+#define MAX_IORINGS    4
+
+// Setup flags
+#define IORING_SETUP_POLL  0x1   // Kernel drains the ring from the timer, no trap needed
+
+// Opcodes
+#define IORING_OP_NOP       0
+#define IORING_OP_WRITE     1   // arg1 = buffer, arg2 = length (0 = NUL-terminated)
+#define IORING_OP_PUTCHAR   2   // arg1 = char
+#define IORING_OP_CURSOR    3   // arg1 = x, arg2 = y
+#define IORING_OP_CLEAR     4
+#define IORING_OP_SLEEP     5   // arg1 = ticks
+#define IORING_OP_FILE_READ 6   // arg1 = path, arg2 = buffer, arg3 = buffer size; may sleep,
+                                // so poll-mode rings leave it for SYSCALL_ENTER
+
+typedef struct {
+    uint8_t  opcode;
+    uint8_t  reserved[3];
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t arg3;
+    uint32_t user_data;     // Copied into the matching CQE
+} IoSqe;
+
+typedef struct {
+    uint32_t user_data;
+    int32_t  result;
+} IoCqe;
+
+typedef struct {
+    volatile uint32_t sq_head;   // Written by the kernel
+    volatile uint32_t sq_tail;   // Written by the task
+    volatile uint32_t cq_head;   // Written by the task
+    volatile uint32_t cq_tail;   // Written by the kernel
+    uint32_t flags;
+    uint32_t sleep_until;        // Poll mode: tick at which a SLEEP op ends
+    uint32_t sqe_tail;           // Task-private: SQEs handed out but not yet submitted
+    IoSqe sq[IORING_ENTRIES];
+    IoCqe cq[IORING_ENTRIES];
+} IoRing;
+
+// Kernel side. A ring belongs to the task that registered it; only that
+// task may enter or unregister it, and it goes when the task does.
+struct Task;
+void ioring_init();
+int ioring_register(IoRing* ring, uint32_t flags);
+int ioring_unregister(int id);
+int ioring_enter(int id, uint32_t to_submit);
+void ioring_poll();
+void ioring_release(struct Task* t);
+uint32_t ioring_ops_completed();
+
+// Task side, for kernel tasks. Ring 3 has the same in user/usys.h.
+int ioring_setup(IoRing* ring, uint32_t flags);
+int ioring_exit(int id);
+int ioring_submit(IoRing* ring, int id);
+
+// Shared by both
+static inline IoSqe* ioring_get_sqe(IoRing* ring) {
+    uint32_t tail = ring->sqe_tail;
+    if (tail - ring->sq_head >= IORING_ENTRIES) return NULL;
+    ring->sqe_tail = tail + 1;
+    return &ring->sq[tail & IORING_MASK];
+}
+
+// Make every SQE handed out since the last call visible to the kernel.
+// Returns how many.
+static inline uint32_t ioring_publish(IoRing* ring) {
+    uint32_t pending = ring->sqe_tail - ring->sq_tail;
+    barrier();
+    ring->sq_tail = ring->sqe_tail;
+    return pending;
+}
+
+static inline IoCqe* ioring_peek_cqe(IoRing* ring) {
+    if (ring->cq_head == ring->cq_tail) return NULL;
+    barrier();
+    return &ring->cq[ring->cq_head & IORING_MASK];
+}
+
+static inline void ioring_cqe_seen(IoRing* ring) {
+    barrier();
+    ring->cq_head++;
+}
+
+static inline void ioring_prep(IoSqe* sqe, uint8_t op, uint32_t a1, uint32_t a2, uint32_t a3) {
+    sqe->opcode = op;
+    sqe->arg1 = a1;
+    sqe->arg2 = a2;
+    sqe->arg3 = a3;
+    sqe->user_data = 0;
+}
+
+#endif
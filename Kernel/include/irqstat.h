@@ -0,0 +1,26 @@
+
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <stdint.h>
+
+// Latency histogram: bucket 0 is < 512 cycles, bucket i covers
+// [2^(8+i), 2^(9+i)) and the last bucket collects everything slower.
+#define IRQSTAT_BUCKETS     12
+#define IRQSTAT_FIRST_SHIFT 8
+
+typedef struct {
+    uint32_t count;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
+    uint32_t hist[IRQSTAT_BUCKETS];
+} IrqStat;
+
+void irqstat_record(int vector, uint64_t cycles);
+const IrqStat* irqstat_get(int vector);
+void irqstat_reset();
+void irqstat_print();
+void irqstat_print_hist(int vector);
+void irqstat_dump_serial();
+
+#endif
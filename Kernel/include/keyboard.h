@@ -6,5 +6,6 @@ void init_keyboard();
 void keyboard_callback();
 void reset_keyboard_state();
 char keyboard_getchar();
+char keyboard_poll();
 
 #endif
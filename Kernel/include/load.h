@@ -0,0 +1,20 @@
+
+#ifndef LOAD_H
+#define LOAD_H
+
+#include <stdint.h>
+
+// Load averages are fixed point with LOAD_FSHIFT fraction bits, sampled
+// every LOAD_FREQ timer ticks and decayed over 1, 5 and 15 seconds
+#define LOAD_FSHIFT  16
+#define LOAD_FIXED_1 (1u << LOAD_FSHIFT)
+#define LOAD_FREQ    10
+
+void cpu_idle_halt();
+void cpu_idle_exit();
+void load_tick(uint32_t now);
+void load_get_avg(uint32_t hundredths[3]);
+uint32_t load_cpu_busy(int cpu);
+void load_print();
+
+#endif
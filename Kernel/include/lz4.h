@@ -0,0 +1,33 @@
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+// LZ4 block format, plus the packed-file layout built on it. Nothing in
+// here depends on the kernel, so tools/mkinitrd links the same code.
+
+#define LZ4_MAX_INPUT  65535        // lz4_compress keeps 16-bit positions
+#define LZ4_PACK_PAGE  4096         // Compressed independently, for random access
+#define LZ4_PACK_MAGIC 0x50345A4C   // "LZ4P"
+
+// A packed file: this header, then one block per page. Block i runs from
+// offsets[i] to offsets[i + 1], counted from the start of the pack; a
+// block as long as its page is stored as is.
+typedef struct {
+    uint32_t magic;
+    uint32_t size;           // Unpacked bytes
+    uint32_t offsets[];      // Pages + 1 entries
+} Lz4Pack;
+
+int lz4_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap);
+int lz4_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap);
+
+uint32_t lz4_pack_bound(uint32_t size);
+uint32_t lz4_pack(uint8_t* out, const uint8_t* const* pages, uint32_t size);
+int lz4_pack_check(const void* pack, uint32_t len);
+uint32_t lz4_pack_size(const void* pack);
+uint32_t lz4_pack_len(const void* pack);
+int lz4_pack_page(const void* pack, uint32_t index, uint8_t* out);
+
+#endif
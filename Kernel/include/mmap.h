@@ -0,0 +1,37 @@
+
+#ifndef MMAP_H
+#define MMAP_H
+
+#include <stdint.h>
+
+#define MMAP_MAX   8            // Mappings per process
+#define MMAP_BASE  0x80000000   // Where mappings are placed, up to MMAP_TOP
+#define MMAP_TOP   0xBF000000   // Well clear of the user stack
+
+// mmap flags
+#define MMAP_READ    0x01
+#define MMAP_WRITE   0x02
+#define MMAP_SHARED  0x04   // Writes reach the file and other mappers; else private copies
+
+// A file mapped into a process. Pages are faulted in from the page
+// cache on first touch.
+typedef struct {
+    uint32_t start;         // Page aligned, 0 for an unused slot
+    uint32_t pages;
+    uint32_t first;         // File page at start
+    uint32_t flags;
+    int file;               // Page cache file id
+} Mapping;
+
+struct Process;
+
+uint32_t mmap_map(const char* path, uint32_t len, uint32_t offset, uint32_t flags);
+int mmap_unmap(uint32_t addr);
+int mmap_sync(uint32_t addr);
+int mmap_fault(uint32_t addr, int write, int can_sleep);
+int mmap_covers(struct Process* p, uint32_t addr, int write);
+void mmap_fork(struct Process* child, struct Process* parent);   // sched_lock held
+void mmap_release(struct Process* p);                            // sched_lock held
+void mmap_collect(int file);
+
+#endif
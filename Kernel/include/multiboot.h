@@ -0,0 +1,35 @@
+
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+// MultibootInfo.flags
+#define MB_INFO_MEMORY  0x001   // mem_lower, mem_upper
+#define MB_INFO_MODS    0x008   // mods_count, mods_addr
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;      // KB below 1 MB
+    uint32_t mem_upper;      // KB from 1 MB up to the first hole
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;      // MultibootModule[mods_count]
+    // Symbols, memory map, drives, ... are not used
+} __attribute__((packed)) MultibootInfo;
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;        // One past the last byte
+    uint32_t cmdline;        // What followed the path in grub.cfg
+    uint32_t reserved;
+} __attribute__((packed)) MultibootModule;
+
+// Saved by boot.S from eax and ebx
+extern uint32_t multiboot_magic;
+extern uint32_t multiboot_info;
+
+#endif
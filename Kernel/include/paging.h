@@ -0,0 +1,52 @@
+
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Virtual memory layout, the same in every address space
+//   0x00000000 - 0x3FFFFFFF  kernel, identity mapped with 4 MB pages
+//   0x40000000 - 0xBFFFFFFF  user space, 4 KB pages, one page directory per process
+//   0xC0000000 - 0xFFFFFFFF  identity mapped, uncached (LAPIC, IOAPIC, framebuffer)
+#define USER_BASE        0x40000000
+#define USER_TOP         0xC0000000
+#define USER_STACK_PAGES 4
+
+// Page table entry bits
+#define PTE_PRESENT  0x001
+#define PTE_WRITE    0x002
+#define PTE_USER     0x004
+#define PTE_PWT      0x008
+#define PTE_PCD      0x010
+#define PTE_DIRTY    0x040   // Set by the CPU on a write
+#define PTE_LARGE    0x080   // 4 MB page, page directory entries only
+#define PTE_COW      0x200   // Available bit: shared until the first write
+#define PTE_SHARED   0x400   // Available bit: file page every mapper writes to, never copied
+
+#define PTE_ADDR(e)  ((e) & 0xFFFFF000)
+
+extern uint32_t kernel_page_dir[1024];
+
+void paging_init();
+void paging_init_cpu();
+void paging_switch(uint32_t* dir);
+
+uint32_t* paging_new_dir();
+void paging_free_dir(uint32_t* dir);
+uint32_t* paging_clone_dir(uint32_t* src);
+int paging_handle_fault(uint32_t err, int can_sleep);
+int paging_map(uint32_t* dir, uint32_t virt, uint32_t phys, uint32_t flags);
+void paging_unmap(uint32_t* dir, uint32_t virt);
+int paging_test_dirty(uint32_t* dir, uint32_t virt, int clear);
+uint32_t* paging_pte(uint32_t* dir, uint32_t virt);
+int paging_copy_to(uint32_t* dir, uint32_t virt, const void* src, uint32_t len);
+
+// Is [ptr, ptr + len) mapped for the current task's user code? Always
+// true for kernel tasks, which may pass any pointer.
+int user_ptr_ok(const void* ptr, uint32_t len, int write);
+int user_ptr_mapped(const void* ptr, uint32_t len, int write);
+int user_str_ok(const char* str, uint32_t max);
+void user_prefault(const void* ptr, uint32_t len, int write);
+
+#endif
@@ -0,0 +1,48 @@
+
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#include <stdint.h>
+
+#define PCACHE_PAGES   1024   // File pages cached at most (4 MB)
+#define PCACHE_BUCKETS 1024   // Power of two
+#define PCACHE_FILES   32     // Files with pages in the cache or mapped
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;           // Pages read in from the filesystem
+    uint32_t evictions;
+    uint32_t writebacks;       // Dirty pages written to the filesystem
+    uint32_t pages;            // Cached now
+    uint32_t mapped;           // ... of which some process maps
+    uint32_t dirty;
+    uint32_t files;
+} PcacheStats;
+
+void pcache_init();
+
+// Pages of a file, by path, shared by its readers and every mapping of it.
+// A file id holds the file's slot until pcache_close.
+int pcache_open(const char* path);
+void pcache_hold(int id);
+void pcache_close(int id);
+
+// The frame holding page index of the file, read in if need be, with a
+// reference for the caller to drop with pcache_put. NULL when nothing
+// can be evicted or the file is gone. Can sleep.
+void* pcache_get(int id, uint32_t index);
+void pcache_put(void* frame);
+void pcache_set_dirty(int id, uint32_t index);
+
+int pcache_read(const char* path, uint32_t offset, void* buf, uint32_t len);
+int pcache_sync(int id);   // -1 for every file
+
+// Hooks for the filesystem, around changes to the contents underneath
+void pcache_update(const char* path, uint32_t offset, const void* data, uint32_t len);
+void pcache_flush(const char* path);
+void pcache_invalidate(const char* path);
+void pcache_drop();
+
+void pcache_stats(PcacheStats* out);
+
+#endif
@@ -0,0 +1,28 @@
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+// Configuration space offsets
+#define PCI_COMMAND   0x04
+#define PCI_CLASS     0x08   // Revision, prog IF, subclass, class
+#define PCI_BAR0      0x10
+#define PCI_BAR4      0x20
+
+// PCI_COMMAND bits
+#define PCI_CMD_IO         0x1
+#define PCI_CMD_BUS_MASTER 0x4
+
+// A function's address on the bus, as the config mechanism wants it
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+} PciAddr;
+
+uint32_t pci_read32(PciAddr dev, uint8_t offset);
+void pci_write32(PciAddr dev, uint8_t offset, uint32_t value);
+int pci_find_class(uint8_t class_code, uint8_t subclass, PciAddr* out);
+
+#endif
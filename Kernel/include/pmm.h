@@ -0,0 +1,31 @@
+
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Physical memory layout
+//   0x00100000  kernel image (boot/linker.ld)
+//   0x00200000  kernel heap (heap.c, 1 MB)
+//   0x00400000  page frames handed out by the page allocator
+//   0x01000000  free; boot modules that landed on the heap move here
+#define PAGE_SIZE  4096
+#define HEAP_START 0x200000
+#define HEAP_SIZE  0x100000
+#define PMM_START  0x400000
+#define PMM_END    0x1000000
+#define PMM_PAGES  ((PMM_END - PMM_START) / PAGE_SIZE)
+
+void pmm_init();
+void* pmm_alloc_page();
+void* pmm_alloc_pages(size_t count);
+void pmm_free_page(void* page);
+void pmm_free_pages(void* page, size_t count);
+void pmm_reserve(uint32_t start, uint32_t end);
+void pmm_page_ref(void* page);
+void pmm_page_unref(void* page);
+int pmm_page_refcount(void* page);
+size_t pmm_free_count();
+
+#endif
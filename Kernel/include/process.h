@@ -0,0 +1,62 @@
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdint.h>
+#include "interrupts.h"
+#include "syscall.h"
+#include "mmap.h"
+
+#define MAX_PROCS 16
+
+// Process states
+#define PROC_FREE    0
+#define PROC_RUNNING 1
+#define PROC_ZOMBIE  2   // Exited, waiting for process_wait
+
+// Exit codes the kernel picks
+#define PROC_EXIT_KILLED   -1
+#define PROC_EXIT_FAULT(v) (0x100 | (v))   // Killed by CPU exception v
+
+// process_spawn errors
+#define PROC_ENOENT  -1   // No such file
+#define PROC_ENOEXEC -2   // Not a usable ELF32 executable
+#define PROC_ENOMEM  -3
+#define PROC_EAGAIN  -4   // Process table full
+
+// A ring 3 program: its own address space, run by one task
+typedef struct Process {
+    int pid;
+    int parent_pid;        // Who may process_wait for it; 0 for the kernel
+    int state;
+    char name[32];
+    uint32_t* page_dir;
+    uint32_t entry;
+    uint32_t user_stack;   // Initial esp
+    int task_id;
+    int detached;          // Nobody waits: free the slot at exit
+    int exit_code;
+    uint64_t spawn_tsc;    // process_spawn called
+    uint64_t start_tsc;    // First switch to ring 3
+    uint64_t exit_tsc;
+    SyscallFrame fork_frame; // Where a forked child starts, eax = 0
+    Mapping maps[MMAP_MAX];  // Mapped files, see mmap.c
+} Process;
+
+typedef struct {
+    int exit_code;
+    uint64_t start_cycles;   // Spawn to the first user instruction
+    uint64_t run_cycles;     // First user instruction to exit
+} ProcResult;
+
+int process_spawn(const char* path, int detached);
+int process_wait(int pid, ProcResult* result);
+int process_fork();
+Process* process_table();
+int process_getpid();
+void process_exit(int code);
+void process_fault(IsrFrame* frame);
+void process_reap(Process* p);   // sched_lock held
+void process_print();
+
+#endif
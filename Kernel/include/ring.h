@@ -0,0 +1,43 @@
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+// Bounded lock-free queues of pointers. Capacity must be a power of two;
+// the caller provides the slot array.
+
+// One producer, one consumer (e.g. an IRQ handler feeding a task).
+// Each index is written by one side only, so no atomics are needed.
+typedef struct {
+    volatile uint32_t head;   // Next slot to read, consumer only
+    volatile uint32_t tail;   // Next slot to write, producer only
+    uint32_t mask;
+    void** slots;
+} SpscRing;
+
+// Many producers (any CPU, any context), one consumer. Producers claim
+// a slot with a CAS on tail; each slot's sequence number says whether it
+// is free, filled, or still being written.
+typedef struct {
+    volatile uint32_t seq;
+    void* item;
+} MpscSlot;
+
+typedef struct {
+    volatile uint32_t tail;   // Claimed by producers
+    uint32_t head;            // Consumer only
+    uint32_t mask;
+    MpscSlot* slots;
+} MpscRing;
+
+int spsc_init(SpscRing* ring, void** slots, uint32_t capacity);
+int spsc_push(SpscRing* ring, void* item);
+int spsc_pop(SpscRing* ring, void** item);
+uint32_t spsc_count(const SpscRing* ring);
+
+int mpsc_init(MpscRing* ring, MpscSlot* slots, uint32_t capacity);
+int mpsc_push(MpscRing* ring, void* item);
+int mpsc_pop(MpscRing* ring, void** item);
+
+#endif
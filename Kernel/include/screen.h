@@ -23,6 +23,7 @@ void puts(const char* str);
 void blink();
 void putf(const char* str, uint8_t fg, uint8_t bg);
 void putint(int num);
+void putuint(uint32_t num);
 void puthex(uint32_t n);
 void set_cursor(int x, int y);
 void next_white();
@@ -0,0 +1,50 @@
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+// Readers never block writers: they retry if the sequence was odd
+// (write in progress) or changed while they read. Writers serialise on
+// the spinlock. Same scheme as the time page, for kernel-only data.
+typedef struct {
+    volatile uint32_t seq;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT { 0, SPINLOCK_INIT }
+
+static inline void seqlock_init(seqlock_t* sl) {
+    sl->seq = 0;
+    spin_lock_init(&sl->lock);
+}
+
+static inline uint32_t write_seqlock_irqsave(seqlock_t* sl) {
+    uint32_t flags = spin_lock_irqsave(&sl->lock);
+    sl->seq++;
+    __sync_synchronize();
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t* sl, uint32_t flags) {
+    __sync_synchronize();
+    sl->seq++;
+    spin_unlock_irqrestore(&sl->lock, flags);
+}
+
+static inline uint32_t read_seqbegin(const seqlock_t* sl) {
+    uint32_t seq;
+    while ((seq = sl->seq) & 1) {
+        __asm__ __volatile__ ("pause");
+    }
+    __asm__ __volatile__ ("" ::: "memory");
+    return seq;
+}
+
+static inline int read_seqretry(const seqlock_t* sl, uint32_t seq) {
+    __asm__ __volatile__ ("" ::: "memory");
+    return sl->seq != seq;
+}
+
+#endif
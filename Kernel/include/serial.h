@@ -0,0 +1,13 @@
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+
+void serial_init();
+void serial_putc(char c);
+void serial_puts(const char* str);
+void serial_putint(uint32_t num);
+void serial_puthex(uint32_t num);
+
+#endif
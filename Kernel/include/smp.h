@@ -0,0 +1,71 @@
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "acpi.h"
+#include "task.h"
+
+#define MAX_CPUS ACPI_MAX_CPUS
+
+// Per-CPU GDT: the five shared entries from gdt.S, then this CPU's
+// TSS and a data segment whose base is its Cpu struct (loaded into gs)
+#define CPU_GDT_ENTRIES  7
+#define CPU_TSS_SELECTOR 0x28
+#define CPU_GS_SELECTOR  0x30
+
+typedef struct {
+    uint32_t prev_tss;
+    uint32_t esp0, ss0;
+    uint32_t esp1, ss1;
+    uint32_t esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap, iomap_base;
+} __attribute__((packed)) Tss;
+
+typedef struct Cpu {
+    struct Cpu* self;            // gs:0
+    Task* current;               // gs:4, see task_current()
+    int index;
+    uint8_t apic_id;
+    volatile int online;
+    volatile int need_resched;
+    Task* idle;
+
+    // Ready tasks on this CPU, same layout as the old global run queue.
+    // Guarded by sched_lock.
+    Task* rq_head[TASK_PRIO_LEVELS];
+    Task* rq_tail[TASK_PRIO_LEVELS];
+    uint32_t rq_bitmap;
+    int nr_ready;
+
+    // Idle accounting, see load.c
+    uint64_t idle_since;         // TSC when the current halt began, 0 if running
+    uint64_t idle_tsc;           // Cycles spent halted
+    uint64_t idle_last;          // idle_tsc at the last once-a-second sample
+    uint32_t busy_pct;           // Busy share of the last second
+
+    int sysenter_user;           // SYSENTER_EIP is the ring 3 entry, see syscall.c
+
+    uint64_t gdt[CPU_GDT_ENTRIES] __attribute__((aligned(8)));
+    Tss tss;
+    void* boot_stack;            // Becomes the idle task's stack on APs
+} Cpu;
+
+extern Cpu cpus[MAX_CPUS];
+extern volatile int cpu_count;
+
+static inline Cpu* cpu_current() {
+    Cpu* cpu;
+    __asm__ __volatile__ ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void smp_init_bsp();
+void smp_init();
+void smp_print();
+
+#endif
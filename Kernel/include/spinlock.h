@@ -0,0 +1,87 @@
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+// Test-and-set lock. Cheapest when uncontended; no fairness.
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock_init(spinlock_t* lock) {
+    lock->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        // Spin on a plain read so the cache line stays shared
+        while (lock->locked) {
+            __asm__ __volatile__ ("pause");
+        }
+    }
+}
+
+static inline int spin_trylock(spinlock_t* lock) {
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+// For data an interrupt handler also touches: a handler spinning on a
+// lock its own CPU holds would never get it
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+// Ticket lock: CPUs get the lock in the order they asked for it, so a
+// busy lock can't starve anyone. One cache line bounce per hand-off.
+typedef struct {
+    volatile uint16_t next;    // Next ticket to hand out
+    volatile uint16_t owner;   // Ticket now holding the lock
+} ticketlock_t;
+
+#define TICKETLOCK_INIT { 0, 0 }
+
+static inline void ticket_lock_init(ticketlock_t* lock) {
+    lock->next = 0;
+    lock->owner = 0;
+}
+
+static inline void ticket_lock(ticketlock_t* lock) {
+    uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    while (lock->owner != ticket) {
+        __asm__ __volatile__ ("pause");
+    }
+    __sync_synchronize();
+}
+
+static inline void ticket_unlock(ticketlock_t* lock) {
+    __sync_synchronize();
+    lock->owner++;   // Only the holder writes owner
+}
+
+static inline uint32_t ticket_lock_irqsave(ticketlock_t* lock) {
+    uint32_t flags = irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(ticketlock_t* lock, uint32_t flags) {
+    ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
@@ -15,13 +15,52 @@
 #define SYSCALL_GETCHAR     5
 #define SYSCALL_PUTCHAR     6
 #define SYSCALL_SLEEP       7
+#define SYSCALL_CYCLES      8
+#define SYSCALL_RING_SETUP  9
+#define SYSCALL_ENTER       10
+#define SYSCALL_RING_EXIT   11
+#define SYSCALL_LOADAVG     12
+#define SYSCALL_EXIT        13
+#define SYSCALL_GETPID      14
+#define SYSCALL_FORK        15
+#define SYSCALL_WAIT        16
+#define SYSCALL_OPEN        17
+#define SYSCALL_READ        18
+#define SYSCALL_WRITE_FD    19
+#define SYSCALL_LSEEK       20
+#define SYSCALL_CLOSE       21
+#define SYSCALL_STAT        22
+#define SYSCALL_READDIR     23
+#define SYSCALL_MMAP        24
+#define SYSCALL_MUNMAP      25
+#define SYSCALL_MSYNC       26
 
-typedef int (*syscall_func_t)(uint32_t, uint32_t, uint32_t);
+// Registers saved by isr128: the data segments, pusha, then what int 0x80
+// pushed (user_esp and user_ss only when called from ring 3).
+// eax = syscall number, ebx/ecx/edx/esi/edi/ebp = arguments 1-6.
+// Results go back in eax (low) and edx (high).
+typedef struct SyscallFrame {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t eip, cs, eflags;
+    uint32_t user_esp, user_ss;
+} SyscallFrame;
 
-void syscall_handler();                      // Called from isr128
+typedef int64_t (*syscall_func_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+void syscall_handler(SyscallFrame* frame);   // Called from isr128 and sysenter_user_entry
 void register_syscall(int num, syscall_func_t func);
 void syscall_init();
+void syscall_init_cpu();
+void syscall_set_user(int user);
+int64_t syscall_dispatch(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+                         uint32_t a4, uint32_t a5, uint32_t a6);
+int syscall_has_sysenter();
 
+// syscall6() takes the sysenter fast path when the CPU has it, int 0x80 otherwise
+int64_t syscall6(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6);
 int syscall(int num, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+int64_t syscall_int80(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6);
+int64_t syscall_sysenter(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6);
 
 #endif
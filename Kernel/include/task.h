@@ -2,17 +2,105 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include <stdint.h>
+#include "wait.h"
+
+#define TASK_STACK_PAGES   4    // 16 KB kernel stack per task
+#define TASK_DEFAULT_SLICE 5    // Timer ticks before preemption
+#define TASK_MAX_FILES     16   // Open file descriptors per task
+
+// Priorities: 0 is the most urgent, TASK_PRIO_LEVELS - 1 the least
+#define TASK_PRIO_LEVELS   32
+#define TASK_PRIO_DEFAULT  16
+#define TASK_PRIO_BOOST    8    // Bonus for a task woken by input, lasts one slice
+
+// Task states
+#define TASK_READY   0
+#define TASK_RUNNING 1
+#define TASK_DEAD    2
+#define TASK_BLOCKED 3
+
 typedef void (*task_func)();
 
-typedef struct {
+// A kernel thread. The task function is called over and over until the
+// task is killed, so old-style "one step per call" tasks keep working.
+typedef struct Task {
+    int id;
     const char* name;
     task_func function;
-    int active;
+    int state;
+    uint32_t esp;        // Saved stack pointer while switched out
+    void* stack;         // Stack pages, NULL for the boot task
+    uint32_t slice;      // Ticks left before preemption
+    uint8_t base_prio;   // Priority set by register_task/task_set_priority
+    uint8_t prio;        // Effective priority, base_prio minus any boost
+    struct Task* rq_next; // Run queue links while TASK_READY
+    struct Task* rq_prev;
+    WaitQueue* waitq;     // Queue we sleep on while TASK_BLOCKED
+    struct Task* wait_next;
+    uint32_t wake_tick;   // Timed sleep deadline, see task_sleep_until
+    int cpu;              // CPU it runs on, or whose run queue it sits on
+    uint8_t pinned;       // Never migrated by wake-up placement or stealing
+    volatile uint8_t kill_pending; // task_kill: exit at the next safe point
+    uint32_t* page_dir;   // User address space, NULL for kernel-only tasks
+    struct Process* proc; // Ring 3 process this task runs, if any
+    struct SyscallFrame* user_frame; // Ring 3 registers of the syscall in progress
+    struct File* files[TASK_MAX_FILES]; // Descriptor table, see vfs.h
+
+    // Accounting, all in TSC cycles, updated by the scheduler
+    uint64_t runtime;     // Time spent running
+    uint64_t run_start;   // When it was last switched in
+    uint64_t wake_tsc;    // When task_wake made it ready, 0 once it ran
+    uint64_t lat_total;   // Sum of wake-up latencies
+    uint32_t lat_max;
+    uint32_t lat_count;
+    uint32_t switches;    // Times switched in
+    uint32_t nvcsw;       // Switched out because it blocked or exited
+    uint32_t nivcsw;      // Switched out while still runnable
 } Task;
 
+// A copy of one task's numbers, taken under the scheduler lock
+typedef struct {
+    int id;
+    const char* name;
+    int state;
+    int cpu;
+    uint8_t prio;
+    uint64_t runtime;     // Includes the current run if it is on a CPU
+    uint64_t lat_total;
+    uint32_t lat_max;
+    uint32_t lat_count;
+    uint32_t switches;
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+} TaskStats;
+
+struct Cpu;
+struct Process;
+
 void init_tasks();
-void register_task(const char* name, task_func func);
+void task_init_cpu(struct Cpu* cpu);
+int register_task(const char* name, task_func func);
+int register_user_task(const char* name, task_func func, struct Process* proc, uint32_t* page_dir);
 void yield();
 void run_next_task();
+void schedule();
+void task_tick();
+void task_preempt();
+void task_exit();
+void task_block();              // Caller holds sched_lock, interrupts off
+void task_wake(Task* t);
+void task_wake_locked(Task* t);
+void task_sleep_until(uint32_t tick);
+void task_timer_wake(uint32_t now);
+int task_kill(int id);
+void task_kill_point();
+int task_set_priority(int id, int prio);
+void task_boost(Task* t);
+void task_set_timeslice(uint32_t ticks);
+uint32_t task_get_timeslice();
+Task* task_current();
+void task_print();
+int task_stats(TaskStats* out, int max);
 
 #endif
@@ -9,6 +9,26 @@ void test_strdup();
 void test_malloc_free();
 void test_calloc();
 void string_and_heap_test();
+void test_syscall_bench();
+void test_syscall_abi();
+void test_ioring();
+void test_timepage();
+void test_wait_queue();
+void test_parallel_checksum();
+void test_sync_stress();
+void test_async();
+void test_user_process();
+void test_fork_cow();
+void test_fs_table();
+void test_fs_write();
+void test_fs_dirs();
+void test_initrd();
+void test_block_cache();
+void test_block_queue();
+void test_fat();
+void test_vfs();
+void test_mmap();
+void test_lz4();
 
 
 #endif
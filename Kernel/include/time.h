@@ -8,5 +8,7 @@ void timer_callback();
 void sleep(uint32_t seconds);
 void sleep_ms(uint32_t miliseconds);
 void sleep_t(uint32_t ticks);
+uint32_t time_tsc_per_us();
+uint32_t time_cycles_to_us(uint64_t cycles);
 
 #endif
@@ -0,0 +1,62 @@
+
+#ifndef TIMEPAGE_H
+#define TIMEPAGE_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+// vDSO-style clock page: written only by the timer interrupt, read by
+// anyone without a syscall. seq is odd while an update is in progress;
+// readers retry until they see the same even value before and after.
+// Every process has it mapped read-only at USER_TIMEPAGE.
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t hz;                    // Timer ticks per second
+    volatile uint64_t ticks;        // Ticks since boot
+    volatile uint64_t tsc_at_tick;  // TSC sampled at the last tick
+    volatile uint32_t tsc_per_tick; // Smoothed TSC calibration
+    volatile uint64_t ns_mult;      // ns = (tsc delta * ns_mult) >> 32; past 2^32 below 1 GHz
+    uint32_t ns_per_tick;
+} __attribute__((aligned(4096))) TimePage;
+
+#define USER_TIMEPAGE 0xBF000000   // Between the mmap area and the user stack
+
+extern TimePage time_page;
+
+void timepage_init(uint32_t hz);
+void timepage_tick();
+
+static inline uint64_t timepage_ticks(const TimePage* tp) {
+    uint32_t seq;
+    uint64_t ticks;
+    do {
+        seq = tp->seq;
+        __asm__ __volatile__ ("" ::: "memory");
+        ticks = tp->ticks;
+        __asm__ __volatile__ ("" ::: "memory");
+    } while ((seq & 1) || seq != tp->seq);
+    return ticks;
+}
+
+// Nanoseconds since boot: tick count plus the TSC-interpolated part of the current tick
+static inline uint64_t timepage_ns(const TimePage* tp) {
+    uint32_t seq, tsc_per_tick, ns_per_tick;
+    uint64_t ticks, tsc0, mult;
+    do {
+        seq = tp->seq;
+        __asm__ __volatile__ ("" ::: "memory");
+        ticks = tp->ticks;
+        tsc0 = tp->tsc_at_tick;
+        mult = tp->ns_mult;
+        tsc_per_tick = tp->tsc_per_tick;
+        ns_per_tick = tp->ns_per_tick;
+        __asm__ __volatile__ ("" ::: "memory");
+    } while ((seq & 1) || seq != tp->seq);
+
+    uint64_t delta = rdtsc() - tsc0;
+    if (delta > tsc_per_tick) delta = tsc_per_tick;   // Tick is late, stay monotonic
+    // delta fits in 32 bits now, so the two halves of mult make no overflow
+    return ticks * ns_per_tick + ((delta * (uint32_t)mult) >> 32) + delta * (uint32_t)(mult >> 32);
+}
+
+#endif
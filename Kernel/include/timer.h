@@ -4,6 +4,8 @@
 
 #include <stdint.h>
 
+#define TIMER_HZ 100
+
 void init_timer(uint32_t frequency);
 void timer_callback(void);
 
@@ -0,0 +1,79 @@
+
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include "fs.h"
+
+#define VFS_MAX_MOUNTS 8
+#define VFS_MOUNT_PATH 32
+#define VFS_CHUNK      (4 * 4096)   // Most a read or write syscall copies per call down
+
+// vfs_open flags
+#define VFS_READ    0x01
+#define VFS_WRITE   0x02
+#define VFS_CREATE  0x04   // Create an empty file if there is none
+#define VFS_TRUNC   0x08   // Cut the file to 0 bytes
+#define VFS_APPEND  0x10   // Every write goes to the end
+
+// vfs_lseek whence
+#define VFS_SEEK_SET 0
+#define VFS_SEEK_CUR 1
+#define VFS_SEEK_END 2
+
+// A filesystem mounted over a directory. Paths handed to the operations
+// are inside the volume ("/" is its root) and normalized. A NULL
+// operation fails, so read-only volumes leave the writers out. Same
+// contracts as the fs_* calls of the same names.
+typedef struct {
+    const char* name;
+    int (*mkdir)(const char* path);
+    int (*write)(const char* path, const void* data, uint32_t size);
+    int (*write_at)(const char* path, uint32_t offset, const void* data, uint32_t len);
+    int (*append)(const char* path, const void* data, uint32_t size);
+    int (*truncate)(const char* path, uint32_t size);
+    int (*read_at)(const char* path, uint32_t offset, void* buf, uint32_t len);
+    int (*remove)(const char* path);
+    int (*stat)(const char* path, FsStat* st);
+    int (*readdir)(const char* path, FsIter* it, FsDirent* out);
+} VfsOps;
+
+// An open file or directory. Descriptors index the current task's
+// table; forked and spawned tasks start with their creator's files,
+// sharing the offsets.
+typedef struct File {
+    uint32_t refs;
+    uint32_t flags;
+    uint32_t type;             // FS_FILE or FS_DIR
+    uint32_t offset;
+    FsIter iter;               // Directories: where vfs_readdir is
+    char path[FS_PATH_MAX];    // Absolute and normalized
+} File;
+
+// What vfs_readdir (and the readdir syscall) fills in
+typedef struct {
+    char name[FS_NAME_MAX];
+    uint32_t type;
+    uint32_t size;
+} VfsDirent;
+
+struct Task;
+
+// Mount table; the ramfs tree is the root and is never in it
+int vfs_mount(const char* path, const VfsOps* ops);
+const VfsOps* vfs_route(const char* path, char* buf, const char** inner);
+void vfs_print_mounts();
+
+// Descriptors of the current task. All return -1 on failure.
+int vfs_open(const char* path, uint32_t flags);
+int vfs_read(int fd, void* buf, uint32_t len);
+int vfs_write(int fd, const void* buf, uint32_t len);
+int vfs_lseek(int fd, int32_t offset, int whence);
+int vfs_readdir(int fd, VfsDirent* out);
+uint32_t vfs_mmap(int fd, uint32_t len, uint32_t offset, uint32_t flags);
+int vfs_close(int fd);
+
+void vfs_inherit(struct Task* child, struct Task* parent);   // sched_lock held
+void vfs_release(struct Task* t);                             // sched_lock held
+
+#endif
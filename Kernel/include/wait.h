@@ -0,0 +1,41 @@
+
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "spinlock.h"
+
+struct Task;
+
+// Tasks blocked on some event. Whoever makes the event happen calls
+// wake_up(); sleepers cost no CPU until then.
+typedef struct WaitQueue {
+    struct Task* head;
+    struct Task* tail;
+} WaitQueue;
+
+#define WAIT_QUEUE_INIT { 0, 0 }
+
+// The scheduler's lock (task.c) also guards every wait queue
+extern spinlock_t sched_lock;
+
+void wait_queue_init(WaitQueue* wq);
+void wait_sleep(WaitQueue* wq);   // sched_lock held, interrupts off
+int wake_up(WaitQueue* wq);
+int wake_up_locked(WaitQueue* wq);
+int wake_up_one(WaitQueue* wq);
+
+// Block until cond is true. The check and the sleep happen under
+// sched_lock with interrupts off, so a wake_up() from an IRQ or another
+// CPU can't slip in between.
+#define wait_event(wq, cond)                    \
+    do {                                        \
+        uint32_t __wait_flags = spin_lock_irqsave(&sched_lock); \
+        while (!(cond)) {                       \
+            wait_sleep(&(wq));                  \
+        }                                       \
+        spin_unlock_irqrestore(&sched_lock, __wait_flags); \
+    } while (0)
+
+#endif
@@ -0,0 +1,27 @@
+
+#ifndef ZCACHE_H
+#define ZCACHE_H
+
+#include <stdint.h>
+
+#define ZCACHE_PAGES 8   // Unpacked pages kept, LRU
+
+typedef struct {
+    uint32_t files;          // Packs registered with zcache_add
+    uint32_t raw_bytes;      // ... their unpacked size
+    uint32_t packed_bytes;   // ... and what they take
+    uint32_t hits;
+    uint32_t misses;         // Pages unpacked
+    uint64_t unpacked;       // Bytes unpacked on misses
+    uint64_t cycles;         // ... and the TSC cycles it took
+} ZcacheStats;
+
+// Reads of LZ4-packed files (see lz4.h) through a few unpacked pages.
+// A pack is identified by its address, so one about to be freed has to
+// be forgotten first.
+int zcache_read(const void* pack, uint32_t offset, void* buf, uint32_t len);
+void zcache_add(const void* pack);
+void zcache_forget(const void* pack);
+void zcache_stats(ZcacheStats* out);
+
+#endif
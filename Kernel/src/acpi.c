@@ -0,0 +1,100 @@
+
+#include "acpi.h"
+#include "heap.h"
+#include "string.h"
+
+typedef struct {
+    char signature[8];      // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed)) Rsdp;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiHeader;
+
+typedef struct {
+    AcpiHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed)) Madt;
+
+#define MADT_LOCAL_APIC   0
+#define MADT_LAPIC_ENABLED 0x1
+
+static int acpi_checksum(const void* data, uint32_t len) {
+    const uint8_t* p = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += p[i];
+    return sum == 0;
+}
+
+static const Rsdp* rsdp_scan(uint32_t start, uint32_t len) {
+    for (uint32_t addr = start; addr < start + len; addr += 16) {
+        const Rsdp* r = (const Rsdp*)addr;
+        if (memcmp(r->signature, "RSD PTR ", 8) == 0 && acpi_checksum(r, 20)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static const Rsdp* rsdp_find() {
+    // First KB of the EBDA (segment in the BDA at 0x40E), then the BIOS
+    // read-only area. The asm hides the tiny address from -Warray-bounds.
+    uint32_t bda = 0x40E;
+    __asm__ ("" : "+r"(bda));
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t*)bda) << 4;
+    const Rsdp* r = NULL;
+    if (ebda) r = rsdp_scan(ebda, 1024);
+    if (!r) r = rsdp_scan(0xE0000, 0x20000);
+    return r;
+}
+
+int acpi_parse_madt(AcpiMadtInfo* info) {
+    info->cpu_count = 0;
+    info->lapic_address = 0;
+
+    const Rsdp* rsdp = rsdp_find();
+    if (!rsdp) return -1;
+
+    const AcpiHeader* rsdt = (const AcpiHeader*)rsdp->rsdt_address;
+    if (memcmp(rsdt->signature, "RSDT", 4) != 0 || !acpi_checksum(rsdt, rsdt->length)) return -1;
+
+    uint32_t entries = (rsdt->length - sizeof(AcpiHeader)) / 4;
+    const uint32_t* tables = (const uint32_t*)(rsdt + 1);
+
+    for (uint32_t i = 0; i < entries; i++) {
+        const Madt* madt = (const Madt*)tables[i];
+        if (memcmp(madt->header.signature, "APIC", 4) != 0) continue;
+        if (!acpi_checksum(madt, madt->header.length)) continue;
+
+        info->lapic_address = madt->lapic_address;
+
+        const uint8_t* p = madt->entries;
+        const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+        while (p + 2 <= end && p[1] >= 2) {
+            if (p[0] == MADT_LOCAL_APIC) {
+                uint8_t apic_id = p[3];
+                uint32_t flags = *(const uint32_t*)(p + 4);
+                if ((flags & MADT_LAPIC_ENABLED) && info->cpu_count < ACPI_MAX_CPUS) {
+                    info->apic_ids[info->cpu_count++] = apic_id;
+                }
+            }
+            p += p[1];
+        }
+        return 0;
+    }
+    return -1;
+}
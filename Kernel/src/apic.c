@@ -0,0 +1,118 @@
+
+#include "apic.h"
+#include "cpu.h"
+
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE   0x100
+#define LAPIC_LVT_MASKED   0x10000
+#define LAPIC_LVT_PERIODIC 0x20000
+#define LAPIC_DELIVERY_EXTINT 0x700
+#define LAPIC_DELIVERY_NMI    0x400
+#define LAPIC_ICR_PENDING  0x1000
+#define LAPIC_ICR_INIT     0x4500   // INIT, level assert
+#define LAPIC_ICR_SIPI     0x4600   // Startup IPI, vector = page number
+#define LAPIC_ICR_FIXED    0x4000
+
+int lapic_available = 0;
+static volatile uint32_t* lapic = (volatile uint32_t*)LAPIC_DEFAULT_BASE;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4];   // Posted write: read back to flush
+}
+
+// Software-enable this CPU's local APIC. The BSP keeps taking PIC
+// interrupts through LINT0 (virtual wire); APs only see IPIs and their timer.
+void lapic_init(uint32_t base, int bsp) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 9))) return;   // No APIC on this CPU
+
+    if (base) lapic = (volatile uint32_t*)base;
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    if (bsp) {
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_DELIVERY_EXTINT);
+        lapic_write(LAPIC_LVT_LINT1, LAPIC_DELIVERY_NMI);
+    } else {
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    }
+    lapic_available = 1;
+}
+
+uint8_t lapic_id() {
+    if (!lapic_available) return 0;
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+static void lapic_icr(uint8_t apic_id, uint32_t low) {
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, low);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ __volatile__ ("pause");
+    }
+    irq_restore(flags);
+}
+
+void lapic_send_init(uint8_t apic_id) {
+    lapic_icr(apic_id, LAPIC_ICR_INIT);
+}
+
+void lapic_send_sipi(uint8_t apic_id, uint8_t page) {
+    lapic_icr(apic_id, LAPIC_ICR_SIPI | page);
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+    if (!lapic_available) return;
+    lapic_icr(apic_id, LAPIC_ICR_FIXED | vector);
+}
+
+// Count LAPIC timer decrements (divide by 16) over a number of PIT ticks.
+// Interrupts must be on so tick_count moves.
+uint32_t lapic_timer_calibrate(uint32_t ticks) {
+    extern volatile uint32_t tick_count;
+    if (!lapic_available || !ticks) return 0;
+
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    uint32_t start = tick_count;
+    while (tick_count == start) __asm__ __volatile__ ("hlt");
+
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    start = tick_count;
+    while (tick_count - start < ticks) __asm__ __volatile__ ("hlt");
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    return elapsed / ticks;
+}
+
+void lapic_timer_start(uint32_t count_per_tick) {
+    if (!lapic_available || !count_per_tick) return;
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, count_per_tick);
+}
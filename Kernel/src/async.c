@@ -0,0 +1,164 @@
+
+#include "async.h"
+#include "task.h"
+#include "wait.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+extern volatile uint32_t tick_count;
+
+// Guards the task list and every task's state/irq. Taken from IRQ context.
+static spinlock_t async_lock = SPINLOCK_INIT;
+static AsyncTask* async_tasks = NULL;
+
+static volatile uint32_t async_irq_mask = 0;   // IRQ lines someone waits on
+static volatile int async_timed = 0;           // Tasks waiting with a deadline
+static volatile int async_kicked = 0;          // Something became runnable
+static WaitQueue async_wq = WAIT_QUEUE_INIT;
+static int async_executor_id = -1;
+
+static void async_kick() {
+    async_kicked = 1;
+    wake_up(&async_wq);
+}
+
+// Recount what the interrupt paths have to look at. async_lock held.
+static void async_update_waits() {
+    uint32_t mask = 0;
+    int timed = 0;
+    for (AsyncTask* t = async_tasks; t; t = t->next) {
+        if (t->state != ASYNC_WAITING) continue;
+        timed++;
+        if (t->irq < 16) mask |= 1u << t->irq;
+    }
+    async_irq_mask = mask;
+    async_timed = timed;
+}
+
+void async_set_timeout(AsyncTask* t, uint32_t ticks) {
+    t->timed_out = 0;
+    t->deadline = tick_count + ticks;
+}
+
+void async_arm(AsyncTask* t, uint8_t irq) {
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    t->state = ASYNC_WAITING;
+    t->irq = irq;
+    async_update_waits();
+    spin_unlock_irqrestore(&async_lock, flags);
+}
+
+void async_disarm(AsyncTask* t) {
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    t->state = ASYNC_RUNNING;
+    t->irq = ASYNC_NO_IRQ;
+    async_update_waits();
+    spin_unlock_irqrestore(&async_lock, flags);
+}
+
+int async_expired(AsyncTask* t) {
+    return (int32_t)(tick_count - t->deadline) >= 0;
+}
+
+// Step every runnable task once. Returns whether anything ran.
+static int async_run_ready() {
+    int ran = 0;
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    AsyncTask** link = &async_tasks;
+    while (*link) {
+        AsyncTask* t = *link;
+        if (t->state != ASYNC_RUNNABLE) {
+            link = &t->next;
+            continue;
+        }
+
+        t->state = ASYNC_RUNNING;
+        spin_unlock_irqrestore(&async_lock, flags);
+        int result = t->fn(t);
+        flags = spin_lock_irqsave(&async_lock);
+        ran = 1;
+
+        if (result == ASYNC_DONE) {
+            t->state = ASYNC_FINISHED;
+            *link = t->next;
+            async_update_waits();
+            continue;
+        }
+        // A plain ASYNC_YIELD stays runnable; a wait left it WAITING,
+        // or RUNNABLE if its event already came
+        if (t->state == ASYNC_RUNNING) t->state = ASYNC_RUNNABLE;
+        if (t->state == ASYNC_RUNNABLE) async_kicked = 1;
+        link = &t->next;
+    }
+    spin_unlock_irqrestore(&async_lock, flags);
+    return ran;
+}
+
+// The one thread behind every async task: sleeps until an IRQ, a
+// timeout or a spawn makes something runnable
+static void async_executor() {
+    wait_event(async_wq, async_kicked);
+    async_kicked = 0;
+    async_run_ready();
+}
+
+void async_init() {
+    if (async_executor_id >= 0) return;   // kernel_setup can run more than once
+    async_executor_id = register_task("async", async_executor);
+}
+
+int async_spawn(AsyncTask* t, const char* name, async_fn fn, void* data) {
+    if (!t || !fn) return -1;
+    t->name = name;
+    t->fn = fn;
+    t->data = data;
+    t->resume = 0;
+    t->state = ASYNC_RUNNABLE;
+    t->irq = ASYNC_NO_IRQ;
+    t->timed_out = 0;
+
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    t->next = async_tasks;
+    async_tasks = t;
+    spin_unlock_irqrestore(&async_lock, flags);
+
+    async_kick();
+    return 0;
+}
+
+void async_irq(int irq) {
+    if (!(async_irq_mask & (1u << irq))) return;
+
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    for (AsyncTask* t = async_tasks; t; t = t->next) {
+        if (t->state == ASYNC_WAITING && t->irq == irq) t->state = ASYNC_RUNNABLE;
+    }
+    async_update_waits();
+    spin_unlock_irqrestore(&async_lock, flags);
+    async_kick();
+}
+
+void async_tick(uint32_t now) {
+    if (!async_timed) return;
+
+    int woke = 0;
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    for (AsyncTask* t = async_tasks; t; t = t->next) {
+        if (t->state != ASYNC_WAITING) continue;
+        if (t->irq == ASYNC_POLL || (int32_t)(now - t->deadline) >= 0) {
+            t->state = ASYNC_RUNNABLE;
+            woke = 1;
+        }
+    }
+    if (woke) async_update_waits();
+    spin_unlock_irqrestore(&async_lock, flags);
+    if (woke) async_kick();
+}
+
+int async_count() {
+    int n = 0;
+    uint32_t flags = spin_lock_irqsave(&async_lock);
+    for (AsyncTask* t = async_tasks; t; t = t->next) n++;
+    spin_unlock_irqrestore(&async_lock, flags);
+    return n;
+}
@@ -0,0 +1,393 @@
+#include "ata.h"
+#include "pci.h"
+#include "io.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "wait.h"
+#include "interrupts.h"
+#include "serial.h"
+
+extern volatile uint32_t tick_count;
+
+// Primary channel, legacy ports
+#define ATA_IO          0x1F0
+#define ATA_CTRL        0x3F6
+#define ATA_IRQ_VECTOR  46   // IRQ14 after pic_remap
+
+// Task file registers, offsets from ATA_IO
+#define REG_DATA     0
+#define REG_COUNT    2
+#define REG_LBA_LO   3
+#define REG_LBA_MID  4
+#define REG_LBA_HI   5
+#define REG_DRIVE    6
+#define REG_STATUS   7   // Reading it also acknowledges the interrupt
+#define REG_COMMAND  7
+
+#define ST_ERR  0x01
+#define ST_DRQ  0x08
+#define ST_DF   0x20
+#define ST_BSY  0x80
+
+#define CTRL_NIEN 0x02   // Keep the drive from raising IRQ14
+#define CTRL_SRST 0x04   // Software reset of both drives on the channel
+
+#define CMD_READ_PIO   0x20
+#define CMD_WRITE_PIO  0x30
+#define CMD_READ_DMA   0xC8
+#define CMD_WRITE_DMA  0xCA
+#define CMD_FLUSH      0xE7
+#define CMD_IDENTIFY   0xEC
+
+// Bus master registers, offsets from the IDE controller's BAR4
+#define BM_COMMAND   0
+#define BM_STATUS    2
+#define BM_PRDT      4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08   // Device to memory
+#define BM_ST_ACTIVE 0x01
+#define BM_ST_ERR    0x02
+#define BM_ST_IRQ    0x04   // Write 1 to clear, like BM_ST_ERR
+
+#define ATA_TIMEOUT  10000000   // Status reads before giving up
+#define ATA_DMA_TICKS 200       // 2 s for IRQ14 to end a DMA transfer
+#define DMA_TIMED_OUT -2
+
+// Physical region descriptor: one contiguous piece of the buffer, which
+// may not cross a 64 KB boundary
+typedef struct {
+    uint32_t addr;
+    uint32_t count;      // Bytes in the low 16 bits (0 = 64 KB), bit 31 ends the table
+} __attribute__((packed)) Prd;
+
+#define PRD_EOT 0x80000000u
+
+static AtaDrive drive;
+static AtaStats stats;       // Only changed by the command owner
+static uint16_t bm_base = 0;
+static Prd* prdt = NULL;     // One page from the frame allocator
+
+// One command at a time. The owner may sleep, so this is a flag and a
+// wait queue under sched_lock rather than a spinlock.
+static volatile int ata_busy = 0;
+static WaitQueue ata_idle_wq = WAIT_QUEUE_INIT;
+
+// Set by the IRQ14 handler when a DMA transfer ends
+static volatile int dma_done = 0;
+static volatile uint8_t dma_bm_status;
+static volatile uint8_t dma_status;
+static WaitQueue ata_done_wq = WAIT_QUEUE_INIT;
+
+// A sleeping dma_wait gives up at this tick; ata_tick wakes it then
+static volatile int dma_waiting = 0;
+static volatile uint32_t dma_deadline;
+
+static int interrupts_enabled() {
+    uint32_t eflags;
+    __asm__ __volatile__ ("pushfl; popl %0" : "=r"(eflags));
+    return eflags & 0x200;
+}
+
+// The drive needs 400 ns after a select before its status means anything
+static void ata_delay() {
+    for (int i = 0; i < 4; i++) inb(ATA_CTRL);
+}
+
+static int wait_not_busy() {
+    for (int i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t st = inb(ATA_IO + REG_STATUS);
+        if (!(st & ST_BSY)) return (st & (ST_ERR | ST_DF)) ? -1 : 0;
+    }
+    return -1;
+}
+
+static int wait_drq() {
+    for (int i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t st = inb(ATA_IO + REG_STATUS);
+        if (st & ST_BSY) continue;
+        if (st & (ST_ERR | ST_DF)) return -1;
+        if (st & ST_DRQ) return 0;
+    }
+    return -1;
+}
+
+static void ata_lock() {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    while (ata_busy) wait_sleep(&ata_idle_wq);
+    ata_busy = 1;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+static void ata_unlock() {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    ata_busy = 0;
+    wake_up_locked(&ata_idle_wq);
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Master drive, LBA28 addressing
+static void ata_select(uint32_t lba, uint32_t count) {
+    outb(ATA_IO + REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    ata_delay();
+    outb(ATA_IO + REG_COUNT, (uint8_t)count);   // 256 is sent as 0
+    outb(ATA_IO + REG_LBA_LO, (uint8_t)lba);
+    outb(ATA_IO + REG_LBA_MID, (uint8_t)(lba >> 8));
+    outb(ATA_IO + REG_LBA_HI, (uint8_t)(lba >> 16));
+}
+
+static void dma_complete(uint8_t bm, uint8_t st) {
+    outb(bm_base + BM_STATUS, BM_ST_ERR | BM_ST_IRQ);
+    dma_bm_status = bm;
+    dma_status = st;
+    dma_done = 1;
+}
+
+static void ata_irq() {
+    uint8_t st = inb(ATA_IO + REG_STATUS);
+    if (!bm_base) return;
+    uint8_t bm = inb(bm_base + BM_STATUS);
+    if (!(bm & BM_ST_IRQ)) return;
+    dma_complete(bm, st);
+    wake_up(&ata_done_wq);
+}
+
+// Sleep until IRQ14 reports the transfer done, or DMA_TIMED_OUT after
+// ATA_DMA_TICKS without it. Early in boot, with interrupts still off,
+// poll the controller instead.
+static int dma_wait() {
+    if (interrupts_enabled()) {
+        uint32_t flags = spin_lock_irqsave(&sched_lock);
+        dma_deadline = tick_count + ATA_DMA_TICKS;
+        dma_waiting = 1;
+        while (!dma_done && (int32_t)(tick_count - dma_deadline) < 0) {
+            wait_sleep(&ata_done_wq);
+        }
+        dma_waiting = 0;
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return dma_done ? 0 : DMA_TIMED_OUT;
+    }
+
+    for (int i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t bm = inb(bm_base + BM_STATUS);
+        if (bm & BM_ST_IRQ) {
+            dma_complete(bm, inb(ATA_IO + REG_STATUS));
+            return 0;
+        }
+    }
+    return DMA_TIMED_OUT;
+}
+
+// Timer interrupt: wake a DMA wait whose IRQ14 never came
+void ata_tick(uint32_t now) {
+    if (dma_waiting && (int32_t)(now - dma_deadline) >= 0) wake_up(&ata_done_wq);
+}
+
+// Get the channel out of a command that never finished
+static void ata_reset() {
+    outb(ATA_CTRL, CTRL_SRST | CTRL_NIEN);
+    ata_delay();
+    outb(ATA_CTRL, CTRL_NIEN);
+    wait_not_busy();
+}
+
+// One PRD per piece of each segment, so scattered buffers still go
+// out as a single command
+static int dma_transfer(uint32_t lba, uint32_t count, const AtaSeg* segs, int nsegs, int write) {
+    int n = 0;
+    for (int s = 0; s < nsegs; s++) {
+        uint32_t addr = (uint32_t)segs[s].buf;
+        uint32_t left = segs[s].count * ATA_SECTOR_SIZE;
+        while (left) {
+            uint32_t chunk = 0x10000 - (addr & 0xFFFF);
+            if (chunk > left) chunk = left;
+            prdt[n].addr = addr;
+            prdt[n].count = chunk & 0xFFFF;
+            addr += chunk;
+            left -= chunk;
+            n++;
+        }
+    }
+    prdt[n - 1].count |= PRD_EOT;
+
+    outb(ATA_CTRL, 0);
+    if (wait_not_busy() < 0) return -1;
+    outb(bm_base + BM_COMMAND, 0);
+    outl(bm_base + BM_PRDT, (uint32_t)prdt);
+    outb(bm_base + BM_STATUS, BM_ST_ERR | BM_ST_IRQ);
+    dma_done = 0;
+
+    ata_select(lba, count);
+    outb(ATA_IO + REG_COMMAND, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+    uint8_t dir = write ? 0 : BM_CMD_READ;
+    outb(bm_base + BM_COMMAND, dir);
+    outb(bm_base + BM_COMMAND, dir | BM_CMD_START);
+
+    int err = dma_wait();
+    outb(bm_base + BM_COMMAND, 0);
+    if (err) return err;
+    if ((dma_bm_status & BM_ST_ERR) || (dma_status & (ST_ERR | ST_DF))) return -1;
+    return 0;
+}
+
+static int pio_transfer(uint32_t lba, uint32_t count, const AtaSeg* segs, int nsegs, int write) {
+    outb(ATA_CTRL, CTRL_NIEN);
+    if (wait_not_busy() < 0) return -1;
+    ata_select(lba, count);
+    outb(ATA_IO + REG_COMMAND, write ? CMD_WRITE_PIO : CMD_READ_PIO);
+
+    for (int s = 0; s < nsegs; s++) {
+        for (uint32_t i = 0; i < segs[s].count; i++) {
+            if (wait_drq() < 0) return -1;
+            uint8_t* sector = segs[s].buf + i * ATA_SECTOR_SIZE;
+            if (write) {
+                outsw(ATA_IO + REG_DATA, sector, ATA_SECTOR_SIZE / 2);
+            } else {
+                insw(ATA_IO + REG_DATA, sector, ATA_SECTOR_SIZE / 2);
+            }
+        }
+    }
+    return wait_not_busy();
+}
+
+// One command for consecutive sectors starting at lba, gathered from or
+// scattered to segs (at most ATA_MAX_SEGS, ATA_MAX_SECTORS in total).
+// Buffers must be kernel memory: DMA goes to their physical (= virtual)
+// address.
+int ata_transfer(uint32_t lba, const AtaSeg* segs, int nsegs, int write) {
+    uint32_t count = 0;
+    int dma = drive.dma;
+    for (int s = 0; s < nsegs; s++) {
+        count += segs[s].count;
+        if ((uint32_t)segs[s].buf & 1) dma = 0;   // PRDs need even addresses
+    }
+    if (!drive.present || nsegs < 1 || nsegs > ATA_MAX_SEGS || count == 0 || count > ATA_MAX_SECTORS) return -1;
+    if (lba >= drive.sectors || count > drive.sectors - lba) return -1;
+
+    ata_lock();
+    uint64_t start = rdtsc();
+    int err = dma ? dma_transfer(lba, count, segs, nsegs, write) : pio_transfer(lba, count, segs, nsegs, write);
+    if (err == DMA_TIMED_OUT) {
+        // Lost interrupts or a wedged controller: stop trusting DMA
+        serial_puts("[ata] DMA timed out, using PIO from now on\n");
+        drive.dma = 0;
+        dma = 0;
+        stats.errors++;
+        ata_reset();
+        err = pio_transfer(lba, count, segs, nsegs, write);
+    }
+    stats.busy_cycles += rdtsc() - start;
+
+    if (write) {
+        stats.writes++;
+        stats.sectors_written += count;
+    } else {
+        stats.reads++;
+        stats.sectors_read += count;
+    }
+    if (dma) stats.dma_ops++; else stats.pio_ops++;
+    if (err) stats.errors++;
+    ata_unlock();
+    return err;
+}
+
+// Push the drive's own write cache to the medium
+int ata_flush() {
+    if (!drive.present) return -1;
+    ata_lock();
+    outb(ATA_CTRL, CTRL_NIEN);
+    int err = wait_not_busy();
+    if (!err) {
+        outb(ATA_IO + REG_DRIVE, 0xE0);
+        ata_delay();
+        outb(ATA_IO + REG_COMMAND, CMD_FLUSH);
+        err = wait_not_busy();
+    }
+    if (err) stats.errors++;
+    ata_unlock();
+    return err;
+}
+
+static int ata_identify() {
+    outb(ATA_CTRL, CTRL_NIEN);
+    outb(ATA_IO + REG_DRIVE, 0xA0);
+    ata_delay();
+    outb(ATA_IO + REG_COUNT, 0);
+    outb(ATA_IO + REG_LBA_LO, 0);
+    outb(ATA_IO + REG_LBA_MID, 0);
+    outb(ATA_IO + REG_LBA_HI, 0);
+    outb(ATA_IO + REG_COMMAND, CMD_IDENTIFY);
+
+    uint8_t st = inb(ATA_IO + REG_STATUS);
+    if (st == 0 || st == 0xFF) return -1;   // No drive, or no controller
+    if (wait_not_busy() < 0) return -1;
+    if (inb(ATA_IO + REG_LBA_MID) || inb(ATA_IO + REG_LBA_HI)) return -1;   // ATAPI, not a disk
+    if (wait_drq() < 0) return -1;
+
+    uint16_t id[256];
+    insw(ATA_IO + REG_DATA, id, 256);
+    drive.sectors = id[60] | ((uint32_t)id[61] << 16);
+    if (!drive.sectors) return -1;   // No LBA support
+
+    // Words 27-46, two characters each, high byte first
+    for (int i = 0; i < 20; i++) {
+        drive.model[2 * i] = (char)(id[27 + i] >> 8);
+        drive.model[2 * i + 1] = (char)id[27 + i];
+    }
+    int len = 40;
+    while (len > 0 && drive.model[len - 1] == ' ') len--;
+    drive.model[len] = '\0';
+    return 0;
+}
+
+// Bus mastering through the PCI IDE controller. A read of sector 0
+// proves it works before any real request relies on it.
+static void ata_dma_init() {
+    PciAddr dev;
+    if (pci_find_class(0x01, 0x01, &dev) < 0) return;   // Mass storage, IDE
+    uint32_t bar4 = pci_read32(dev, PCI_BAR4);
+    if (!(bar4 & 1)) return;   // Bus master registers must be in I/O space
+    bm_base = bar4 & 0xFFFC;
+    pci_write32(dev, PCI_COMMAND, (pci_read32(dev, PCI_COMMAND) & 0xFFFF) | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+
+    prdt = (Prd*)pmm_alloc_page();
+    AtaSeg probe = { (uint8_t*)pmm_alloc_page(), 1 };
+    if (prdt && probe.buf && dma_transfer(0, 1, &probe, 1, 0) == 0) {
+        drive.dma = 1;
+    } else {
+        ata_reset();
+        pmm_free_page(prdt);
+        prdt = NULL;
+        bm_base = 0;
+    }
+    pmm_free_page(probe.buf);
+}
+
+void ata_init() {
+    static int initialized = 0;
+    if (initialized) return;   // kernel_setup can run more than once
+    initialized = 1;
+
+    if (ata_identify() < 0) {
+        serial_puts("[ata] no disk on the primary channel\n");
+        return;
+    }
+    drive.present = 1;
+    register_interrupt_handler(ATA_IRQ_VECTOR, ata_irq);
+    ata_dma_init();
+
+    serial_puts("[ata] ");
+    serial_puts(drive.model);
+    serial_puts(", ");
+    serial_putint(drive.sectors / 2048);
+    serial_puts(" MB, ");
+    serial_puts(drive.dma ? "bus-master DMA\n" : "PIO\n");
+}
+
+const AtaDrive* ata_drive() {
+    return &drive;
+}
+
+void ata_stats(AtaStats* out) {
+    *out = stats;
+}
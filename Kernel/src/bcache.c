@@ -0,0 +1,346 @@
+#include "bcache.h"
+#include "ata.h"
+#include "blkq.h"
+#include "pmm.h"
+#include "wait.h"
+#include "task.h"
+#include "time.h"
+#include "spinlock.h"
+#include "heap.h"
+#include "serial.h"
+
+// Sector cache in front of the disk. Lookups hash the LBA; unpinned
+// buffers sit on an LRU list, and eviction takes the least recently
+// released clean one. Dirty sectors are written back by bsync, which a
+// kernel task runs every BCACHE_FLUSH_TICKS.
+
+static Buf bufs[BCACHE_BLOCKS];
+static Buf* buckets[BCACHE_BUCKETS];
+static Buf* lru_head = NULL;
+static Buf* lru_tail = NULL;
+static BcacheStats stats;
+static int ready = 0;
+
+// Sequential read detection, one stream at a time
+static uint32_t seq_next = 0;     // The sector a sequential reader wants next
+static uint32_t ra_window = 0;    // Sectors to read on its next miss
+
+// Guards the hash, the LRU list, refs and the flags. Disk I/O happens
+// with it dropped; whoever sets busy owns the buffer's data until it
+// clears it and wakes bcache_wq.
+static spinlock_t bcache_lock = SPINLOCK_INIT;
+static WaitQueue bcache_wq = WAIT_QUEUE_INIT;
+
+// One bsync at a time: it sleeps on the disk with the batch in hand
+static volatile int syncing = 0;
+static WaitQueue sync_wq = WAIT_QUEUE_INIT;
+
+static uint32_t bucket_of(uint32_t lba) {
+    return (lba * 2654435761u) >> 24;   // Fibonacci hashing, 256 buckets
+}
+
+static Buf* hash_find(uint32_t lba) {
+    for (Buf* b = buckets[bucket_of(lba)]; b; b = b->hash_next) {
+        if (b->lba == lba) return b;
+    }
+    return NULL;
+}
+
+static void hash_remove(Buf* b) {
+    Buf** link = &buckets[bucket_of(b->lba)];
+    while (*link && *link != b) link = &(*link)->hash_next;
+    if (*link) *link = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static void hash_insert(Buf* b) {
+    uint32_t i = bucket_of(b->lba);
+    b->hash_next = buckets[i];
+    buckets[i] = b;
+}
+
+static void lru_unlink(Buf* b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next; else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev; else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_head(Buf* b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b; else lru_tail = b;
+    lru_head = b;
+}
+
+// The least recently used buffer nobody needs: unpinned, clean and idle
+static Buf* find_victim() {
+    for (Buf* b = lru_tail; b; b = b->lru_prev) {
+        if (!b->refs && !b->dirty && !b->busy) return b;
+    }
+    return NULL;
+}
+
+// The flush task: write dirty sectors back every period
+static void bcache_flusher() {
+    sleep_t(BCACHE_FLUSH_TICKS);
+    bsync();
+}
+
+void bcache_init() {
+    if (ready || !ata_drive()->present) return;   // kernel_setup can run more than once
+
+    uint8_t* pages = (uint8_t*)pmm_alloc_pages(BCACHE_BLOCKS * ATA_SECTOR_SIZE / PAGE_SIZE);
+    if (!pages) {
+        serial_puts("[bcache] out of memory\n");
+        return;
+    }
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        bufs[i].data = pages + i * ATA_SECTOR_SIZE;
+        lru_push_head(&bufs[i]);
+    }
+    ready = 1;
+    register_task("bflush", bcache_flusher);
+}
+
+// Give b to lba: drop whatever it held and hash it under the new
+// sector, not yet valid. bcache_lock held.
+static void install(Buf* b, uint32_t lba) {
+    if (b->valid) {
+        stats.evictions++;
+        if (b->ra) {
+            // Read ahead for nothing: the stream was shorter than guessed
+            stats.ra_wasted++;
+            ra_window /= 2;
+        }
+    }
+    hash_remove(b);
+    b->lba = lba;
+    b->valid = 0;
+    b->ra = 0;
+    hash_insert(b);
+}
+
+static void bcache_io_done(BlkBio* bio) {
+    Buf* b = (Buf*)bio->priv;
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    if (!bio->write) {
+        b->valid = bio->status == 0;
+    } else if (bio->status == 0) {
+        stats.writebacks++;
+    } else if (!b->dirty) {
+        b->dirty = 1;   // Try again next time
+        stats.dirty++;
+    }
+    b->busy = 0;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    wake_up(&bcache_wq);
+}
+
+// Queue b's sector for reading or writing; the owner set busy
+static void bio_start(Buf* b, int write) {
+    b->io.lba = b->lba;
+    b->io.count = 1;
+    b->io.buf = b->data;
+    b->io.write = write;
+    b->io.end = bcache_io_done;
+    b->io.priv = b;
+    blk_submit(&b->io);
+}
+
+// Claim buffers for the sectors after lba, up to the read-ahead window.
+// Stops at the first one already cached or when nothing can be evicted.
+// bcache_lock held.
+static int read_ahead(uint32_t lba, Buf** ahead) {
+    uint32_t last = ata_drive()->sectors;
+    int n = 0;
+    for (uint32_t i = 1; i < ra_window && lba + i < last; i++) {
+        if (hash_find(lba + i)) break;
+        Buf* b = find_victim();
+        if (!b) break;
+        install(b, lba + i);
+        b->busy = 1;
+        b->ra = 1;
+        ahead[n++] = b;
+    }
+    stats.ra_sectors += n;
+    return n;
+}
+
+// The sector, read from the disk unless it is cached. Pinned until
+// brelse. NULL if there is no disk, the read failed or every buffer is
+// pinned.
+//
+// A miss right where the previous read left off reads ahead as well,
+// with a window that doubles on every such miss (up to BCACHE_RA_MAX)
+// and halves when read-ahead goes unused. The sectors are queued
+// together, so the block queue turns them into one transfer.
+Buf* bread(uint32_t lba) {
+    if (!ready) return NULL;
+    Buf* ahead[BCACHE_RA_MAX];
+    int nahead = 0;
+
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    int sequential = lba == seq_next;
+    seq_next = lba + 1;
+
+    Buf* b = hash_find(lba);
+    if (b && b->valid) {
+        stats.hits++;
+        if (b->ra) {
+            stats.ra_hits++;
+            b->ra = 0;
+        }
+    } else if (!b) {
+        stats.misses++;
+        b = find_victim();
+        if (!b) {
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            // Only dirty buffers left? Write them back and try once more
+            if (bsync() < 0) return NULL;
+            flags = spin_lock_irqsave(&bcache_lock);
+            b = hash_find(lba);
+            if (!b) b = find_victim();
+            if (!b) {
+                spin_unlock_irqrestore(&bcache_lock, flags);
+                return NULL;
+            }
+        }
+        if (b->lba != lba || !b->valid) install(b, lba);
+
+        if (!sequential) {
+            ra_window = 0;
+        } else if (ra_window < BCACHE_RA_MIN) {
+            ra_window = BCACHE_RA_MIN;
+        } else if (ra_window < BCACHE_RA_MAX) {
+            ra_window *= 2;
+        }
+    }
+
+    if (!b->refs) lru_unlink(b);
+    b->refs++;
+    int load = !b->valid && !b->busy;
+    if (load) {
+        b->busy = 1;
+        nahead = read_ahead(lba, ahead);
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    if (load) {
+        bio_start(b, 0);
+        for (int i = 0; i < nahead; i++) bio_start(ahead[i], 0);
+        blk_run();
+    }
+    wait_event(bcache_wq, !b->busy);
+
+    if (!b->valid) {
+        brelse(b);
+        return NULL;
+    }
+    return b;
+}
+
+// A pinned buffer for a sector the caller is about to overwrite whole:
+// zero-filled, without a disk read. Falls back to bread when the sector
+// is already cached (or on its way in) or every buffer is taken.
+Buf* bnew(uint32_t lba) {
+    if (!ready) return NULL;
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    Buf* b = hash_find(lba) ? NULL : find_victim();
+    if (!b) {
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        b = bread(lba);
+        if (b) memset(b->data, 0, ATA_SECTOR_SIZE);
+        return b;
+    }
+    install(b, lba);
+    b->valid = 1;
+    lru_unlink(b);
+    b->refs = 1;
+    memset(b->data, 0, ATA_SECTOR_SIZE);
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    return b;
+}
+
+// The holder changed b->data
+void bdirty(Buf* b) {
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    if (!b->dirty) stats.dirty++;
+    b->dirty = 1;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+void brelse(Buf* b) {
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    if (b->refs && --b->refs == 0) lru_push_head(b);
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Write every dirty sector back, then flush the drive's cache. The
+// block queue sorts and merges them, so neighbouring sectors go out as
+// one command. -1 if any write failed (those sectors stay dirty).
+int bsync() {
+    if (!ready) return 0;
+
+    static Buf* batch[BCACHE_BLOCKS];
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    while (syncing) wait_sleep(&sync_wq);
+    syncing = 1;
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    flags = spin_lock_irqsave(&bcache_lock);
+    int n = 0;
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        Buf* b = &bufs[i];
+        if (!b->dirty || b->busy) continue;
+        b->busy = 1;
+        b->dirty = 0;
+        stats.dirty--;
+        if (!b->refs) lru_unlink(b);
+        b->refs++;
+        batch[n++] = b;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    for (int i = 0; i < n; i++) bio_start(batch[i], 1);
+    blk_run();
+
+    int err = 0;
+    for (int i = 0; i < n; i++) {
+        Buf* b = batch[i];
+        wait_event(bcache_wq, !b->busy);
+        if (b->io.status != 0) err = -1;
+        brelse(b);
+    }
+    if (n && ata_flush() < 0) err = -1;
+
+    flags = spin_lock_irqsave(&sched_lock);
+    syncing = 0;
+    wake_up_locked(&sync_wq);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return err;
+}
+
+// Write back, then forget every unpinned sector, so the next reads
+// come from the disk
+void bcache_drop() {
+    bsync();
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        Buf* b = &bufs[i];
+        if (b->refs || b->dirty || b->busy || !b->valid) continue;
+        hash_remove(b);
+        b->valid = 0;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+void bcache_stats(BcacheStats* out) {
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    *out = stats;
+    out->ra_window = ra_window;
+    out->pinned = 0;
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        if (bufs[i].refs) out->pinned++;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
@@ -0,0 +1,219 @@
+#include "blkq.h"
+#include "ata.h"
+#include "wait.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+extern volatile uint32_t tick_count;
+
+// Queued bios for consecutive sectors, done as one disk command
+typedef struct BlkRequest {
+    uint32_t lba;
+    uint32_t count;
+    int write;
+    int nbios;
+    uint32_t deadline;           // tick_count after which it jumps the queue
+    BlkBio* first;
+    BlkBio* last;
+    struct BlkRequest* prev;     // The queue, sorted by lba
+    struct BlkRequest* next;
+} BlkRequest;
+
+// There is no I/O thread: whoever calls blk_run while nobody else is
+// dispatching drains the queue, and everyone else just waits for their
+// bios. Requests queued meanwhile get merged into bigger ones.
+static BlkRequest pool[BLK_MAX_REQUESTS];
+static BlkRequest* free_list = NULL;
+static int pool_ready = 0;
+static BlkRequest* queue = NULL;
+static uint32_t head_pos = 0;    // Where the last request ended
+static volatile int dispatching = 0;
+static BlkStats stats;
+
+// Guards everything above. Taken before sched_lock, never after it.
+static spinlock_t blk_lock = SPINLOCK_INIT;
+static WaitQueue blk_wq = WAIT_QUEUE_INIT;
+
+static BlkRequest* req_alloc() {
+    if (!pool_ready) {
+        for (int i = 0; i < BLK_MAX_REQUESTS; i++) {
+            pool[i].next = free_list;
+            free_list = &pool[i];
+        }
+        pool_ready = 1;
+    }
+    BlkRequest* r = free_list;
+    if (r) free_list = r->next;
+    return r;
+}
+
+static void req_free(BlkRequest* r) {
+    r->next = free_list;
+    free_list = r;
+}
+
+static void queue_unlink(BlkRequest* r) {
+    if (r->prev) r->prev->next = r->next; else queue = r->next;
+    if (r->next) r->next->prev = r->prev;
+    stats.depth--;
+}
+
+static int fits(BlkRequest* r, int write, uint32_t count, int nbios) {
+    return r->write == write && r->count + count <= ATA_MAX_SECTORS && r->nbios + nbios <= ATA_MAX_SEGS;
+}
+
+static void earlier_deadline(BlkRequest* r, uint32_t deadline) {
+    if ((int32_t)(deadline - r->deadline) < 0) r->deadline = deadline;
+}
+
+// b directly follows a: make them one request
+static void try_join(BlkRequest* a, BlkRequest* b) {
+    if (!a || !b || a->lba + a->count != b->lba || !fits(a, b->write, b->count, b->nbios)) return;
+    a->last->next = b->first;
+    a->last = b->last;
+    a->count += b->count;
+    a->nbios += b->nbios;
+    earlier_deadline(a, b->deadline);
+    queue_unlink(b);
+    req_free(b);
+    stats.joins++;
+}
+
+// Queue a bio without starting it; call blk_run once a batch is in.
+// The bio and its buffer must stay put until it completes.
+void blk_submit(BlkBio* bio) {
+    bio->status = BLK_PENDING;
+    bio->next = NULL;
+    uint32_t deadline = tick_count + (bio->write ? BLK_WRITE_DEADLINE : BLK_READ_DEADLINE);
+
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    stats.bios++;
+    while (1) {
+        // The last request starting at or before bio, and the one after it
+        BlkRequest* prev = NULL;
+        for (BlkRequest* r = queue; r && r->lba <= bio->lba; r = r->next) prev = r;
+        BlkRequest* next = prev ? prev->next : queue;
+
+        if (prev && prev->lba + prev->count == bio->lba && fits(prev, bio->write, bio->count, 1)) {
+            prev->last->next = bio;
+            prev->last = bio;
+            prev->count += bio->count;
+            prev->nbios++;
+            earlier_deadline(prev, deadline);
+            stats.back_merges++;
+            try_join(prev, next);
+            break;
+        }
+        if (next && bio->lba + bio->count == next->lba && fits(next, bio->write, bio->count, 1)) {
+            bio->next = next->first;
+            next->first = bio;
+            next->lba = bio->lba;
+            next->count += bio->count;
+            next->nbios++;
+            earlier_deadline(next, deadline);
+            stats.front_merges++;
+            try_join(prev, next);
+            break;
+        }
+
+        BlkRequest* r = req_alloc();
+        if (!r) {
+            // Every request is queued: get some of them done first
+            spin_unlock_irqrestore(&blk_lock, flags);
+            blk_run();
+            wait_event(blk_wq, free_list != NULL || !dispatching);
+            flags = spin_lock_irqsave(&blk_lock);
+            continue;
+        }
+        r->lba = bio->lba;
+        r->count = bio->count;
+        r->write = bio->write;
+        r->nbios = 1;
+        r->deadline = deadline;
+        r->first = r->last = bio;
+        r->prev = prev;
+        r->next = next;
+        if (prev) prev->next = r; else queue = r;
+        if (next) next->prev = r;
+        if (++stats.depth > stats.max_depth) stats.max_depth = stats.depth;
+        break;
+    }
+    spin_unlock_irqrestore(&blk_lock, flags);
+}
+
+// Elevator (C-SCAN): the next request at or above where the disk head
+// was left, wrapping to the lowest one. A request past its deadline
+// goes first, so a busy region can't starve the rest. blk_lock held.
+static BlkRequest* pick_next() {
+    if (!queue) return NULL;
+
+    BlkRequest* pick = queue;
+    for (BlkRequest* r = queue; r; r = r->next) {
+        if (r->lba >= head_pos) {
+            pick = r;
+            break;
+        }
+    }
+
+    BlkRequest* oldest = queue;
+    for (BlkRequest* r = queue->next; r; r = r->next) {
+        if ((int32_t)(r->deadline - oldest->deadline) < 0) oldest = r;
+    }
+    if (oldest != pick && (int32_t)(tick_count - oldest->deadline) >= 0) {
+        stats.deadline_picks++;
+        return oldest;
+    }
+    return pick;
+}
+
+// Send queued requests to the disk until none are left, unless some
+// other task is already doing that
+void blk_run() {
+    static AtaSeg segs[ATA_MAX_SEGS];   // Only the dispatcher uses it
+
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    if (dispatching) {
+        spin_unlock_irqrestore(&blk_lock, flags);
+        return;
+    }
+    dispatching = 1;
+
+    BlkRequest* r;
+    while ((r = pick_next())) {
+        stats.depth_sum += stats.depth;
+        queue_unlink(r);
+        stats.requests++;
+        stats.sectors += r->count;
+        head_pos = r->lba + r->count;
+        spin_unlock_irqrestore(&blk_lock, flags);
+
+        int n = 0;
+        for (BlkBio* b = r->first; b; b = b->next) {
+            segs[n].buf = b->buf;
+            segs[n].count = b->count;
+            n++;
+        }
+        int err = ata_transfer(r->lba, segs, n, r->write);
+
+        // A finished bio may be reused at once, so read next first
+        for (BlkBio* b = r->first; b; ) {
+            BlkBio* next = b->next;
+            b->status = err ? -1 : 0;
+            if (b->end) b->end(b);
+            b = next;
+        }
+        wake_up(&blk_wq);
+
+        flags = spin_lock_irqsave(&blk_lock);
+        req_free(r);
+    }
+    dispatching = 0;
+    spin_unlock_irqrestore(&blk_lock, flags);
+    wake_up(&blk_wq);
+}
+
+void blk_stats(BlkStats* out) {
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&blk_lock, flags);
+}
@@ -0,0 +1,175 @@
+
+#include "elf.h"
+#include "paging.h"
+#include "pmm.h"
+#include "heap.h"
+#include "spinlock.h"
+
+#define ELF_TEXT_CACHE 8
+
+// Read-only segments already loaded from an image, so the next instance
+// of the same program maps the same frames instead of copying them
+// again. The cache holds one reference on each frame.
+typedef struct {
+    const void* image;
+    uint32_t offset;     // p_offset, p_vaddr and p_memsz identify the segment
+    uint32_t vaddr;
+    uint32_t memsz;
+    uint32_t pages;
+    uint32_t* frames;
+} TextSegment;
+
+static TextSegment text_cache[ELF_TEXT_CACHE];
+static int text_victim = 0;
+static spinlock_t text_lock = SPINLOCK_INIT;
+
+static int elf_check_header(const Elf32_Ehdr* eh, uint32_t size) {
+    if (size < sizeof(Elf32_Ehdr)) return 0;
+    if (eh->e_magic != ELF_MAGIC || eh->e_class != ELFCLASS32 || eh->e_data != ELFDATA2LSB) return 0;
+    if (eh->e_type != ET_EXEC || eh->e_machine != EM_386) return 0;
+    if (eh->e_phentsize != sizeof(Elf32_Phdr) || eh->e_phnum == 0) return 0;
+    if (eh->e_phoff > size || (uint32_t)eh->e_phnum * sizeof(Elf32_Phdr) > size - eh->e_phoff) return 0;
+    return eh->e_entry >= USER_BASE && eh->e_entry < USER_TOP;
+}
+
+static uint32_t segment_pages(const Elf32_Phdr* ph) {
+    uint32_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    return (ph->p_vaddr + ph->p_memsz - start + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static int segment_unmapped(uint32_t* dir, const Elf32_Phdr* ph) {
+    uint32_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    for (uint32_t i = 0; i < segment_pages(ph); i++) {
+        uint32_t* pte = paging_pte(dir, start + i * PAGE_SIZE);
+        if (pte && (*pte & PTE_PRESENT)) return 0;
+    }
+    return 1;
+}
+
+// Map a cached copy of this read-only segment, if there is one
+static int text_map_cached(const void* image, const Elf32_Phdr* ph, uint32_t* dir) {
+    uint32_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint32_t flags = spin_lock_irqsave(&text_lock);
+    for (int i = 0; i < ELF_TEXT_CACHE; i++) {
+        TextSegment* ts = &text_cache[i];
+        if (ts->image != image || ts->offset != ph->p_offset ||
+            ts->vaddr != ph->p_vaddr || ts->memsz != ph->p_memsz) continue;
+
+        for (uint32_t j = 0; j < ts->pages; j++) {
+            pmm_page_ref((void*)ts->frames[j]);
+            if (paging_map(dir, start + j * PAGE_SIZE, ts->frames[j], PTE_USER) < 0) {
+                pmm_page_unref((void*)ts->frames[j]);
+                spin_unlock_irqrestore(&text_lock, flags);
+                return ELF_NO_MEMORY;
+            }
+        }
+        spin_unlock_irqrestore(&text_lock, flags);
+        return 1;
+    }
+    spin_unlock_irqrestore(&text_lock, flags);
+    return 0;
+}
+
+// Remember a freshly loaded read-only segment, evicting round robin.
+// Evicted frames live on in the processes still mapping them.
+static void text_remember(const void* image, const Elf32_Phdr* ph, uint32_t* dir) {
+    uint32_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint32_t pages = segment_pages(ph);
+    uint32_t* frames = (uint32_t*)malloc(pages * sizeof(uint32_t));
+    if (!frames) return;
+    for (uint32_t j = 0; j < pages; j++) {
+        frames[j] = PTE_ADDR(*paging_pte(dir, start + j * PAGE_SIZE));
+        pmm_page_ref((void*)frames[j]);
+    }
+
+    uint32_t flags = spin_lock_irqsave(&text_lock);
+    TextSegment* ts = &text_cache[text_victim];
+    text_victim = (text_victim + 1) % ELF_TEXT_CACHE;
+    uint32_t* old_frames = ts->frames;
+    uint32_t old_pages = ts->pages;
+    ts->image = image;
+    ts->offset = ph->p_offset;
+    ts->vaddr = ph->p_vaddr;
+    ts->memsz = ph->p_memsz;
+    ts->pages = pages;
+    ts->frames = frames;
+    spin_unlock_irqrestore(&text_lock, flags);
+
+    if (old_frames) {
+        for (uint32_t j = 0; j < old_pages; j++) pmm_page_unref((void*)old_frames[j]);
+        free(old_frames);
+    }
+}
+
+// Back [vaddr, vaddr + memsz) with zeroed frames. A page shared with an
+// earlier segment keeps its frame and gains write access if this one
+// needs it. If other processes map it too it is copied first, since the
+// caller is about to write into it.
+static int elf_map_segment(uint32_t* dir, const Elf32_Phdr* ph) {
+    uint32_t flags = PTE_USER | ((ph->p_flags & PF_W) ? PTE_WRITE : 0);
+    uint32_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint32_t end = ph->p_vaddr + ph->p_memsz;
+
+    for (uint32_t page = start; page < end; page += PAGE_SIZE) {
+        uint32_t* pte = paging_pte(dir, page);
+        if (pte && (*pte & PTE_PRESENT)) {
+            void* frame = (void*)PTE_ADDR(*pte);
+            if (pmm_page_refcount(frame) > 1) {
+                void* copy = pmm_alloc_page();
+                if (!copy) return ELF_NO_MEMORY;
+                memcpy(copy, frame, PAGE_SIZE);
+                *pte = (uint32_t)copy | (*pte & 0xFFF);
+                pmm_page_unref(frame);
+            }
+            *pte |= flags;
+            continue;
+        }
+        void* frame = pmm_alloc_page();
+        if (!frame) return ELF_NO_MEMORY;
+        memset(frame, 0, PAGE_SIZE);
+        if (paging_map(dir, page, (uint32_t)frame, flags) < 0) {
+            pmm_free_page(frame);
+            return ELF_NO_MEMORY;
+        }
+    }
+    return ELF_OK;
+}
+
+// Map and fill every PT_LOAD segment of an ELF32 executable into dir.
+// Nothing is undone on failure; the caller drops the whole directory.
+int elf_load(const void* image, uint32_t size, uint32_t* dir, uint32_t* entry, int cacheable) {
+    const uint8_t* base = (const uint8_t*)image;
+    const Elf32_Ehdr* eh = (const Elf32_Ehdr*)base;
+    if (!elf_check_header(eh, size)) return ELF_BAD_HEADER;
+
+    const Elf32_Phdr* phdrs = (const Elf32_Phdr*)(base + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; i++) {
+        const Elf32_Phdr* ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+
+        if (ph->p_filesz > ph->p_memsz || ph->p_offset > size || ph->p_filesz > size - ph->p_offset) {
+            return ELF_BAD_SEGMENT;
+        }
+        if (ph->p_vaddr < USER_BASE || ph->p_vaddr >= USER_TOP || ph->p_memsz > USER_TOP - ph->p_vaddr) {
+            return ELF_BAD_SEGMENT;
+        }
+
+        // Text and read-only data are shared by every instance of the image
+        int shareable = cacheable && !(ph->p_flags & PF_W) && segment_unmapped(dir, ph);
+        if (shareable) {
+            int cached = text_map_cached(image, ph, dir);
+            if (cached < 0) return cached;
+            if (cached) continue;
+        }
+
+        int err = elf_map_segment(dir, ph);
+        if (err) return err;
+        if (paging_copy_to(dir, ph->p_vaddr, base + ph->p_offset, ph->p_filesz) < 0) {
+            return ELF_NO_MEMORY;
+        }
+        if (shareable) text_remember(image, ph, dir);
+    }
+
+    *entry = eh->e_entry;
+    return ELF_OK;
+}
@@ -0,0 +1,1250 @@
+
+#include "fat.h"
+#include "vfs.h"
+#include "bcache.h"
+#include "ata.h"
+#include "wait.h"
+#include "task.h"
+#include "spinlock.h"
+#include "heap.h"
+#include "string.h"
+#include "serial.h"
+
+// FAT16 and FAT32 through the block cache: the boot sector, the FATs,
+// directories and file data are all cached sectors. Two caches keep
+// the common paths off the FAT itself:
+//  - the cluster chains of recently used files and directories, as
+//    arrays, so seeking to any offset is an index and not a FAT walk;
+//  - the entries of recently used directories, hashed by name on the
+//    first scan, so later lookups don't read the directory again.
+// Long names are read; new entries get 8.3 names, with lower case kept
+// through the NT case bits.
+
+#define SECTOR ATA_SECTOR_SIZE
+
+#define ATTR_VOLUME   0x08
+#define ATTR_DIR      0x10
+#define ATTR_ARCHIVE  0x20
+#define ATTR_LFN      0x0F    // Read-only, hidden, system and volume at once
+
+#define NT_LOWER_BASE 0x08
+#define NT_LOWER_EXT  0x10
+
+#define ENTRY_END     0x00
+#define ENTRY_FREE    0xE5
+#define LFN_LAST      0x40
+
+#define FAT_NAME_MAX  FS_NAME_MAX
+#define FAT_MIN_CHAIN 8
+#define FAT_MIN_TABLE 16
+
+#define FSINFO_SIG1   0x41615252
+#define FSINFO_SIG2   0x61417272
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+// A directory entry as it is on the disk
+typedef struct __attribute__((packed)) {
+    char name[11];            // 8.3, space padded, no dot
+    uint8_t attr;
+    uint8_t nt_case;
+    uint8_t ctime_tenth;
+    uint16_t ctime;
+    uint16_t cdate;
+    uint16_t adate;
+    uint16_t cluster_hi;      // FAT32 only
+    uint16_t mtime;
+    uint16_t mdate;
+    uint16_t cluster_lo;
+    uint32_t size;
+} FatDirent;
+
+// A piece of a long name, 13 UCS-2 characters, stored just before its
+// 8.3 entry, last piece first
+typedef struct __attribute__((packed)) {
+    uint8_t seq;              // 1-based, LFN_LAST on the last piece
+    uint16_t name1[5];
+    uint8_t attr;
+    uint8_t type;
+    uint8_t checksum;         // Of the 8.3 name it belongs to
+    uint16_t name2[6];
+    uint16_t zero;
+    uint16_t name3[2];
+} FatLfn;
+
+#define ENTRIES_PER_SECTOR (SECTOR / sizeof(FatDirent))
+
+typedef struct {
+    uint32_t type;            // 16 or 32; 0 while unmounted
+    uint32_t start;           // First sector of the volume
+    uint32_t spc;             // Sectors per cluster
+    uint32_t cluster_size;
+    uint32_t fat_lba;         // First FAT; the copies follow it
+    uint32_t fat_sectors;     // Per FAT
+    uint32_t nfats;
+    uint32_t root_lba;        // FAT16: the fixed root directory
+    uint32_t root_entries;
+    uint32_t root_cluster;    // FAT32: the root directory's chain
+    uint32_t data_lba;        // Cluster 2
+    uint32_t clusters;        // Numbered 2 .. clusters + 1
+    uint32_t free;
+    uint32_t next_free;       // Where allocation starts looking
+} FatVolume;
+
+typedef struct {
+    uint32_t first;           // Its first cluster; 0 for an empty slot
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* clusters;
+    uint32_t used;            // Clock of the last use
+} Chain;
+
+typedef struct {
+    char* name;               // As listed: the long name, or the 8.3 one
+    char short_name[11];      // As on the disk, to keep new aliases unique
+    uint32_t hash;            // Of the name in lower case
+    uint32_t slot;            // The 8.3 entry's index in the directory
+    uint32_t first_slot;      // Its first long name piece, or slot
+    uint32_t cluster;
+    uint32_t size;
+    uint8_t attr;
+    uint8_t removed;
+} DirEntry;
+
+typedef struct {
+    int valid;
+    uint32_t cluster;         // The directory; 0 is the FAT16 root
+    uint32_t used;
+    DirEntry* entries;        // In directory order
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t live;            // Entries not removed
+    uint32_t* table;          // Name hash -> entries index + 1; 0 is empty
+    uint32_t table_size;      // Power of two, over twice count
+    uint32_t end;             // First slot after the last one in use
+    uint32_t free_hint;       // No deleted slot to reuse below this one
+} Dir;
+
+// A resolved path
+typedef struct {
+    int root;
+    uint32_t dir;             // Directory holding the entry
+    uint32_t slot;
+    uint32_t first_slot;
+    uint32_t cluster;         // First cluster, 0 for an empty file
+    uint32_t size;
+    uint8_t attr;
+    Dir* cached;              // Where its DirEntry lives, if still there
+    uint32_t index;
+} Node;
+
+static FatVolume vol;
+static Chain chains[FAT_CHAIN_CACHE];
+static Dir dirs[FAT_DIR_CACHE];
+static uint32_t use_clock = 0;   // Orders cache entries by last use
+static FatStats stats;
+
+// One caller at a time: every operation sleeps on the disk. A flag and
+// a wait queue under sched_lock, like the ATA channel.
+static volatile int fat_busy = 0;
+static WaitQueue fat_wq = WAIT_QUEUE_INIT;
+
+static void fat_lock() {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    while (fat_busy) wait_sleep(&fat_wq);
+    fat_busy = 1;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+static void fat_unlock() {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    fat_busy = 0;
+    wake_up_locked(&fat_wq);
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+static uint16_t rd16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const uint8_t* p) {
+    return rd16(p) | ((uint32_t)rd16(p + 2) << 16);
+}
+
+// ---- The FAT. The lock is held from here on. ----
+
+static uint32_t cluster_lba(uint32_t c) {
+    return vol.data_lba + (c - 2) * vol.spc;
+}
+
+static int valid_cluster(uint32_t c) {
+    return c >= 2 && c < vol.clusters + 2;
+}
+
+static uint32_t end_mark() {
+    return vol.type == 32 ? 0x0FFFFFFF : 0xFFFF;
+}
+
+static int fat_get(uint32_t c, uint32_t* value) {
+    uint32_t offset = c * (vol.type / 8);
+    Buf* b = bread(vol.fat_lba + offset / SECTOR);
+    if (!b) return -1;
+    const uint8_t* p = b->data + offset % SECTOR;
+    *value = vol.type == 32 ? rd32(p) & 0x0FFFFFFF : rd16(p);
+    brelse(b);
+    return 0;
+}
+
+// Every copy of the FAT gets the change
+static int fat_set(uint32_t c, uint32_t value) {
+    uint32_t offset = c * (vol.type / 8);
+    for (uint32_t i = 0; i < vol.nfats; i++) {
+        Buf* b = bread(vol.fat_lba + i * vol.fat_sectors + offset / SECTOR);
+        if (!b) return -1;
+        uint8_t* p = b->data + offset % SECTOR;
+        if (vol.type == 32) {
+            // The top four bits are reserved and must be kept
+            uint32_t v = (rd32(p) & 0xF0000000) | (value & 0x0FFFFFFF);
+            memcpy(p, &v, 4);
+        } else {
+            uint16_t v = (uint16_t)value;
+            memcpy(p, &v, 2);
+        }
+        bdirty(b);
+        brelse(b);
+    }
+    return 0;
+}
+
+// Give back c and everything after it
+static void chain_release(uint32_t c) {
+    for (uint32_t n = 0; valid_cluster(c) && n < vol.clusters; n++) {
+        uint32_t next;
+        if (fat_get(c, &next) < 0 || fat_set(c, 0) < 0) return;
+        vol.free++;
+        c = next;
+    }
+}
+
+// A free cluster, marked as the end of a chain. zero clears it on the
+// disk, for directories.
+static uint32_t cluster_alloc(int zero) {
+    for (uint32_t n = 0; n < vol.clusters; n++) {
+        uint32_t c = 2 + (vol.next_free - 2 + n) % vol.clusters;
+        uint32_t v;
+        if (fat_get(c, &v) < 0) return 0;
+        if (v != 0) continue;
+        if (fat_set(c, end_mark()) < 0) return 0;
+        vol.next_free = valid_cluster(c + 1) ? c + 1 : 2;
+        vol.free--;
+        for (uint32_t i = 0; zero && i < vol.spc; i++) {
+            Buf* b = bnew(cluster_lba(c) + i);
+            if (!b) {
+                chain_release(c);
+                return 0;
+            }
+            bdirty(b);
+            brelse(b);
+        }
+        return c;
+    }
+    return 0;
+}
+
+// ---- Cached chains ----
+
+static int chain_push(Chain* ch, uint32_t c) {
+    if (ch->count == ch->capacity) {
+        uint32_t grown = ch->capacity ? ch->capacity * 2 : FAT_MIN_CHAIN;
+        uint32_t* clusters = (uint32_t*)realloc(ch->clusters, grown * sizeof(uint32_t));
+        if (!clusters) return 0;
+        ch->clusters = clusters;
+        ch->capacity = grown;
+    }
+    ch->clusters[ch->count++] = c;
+    return 1;
+}
+
+static void chain_clear(Chain* ch) {
+    free(ch->clusters);
+    memset(ch, 0, sizeof(Chain));
+}
+
+static void chain_forget(uint32_t first) {
+    for (int i = 0; i < FAT_CHAIN_CACHE; i++) {
+        if (chains[i].first == first) chain_clear(&chains[i]);
+    }
+}
+
+// The whole chain starting at first, walked from the FAT on a miss
+static Chain* chain_get(uint32_t first) {
+    if (!valid_cluster(first)) return NULL;
+    Chain* victim = &chains[0];
+    for (int i = 0; i < FAT_CHAIN_CACHE; i++) {
+        Chain* ch = &chains[i];
+        if (ch->first == first) {
+            stats.chain_hits++;
+            ch->used = ++use_clock;
+            return ch;
+        }
+        if (!ch->first || (victim->first && ch->used < victim->used)) victim = ch;
+    }
+
+    stats.chain_misses++;
+    chain_clear(victim);
+    victim->first = first;
+    victim->used = ++use_clock;
+    uint32_t c = first;
+    while (1) {
+        // More links than clusters means a loop
+        if (victim->count >= vol.clusters || !chain_push(victim, c)) break;
+        uint32_t next;
+        if (fat_get(c, &next) < 0) break;
+        if (!valid_cluster(next)) return victim;   // End of chain
+        c = next;
+    }
+    chain_clear(victim);
+    return NULL;
+}
+
+// Link new clusters to the end of ch until it has count of them
+static int chain_extend(Chain* ch, uint32_t count, int zero) {
+    while (ch->count < count) {
+        uint32_t c = cluster_alloc(zero);
+        if (!c) return 0;
+        if (fat_set(ch->clusters[ch->count - 1], c) < 0 || !chain_push(ch, c)) {
+            chain_release(c);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ---- Directories ----
+
+static uint32_t lower(uint32_t c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+// FNV-1a of the name in lower case: FAT names ignore case
+static uint32_t name_hash(const char* name, uint32_t len) {
+    uint32_t h = FNV_OFFSET;
+    while (len--) {
+        h ^= lower((uint8_t)*name++);
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static int name_eq(const char* a, const char* b, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (!a[i] || lower((uint8_t)a[i]) != lower((uint8_t)b[i])) return 0;
+    }
+    return a[len] == '\0';
+}
+
+// The sector holding a directory slot; 0 past the end of the directory
+static uint32_t slot_lba(uint32_t dir, uint32_t slot) {
+    uint32_t byte = slot * sizeof(FatDirent);
+    if (dir == 0) {
+        return slot < vol.root_entries ? vol.root_lba + byte / SECTOR : 0;
+    }
+    Chain* ch = chain_get(dir);
+    if (!ch || byte / vol.cluster_size >= ch->count) return 0;
+    return cluster_lba(ch->clusters[byte / vol.cluster_size]) + byte % vol.cluster_size / SECTOR;
+}
+
+static void dir_clear(Dir* d) {
+    for (uint32_t i = 0; i < d->count; i++) free(d->entries[i].name);
+    free(d->entries);
+    free(d->table);
+    memset(d, 0, sizeof(Dir));
+}
+
+static void dir_forget(uint32_t cluster) {
+    for (int i = 0; i < FAT_DIR_CACHE; i++) {
+        if (dirs[i].valid && dirs[i].cluster == cluster) dir_clear(&dirs[i]);
+    }
+}
+
+static void table_put(uint32_t* table, uint32_t size, uint32_t hash, uint32_t value) {
+    uint32_t i = hash & (size - 1);
+    while (table[i]) i = (i + 1) & (size - 1);
+    table[i] = value;
+}
+
+static int dir_add(Dir* d, const char* name, uint32_t len, uint32_t slot, uint32_t first_slot,
+                   const FatDirent* e) {
+    if (d->count == d->capacity) {
+        uint32_t grown = d->capacity ? d->capacity * 2 : FAT_MIN_TABLE;
+        DirEntry* entries = (DirEntry*)realloc(d->entries, grown * sizeof(DirEntry));
+        if (!entries) return 0;
+        d->entries = entries;
+        d->capacity = grown;
+    }
+    if ((d->count + 1) * 2 > d->table_size) {
+        // Never deleted from, so growing is the only rehash
+        uint32_t size = d->table_size ? d->table_size * 2 : FAT_MIN_TABLE;
+        uint32_t* table = (uint32_t*)calloc(size, sizeof(uint32_t));
+        if (!table) return 0;
+        for (uint32_t i = 0; i < d->count; i++) {
+            table_put(table, size, d->entries[i].hash, i + 1);
+        }
+        free(d->table);
+        d->table = table;
+        d->table_size = size;
+    }
+
+    DirEntry* de = &d->entries[d->count];
+    de->name = strdup_n(name, len);
+    if (!de->name) return 0;
+    memcpy(de->short_name, e->name, sizeof(de->short_name));
+    de->hash = name_hash(name, len);
+    de->slot = slot;
+    de->first_slot = first_slot;
+    de->cluster = ((uint32_t)e->cluster_hi << 16) | e->cluster_lo;
+    de->size = e->size;
+    de->attr = e->attr;
+    de->removed = 0;
+    table_put(d->table, d->table_size, de->hash, ++d->count);
+    d->live++;
+    return 1;
+}
+
+static DirEntry* dir_find(Dir* d, const char* name, uint32_t len) {
+    if (!d->table_size) return NULL;
+    uint32_t hash = name_hash(name, len);
+    uint32_t mask = d->table_size - 1;
+    for (uint32_t i = hash & mask; d->table[i]; i = (i + 1) & mask) {
+        DirEntry* e = &d->entries[d->table[i] - 1];
+        if (!e->removed && e->hash == hash && name_eq(e->name, name, len)) return e;
+    }
+    return NULL;
+}
+
+static uint8_t short_checksum(const char* name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)name[i];
+    return sum;
+}
+
+// "README  TXT" as "README.TXT", or "readme.txt" with the case bits
+static uint32_t short_name(const FatDirent* e, char* out) {
+    uint32_t n = 0;
+    for (int i = 0; i < 8 && e->name[i] != ' '; i++) {
+        out[n++] = e->nt_case & NT_LOWER_BASE ? (char)lower((uint8_t)e->name[i]) : e->name[i];
+    }
+    if ((uint8_t)out[0] == 0x05) out[0] = (char)0xE5;   // A real 0xE5 is stored as 0x05
+    if (e->name[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && e->name[i] != ' '; i++) {
+            out[n++] = e->nt_case & NT_LOWER_EXT ? (char)lower((uint8_t)e->name[i]) : e->name[i];
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// Drop one long name piece into place. Only ASCII survives.
+static void lfn_put(char* name, const FatLfn* l) {
+    uint32_t base = ((l->seq & 0x1F) - 1) * 13;
+    for (int i = 0; i < 13; i++) {
+        uint16_t c = i < 5 ? l->name1[i] : i < 11 ? l->name2[i - 5] : l->name3[i - 11];
+        if (c == 0 || c == 0xFFFF) return;
+        if (base + i < FAT_NAME_MAX - 1) name[base + i] = c < 0x80 ? (char)c : '?';
+    }
+}
+
+// Read a directory into d: every entry hashed, long names joined up
+static int dir_scan(Dir* d, uint32_t cluster) {
+    static char lfn[FAT_NAME_MAX];
+    char name[13];
+    int have_lfn = 0;
+    uint8_t lfn_sum = 0;
+    uint32_t lfn_first = 0;
+    uint32_t slot = 0;
+
+    d->valid = 1;
+    d->cluster = cluster;
+    d->free_hint = 0xFFFFFFFF;
+    while (1) {
+        uint32_t lba = slot_lba(cluster, slot);
+        if (!lba) break;
+        Buf* b = bread(lba);
+        if (!b) return 0;
+        const FatDirent* e = (const FatDirent*)b->data;
+        int end = 0;
+        for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++, slot++) {
+            uint8_t first = (uint8_t)e[i].name[0];
+            if (first == ENTRY_END) {
+                end = 1;
+                break;
+            }
+            if (first == ENTRY_FREE) {
+                if (slot < d->free_hint) d->free_hint = slot;
+                have_lfn = 0;
+            } else if (e[i].attr == ATTR_LFN) {
+                const FatLfn* l = (const FatLfn*)&e[i];
+                if (l->seq & LFN_LAST) {
+                    memset(lfn, 0, sizeof(lfn));
+                    have_lfn = 1;
+                    lfn_sum = l->checksum;
+                    lfn_first = slot;
+                } else if (l->checksum != lfn_sum) {
+                    have_lfn = 0;
+                }
+                if (have_lfn && (l->seq & 0x1F)) lfn_put(lfn, l);
+            } else {
+                int ok = 1;
+                if (!(e[i].attr & ATTR_VOLUME) && first != '.') {
+                    if (have_lfn && lfn[0] && short_checksum(e[i].name) == lfn_sum) {
+                        ok = dir_add(d, lfn, strlen(lfn), slot, lfn_first, &e[i]);
+                    } else {
+                        ok = dir_add(d, name, short_name(&e[i], name), slot, slot, &e[i]);
+                    }
+                }
+                have_lfn = 0;
+                if (!ok) {
+                    brelse(b);
+                    return 0;
+                }
+            }
+        }
+        brelse(b);
+        if (end) break;
+    }
+    d->end = slot;
+    if (d->free_hint > slot) d->free_hint = slot;
+    return 1;
+}
+
+// The hashed entries of a directory, scanned on the first use
+static Dir* dir_get(uint32_t cluster) {
+    Dir* victim = &dirs[0];
+    for (int i = 0; i < FAT_DIR_CACHE; i++) {
+        Dir* d = &dirs[i];
+        if (d->valid && d->cluster == cluster) {
+            stats.dir_hits++;
+            d->used = ++use_clock;
+            return d;
+        }
+        if (!d->valid || (victim->valid && d->used < victim->used)) victim = d;
+    }
+
+    stats.dir_misses++;
+    dir_clear(victim);
+    victim->used = ++use_clock;
+    if (!dir_scan(victim, cluster)) {
+        dir_clear(victim);
+        return NULL;
+    }
+    return victim;
+}
+
+// d's cached entries, or NULL if it isn't cached: never reads the disk
+// or evicts anything, unlike dir_get
+static Dir* dir_cached(uint32_t cluster) {
+    for (int i = 0; i < FAT_DIR_CACHE; i++) {
+        if (dirs[i].valid && dirs[i].cluster == cluster) return &dirs[i];
+    }
+    return NULL;
+}
+
+// The first run of count deleted slots in d, or where one starts at its
+// end (everything past d->end is free). Slots below free_hint are known
+// to be in use, so a create only looks past the first hole for a run.
+static uint32_t dir_free_run(Dir* d, uint32_t count) {
+    uint32_t slot = d->free_hint;
+    uint32_t start = slot, run = 0;
+    int hole = 0;
+    while (slot < d->end) {
+        uint32_t lba = slot_lba(d->cluster, slot);
+        Buf* b = lba ? bread(lba) : NULL;
+        if (!b) {
+            run = 0;
+            break;
+        }
+        const FatDirent* e = (const FatDirent*)b->data;
+        for (uint32_t i = slot % ENTRIES_PER_SECTOR; i < ENTRIES_PER_SECTOR && slot < d->end; i++, slot++) {
+            if ((uint8_t)e[i].name[0] != ENTRY_FREE) {
+                run = 0;
+                continue;
+            }
+            if (!hole) {
+                d->free_hint = slot;
+                hole = 1;
+            }
+            if (!run++) start = slot;
+            if (run == count) {
+                brelse(b);
+                return start;
+            }
+        }
+        brelse(b);
+    }
+    if (!hole) d->free_hint = d->end;
+    return run ? start : d->end;
+}
+
+// ---- Paths ----
+
+static void root_node(Node* n) {
+    memset(n, 0, sizeof(Node));
+    n->root = 1;
+    n->cluster = vol.type == 32 ? vol.root_cluster : 0;
+    n->attr = ATTR_DIR;
+}
+
+static void node_from(Node* n, Dir* d, DirEntry* e) {
+    n->root = 0;
+    n->dir = d->cluster;
+    n->slot = e->slot;
+    n->first_slot = e->first_slot;
+    n->cluster = e->cluster;
+    n->size = e->size;
+    n->attr = e->attr;
+    n->cached = d;
+    n->index = e - d->entries;
+}
+
+// One step down from the directory n
+static int step(Node* n, const char* name, uint32_t len) {
+    if (!(n->attr & ATTR_DIR)) return -1;
+    Dir* d = dir_get(n->cluster);
+    DirEntry* e = d ? dir_find(d, name, len) : NULL;
+    if (!e) return -1;
+    node_from(n, d, e);
+    return 0;
+}
+
+// Paths come normalized from the VFS: no ".", ".." or empty components
+static int resolve(const char* path, Node* n) {
+    const char* name;
+    uint32_t len, pos = 0;
+    root_node(n);
+    while (fs_next_component(path, &pos, &name, &len)) {
+        if (step(n, name, len) < 0) return -1;
+    }
+    return 0;
+}
+
+// The directory holding the last component of path, which is left in
+// name/len. -1 for the root or a missing directory.
+static int resolve_parent(const char* path, Node* parent, const char** name, uint32_t* len) {
+    const char* next;
+    uint32_t next_len, pos = 0;
+    root_node(parent);
+    if (!fs_next_component(path, &pos, name, len)) return -1;
+    while (fs_next_component(path, &pos, &next, &next_len)) {
+        if (step(parent, *name, *len) < 0) return -1;
+        *name = next;
+        *len = next_len;
+    }
+    return parent->attr & ATTR_DIR ? 0 : -1;
+}
+
+static DirEntry* node_entry(Node* n) {
+    Dir* d = n->cached;
+    if (!d || !d->valid || d->cluster != n->dir || n->index >= d->count) return NULL;
+    DirEntry* e = &d->entries[n->index];
+    return e->slot == n->slot && !e->removed ? e : NULL;
+}
+
+// Write n's first cluster and size back to its entry, on the disk and
+// in the directory cache
+static int node_store(Node* n) {
+    if (n->root) return 0;
+    uint32_t lba = slot_lba(n->dir, n->slot);
+    Buf* b = lba ? bread(lba) : NULL;
+    if (!b) return -1;
+    FatDirent* e = (FatDirent*)b->data + n->slot % ENTRIES_PER_SECTOR;
+    e->cluster_lo = (uint16_t)n->cluster;
+    e->cluster_hi = vol.type == 32 ? (uint16_t)(n->cluster >> 16) : 0;
+    e->size = n->attr & ATTR_DIR ? 0 : n->size;
+    bdirty(b);
+    brelse(b);
+
+    DirEntry* de = node_entry(n);
+    if (de) {
+        de->cluster = n->cluster;
+        de->size = n->size;
+    }
+    return 0;
+}
+
+static int short_char(char c) {
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) return 1;
+    return c && strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+// The 8.3 form of name. A part may be all lower case (kept with the NT
+// case bits) but not mixed; -1 for names that need a long entry.
+static int make_short(const char* name, uint32_t len, FatDirent* e) {
+    uint32_t base = len;
+    for (uint32_t i = len; i > 0; i--) {
+        if (name[i - 1] == '.') {
+            base = i - 1;
+            break;
+        }
+    }
+    uint32_t ext = base < len ? len - base - 1 : 0;
+    if (base == 0 || base > 8 || ext > 3 || (base < len && ext == 0)) return -1;
+
+    int lower_case[2] = { 0, 0 }, upper_case[2] = { 0, 0 };
+    memset(e->name, ' ', sizeof(e->name));
+    for (uint32_t i = 0; i < len; i++) {
+        if (i == base) continue;
+        char c = name[i];
+        int part = i > base;
+        if (!short_char(c)) return -1;
+        if (c >= 'a' && c <= 'z') {
+            lower_case[part] = 1;
+            c -= 32;
+        } else if (c >= 'A' && c <= 'Z') {
+            upper_case[part] = 1;
+        }
+        e->name[part ? 8 + i - base - 1 : i] = c;
+    }
+    if ((lower_case[0] && upper_case[0]) || (lower_case[1] && upper_case[1])) return -1;
+    e->nt_case = (lower_case[0] ? NT_LOWER_BASE : 0) | (lower_case[1] ? NT_LOWER_EXT : 0);
+    return 0;
+}
+
+// What a long name may hold. Only ASCII: lfn_put reads nothing else back.
+static int long_char(char c) {
+    return (uint8_t)c >= 0x20 && (uint8_t)c < 0x7F && !strchr("\"*/:<>?\\|", c);
+}
+
+static int alias_taken(Dir* d, const char* name) {
+    for (uint32_t i = 0; i < d->count; i++) {
+        if (!d->entries[i].removed && memcmp(d->entries[i].short_name, name, 11) == 0) return 1;
+    }
+    return 0;
+}
+
+// The 8.3 alias of a long name, "notes-2024.txt" as "NOTES-~1.TXT":
+// upper case, other characters as '_', and the lowest ~N no entry of d
+// has. Each alias taken rules out one N, so d->count + 1 tries do.
+static int make_alias(Dir* d, const char* name, uint32_t len, FatDirent* e) {
+    char base[8], ext[3];
+    uint32_t nbase = 0, next = 0, dot = len;
+    for (uint32_t i = len - 1; i > 0; i--) {
+        if (name[i] == '.') {
+            dot = i;
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (i == dot || c == '.' || c == ' ') continue;
+        if (c >= 'a' && c <= 'z') c -= 32;
+        if (!short_char(c)) c = '_';
+        if (i < dot && nbase < 8) base[nbase++] = c;
+        if (i > dot && next < 3) ext[next++] = c;
+    }
+    if (nbase == 0) base[nbase++] = '_';
+
+    for (uint32_t n = 1; n <= d->count + 1; n++) {
+        char tail[12];
+        uint32_t ntail = 0;
+        for (uint32_t v = n; v; v /= 10) tail[ntail++] = (char)('0' + v % 10);
+        tail[ntail++] = '~';
+        uint32_t keep = nbase < 8 - ntail ? nbase : 8 - ntail;
+
+        memset(e->name, ' ', sizeof(e->name));
+        memcpy(e->name, base, keep);
+        for (uint32_t i = 0; i < ntail; i++) e->name[keep + i] = tail[ntail - 1 - i];
+        memcpy(e->name + 8, ext, next);
+        if (!alias_taken(d, e->name)) return 0;
+    }
+    return -1;
+}
+
+// Piece seq (1-based) of name, for the 8.3 entry with checksum sum. The
+// name ends with a 0 if there is room, then 0xFFFF padding.
+static void lfn_make(FatLfn* l, const char* name, uint32_t len, uint32_t seq, int last, uint8_t sum) {
+    memset(l, 0, sizeof(FatLfn));
+    l->seq = (uint8_t)(seq | (last ? LFN_LAST : 0));
+    l->attr = ATTR_LFN;
+    l->checksum = sum;
+    uint32_t base = (seq - 1) * 13;
+    for (uint32_t i = 0; i < 13; i++) {
+        uint32_t at = base + i;
+        uint16_t c = at < len ? (uint8_t)name[at] : at == len ? 0 : 0xFFFF;
+        if (i < 5) l->name1[i] = c;
+        else if (i < 11) l->name2[i - 5] = c;
+        else l->name3[i - 11] = c;
+    }
+}
+
+// Add an entry for name to the directory parent, in the first run of
+// slots removed entries left, else at the end, growing the directory
+// when it is full (the FAT16 root can't grow). A name that isn't 8.3
+// gets long name pieces ahead of an 8.3 alias.
+static int dir_create(Node* parent, const char* name, uint32_t len, uint8_t attr,
+                      uint32_t cluster, Node* out) {
+    Dir* d = dir_get(parent->cluster);
+    if (!d || dir_find(d, name, len)) return -1;
+
+    FatDirent e;
+    memset(&e, 0, sizeof(e));
+    uint32_t pieces = 0;
+    if (make_short(name, len, &e) < 0 || alias_taken(d, e.name)) {
+        if (len >= FAT_NAME_MAX || name[len - 1] == '.' || name[len - 1] == ' ') return -1;
+        for (uint32_t i = 0; i < len; i++) {
+            if (!long_char(name[i])) return -1;
+        }
+        memset(&e, 0, sizeof(e));
+        if (make_alias(d, name, len, &e) < 0) return -1;
+        pieces = (len + 12) / 13;
+    }
+    e.attr = attr;
+    e.cluster_lo = (uint16_t)cluster;
+    e.cluster_hi = vol.type == 32 ? (uint16_t)(cluster >> 16) : 0;
+
+    uint32_t first = dir_free_run(d, pieces + 1);
+    uint32_t slot = first + pieces;
+    if (!slot_lba(parent->cluster, slot) && parent->cluster) {
+        Chain* ch = chain_get(parent->cluster);
+        uint32_t need = slot * sizeof(FatDirent) / vol.cluster_size + 1;
+        if (ch) chain_extend(ch, need, 1);
+    }
+    if (!slot_lba(parent->cluster, slot)) return -1;
+
+    // The pieces go first, last one first: a name cut short by a failed
+    // write is ignored without its 8.3 entry
+    uint8_t sum = short_checksum(e.name);
+    for (uint32_t s = first; s <= slot; s++) {
+        Buf* b = bread(slot_lba(parent->cluster, s));
+        if (!b) return -1;
+        FatDirent* at = (FatDirent*)b->data + s % ENTRIES_PER_SECTOR;
+        if (s < slot) {
+            lfn_make((FatLfn*)at, name, len, slot - s, s == first, sum);
+        } else {
+            memcpy(at, &e, sizeof(e));
+        }
+        bdirty(b);
+        brelse(b);
+    }
+
+    if (slot >= d->end) d->end = slot + 1;
+    if (d->free_hint == first) d->free_hint = slot + 1;
+    if (!dir_add(d, name, len, slot, first, &e)) {
+        dir_clear(d);   // Out of memory: rescan next time
+        return -1;
+    }
+    node_from(out, d, &d->entries[d->count - 1]);
+    return 0;
+}
+
+// ---- File contents ----
+
+static int node_read(Node* n, uint32_t offset, uint8_t* dst, uint32_t len) {
+    if (offset >= n->size) return 0;
+    if (len > n->size - offset) len = n->size - offset;
+    Chain* ch = chain_get(n->cluster);
+    if (!ch) return -1;
+
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t pos = offset + done;
+        uint32_t index = pos / vol.cluster_size;
+        if (index >= ch->count) break;   // The chain is shorter than the size says
+        uint32_t within = pos % SECTOR;
+        uint32_t chunk = SECTOR - within;
+        if (chunk > len - done) chunk = len - done;
+        Buf* b = bread(cluster_lba(ch->clusters[index]) + pos % vol.cluster_size / SECTOR);
+        if (!b) return done ? (int)done : -1;
+        memcpy(dst + done, b->data + within, chunk);
+        brelse(b);
+        done += chunk;
+    }
+    return done;
+}
+
+// Make room for size bytes: a first cluster if the file has none, then
+// more at the end of its chain
+static Chain* node_reserve(Node* n, uint32_t size) {
+    uint32_t need = (size + vol.cluster_size - 1) / vol.cluster_size;
+    if (!n->cluster) {
+        if (!need) return NULL;
+        n->cluster = cluster_alloc(0);
+        if (!n->cluster) return NULL;
+    }
+    Chain* ch = chain_get(n->cluster);
+    return ch && chain_extend(ch, need, 0) ? ch : NULL;
+}
+
+static int node_write(Node* n, uint32_t offset, const uint8_t* src, uint32_t len) {
+    if (!len) return 0;
+    if (len > 0xFFFFFFFF - offset) return -1;
+    Chain* ch = node_reserve(n, offset + len);
+    int err = ch ? 0 : -1;
+
+    uint32_t done = 0;
+    while (!err && done < len) {
+        uint32_t pos = offset + done;
+        uint32_t within = pos % SECTOR;
+        uint32_t chunk = SECTOR - within;
+        if (chunk > len - done) chunk = len - done;
+        uint32_t lba = cluster_lba(ch->clusters[pos / vol.cluster_size]) + pos % vol.cluster_size / SECTOR;
+        // A whole sector is overwritten without being read first
+        Buf* b = chunk == SECTOR ? bnew(lba) : bread(lba);
+        if (!b) {
+            err = -1;
+            break;
+        }
+        memcpy(b->data + within, src + done, chunk);
+        bdirty(b);
+        brelse(b);
+        done += chunk;
+    }
+    if (offset + done > n->size) n->size = offset + done;
+    if (node_store(n) < 0) err = -1;
+    return err;
+}
+
+// Shrinking frees the clusters past the new end; growing writes zeroes
+static int node_truncate(Node* n, uint32_t size) {
+    static const uint8_t zeroes[SECTOR];
+    while (n->size < size) {
+        uint32_t chunk = SECTOR - n->size % SECTOR;
+        if (chunk > size - n->size) chunk = size - n->size;
+        if (node_write(n, n->size, zeroes, chunk) < 0) return -1;
+    }
+
+    uint32_t keep = (size + vol.cluster_size - 1) / vol.cluster_size;
+    Chain* ch = n->cluster ? chain_get(n->cluster) : NULL;
+    if (n->cluster && !ch) return -1;
+    if (ch && keep < ch->count) {
+        uint32_t cut = ch->clusters[keep];
+        if (keep == 0) {
+            chain_forget(n->cluster);
+            n->cluster = 0;
+        } else {
+            if (fat_set(ch->clusters[keep - 1], end_mark()) < 0) return -1;
+            ch->count = keep;
+        }
+        chain_release(cut);
+    }
+    n->size = size;
+    return node_store(n);
+}
+
+// The file at path, created empty if it doesn't exist
+static int lookup_create(const char* path, Node* n) {
+    if (resolve(path, n) == 0) return n->attr & ATTR_DIR ? -1 : 0;
+    Node parent;
+    const char* name;
+    uint32_t len;
+    if (resolve_parent(path, &parent, &name, &len) < 0) return -1;
+    return dir_create(&parent, name, len, ATTR_ARCHIVE, 0, n);
+}
+
+// ---- Mounting ----
+
+static int probe(uint32_t start) {
+    Buf* b = bread(start);
+    if (!b) return -1;
+    const uint8_t* s = b->data;
+    uint32_t bps = rd16(s + 11);
+    uint32_t spc = s[13];
+    uint32_t reserved = rd16(s + 14);
+    uint32_t nfats = s[16];
+    uint32_t root_entries = rd16(s + 17);
+    uint32_t total = rd16(s + 19) ? rd16(s + 19) : rd32(s + 32);
+    uint32_t fat_sectors = rd16(s + 22) ? rd16(s + 22) : rd32(s + 36);
+    uint32_t root_cluster = rd32(s + 44);
+    uint32_t fsinfo = rd16(s + 48);
+    int sane = (s[0] == 0xEB || s[0] == 0xE9) && s[510] == 0x55 && s[511] == 0xAA &&
+               bps == SECTOR && spc && !(spc & (spc - 1)) && reserved && nfats && fat_sectors;
+    brelse(b);
+    if (!sane) return -1;
+
+    uint32_t root_sectors = (root_entries * sizeof(FatDirent) + SECTOR - 1) / SECTOR;
+    uint32_t data = reserved + nfats * fat_sectors + root_sectors;
+    if (total <= data) return -1;
+    uint32_t clusters = (total - data) / spc;
+    if (clusters < 4085) {
+        serial_puts("[fat] FAT12 is not supported\n");
+        return -1;
+    }
+
+    memset(&vol, 0, sizeof(vol));
+    vol.start = start;
+    vol.spc = spc;
+    vol.cluster_size = spc * SECTOR;
+    vol.fat_lba = start + reserved;
+    vol.fat_sectors = fat_sectors;
+    vol.nfats = nfats;
+    vol.root_lba = vol.fat_lba + nfats * fat_sectors;
+    vol.root_entries = root_entries;
+    vol.data_lba = start + data;
+    vol.clusters = clusters;
+    vol.next_free = 2;
+    vol.type = clusters < 65525 ? 16 : 32;
+    if (vol.type == 32) {
+        vol.root_cluster = root_cluster;
+        if (!valid_cluster(root_cluster)) {
+            vol.type = 0;
+            return -1;
+        }
+    }
+
+    // FAT32 keeps a free count hint; we track our own from here on, so
+    // mark the hint unknown rather than let it go stale
+    int counted = 0;
+    Buf* info = vol.type == 32 && fsinfo ? bread(start + fsinfo) : NULL;
+    if (info) {
+        uint8_t* p = info->data;
+        if (rd32(p) == FSINFO_SIG1 && rd32(p + 484) == FSINFO_SIG2) {
+            uint32_t hint = rd32(p + 488);
+            if (hint <= clusters) {
+                vol.free = hint;
+                counted = 1;
+            }
+            if (valid_cluster(rd32(p + 492))) vol.next_free = rd32(p + 492);
+            memset(p + 488, 0xFF, 8);
+            bdirty(info);
+        }
+        brelse(info);
+    }
+    for (uint32_t c = 2; !counted && c < clusters + 2; c++) {
+        uint32_t v;
+        if (fat_get(c, &v) < 0) {
+            vol.type = 0;
+            return -1;
+        }
+        if (v == 0) vol.free++;
+    }
+    return 0;
+}
+
+// A bare volume, or the first FAT partition of an MBR disk
+static int fat_probe() {
+    if (probe(0) == 0) return 0;
+    Buf* b = bread(0);
+    if (!b) return -1;
+    uint32_t start = 0;
+    if (b->data[510] == 0x55 && b->data[511] == 0xAA) {
+        for (int i = 0; i < 4 && !start; i++) {
+            const uint8_t* p = b->data + 446 + i * 16;
+            uint8_t type = p[4];
+            if (type == 0x04 || type == 0x06 || type == 0x0E || type == 0x0B || type == 0x0C) {
+                start = rd32(p + 8);
+            }
+        }
+    }
+    brelse(b);
+    return start ? probe(start) : -1;
+}
+
+static const VfsOps fat_ops = {
+    .name = "fat",
+    .mkdir = fat_mkdir,
+    .write = fat_write,
+    .write_at = fat_write_at,
+    .append = fat_append,
+    .truncate = fat_truncate,
+    .read_at = fat_read_at,
+    .remove = fat_remove,
+    .stat = fat_stat,
+    .readdir = fat_readdir,
+};
+
+int fat_mount() {
+    fat_lock();
+    if (!vol.type && fat_probe() == 0) {
+        serial_puts("[fat] FAT");
+        serial_putint(vol.type);
+        serial_puts(" volume at sector ");
+        serial_putint(vol.start);
+        serial_puts(", ");
+        serial_putint(vol.clusters);
+        serial_puts(" clusters of ");
+        serial_putint(vol.cluster_size);
+        serial_puts(" bytes, mounted at " FAT_MOUNT "\n");
+    }
+    int mounted = vol.type != 0;
+    fat_unlock();
+    // Again on every boot pass: fs_init starts the tree over
+    if (mounted) vfs_mount(FAT_MOUNT, &fat_ops);
+    return mounted ? 0 : -1;
+}
+
+int fat_mounted() {
+    return vol.type != 0;
+}
+
+void fat_stats(FatStats* out) {
+    fat_lock();
+    *out = stats;
+    out->type = vol.type;
+    out->cluster_size = vol.cluster_size;
+    out->clusters = vol.clusters;
+    out->free = vol.free;
+    fat_unlock();
+}
+
+// ---- The interface ----
+
+int fat_mkdir(const char* path) {
+    fat_lock();
+    Node parent, n;
+    const char* name;
+    uint32_t len;
+    int err = -1;
+    if (resolve_parent(path, &parent, &name, &len) == 0) {
+        uint32_t c = cluster_alloc(1);
+        Buf* b = c ? bread(cluster_lba(c)) : NULL;
+        if (b) {
+            // "." and "..", where the root is always cluster 0
+            FatDirent* e = (FatDirent*)b->data;
+            uint32_t up = parent.root ? 0 : parent.cluster;
+            memset(e, 0, 2 * sizeof(FatDirent));
+            memcpy(e[0].name, ".          ", 11);
+            memcpy(e[1].name, "..         ", 11);
+            e[0].attr = e[1].attr = ATTR_DIR;
+            e[0].cluster_lo = (uint16_t)c;
+            e[0].cluster_hi = vol.type == 32 ? (uint16_t)(c >> 16) : 0;
+            e[1].cluster_lo = (uint16_t)up;
+            e[1].cluster_hi = vol.type == 32 ? (uint16_t)(up >> 16) : 0;
+            bdirty(b);
+            brelse(b);
+            err = dir_create(&parent, name, len, ATTR_DIR, c, &n);
+        }
+        if (err < 0 && c) chain_release(c);
+    }
+    fat_unlock();
+    return err;
+}
+
+int fat_write(const char* path, const void* data, uint32_t size) {
+    fat_lock();
+    Node n;
+    int err = lookup_create(path, &n);
+    if (err == 0) err = node_truncate(&n, 0);
+    if (err == 0) err = node_write(&n, 0, (const uint8_t*)data, size);
+    fat_unlock();
+    return err;
+}
+
+// A write past the end zero-fills the gap first
+int fat_write_at(const char* path, uint32_t offset, const void* data, uint32_t len) {
+    fat_lock();
+    Node n;
+    int err = lookup_create(path, &n);
+    if (err == 0 && offset > n.size) err = node_truncate(&n, offset);
+    if (err == 0) err = node_write(&n, offset, (const uint8_t*)data, len);
+    fat_unlock();
+    return err;
+}
+
+int fat_append(const char* path, const void* data, uint32_t size) {
+    fat_lock();
+    Node n;
+    int err = lookup_create(path, &n);
+    if (err == 0) err = node_write(&n, n.size, (const uint8_t*)data, size);
+    fat_unlock();
+    return err;
+}
+
+int fat_truncate(const char* path, uint32_t size) {
+    fat_lock();
+    Node n;
+    int err = resolve(path, &n);
+    if (err == 0 && (n.attr & ATTR_DIR)) err = -1;
+    if (err == 0) err = node_truncate(&n, size);
+    fat_unlock();
+    return err;
+}
+
+int fat_read_at(const char* path, uint32_t offset, void* buf, uint32_t len) {
+    fat_lock();
+    Node n;
+    int r = -1;
+    if (resolve(path, &n) == 0 && !(n.attr & ATTR_DIR)) r = node_read(&n, offset, (uint8_t*)buf, len);
+    fat_unlock();
+    return r;
+}
+
+// A file, or an empty directory
+int fat_remove(const char* path) {
+    fat_lock();
+    Node n;
+    int err = resolve(path, &n);
+    if (err == 0 && n.root) err = -1;
+    if (err == 0 && (n.attr & ATTR_DIR)) {
+        Dir* d = dir_get(n.cluster);
+        if (!d || d->live) err = -1;
+    }
+    // The entry and its long name pieces go first, then the clusters
+    for (uint32_t slot = n.first_slot; err == 0 && slot <= n.slot; slot++) {
+        uint32_t lba = slot_lba(n.dir, slot);
+        Buf* b = lba ? bread(lba) : NULL;
+        if (!b) {
+            err = -1;
+            break;
+        }
+        ((FatDirent*)b->data)[slot % ENTRIES_PER_SECTOR].name[0] = (char)ENTRY_FREE;
+        bdirty(b);
+        brelse(b);
+    }
+    if (err == 0) {
+        DirEntry* e = node_entry(&n);
+        if (e) {
+            e->removed = 1;
+            n.cached->live--;
+            if (n.first_slot < n.cached->free_hint) n.cached->free_hint = n.first_slot;
+        }
+        if (n.attr & ATTR_DIR) dir_forget(n.cluster);
+        chain_forget(n.cluster);
+        chain_release(n.cluster);
+    }
+    fat_unlock();
+    return err;
+}
+
+// A directory's size is its entry count, like in the tree
+int fat_stat(const char* path, FsStat* st) {
+    fat_lock();
+    Node n;
+    int err = resolve(path, &n);
+    if (err == 0) {
+        Dir* d = n.attr & ATTR_DIR ? dir_get(n.cluster) : NULL;
+        st->type = n.attr & ATTR_DIR ? FS_DIR : FS_FILE;
+        st->size = n.attr & ATTR_DIR ? (d ? d->live : 0) : n.size;
+        st->pages = 0;
+        st->packed = 0;
+    }
+    fat_unlock();
+    return err;
+}
+
+// The name is copied into the iterator, since the cache entry behind
+// it can go at any time. A subdirectory's size is its entry count only
+// if it is cached already (0 otherwise): scanning every one of them
+// would cost a disk read each, and could evict d. fs_stat counts.
+int fat_readdir(const char* path, FsIter* it, FsDirent* out) {
+    fat_lock();
+    Node n;
+    Dir* d = resolve(path, &n) == 0 && (n.attr & ATTR_DIR) ? dir_get(n.cluster) : NULL;
+    int found = 0;
+    while (d && !found && it->index < d->count) {
+        DirEntry* e = &d->entries[it->index++];
+        if (e->removed) continue;
+        strncpy(it->name, e->name, FS_NAME_MAX - 1);
+        it->name[FS_NAME_MAX - 1] = '\0';
+        out->name = it->name;
+        out->type = e->attr & ATTR_DIR ? FS_DIR : FS_FILE;
+        out->size = e->size;
+        if (e->attr & ATTR_DIR) {
+            Dir* sub = dir_cached(e->cluster);
+            out->size = sub ? sub->live : 0;
+        }
+        found = 1;
+    }
+    fat_unlock();
+    return found;
+}
@@ -1,50 +1,924 @@
-
 #include "fs.h"
 #include "screen.h"
 #include "string.h"
+#include "spinlock.h"
+#include "pmm.h"
+#include "heap.h"
+#include "initrd.h"
+#include "vfs.h"
+#include "pcache.h"
+#include "lz4.h"
+#include "zcache.h"
+#include "wait.h"
+
+// ELF images of the programs in user/, embedded by src/apps.S
+extern const char app_hello[], app_hello_end[];
+extern const char app_fault[], app_fault_end[];
+extern const char app_forktest[], app_forktest_end[];
+extern const char app_sleeper[], app_sleeper_end[];
+extern const char app_files[], app_files_end[];
+extern const char app_mapper[], app_mapper_end[];
+extern const char app_sysbench[], app_sysbench_end[];
+extern const char app_ringtest[], app_ringtest_end[];
+
+// Every directory indexes its children in an open-addressed hash table,
+// linear probing, doubled once it is 70% full counting tombstones. A
+// lookup walks one table per path component, so its cost depends on
+// the depth of the path, not on how many files there are.
+#define FS_DIR_MIN_SLOTS 8
+#define FS_MAX_LOAD_PCT  70
+#define FS_MIN_EXTENTS   4
+
+// Recently resolved full paths, direct mapped by hash
+#define FS_DCACHE_SLOTS  256
+#define FS_DCACHE_PATH   64
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+typedef struct Dentry Dentry;
+
+typedef struct {
+    Dentry** slots;
+    uint32_t capacity;     // Always a power of two, or 0
+    uint32_t count;
+    uint32_t dead;         // Tombstones
+} DirTable;
+
+struct Dentry {
+    char* name;            // Owned; "" for the root
+    uint32_t hash;         // fs_hash(name), so probes rarely need strcmp
+    uint32_t type;         // FS_FILE or FS_DIR
+    Dentry* parent;
+    Inode* inode;          // Files only
+    DirTable children;     // Directories only
+};
+
+typedef struct {
+    uint32_t hash;
+    uint32_t gen;          // Valid only while it matches dcache_gen
+    Dentry* dentry;
+    char path[FS_DCACHE_PATH];
+} DcacheEntry;
+
+// Marks a removed child: lookups probe past it, inserts may reuse it
+static Dentry tombstone;
+
+static Dentry root = { .name = "", .type = FS_DIR };
+static uint32_t entry_count = 0;   // Files and directories, not the root
+static spinlock_t fs_lock = SPINLOCK_INIT;   // The tree; inode contents have inode_lock
+static WaitQueue inode_wq = WAIT_QUEUE_INIT;
+
+// Removing an entry bumps the generation, which drops every cached
+// path at once: none of them can point at a freed dentry
+static DcacheEntry dcache[FS_DCACHE_SLOTS];
+static uint32_t dcache_gen = 1;
+static uint32_t dcache_hits = 0;
+static uint32_t dcache_misses = 0;
+
+// FNV-1a over len bytes
+static uint32_t hash_n(const char* s, uint32_t len) {
+    uint32_t h = FNV_OFFSET;
+    while (len--) {
+        h ^= (uint8_t)*s++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+uint32_t fs_hash(const char* path) {
+    return hash_n(path, strlen(path));
+}
+
+static int slot_used(const Dentry* d) {
+    return d && d != &tombstone;
+}
+
+// ---- Inodes. All of these run with the inode locked, fs_lock not held. ----
+
+static void inode_free_extents(Inode* in, uint32_t keep) {
+    while (in->nextents > keep) {
+        pmm_free_page(in->extents[--in->nextents]);
+    }
+}
+
+// The pack goes, freed if the inode owns it
+static void inode_drop_pack(Inode* in) {
+    if (!in->packed) return;
+    zcache_forget(in->packed);
+    if (in->packed_pages) pmm_free_pages((void*)in->packed, in->packed_pages);
+    in->packed = NULL;
+    in->packed_pages = 0;
+}
 
-//#define NULL ((void*)0)
+// fs_read's copy goes once the contents it copies are about to change
+static void inode_drop_text(Inode* in) {
+    if (!in->text) return;
+    pmm_free_page(in->text);
+    in->text = NULL;
+}
+
+static void inode_free(Inode* in) {
+    inode_free_extents(in, 0);
+    inode_drop_pack(in);
+    inode_drop_text(in);
+    free(in->extents);
+    free(in);
+}
+
+// Make room for size bytes in extents. New pages come zeroed, and the
+// extent array doubles, so appending stays amortized O(1).
+static int inode_reserve(Inode* in, uint32_t size) {
+    uint32_t need = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (need > in->max_extents) {
+        uint32_t grown = in->max_extents ? in->max_extents : FS_MIN_EXTENTS;
+        while (grown < need) grown *= 2;
+        uint8_t** extents = (uint8_t**)realloc(in->extents, grown * sizeof(uint8_t*));
+        if (!extents) return 0;
+        in->extents = extents;
+        in->max_extents = grown;
+    }
+    while (in->nextents < need) {
+        uint8_t* page = (uint8_t*)pmm_alloc_page();
+        if (!page) return 0;
+        memset(page, 0, PAGE_SIZE);
+        in->extents[in->nextents++] = page;
+    }
+    return 1;
+}
+
+static void inode_copy_in(Inode* in, uint32_t offset, const uint8_t* src, uint32_t len) {
+    while (len) {
+        uint32_t within = offset % PAGE_SIZE;
+        uint32_t chunk = PAGE_SIZE - within;
+        if (chunk > len) chunk = len;
+        memcpy(in->extents[offset / PAGE_SIZE] + within, src, chunk);
+        offset += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+// Bytes copied, or -1 if the file is packed and the pack is damaged
+static int inode_read(Inode* in, uint32_t offset, uint8_t* dst, uint32_t len) {
+    if (offset >= in->size) return 0;
+    if (len > in->size - offset) len = in->size - offset;
+    if (in->packed) return zcache_read(in->packed, offset, dst, len);
+    if (in->data) {
+        memcpy(dst, in->data + offset, len);
+        return len;
+    }
 
-#define MAX_FILES 8
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t within = (offset + done) % PAGE_SIZE;
+        uint32_t chunk = PAGE_SIZE - within;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(dst + done, in->extents[(offset + done) / PAGE_SIZE] + within, chunk);
+        done += chunk;
+    }
+    return len;
+}
+
+// Packed contents are unpacked straight into extents, past the LRU of
+// zcache.c: nothing will read them from the pack again
+static int inode_unpack(Inode* in) {
+    if (!inode_reserve(in, in->size)) return 0;
+    for (uint32_t i = 0; i < in->nextents; i++) {
+        if (lz4_pack_page(in->packed, i, in->extents[i]) < 0) return 0;
+    }
+    inode_drop_pack(in);
+    return 1;
+}
+
+// Borrowed or packed contents become owned extents before the first change
+static int inode_own(Inode* in) {
+    inode_drop_text(in);
+    if (in->packed) return inode_unpack(in);
+    if (!in->data) return 1;
+    const uint8_t* data = in->data;
+    if (!inode_reserve(in, in->size)) return 0;
+    in->data = NULL;
+    inode_copy_in(in, 0, data, in->size);
+    return 1;
+}
+
+static int inode_write(Inode* in, uint32_t offset, const uint8_t* src, uint32_t len) {
+    if (len > 0xFFFFFFFF - offset) return 0;
+    if (!inode_own(in) || !inode_reserve(in, offset + len)) return 0;
+    inode_copy_in(in, offset, src, len);
+    if (offset + len > in->size) in->size = offset + len;
+    return 1;
+}
 
-static File files[MAX_FILES];
-static int file_count = 0;
+// Trade the extents for an LZ4 pack in as few frames as it fits, if that
+// saves at least an eighth. The pack is built in frames for the worst
+// case, whose unused tail is then given back. Anything that doesn't work
+// out leaves the file as it was.
+static void inode_pack(Inode* in) {
+    if (in->packed || in->data || !in->size) return;
+    uint32_t pages = (lz4_pack_bound(in->size) + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t* pack = (uint8_t*)pmm_alloc_pages(pages);
+    if (!pack) return;
 
+    uint32_t len = lz4_pack(pack, (const uint8_t* const*)in->extents, in->size);
+    uint32_t used = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (len > in->size - in->size / 8 || used >= in->nextents) {
+        pmm_free_pages(pack, pages);
+        return;
+    }
+    if (used < pages) pmm_free_pages(pack + used * PAGE_SIZE, pages - used);
+
+    inode_free_extents(in, 0);
+    free(in->extents);
+    in->extents = NULL;
+    in->max_extents = 0;
+    in->packed = pack;
+    in->packed_pages = used;
+    zcache_add(pack);
+}
+
+// Shrinking frees whole pages past the end and zeroes the tail of the
+// last one, so the byte after the contents is always 0 (see fs_read)
+static int inode_truncate(Inode* in, uint32_t size) {
+    if (size == 0) {
+        // Nothing of the old contents stays, so there is nothing to unpack
+        inode_drop_pack(in);
+        in->data = NULL;
+    }
+    if (!inode_own(in)) return 0;
+    if (size > in->size) {
+        if (!inode_reserve(in, size)) return 0;
+    } else {
+        inode_free_extents(in, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+        if (size % PAGE_SIZE) {
+            memset(in->extents[size / PAGE_SIZE] + size % PAGE_SIZE, 0, PAGE_SIZE - size % PAGE_SIZE);
+        }
+    }
+    in->size = size;
+    return 1;
+}
+
+// Take in's contents, sleeping while another call has them. The caller
+// pinned it (users) under fs_lock, so it can't be freed meanwhile.
+static void inode_lock(Inode* in) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    while (in->busy) wait_sleep(&inode_wq);
+    in->busy = 1;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Give the contents back and drop the pin; the last user of a removed
+// file frees it
+static void inode_unlock(Inode* in) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    in->busy = 0;
+    wake_up_locked(&inode_wq);
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    flags = spin_lock_irqsave(&fs_lock);
+    int last = --in->users == 0 && in->removed;
+    spin_unlock_irqrestore(&fs_lock, flags);
+    if (last) inode_free(in);
+}
+
+// The file is gone from the tree. fs_lock held. Returns in if the caller
+// has to free it once fs_lock is dropped, NULL if a user still holds it.
+static Inode* inode_unlink(Inode* in) {
+    in->removed = 1;
+    return in->users ? NULL : in;
+}
+
+// ---- Directories. fs_lock held for all of these. ----
+
+static Dentry* dir_find(Dentry* dir, const char* name, uint32_t len, uint32_t hash) {
+    DirTable* t = &dir->children;
+    if (!t->capacity) return NULL;
+    uint32_t mask = t->capacity - 1;
+    for (uint32_t i = hash & mask, n = 0; n < t->capacity; i = (i + 1) & mask, n++) {
+        Dentry* d = t->slots[i];
+        if (!d) return NULL;
+        if (d != &tombstone && d->hash == hash && strncmp(d->name, name, len) == 0 && d->name[len] == '\0') {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Move every live child into a table of new_capacity slots, dropping
+// the tombstones
+static int dir_rehash(DirTable* t, uint32_t new_capacity) {
+    Dentry** slots = (Dentry**)calloc(new_capacity, sizeof(Dentry*));
+    if (!slots) return 0;
+
+    uint32_t mask = new_capacity - 1;
+    for (uint32_t i = 0; i < t->capacity; i++) {
+        if (!slot_used(t->slots[i])) continue;
+        uint32_t j = t->slots[i]->hash & mask;
+        while (slots[j]) j = (j + 1) & mask;
+        slots[j] = t->slots[i];
+    }
+
+    free(t->slots);
+    t->slots = slots;
+    t->capacity = new_capacity;
+    t->dead = 0;
+    return 1;
+}
+
+static int dir_insert(Dentry* dir, Dentry* child) {
+    DirTable* t = &dir->children;
+    if ((t->count + t->dead + 1) * 100 > t->capacity * FS_MAX_LOAD_PCT) {
+        // Mostly tombstones? Rehashing in place is enough
+        uint32_t grown = t->capacity ? t->capacity : FS_DIR_MIN_SLOTS;
+        if ((t->count + 1) * 100 > grown * FS_MAX_LOAD_PCT / 2) grown *= 2;
+        if (!dir_rehash(t, grown)) return 0;
+    }
+
+    uint32_t mask = t->capacity - 1;
+    uint32_t i = child->hash & mask;
+    while (slot_used(t->slots[i])) i = (i + 1) & mask;
+    if (t->slots[i] == &tombstone) t->dead--;
+    t->slots[i] = child;
+    t->count++;
+    child->parent = dir;
+    return 1;
+}
+
+static void dir_unlink(Dentry* dir, Dentry* child) {
+    DirTable* t = &dir->children;
+    uint32_t mask = t->capacity - 1;
+    for (uint32_t i = child->hash & mask; t->slots[i]; i = (i + 1) & mask) {
+        if (t->slots[i] == child) {
+            t->slots[i] = &tombstone;
+            t->count--;
+            t->dead++;
+            return;
+        }
+    }
+}
+
+static Dentry* dentry_new(const char* name, uint32_t len, uint32_t type) {
+    Dentry* d = (Dentry*)calloc(1, sizeof(Dentry));
+    char* copy = (char*)malloc(len + 1);
+    Inode* in = type == FS_FILE ? (Inode*)calloc(1, sizeof(Inode)) : NULL;
+    if (!d || !copy || (type == FS_FILE && !in)) {
+        free(d);
+        free(copy);
+        free(in);
+        return NULL;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    d->name = copy;
+    d->hash = hash_n(name, len);
+    d->type = type;
+    d->inode = in;
+    return d;
+}
+
+// Frees d and everything below it, without unlinking it from its parent.
+// Files someone is still working on are left to their last user.
+static void dentry_free(Dentry* d) {
+    for (uint32_t i = 0; i < d->children.capacity; i++) {
+        if (slot_used(d->children.slots[i])) dentry_free(d->children.slots[i]);
+    }
+    free(d->children.slots);
+    if (d->inode && inode_unlink(d->inode)) inode_free(d->inode);
+    if (d != &root) {
+        free(d->name);
+        free(d);
+    }
+}
+
+// ---- Path walking ----
+
+// The next component of path after *pos, skipping slashes
+int fs_next_component(const char* path, uint32_t* pos, const char** name, uint32_t* len) {
+    while (path[*pos] == '/') (*pos)++;
+    if (!path[*pos]) return 0;
+    *name = path + *pos;
+    *len = 0;
+    while (path[*pos] && path[*pos] != '/') {
+        (*pos)++;
+        (*len)++;
+    }
+    return 1;
+}
+
+static int is_dot(const char* name, uint32_t len) {
+    return len == 1 && name[0] == '.';
+}
+
+static int is_dotdot(const char* name, uint32_t len) {
+    return len == 2 && name[0] == '.' && name[1] == '.';
+}
+
+// One step down (or up, for ..) from dir
+static Dentry* step(Dentry* dir, const char* name, uint32_t len) {
+    if (dir->type != FS_DIR) return NULL;
+    if (is_dot(name, len)) return dir;
+    if (is_dotdot(name, len)) return dir->parent ? dir->parent : dir;
+    return dir_find(dir, name, len, hash_n(name, len));
+}
+
+static Dentry* walk(const char* path) {
+    if (path[0] != '/') return NULL;
+    Dentry* d = &root;
+    const char* name;
+    uint32_t len, pos = 0;
+    while (d && fs_next_component(path, &pos, &name, &len)) {
+        d = step(d, name, len);
+    }
+    return d;
+}
+
+static Dentry* lookup(const char* path) {
+    uint32_t len = strlen(path);
+    if (len >= FS_DCACHE_PATH) return walk(path);
+
+    uint32_t hash = hash_n(path, len);
+    DcacheEntry* c = &dcache[hash % FS_DCACHE_SLOTS];
+    if (c->gen == dcache_gen && c->hash == hash && strcmp(c->path, path) == 0) {
+        dcache_hits++;
+        return c->dentry;
+    }
+
+    dcache_misses++;
+    Dentry* d = walk(path);
+    if (d) {
+        c->hash = hash;
+        c->gen = dcache_gen;
+        c->dentry = d;
+        memcpy(c->path, path, len + 1);
+    }
+    return d;
+}
+
+// The directory that holds the last component of path, which is
+// returned in name/len. NULL if that directory doesn't exist or the
+// last component can't be created (the root, "." or "..").
+static Dentry* lookup_parent(const char* path, const char** name, uint32_t* len) {
+    if (path[0] != '/') return NULL;
+    Dentry* d = &root;
+    uint32_t pos = 0;
+    if (!fs_next_component(path, &pos, name, len)) return NULL;
+
+    const char* next;
+    uint32_t next_len;
+    while (fs_next_component(path, &pos, &next, &next_len)) {
+        d = step(d, *name, *len);
+        if (!d) return NULL;
+        *name = next;
+        *len = next_len;
+    }
+    if (d->type != FS_DIR || is_dot(*name, *len) || is_dotdot(*name, *len)) return NULL;
+    return d;
+}
+
+// Create path as type unless it already exists. Returns the dentry
+// (NULL if out of memory or the parent is missing); *created says
+// whether it is new.
+static Dentry* create(const char* path, uint32_t type, int* created) {
+    const char* name;
+    uint32_t len;
+    *created = 0;
+    Dentry* dir = lookup_parent(path, &name, &len);
+    if (!dir) return NULL;
+
+    Dentry* d = dir_find(dir, name, len, hash_n(name, len));
+    if (d) return d;
+
+    d = dentry_new(name, len, type);
+    if (!d) return NULL;
+    if (!dir_insert(dir, d)) {
+        dentry_free(d);
+        return NULL;
+    }
+    entry_count++;
+    *created = 1;
+    return d;
+}
+
+// The inode of the file at path, created empty if it doesn't exist
+static Inode* lookup_create(const char* path) {
+    int created;
+    Dentry* d = create(path, FS_FILE, &created);
+    return d && d->type == FS_FILE ? d->inode : NULL;
+}
+
+static Inode* lookup_file(const char* path) {
+    Dentry* d = lookup(path);
+    return d && d->type == FS_FILE ? d->inode : NULL;
+}
+
+// The file at path, pinned and locked for inode_unlock; created empty
+// first if create is set. NULL if there is no such file (or no room).
+static Inode* file_get(const char* path, int create) {
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    Inode* in = create ? lookup_create(path) : lookup_file(path);
+    if (in) in->users++;
+    spin_unlock_irqrestore(&fs_lock, flags);
+    if (in) inode_lock(in);
+    return in;
+}
+
+// ---- The interface ----
 
 void fs_init() {
-    files[0].path = "/Saved/hello.txt";
-    files[0].content = "Hello from /Saved/hello.txt!\nThis is a test file.";
-    files[1].path = "/Saved/settings.cfg";
-    files[1].content = "logo=big\ntheme=dark";
-    file_count = 2;
+    pcache_drop();
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    dentry_free(&root);
+    memset(&root.children, 0, sizeof(root.children));
+    entry_count = 0;
+    dcache_gen++;
+    spin_unlock_irqrestore(&fs_lock, flags);
+
+    fs_mkdir("/Saved");
+    fs_mkdir("/Apps");
+    fs_mkdir("/Tmp");
+    fs_add("/Saved/hello.txt", "Hello from /Saved/hello.txt!\nThis is a test file.");
+    fs_add("/Saved/settings.cfg", "logo=big\ntheme=dark");
     fs_add("/Saved/log.txt", "System log started.\n");
     fs_add("/Saved/me.txt", "Amity!");
+    fs_add_static("/Apps/hello", app_hello, app_hello_end - app_hello);
+    fs_add_static("/Apps/fault", app_fault, app_fault_end - app_fault);
+    fs_add_static("/Apps/forktest", app_forktest, app_forktest_end - app_forktest);
+    fs_add_static("/Apps/sleeper", app_sleeper, app_sleeper_end - app_sleeper);
+    fs_add_static("/Apps/files", app_files, app_files_end - app_files);
+    fs_add_static("/Apps/mapper", app_mapper, app_mapper_end - app_mapper);
+    fs_add_static("/Apps/sysbench", app_sysbench, app_sysbench_end - app_sysbench);
+    fs_add_static("/Apps/ringtest", app_ringtest, app_ringtest_end - app_ringtest);
+
+    // Files in the initrd replace the built-in ones
+    initrd_populate();
 }
 
-const char* fs_read(const char* path) {
-    for (int i = 0; i < file_count; i++) {
-        if (strcmp(files[i].path, path) == 0) {
-            return files[i].content;
-        }
+// 0 on success, -1 if path exists or its parent doesn't
+int fs_mkdir(const char* path) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    if (vol) return vol->mkdir ? vol->mkdir(inner) : -1;
+
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    int created;
+    Dentry* d = create(path, FS_DIR, &created);
+    spin_unlock_irqrestore(&fs_lock, flags);
+    return d && created ? 0 : -1;
+}
+
+// Replace path's contents (creating it) with a copy of data. Returns 0,
+// or -1 when out of memory, the parent directory is missing or path is
+// a directory.
+int fs_write(const char* path, const void* data, uint32_t size) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    int ok;
+    if (vol) {
+        ok = vol->write && vol->write(inner, data, size) == 0;
+    } else {
+        Inode* in = file_get(path, 1);
+        ok = in && inode_truncate(in, 0) && inode_write(in, 0, (const uint8_t*)data, size);
+        if (ok && in->compress) inode_pack(in);
+        if (in) inode_unlock(in);
     }
-    puts("fs_read: file not found: ");
-    puts(path);
-    puts("\n");
-    return NULL;
+    pcache_invalidate(path);
+    return ok ? 0 : -1;
+}
+
+// Add to the end of path (creating it). Only the tail extent is
+// touched, and a new page once it fills up.
+int fs_append(const char* path, const void* data, uint32_t size) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    int ok;
+    pcache_flush(path);
+    if (vol) {
+        ok = vol->append && vol->append(inner, data, size) == 0;
+    } else {
+        Inode* in = file_get(path, 1);
+        ok = in && inode_write(in, in->size, (const uint8_t*)data, size);
+        if (in) inode_unlock(in);
+    }
+    pcache_invalidate(path);
+    return ok ? 0 : -1;
+}
+
+// Write len bytes at offset (creating path), zero-filling any gap past
+// the end. 0 or -1, like fs_write. Cached pages of the file get the
+// same bytes.
+int fs_write_at(const char* path, uint32_t offset, const void* data, uint32_t len) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    int ok;
+    if (vol) {
+        ok = vol->write_at && vol->write_at(inner, offset, data, len) == 0;
+    } else {
+        Inode* in = file_get(path, 1);
+        ok = in && inode_write(in, offset, (const uint8_t*)data, len);
+        if (in) inode_unlock(in);
+    }
+    if (ok) pcache_update(path, offset, data, len);
+    return ok ? 0 : -1;
 }
 
-void fs_debug_list() {
-    for (int i = 0; i < file_count; i++) {
-        puts("-> ");
-        puts(files[i].path);
-        newline();
+// Cut path down to size bytes, or zero-fill it up to size
+int fs_truncate(const char* path, uint32_t size) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    int ok;
+    pcache_flush(path);
+    if (vol) {
+        ok = vol->truncate && vol->truncate(inner, size) == 0;
+    } else {
+        Inode* in = file_get(path, 0);
+        ok = in && inode_truncate(in, size);
+        if (in) inode_unlock(in);
     }
+    pcache_invalidate(path);
+    return ok ? 0 : -1;
+}
+
+// Copy up to len bytes from offset into buf. Returns how many, 0 at
+// the end of the file, -1 if there is no such file.
+int fs_read_at(const char* path, uint32_t offset, void* buf, uint32_t len) {
+    char disk_path[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, disk_path, &inner);
+    if (vol) return vol->read_at ? vol->read_at(inner, offset, buf, len) : -1;
+
+    Inode* in = file_get(path, 0);
+    if (!in) return -1;
+    int n = inode_read(in, offset, (uint8_t*)buf, len);
+    inode_unlock(in);
+    return n;
 }
 
+// Old style text files: 1 on success, 0 on failure
 int fs_add(const char* path, const char* content) {
-    if (file_count >= MAX_FILES) return 0;
-    files[file_count].path = path;
-    files[file_count].content = content;
-    file_count++;
+    return fs_write(path, content, strlen(content)) == 0;
+}
+
+// Zero-copy file for data that never changes or goes away, like the
+// embedded programs. A later write switches it to owned extents.
+int fs_add_static(const char* path, const void* data, uint32_t size) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    if (vfs_route(path, buf, &inner)) return 0;
+
+    Inode* in = file_get(path, 1);
+    if (!in) return 0;
+    inode_free_extents(in, 0);
+    inode_drop_pack(in);
+    inode_drop_text(in);
+    in->data = (const uint8_t*)data;
+    in->size = size;
+    inode_unlock(in);
     return 1;
 }
+
+// A file whose contents are an LZ4 pack that never changes or goes
+// away, like a packed initrd member. Reads unpack it a page at a time;
+// a write unpacks the whole file into extents.
+int fs_add_packed(const char* path, const void* pack) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    if (vfs_route(path, buf, &inner)) return 0;
+
+    Inode* in = file_get(path, 1);
+    if (!in) return 0;
+    inode_free_extents(in, 0);
+    inode_drop_pack(in);
+    inode_drop_text(in);
+    in->data = NULL;
+    in->packed = (const uint8_t*)pack;
+    in->size = lz4_pack_size(pack);
+    zcache_add(pack);
+    inode_unlock(in);
+    return 1;
+}
+
+// Keep path LZ4-compressed from now on: it is packed right away and
+// again after every fs_write, whenever that saves memory. Appends and
+// writes in place unpack it. Turning it off unpacks it for good.
+// Returns 1 if the file is packed now, 0 if not, -1 if there is no such
+// file in memory.
+int fs_compress(const char* path, int on) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    if (vfs_route(path, buf, &inner)) return -1;
+
+    Inode* in = file_get(path, 0);
+    if (!in) return -1;
+    in->compress = on;
+    if (on) {
+        inode_pack(in);
+    } else if (in->packed) {
+        inode_unpack(in);
+    }
+    int packed = in->packed != NULL;
+    inode_unlock(in);
+    return packed;
+}
+
+// The contents as one string, for small text files: a file that fits
+// in its first extent (always NUL-terminated, see inode_truncate).
+// Borrowed and packed data have no terminator of their own, so they get
+// a terminated copy on the side and stay as they are; fs_read_static
+// keeps working. The pointer is only good until the file changes.
+// Anything bigger, and anything on a mounted volume, has to go through
+// fs_read_at.
+const char* fs_read(const char* path) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    if (vfs_route(path, buf, &inner)) {
+        puts("fs_read: use fs_read_at for files on mounted volumes: ");
+        puts(path);
+        puts("\n");
+        return NULL;
+    }
+
+    Inode* in = file_get(path, 0);
+    const char* content = NULL;
+    if (in) {
+        int borrowed = in->data || in->packed;
+        if (in->size < PAGE_SIZE && borrowed && !in->text) {
+            in->text = (char*)pmm_alloc_page();
+            int n = in->text ? inode_read(in, 0, (uint8_t*)in->text, in->size) : -1;
+            if (n >= 0) {
+                in->text[n] = '\0';
+            } else {
+                inode_drop_text(in);
+            }
+        }
+        if (in->size < PAGE_SIZE) {
+            content = borrowed ? in->text : in->nextents ? (const char*)in->extents[0] : "";
+        }
+        inode_unlock(in);
+    }
+
+    if (!in) {
+        puts("fs_read: file not found: ");
+        puts(path);
+        puts("\n");
+    } else if (!content) {
+        puts("fs_read: file too large or out of memory: ");
+        puts(path);
+        puts("\n");
+    }
+    return content;
+}
+
+// Borrowed contents of a static file, which stay valid and unchanged for
+// good. NULL for missing or written files.
+const void* fs_read_static(const char* path, uint32_t* size) {
+    Inode* in = file_get(path, 0);
+    if (!in) return NULL;
+    const void* data = in->data;
+    if (data) *size = in->size;
+    inode_unlock(in);
+    return data;
+}
+
+// Remove a file or an empty directory
+int fs_remove(const char* path) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    int ok;
+    if (vol) {
+        ok = vol->remove && vol->remove(inner) == 0;
+    } else {
+        uint32_t flags = spin_lock_irqsave(&fs_lock);
+        Dentry* d = lookup(path);
+        Inode* in = NULL;
+        ok = d && d != &root && d->children.count == 0;
+        if (ok) {
+            // The contents are freed with interrupts back on
+            if (d->inode) in = inode_unlink(d->inode);
+            d->inode = NULL;
+            dir_unlink(d->parent, d);
+            dentry_free(d);
+            entry_count--;
+            dcache_gen++;
+        }
+        spin_unlock_irqrestore(&fs_lock, flags);
+        if (in) inode_free(in);
+    }
+    pcache_invalidate(path);
+    return ok ? 0 : -1;
+}
+
+int fs_stat(const char* path, FsStat* st) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    if (vol) return vol->stat ? vol->stat(inner, st) : -1;
+
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    Dentry* d = lookup(path);
+    Inode* in = d ? d->inode : NULL;
+    if (d && !in) {
+        st->type = d->type;
+        st->size = d->children.count;
+        st->pages = 0;
+        st->packed = 0;
+    }
+    if (in) in->users++;
+    spin_unlock_irqrestore(&fs_lock, flags);
+    if (!in) return d ? 0 : -1;
+
+    inode_lock(in);
+    st->type = FS_FILE;
+    st->size = in->size;
+    st->pages = in->nextents + in->packed_pages;
+    st->packed = in->packed ? lz4_pack_len(in->packed) : 0;
+    inode_unlock(in);
+    return 0;
+}
+
+// Copy the next entry of directory path into out; returns 0 when there
+// are no more (or no such directory). Entries added or removed during a
+// walk may or may not be seen, and a table that grew mid-walk can
+// repeat some. out->name is only good until that entry is removed.
+int fs_readdir(const char* path, FsIter* it, FsDirent* out) {
+    char buf[FS_PATH_MAX];
+    const char* inner;
+    const VfsOps* vol = vfs_route(path, buf, &inner);
+    if (vol) return vol->readdir ? vol->readdir(inner, it, out) : 0;
+
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    Dentry* dir = lookup(path);
+    if (dir && dir->type == FS_DIR) {
+        while (it->index < dir->children.capacity) {
+            Dentry* d = dir->children.slots[it->index++];
+            if (slot_used(d)) {
+                out->name = d->name;
+                out->type = d->type;
+                out->size = d->inode ? d->inode->size : d->children.count;
+                spin_unlock_irqrestore(&fs_lock, flags);
+                return 1;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&fs_lock, flags);
+    return 0;
+}
+
+// Turn path, absolute or relative to cwd, into an absolute path with no
+// ".", ".." or repeated slashes. Returns -1 if it doesn't fit in size.
+int fs_normalize(const char* cwd, const char* path, char* out, uint32_t size) {
+    if (size < 2) return -1;
+    uint32_t n = 0;
+    const char* parts[2] = { path[0] == '/' ? "" : cwd, path };
+
+    for (int p = 0; p < 2; p++) {
+        const char* name;
+        uint32_t len, pos = 0;
+        while (fs_next_component(parts[p], &pos, &name, &len)) {
+            if (is_dot(name, len)) continue;
+            if (is_dotdot(name, len)) {
+                while (n > 0 && out[n - 1] != '/') n--;   // Drop the last component
+                if (n > 0) n--;
+                continue;
+            }
+            if (n + 1 + len + 1 > size) return -1;
+            out[n++] = '/';
+            memcpy(out + n, name, len);
+            n += len;
+        }
+    }
+    if (n == 0) out[n++] = '/';
+    out[n] = '\0';
+    return 0;
+}
+
+// An empty directory standing in for a mounted volume, so listing its
+// parent shows it. Lookups below it never reach the tree.
+void fs_mount_point(const char* path) {
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    int created;
+    create(path, FS_DIR, &created);
+    spin_unlock_irqrestore(&fs_lock, flags);
+}
+
+uint32_t fs_count() {
+    return entry_count;
+}
+
+void fs_dcache_stats(uint32_t* hits, uint32_t* misses) {
+    *hits = dcache_hits;
+    *misses = dcache_misses;
+}
+
+// Forget every cached path, so the next lookups walk the tree
+void fs_dcache_drop() {
+    uint32_t flags = spin_lock_irqsave(&fs_lock);
+    dcache_gen++;
+    spin_unlock_irqrestore(&fs_lock, flags);
+}
@@ -4,9 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "string.h"
-
-#define HEAP_START 0x100000
-#define HEAP_SIZE  0x10000
+#include "spinlock.h"
+#include "pmm.h"   // HEAP_START and HEAP_SIZE
 #define ALIGN16(x) (((x) + 15) & ~15)
 
 typedef struct Block {
@@ -22,12 +21,22 @@ static uint8_t* heap_end  = (uint8_t*)(HEAP_START + HEAP_SIZE);
 
 static Block* head = NULL;
 
-void* malloc(size_t size) {
+// Guards the block list and the break. A ticket lock so a CPU churning
+// through allocations can't starve the others; IRQ-safe because the
+// scheduler frees tasks with interrupts off.
+static ticketlock_t heap_lock = TICKETLOCK_INIT;
+
+static void* heap_sbrk(ptrdiff_t increment);
+
+static void* heap_alloc(size_t size) {
     if (size == 0) return NULL;
 
     size = ALIGN16(size);
 
     if (!head) {
+        // Claim the space from the break too, or the next block appended
+        // would land on top of this one
+        if (heap_sbrk(BLOCK_SIZE + size) != heap_base) return NULL;
         head = (Block*)heap_base;
         head->size = size;
         head->next = NULL;
@@ -65,7 +74,7 @@ void* malloc(size_t size) {
 
     // No suitable free block found, append new block at the end (same as before)
     uint8_t* next_addr = (uint8_t*)current + BLOCK_SIZE + current->size;
-    uint8_t* alloc = sbrk(BLOCK_SIZE + size);
+    uint8_t* alloc = heap_sbrk(BLOCK_SIZE + size);
     if (alloc == (void*)-1 || alloc != next_addr) {
         return NULL;
     }
@@ -79,7 +88,7 @@ void* malloc(size_t size) {
     return (void*)(new_block + 1);
 }
 
-void free(void* ptr) {
+static void heap_free(void* ptr) {
     if (!ptr) return;
     Block* block = (Block*)ptr - 1;
     if (block->free) return;
@@ -92,6 +101,19 @@ void free(void* ptr) {
     }
 }
 
+void* malloc(size_t size) {
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
+    void* ptr = heap_alloc(size);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+void free(void* ptr) {
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
+    heap_free(ptr);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+}
+
 void* calloc(size_t num, size_t size) {
     size_t total = num * size;
     void* ptr = malloc(total);
@@ -154,16 +176,17 @@ void* realloc(void* ptr, size_t new_size) {
         return NULL;
     }
 
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
     Block* block = (Block*)ptr - 1;
-    if (block->size >= new_size) {
-        return ptr;
+    void* new_ptr = ptr;
+    if (block->size < new_size) {
+        new_ptr = heap_alloc(new_size);
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, block->size);
+            heap_free(ptr);
+        }
     }
-
-    void* new_ptr = malloc(new_size);
-    if (!new_ptr) return NULL;
-
-    memcpy(new_ptr, ptr, block->size);
-    free(ptr);
+    ticket_unlock_irqrestore(&heap_lock, flags);
     return new_ptr;
 }
 
@@ -180,12 +203,14 @@ void print_block(Block* b) {
 }
 
 void print_heap_state() {
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
     Block* current = head;
     puts("Heap blocks:\n");
     while (current) {
         print_block(current);
         current = current->next;
     }
+    ticket_unlock_irqrestore(&heap_lock, flags);
 }
 void test_malloc_splitting(void) {
     puts("[Test] malloc + splitting\n");
@@ -246,7 +271,7 @@ void test_realloc() {
 
 static uint8_t* heap_break = (uint8_t*)HEAP_START;
 
-void* sbrk(ptrdiff_t increment) {
+static void* heap_sbrk(ptrdiff_t increment) {
     uint8_t* prev_break = heap_break;
     uint8_t* new_break = heap_break + increment;
 
@@ -258,6 +283,13 @@ void* sbrk(ptrdiff_t increment) {
     return prev_break;
 }
 
+void* sbrk(ptrdiff_t increment) {
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
+    void* prev_break = heap_sbrk(increment);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+    return prev_break;
+}
+
 void test_sbrk() {
     puts("[Test] sbrk\n");
 
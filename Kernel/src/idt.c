@@ -4,10 +4,44 @@
 #include <stdint.h>
 
 extern void isr0();
+extern void isr1();
+extern void isr2();
+extern void isr3();
+extern void isr4();
+extern void isr5();
+extern void isr6();
+extern void isr7();
+extern void isr8();
+extern void isr9();
+extern void isr10();
+extern void isr11();
+extern void isr12();
+extern void isr13();
+extern void isr14();
+extern void isr15();
+extern void isr16();
+extern void isr17();
+extern void isr18();
+extern void isr19();
+extern void isr20();
+extern void isr21();
+extern void isr22();
+extern void isr23();
+extern void isr24();
+extern void isr25();
+extern void isr26();
+extern void isr27();
+extern void isr28();
+extern void isr29();
+extern void isr30();
+extern void isr31();
 extern void isr32();
 extern void isr33();
 extern void isr44();
+extern void isr64();
+extern void isr65();
 extern void isr128();
+extern void isr255();
 extern void load_idt(uint32_t);
 
 #define IDT_ENTRIES 256
@@ -26,11 +60,29 @@ void idt_install() {
     idt_ptr.limit = sizeof(struct IDTEntry) * IDT_ENTRIES - 1;
     idt_ptr.base  = (uint32_t)&idt;
 
-    idt_set_gate(0,   (uint32_t)isr0,   0x08, 0x8E);
+    // CPU exceptions: a fault in ring 3 now kills the process instead of
+    // triple faulting the machine
+    void (*exceptions[32])() = {
+        isr0,  isr1,  isr2,  isr3,  isr4,  isr5,  isr6,  isr7,
+        isr8,  isr9,  isr10, isr11, isr12, isr13, isr14, isr15,
+        isr16, isr17, isr18, isr19, isr20, isr21, isr22, isr23,
+        isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31,
+    };
+    for (int i = 0; i < 32; i++) {
+        idt_set_gate(i, (uint32_t)exceptions[i], 0x08, 0x8E);
+    }
     idt_set_gate(32,  (uint32_t)isr32,  0x08, 0x8E);
     idt_set_gate(33,  (uint32_t)isr33,  0x08, 0x8E);
     idt_set_gate(44,  (uint32_t)isr44,  0x08, 0x8E);
-    idt_set_gate(128, (uint32_t)isr128, 0x08, 0x8E);
+    idt_set_gate(64,  (uint32_t)isr64,  0x08, 0x8E);
+    idt_set_gate(65,  (uint32_t)isr65,  0x08, 0x8E);
+    idt_set_gate(128, (uint32_t)isr128, 0x08, 0xEE);   // DPL 3: ring 3 may int 0x80
+    idt_set_gate(255, (uint32_t)isr255, 0x08, 0x8E);
 
     load_idt((uint32_t)&idt_ptr);
 }
+
+// Application processors share the boot CPU's table
+void idt_reload() {
+    load_idt((uint32_t)&idt_ptr);
+}
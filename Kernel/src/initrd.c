@@ -0,0 +1,400 @@
+#include "initrd.h"
+#include "multiboot.h"
+#include "fs.h"
+#include "vfs.h"
+#include "pmm.h"
+#include "heap.h"
+#include "string.h"
+#include "serial.h"
+#include "lz4.h"
+#include "zcache.h"
+#include <stddef.h>
+
+static InitrdInfo info;
+
+static uint32_t page_up(uint32_t addr) {
+    return (addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+// Find the initrd (the first boot module) and keep the frame allocator
+// off it. Runs once, after pmm_init and before anything uses the heap.
+void initrd_init() {
+    static int initialized = 0;
+    if (initialized) return;   // kernel_setup can run more than once
+    initialized = 1;
+
+    if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC) return;
+    const MultibootInfo* mbi = (const MultibootInfo*)multiboot_info;
+    if (!(mbi->flags & MB_INFO_MODS) || mbi->mods_count == 0) return;
+
+    const MultibootModule* mods = (const MultibootModule*)mbi->mods_addr;
+    uint32_t start = mods[0].mod_start;
+    uint32_t end = mods[0].mod_end;
+    if (end <= start) return;
+
+    // GRUB puts modules right after the kernel image. One big enough to
+    // reach the heap is moved above the page frames, the only copy made.
+    if (start < HEAP_START + HEAP_SIZE && end > HEAP_START) {
+        uint32_t dest = PMM_END;
+        for (uint32_t i = 0; i < mbi->mods_count; i++) {
+            if (mods[i].mod_end > dest) dest = page_up(mods[i].mod_end);
+        }
+        uint32_t mem_top = (mbi->flags & MB_INFO_MEMORY) ? 0x100000 + mbi->mem_upper * 1024 : 0;
+        if (dest + (end - start) > mem_top) {
+            serial_puts("[initrd] no room to move the module off the heap, ignored\n");
+            return;
+        }
+        memmove((void*)dest, (const void*)start, end - start);
+        end = dest + (end - start);
+        start = dest;
+        info.moved = 1;
+    }
+
+    pmm_reserve(start, end);
+    info.start = start;
+    info.size = end - start;
+}
+
+static uint32_t octal(const char* s, uint32_t len) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++) {
+        n = n * 8 + (s[i] - '0');
+    }
+    return n;
+}
+
+static int header_ok(const TarHeader* h) {
+    if (memcmp(h->magic, "ustar", 5) != 0) return 0;
+
+    const uint8_t* b = (const uint8_t*)h;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < TAR_BLOCK; i++) {
+        int in_chksum = i >= offsetof(TarHeader, chksum) && i < offsetof(TarHeader, chksum) + sizeof(h->chksum);
+        sum += in_chksum ? ' ' : b[i];
+    }
+    return sum == octal(h->chksum, sizeof(h->chksum));
+}
+
+// prefix/name, neither of which has to be NUL-terminated
+static void member_name(const TarHeader* h, char* out) {
+    size_t n = strnlen(h->prefix, sizeof(h->prefix));
+    memcpy(out, h->prefix, n);
+    if (n) out[n++] = '/';
+    size_t len = strnlen(h->name, sizeof(h->name));
+    memcpy(out + n, h->name, len);
+    out[n + len] = '\0';
+}
+
+// Archives don't have to list a directory before its contents
+static void mkdir_parents(char* path) {
+    for (char* c = path + 1; *c; c++) {
+        if (*c != '/') continue;
+        *c = '\0';
+        fs_mkdir(path);
+        *c = '/';
+    }
+}
+
+// One member of the archive: its normalized path and contents
+typedef struct {
+    char path[FS_PATH_MAX];
+    char type;
+    const uint8_t* data;
+    uint32_t size;           // Unpacked
+    uint32_t packed;         // Bytes in the archive, for TAR_LZ4
+} Member;
+
+// The member at *pos, which moves past it. 0 at the end of the archive
+// (or at a damaged header, which is reported once). Damaged packs are
+// reported and skipped.
+static int next_member(uint32_t* pos, Member* m, int quiet) {
+    while (*pos + TAR_BLOCK <= info.size) {
+        const TarHeader* h = (const TarHeader*)(info.start + *pos);
+        if (h->name[0] == '\0') return 0;   // The zero blocks at the end
+        if (!header_ok(h)) {
+            if (!quiet) {
+                serial_puts("[initrd] bad header at offset ");
+                serial_puthex(*pos);
+                serial_puts("\n");
+            }
+            return 0;
+        }
+
+        uint32_t size = octal(h->size, sizeof(h->size));
+        *pos += TAR_BLOCK;
+        if (size > info.size - *pos) return 0;
+        m->data = (const uint8_t*)h + TAR_BLOCK;
+        m->size = size;
+        m->type = h->typeflag;
+        *pos += (size + TAR_BLOCK - 1) & ~(TAR_BLOCK - 1);
+
+        char raw[sizeof(h->prefix) + sizeof(h->name) + 2];
+        member_name(h, raw);
+        if (fs_normalize("/", raw, m->path, sizeof(m->path)) < 0 || strcmp(m->path, "/") == 0) continue;
+
+        m->packed = 0;
+        if (m->type == TAR_LZ4) {
+            if (lz4_pack_check(m->data, size) < 0) {
+                if (!quiet) {
+                    serial_puts("[initrd] bad LZ4 pack: ");
+                    serial_puts(m->path);
+                    serial_puts("\n");
+                }
+                continue;
+            }
+            m->packed = size;
+            m->size = lz4_pack_size(m->data);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int is_file(const Member* m) {
+    return m->type == TAR_FILE || m->type == TAR_OLDFILE || m->type == TAR_LZ4;
+}
+
+// ---- The archive itself, mounted read-only at INITRD_MOUNT ----
+
+// Every path in the archive, indexed once by initrd_populate: the tar is
+// never rescanned. Directories an archive only implies (by having
+// something below them) get a node too. Nodes are found by a hash of
+// their full path, linear probing, and list their children in archive
+// order.
+typedef struct {
+    char* path;              // Normalized, owned
+    uint32_t hash;           // fs_hash(path)
+    uint32_t type;           // FS_FILE or FS_DIR
+    const uint8_t* data;     // Files: the member in the module
+    uint32_t size;           // Unpacked bytes, or entries for a directory
+    uint32_t packed;         // Bytes of the LZ4 pack, 0 if not packed
+    int first_child;         // Indexes into nodes, -1 for none
+    int last_child;
+    int next;                // The next child of the same directory
+} Node;
+
+static Node* nodes;          // nodes[0] is the root
+static uint32_t node_count = 0;
+static uint32_t node_cap = 0;
+static int* slots;           // Node indexes, -1 for empty
+static uint32_t slot_cap = 0;   // A power of two, at least twice node_count
+
+static void slot_insert(int i) {
+    uint32_t mask = slot_cap - 1;
+    uint32_t s = nodes[i].hash & mask;
+    while (slots[s] >= 0) s = (s + 1) & mask;
+    slots[s] = i;
+}
+
+// Room for one more node, in the array and in the hash table
+static int index_grow() {
+    if (node_count == node_cap) {
+        uint32_t cap = node_cap ? node_cap * 2 : 64;
+        Node* grown = (Node*)realloc(nodes, cap * sizeof(Node));
+        if (!grown) return 0;
+        nodes = grown;
+        node_cap = cap;
+    }
+    if ((node_count + 1) * 2 > slot_cap) {
+        uint32_t cap = slot_cap ? slot_cap * 2 : 128;
+        int* grown = (int*)malloc(cap * sizeof(int));
+        if (!grown) return 0;
+        for (uint32_t i = 0; i < cap; i++) grown[i] = -1;
+        free(slots);
+        slots = grown;
+        slot_cap = cap;
+        for (uint32_t i = 0; i < node_count; i++) slot_insert(i);
+    }
+    return 1;
+}
+
+static int node_find(const char* path) {
+    if (!slot_cap) return -1;
+    uint32_t hash = fs_hash(path);
+    uint32_t mask = slot_cap - 1;
+    for (uint32_t s = hash & mask; slots[s] >= 0; s = (s + 1) & mask) {
+        const Node* n = &nodes[slots[s]];
+        if (n->hash == hash && strcmp(n->path, path) == 0) return slots[s];
+    }
+    return -1;
+}
+
+// The node for path, added with any missing parents if it isn't there
+// yet. path is put back as it was. -1 if out of memory, or if a parent
+// turns out to be a file.
+static int node_add(char* path, uint32_t type) {
+    int i = node_find(path);
+    if (i >= 0) return i;
+
+    int parent = -1;
+    if (strcmp(path, "/") != 0) {
+        char* slash = strrchr(path, '/');
+        if (slash == path) {
+            parent = 0;
+        } else {
+            *slash = '\0';
+            parent = node_add(path, FS_DIR);
+            *slash = '/';
+        }
+        if (parent < 0 || nodes[parent].type != FS_DIR) return -1;
+    }
+
+    char* copy = (char*)malloc(strlen(path) + 1);
+    if (!copy || !index_grow()) {
+        free(copy);
+        return -1;
+    }
+    strcpy(copy, path);
+    i = node_count++;
+    Node* n = &nodes[i];
+    n->path = copy;
+    n->hash = fs_hash(path);
+    n->type = type;
+    n->data = NULL;
+    n->size = 0;
+    n->packed = 0;
+    n->first_child = n->last_child = n->next = -1;
+    slot_insert(i);
+
+    if (parent >= 0) {
+        Node* p = &nodes[parent];
+        if (p->last_child >= 0) {
+            nodes[p->last_child].next = i;
+        } else {
+            p->first_child = i;
+        }
+        p->last_child = i;
+        p->size++;
+    }
+    return i;
+}
+
+// One pass over the archive. Links and devices are left out, but still
+// make their directories show up.
+static void index_build() {
+    char root[] = "/";
+    if (node_add(root, FS_DIR) < 0) return;
+
+    uint32_t pos = 0;
+    Member m;
+    int failed = 0;
+    while (next_member(&pos, &m, 1)) {
+        if (is_file(&m)) {
+            int i = node_add(m.path, FS_FILE);
+            if (i < 0) {
+                failed = 1;
+            } else if (nodes[i].type == FS_FILE) {
+                // A later member of the same name wins, as in the tree
+                nodes[i].data = m.data;
+                nodes[i].size = m.size;
+                nodes[i].packed = m.packed;
+            }
+        } else if (m.type == TAR_DIR) {
+            failed |= node_add(m.path, FS_DIR) < 0;
+        } else {
+            char* slash = strrchr(m.path, '/');
+            if (slash != m.path) {
+                *slash = '\0';
+                failed |= node_add(m.path, FS_DIR) < 0;
+            }
+        }
+    }
+    if (failed) serial_puts("[initrd] some members left out of " INITRD_MOUNT "\n");
+}
+
+static const Node* lookup(const char* path) {
+    int i = node_find(path);
+    return i >= 0 ? &nodes[i] : NULL;
+}
+
+// it->index is 0 to start, then 2 + the index of the next child to hand
+// out (1 once there are none left)
+static int initrd_readdir(const char* path, FsIter* it, FsDirent* out) {
+    const Node* dir = lookup(path);
+    if (!dir || dir->type != FS_DIR) return 0;
+    int i = it->index == 0 ? dir->first_child : (int)it->index - 2;
+    if (i < 0) return 0;
+
+    const Node* n = &nodes[i];
+    const char* name = strrchr(n->path, '/') + 1;
+    uint32_t len = strlen(name);
+    if (len >= FS_NAME_MAX) len = FS_NAME_MAX - 1;
+    memcpy(it->name, name, len);
+    it->name[len] = '\0';
+    out->name = it->name;
+    out->type = n->type;
+    out->size = n->size;
+    it->index = n->next + 2;
+    return 1;
+}
+
+static int initrd_stat(const char* path, FsStat* st) {
+    const Node* n = lookup(path);
+    if (!n) return -1;
+    st->type = n->type;
+    st->size = n->size;
+    st->pages = 0;
+    st->packed = n->packed;
+    return 0;
+}
+
+static int initrd_read_at(const char* path, uint32_t offset, void* buf, uint32_t len) {
+    const Node* n = lookup(path);
+    if (!n || n->type != FS_FILE) return -1;
+    if (offset >= n->size) return 0;
+    if (len > n->size - offset) len = n->size - offset;
+    if (n->packed) return zcache_read(n->data, offset, buf, len);
+    memcpy(buf, n->data + offset, len);
+    return len;
+}
+
+static const VfsOps initrd_ops = {
+    .name = "initrd",
+    .read_at = initrd_read_at,
+    .stat = initrd_stat,
+    .readdir = initrd_readdir,
+};
+
+// Add every member of the archive to the filesystem. File contents are
+// not copied: the files point into the module, which stays put for good,
+// packed members included (they are unpacked as they are read).
+// The archive as it is also gets mounted, read-only, at INITRD_MOUNT.
+// Called by fs_init, so it runs again whenever the tree is rebuilt.
+void initrd_populate() {
+    if (!info.start) return;
+
+    info.files = 0;
+    info.packed = 0;
+    info.dirs = 0;
+    uint32_t pos = 0;
+    Member m;
+    while (next_member(&pos, &m, 0)) {
+        mkdir_parents(m.path);
+        if (m.type == TAR_DIR) {
+            if (fs_mkdir(m.path) == 0) info.dirs++;
+        } else if (m.packed) {
+            if (fs_add_packed(m.path, m.data)) {
+                info.files++;
+                info.packed++;
+            }
+        } else if (is_file(&m)) {
+            if (fs_add_static(m.path, m.data, m.size)) info.files++;
+        }
+    }
+    if (!node_count) index_build();   // The archive never changes
+    vfs_mount(INITRD_MOUNT, &initrd_ops);
+
+    serial_puts("[initrd] ");
+    serial_putint(info.files);
+    serial_puts(" files (");
+    serial_putint(info.packed);
+    serial_puts(" packed), ");
+    serial_putint(info.dirs);
+    serial_puts(" directories from ");
+    serial_puthex(info.start);
+    serial_puts(info.moved ? " (moved off the heap)\n" : "\n");
+}
+
+const InitrdInfo* initrd_info() {
+    return &info;
+}
@@ -1,6 +1,14 @@
 
 #include "screen.h"
 #include "io.h"
+#include "cpu.h"
+#include "irqstat.h"
+#include "task.h"
+#include "apic.h"
+#include "async.h"
+#include "load.h"
+#include "process.h"
+#include "paging.h"
 #include <stdint.h>
 
 #define MAX_INTERRUPTS 256
@@ -11,27 +19,77 @@ void register_interrupt_handler(int n, void (*handler)()) {
     interrupt_handlers[n] = handler;
 }
 
+// An exception in kernel code: nothing sane to return to
+static void exception_panic(IsrFrame* frame) {
+    uint32_t cr2;
+    __asm__ __volatile__ ("mov %%cr2, %0" : "=r"(cr2));
+    setcolor(15, 4);
+    puts("\n[panic] exception ");
+    putint(frame->int_no);
+    puts(" err=");
+    puthex(frame->err_code);
+    puts(" eip=");
+    puthex(frame->eip);
+    puts(" cr2=");
+    puthex(cr2);
+    newline();
+    while (1) {
+        __asm__ __volatile__ ("cli; hlt");
+    }
+}
+
 // ISR entry point called from ASM stub
-void isr_handler(int interrupt_number, uint32_t error_code) {
+void isr_handler(IsrFrame* frame) {
+    int interrupt_number = frame->int_no;
+    uint64_t entry_tsc = rdtsc();
+    cpu_idle_exit();
+
+    // Copy-on-write or a mapped file page: fix it up and retry
+    if (interrupt_number == 14 && paging_handle_fault(frame->err_code, (frame->eflags & EFLAGS_IF) != 0)) {
+        return;
+    }
+
+    // A fault in ring 3 only takes down that process
+    if (interrupt_number < 32 && (frame->cs & 3)) {
+        process_fault(frame);
+    }
 
     if (interrupt_handlers[interrupt_number]) {
         interrupt_handlers[interrupt_number]();
+    } else if (interrupt_number < 32) {
+        exception_panic(frame);
     } else {
         puts("[unhandled interrupt] ");
         puthex(interrupt_number);
         puts(" (err=");
-        puthex(error_code);
+        puthex(frame->err_code);
         puts(")");
         newline();
     }
 
-    // Acknowledge PIC
-    if (interrupt_number >= 40) {
+    // Acknowledge PIC for IRQ0-15, the local APIC for its own vectors
+    if (interrupt_number >= 40 && interrupt_number < 48) {
         outb(0xA0, 0x20);  // Slave
     }
-    if (interrupt_number >= 32) {
+    if (interrupt_number >= 32 && interrupt_number < 48) {
         outb(0x20, 0x20);  // Master
     }
+    if (interrupt_number >= APIC_TIMER_VECTOR) {
+        lapic_eoi();
+    }
+
+    irqstat_record(interrupt_number, rdtsc() - entry_tsc);
+
+    // Resume any driver coroutine waiting on this line
+    if (interrupt_number >= 32 && interrupt_number < 48) {
+        async_irq(interrupt_number - 32);
+    }
+
+    // Time slice used up? Switch tasks now that the PIC is acknowledged
+    if (interrupt_number >= 32) {
+        task_preempt();
+    }
+    if (frame->cs & 3) task_kill_point();
 }
 
 // Special handler for divide-by-zero
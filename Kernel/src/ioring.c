@@ -0,0 +1,287 @@
+
+#include "ioring.h"
+#include "syscall.h"
+#include "screen.h"
+#include "time.h"
+#include "fs.h"
+#include "string.h"
+#include "heap.h"
+#include "task.h"
+#include "paging.h"
+#include "pmm.h"
+#include "vfs.h"
+#include "pcache.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+#define IORING_POLL_BUDGET 32     // SQEs drained per ring per timer tick
+#define IORING_STR_MAX     4096   // Longest NUL-terminated IORING_OP_WRITE
+
+extern volatile uint32_t tick_count;
+
+typedef struct {
+    IoRing* ring;
+    uint32_t flags;
+    Task* owner;              // The only task that may enter or unregister it
+    uint32_t* page_dir;       // The owner's address space; NULL for a kernel task
+    volatile uint32_t busy;   // Someone is draining it: the timer or SYSCALL_ENTER
+} RingSlot;
+
+// Guards handing out and clearing slots. Drainers go by busy alone.
+static spinlock_t slots_lock = SPINLOCK_INIT;
+static RingSlot rings[MAX_IORINGS];
+static uint32_t ops_completed = 0;
+
+void ioring_init() {
+    for (int i = 0; i < MAX_IORINGS; i++) {
+        rings[i].ring = NULL;
+        rings[i].flags = 0;
+        rings[i].owner = NULL;
+        rings[i].page_dir = NULL;
+        rings[i].busy = 0;
+    }
+}
+
+// The ring belongs to the calling task, which may be a process: then it
+// lives in user memory, and only the process's own address space sees it
+int ioring_register(IoRing* ring, uint32_t flags) {
+    if (!ring || !user_ptr_ok(ring, sizeof(IoRing), 1)) return -1;
+    // The timer writes completions and can't take the fault
+    user_prefault(ring, sizeof(IoRing), 1);
+
+    Task* self = task_current();
+    uint32_t irq = spin_lock_irqsave(&slots_lock);
+    for (int i = 0; i < MAX_IORINGS; i++) {
+        if (!rings[i].ring) {
+            ring->sq_head = ring->sq_tail = 0;
+            ring->cq_head = ring->cq_tail = 0;
+            ring->flags = flags;
+            ring->sleep_until = 0;
+            ring->sqe_tail = 0;
+            rings[i].flags = flags;
+            rings[i].owner = self;
+            rings[i].page_dir = self->page_dir;
+            barrier();
+            rings[i].ring = ring;
+            spin_unlock_irqrestore(&slots_lock, irq);
+            return i;
+        }
+    }
+    spin_unlock_irqrestore(&slots_lock, irq);
+    return -1;
+}
+
+static int slot_mine(int id) {
+    return id >= 0 && id < MAX_IORINGS && rings[id].ring && rings[id].owner == task_current();
+}
+
+// Take the ring away from drainers. Once busy is ours none is inside,
+// and the next finds the ring gone. Only a timer drain can hold busy
+// here (SYSCALL_ENTER's is the owner's own), and it is short, so spin.
+static void slot_clear(RingSlot* slot) {
+    while (__sync_lock_test_and_set(&slot->busy, 1)) cpu_relax();
+    uint32_t irq = spin_lock_irqsave(&slots_lock);
+    slot->ring = NULL;
+    slot->flags = 0;
+    slot->owner = NULL;
+    slot->page_dir = NULL;
+    spin_unlock_irqrestore(&slots_lock, irq);
+    __sync_lock_release(&slot->busy);
+}
+
+int ioring_unregister(int id) {
+    if (!slot_mine(id)) return -1;
+    slot_clear(&rings[id]);
+    return 0;
+}
+
+// Drop the rings a dead task left registered. Called from process_exit
+// and reap_tasks, before the memory they live in goes away.
+void ioring_release(Task* t) {
+    for (int i = 0; i < MAX_IORINGS; i++) {
+        if (rings[i].ring && rings[i].owner == t) slot_clear(&rings[i]);
+    }
+}
+
+// SQE pointers come from the ring's owner, so they are checked against
+// its address space. The timer can't take a fault: there they must also
+// be mapped already, or the SQE waits for SYSCALL_ENTER.
+static int sqe_buf_ok(RingSlot* slot, const void* buf, uint32_t len, int write, int can_block) {
+    if (!slot->page_dir) return 1;
+    if (!can_block) return user_ptr_mapped(buf, len, write);
+    if (!user_ptr_ok(buf, len, write)) return 0;
+    user_prefault(buf, len, write);
+    return 1;
+}
+
+static int sqe_str_ok(RingSlot* slot, const char* str, int can_block) {
+    if (!slot->page_dir) return 1;
+    if (can_block) return user_str_ok(str, IORING_STR_MAX);
+    for (uint32_t i = 0; i < IORING_STR_MAX; i++) {
+        if ((i == 0 || (((uint32_t)str + i) & (PAGE_SIZE - 1)) == 0) && !user_ptr_mapped(str + i, 1, 0)) {
+            return 0;
+        }
+        if (str[i] == '\0') return 1;
+    }
+    return 0;
+}
+
+// Whether an SQE's pointers can be used from here: 1 if so, 0 if not
+// yet (poll mode), -1 if never
+static int sqe_check(RingSlot* slot, const IoSqe* sqe, int can_block) {
+    int ok = 1;
+    switch (sqe->opcode) {
+        case IORING_OP_WRITE:
+            ok = sqe->arg2 ? sqe_buf_ok(slot, (const void*)sqe->arg1, sqe->arg2, 0, can_block)
+                           : sqe_str_ok(slot, (const char*)sqe->arg1, can_block);
+            break;
+        case IORING_OP_FILE_READ:
+            ok = sqe_str_ok(slot, (const char*)sqe->arg1, can_block) &&
+                 sqe_buf_ok(slot, (void*)sqe->arg2, sqe->arg3, 1, can_block);
+            break;
+    }
+    if (ok) return 1;
+    return can_block ? -1 : 0;
+}
+
+// A chunk at a time, each faulted in before the filesystem's lock is taken
+static int32_t ioring_file_read(const char* path, char* buf, uint32_t size) {
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t chunk = size - done < VFS_CHUNK ? size - done : VFS_CHUNK;
+        user_prefault(buf + done, chunk, 1);
+        int n = pcache_read(path, done, buf + done, chunk);
+        if (n < 0) return done ? (int32_t)done : -1;
+        done += n;
+        if ((uint32_t)n < chunk) break;
+    }
+    return (int32_t)done;
+}
+
+static int32_t ioring_execute(IoRing* ring, const IoSqe* sqe, int can_block) {
+    switch (sqe->opcode) {
+        case IORING_OP_NOP:
+            return 0;
+        case IORING_OP_WRITE: {
+            const char* str = (const char*)sqe->arg1;
+            uint32_t len = sqe->arg2 ? sqe->arg2 : strlen(str);
+            for (uint32_t i = 0; i < len; i++) putc(str[i]);
+            return (int32_t)len;
+        }
+        case IORING_OP_PUTCHAR:
+            putc((char)sqe->arg1);
+            return 0;
+        case IORING_OP_CURSOR:
+            move_cursor(sqe->arg1, sqe->arg2);
+            return 0;
+        case IORING_OP_CLEAR:
+            clear();
+            return 0;
+        case IORING_OP_SLEEP:
+            if (can_block) {
+                sleep_t(sqe->arg1);
+            } else {
+                ring->sleep_until = tick_count + sqe->arg1;
+            }
+            return 0;
+        case IORING_OP_FILE_READ:
+            return ioring_file_read((const char*)sqe->arg1, (char*)sqe->arg2, sqe->arg3);
+        default:
+            return -1;
+    }
+}
+
+// Consume up to max SQEs. Stops early when the CQ is full so no
+// completion is ever dropped, or on a non-blocking SLEEP.
+static int ioring_drain_locked(RingSlot* slot, IoRing* ring, uint32_t max, int can_block) {
+    int done = 0;
+
+    while (!max || (uint32_t)done < max) {
+        if (!can_block && (int32_t)(tick_count - ring->sleep_until) < 0) break;
+
+        uint32_t head = ring->sq_head;
+        barrier();
+        if (head == ring->sq_tail) break;
+        if (ring->cq_tail - ring->cq_head >= IORING_ENTRIES) break;
+
+        // A copy, so the task can't change it between check and use
+        IoSqe sqe = ring->sq[head & IORING_MASK];
+        // File locks sleep, which the timer can't
+        if (!can_block && sqe.opcode == IORING_OP_FILE_READ) break;
+        int check = sqe_check(slot, &sqe, can_block);
+        if (check == 0) break;
+        int32_t result = check > 0 ? ioring_execute(ring, &sqe, can_block) : -1;
+
+        IoCqe* cqe = &ring->cq[ring->cq_tail & IORING_MASK];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        barrier();
+        ring->cq_tail++;
+        ring->sq_head = head + 1;
+
+        __sync_fetch_and_add(&ops_completed, 1);
+        done++;
+    }
+    return done;
+}
+
+// Whether the ring itself can be touched from here: a process's ring
+// only while its address space is loaded, and from the timer only if
+// that can't fault
+static int ring_in_view(RingSlot* slot, IoRing* ring, int can_block) {
+    if (!slot->page_dir) return 1;
+    if (task_current()->page_dir != slot->page_dir) return 0;
+    if (!can_block) return user_ptr_mapped(ring, sizeof(IoRing), 1);
+    if (!user_ptr_ok(ring, sizeof(IoRing), 1)) return 0;
+    user_prefault(ring, sizeof(IoRing), 1);
+    return 1;
+}
+
+// One drainer per ring at a time. The timer can fire in the middle of a
+// SYSCALL_ENTER, or run on another CPU; whoever finds the ring busy
+// leaves the SQEs to the one draining it.
+static int ioring_drain(RingSlot* slot, uint32_t max, int can_block) {
+    if (__sync_lock_test_and_set(&slot->busy, 1)) return 0;
+    IoRing* ring = slot->ring;
+    int done = -1;
+    if (ring && ring_in_view(slot, ring, can_block)) {
+        done = ioring_drain_locked(slot, ring, max, can_block);
+    }
+    __sync_lock_release(&slot->busy);
+    return done;
+}
+
+int ioring_enter(int id, uint32_t to_submit) {
+    if (!slot_mine(id)) return -1;
+    return ioring_drain(&rings[id], to_submit, 1);
+}
+
+// Called from every CPU's timer: drain poll-mode rings without the task
+// trapping. A process's ring goes while the process is running here.
+void ioring_poll() {
+    for (int i = 0; i < MAX_IORINGS; i++) {
+        if (rings[i].ring && (rings[i].flags & IORING_SETUP_POLL)) {
+            ioring_drain(&rings[i], IORING_POLL_BUDGET, 0);
+        }
+    }
+}
+
+uint32_t ioring_ops_completed() {
+    return ops_completed;
+}
+
+int ioring_setup(IoRing* ring, uint32_t flags) {
+    return syscall(SYSCALL_RING_SETUP, (uint32_t)ring, flags, 0);
+}
+
+int ioring_exit(int id) {
+    return syscall(SYSCALL_RING_EXIT, (uint32_t)id, 0, 0);
+}
+
+// Publish every SQE handed out since the last submit. Poll-mode rings are
+// picked up by the kernel on its own; others are flushed with one trap.
+int ioring_submit(IoRing* ring, int id) {
+    uint32_t pending = ioring_publish(ring);
+    if (ring->flags & IORING_SETUP_POLL) return (int)pending;
+    return syscall(SYSCALL_ENTER, (uint32_t)id, 0, 0);
+}
@@ -0,0 +1,139 @@
+
+#include "irqstat.h"
+#include "screen.h"
+#include "serial.h"
+#include "cpu.h"
+#include "heap.h"
+#include "string.h"
+
+#define MAX_INTERRUPTS 256
+
+static IrqStat irq_stats[MAX_INTERRUPTS];
+
+static const char* irq_name(int vector) {
+    switch (vector) {
+        case 0:   return "divide";
+        case 32:  return "timer";
+        case 33:  return "keyboard";
+        case 44:  return "mouse";
+        case 128: return "syscall";
+        default:  return vector < 32 ? "exception" : "irq";
+    }
+}
+
+void irqstat_record(int vector, uint64_t cycles) {
+    IrqStat* s = &irq_stats[vector];
+    uint32_t c = (cycles >> 32) ? 0xFFFFFFFF : (uint32_t)cycles;
+
+    s->count++;
+    s->total_cycles += cycles;
+    if (c > s->max_cycles) s->max_cycles = c;
+
+    int bucket = 0;
+    if (c) {
+        bucket = (31 - __builtin_clz(c)) - IRQSTAT_FIRST_SHIFT;
+        if (bucket < 0) bucket = 0;
+        if (bucket >= IRQSTAT_BUCKETS) bucket = IRQSTAT_BUCKETS - 1;
+    }
+    s->hist[bucket]++;
+}
+
+const IrqStat* irqstat_get(int vector) {
+    if (vector < 0 || vector >= MAX_INTERRUPTS) return NULL;
+    return &irq_stats[vector];
+}
+
+void irqstat_reset() {
+    uint32_t flags = irq_save();
+    memset(irq_stats, 0, sizeof(irq_stats));
+    irq_restore(flags);
+}
+
+static uint32_t irqstat_avg(const IrqStat* s) {
+    if (!s->count) return 0;
+    uint64_t avg = div64_32(s->total_cycles, s->count);
+    return (avg >> 32) ? 0xFFFFFFFF : (uint32_t)avg;
+}
+
+// Right-align a number in a column of the given width
+static void put_col(uint32_t value, int width) {
+    int len = 0;
+    uint32_t v = value;
+    do { len++; v /= 10; } while (v);
+    for (int i = len; i < width; i++) putc(' ');
+    putuint(value);
+}
+
+void irqstat_print() {
+    puts("vec name         count   avg cyc   max cyc\n");
+    for (int i = 0; i < MAX_INTERRUPTS; i++) {
+        const IrqStat* s = &irq_stats[i];
+        if (!s->count) continue;
+
+        put_col(i, 3);
+        putc(' ');
+        const char* name = irq_name(i);
+        puts(name);
+        for (int pad = strlen(name); pad < 9; pad++) putc(' ');
+        put_col(s->count, 8);
+        put_col(irqstat_avg(s), 10);
+        put_col(s->max_cycles, 10);
+        putc('\n');
+    }
+}
+
+void irqstat_print_hist(int vector) {
+    const IrqStat* s = irqstat_get(vector);
+    if (!s || !s->count) {
+        puts("No samples for that vector");
+        return;
+    }
+
+    uint32_t peak = 1;
+    for (int b = 0; b < IRQSTAT_BUCKETS; b++) {
+        if (s->hist[b] > peak) peak = s->hist[b];
+    }
+
+    puts("cycles <        count\n");
+    for (int b = 0; b < IRQSTAT_BUCKETS; b++) {
+        if (b == IRQSTAT_BUCKETS - 1) {
+            puts("   more");
+        } else {
+            put_col(1u << (IRQSTAT_FIRST_SHIFT + b + 1), 7);
+        }
+        put_col(s->hist[b], 11);
+        putc(' ');
+        uint32_t bar = (s->hist[b] * 40) / peak;
+        if (s->hist[b] && !bar) bar = 1;
+        for (uint32_t j = 0; j < bar; j++) putc((char)219);
+        putc('\n');
+    }
+}
+
+void irqstat_dump_serial() {
+    serial_puts("# irqstat: vector name count total_cycles avg max hist[");
+    serial_putint(IRQSTAT_BUCKETS);
+    serial_puts("]\n");
+
+    for (int i = 0; i < MAX_INTERRUPTS; i++) {
+        const IrqStat* s = &irq_stats[i];
+        if (!s->count) continue;
+
+        serial_putint(i);
+        serial_putc(' ');
+        serial_puts(irq_name(i));
+        serial_putc(' ');
+        serial_putint(s->count);
+        serial_putc(' ');
+        serial_putint((uint32_t)div64_32(s->total_cycles, 1000));
+        serial_puts("k ");
+        serial_putint(irqstat_avg(s));
+        serial_putc(' ');
+        serial_putint(s->max_cycles);
+        for (int b = 0; b < IRQSTAT_BUCKETS; b++) {
+            serial_putc(b ? ',' : ' ');
+            serial_putint(s->hist[b]);
+        }
+        serial_putc('\n');
+    }
+}
@@ -15,6 +15,20 @@
 #include "commands.h"
 #include "app.h"
 #include "cyclone.h"
+#include "serial.h"
+#include "ioring.h"
+#include "timepage.h"
+#include "pmm.h"
+#include "smp.h"
+#include "async.h"
+#include "load.h"
+#include "paging.h"
+#include "process.h"
+#include "initrd.h"
+#include "ata.h"
+#include "bcache.h"
+#include "fat.h"
+#include "pcache.h"
 #include <stdint.h>
 
 int menu = 0;
@@ -28,7 +42,6 @@ const char* main_menu[] = {
 };
 const int main_menu_count = sizeof(main_menu) / sizeof(main_menu[0]);
 
-extern void gdt_install();
 extern int POINTER;
 extern int load_cyclone;
 int owly;
@@ -38,20 +51,39 @@ void qemu_exit(int code) {
     outb(0xF4, code);
 }
 
+// Apps with an ELF build under /Apps run inside AmitX in ring 3. The
+// rest still ask boo.sh to start them on the host.
+static const char* app_paths[] = { 0, "/Apps/perch", "/Apps/owly" };
+
 void launch_app(int app_code) {
+    if (app_code > 0 && app_code < 3 && process_spawn(app_paths[app_code], 1) > 0) {
+        return;
+    }
     outb(0xF4, 0x10 + app_code);  // e.g., 0x11 = Perch, 0x12 = Owly
 }
 
 void kernel_setup() {
-    gdt_install();
+    serial_init();
+    smp_init_bsp();
     pic_remap();
     idt_install();
     register_interrupt_handler(0, isr0_handler);
     init_keyboard();
-    init_timer(100);
+    timepage_init(TIMER_HZ);
+    init_timer(TIMER_HZ);
+    pmm_init();
+    initrd_init();
     fs_init();
+    paging_init();
     init_tasks();
     syscall_init();
+    ioring_init();
+    smp_init();
+    async_init();
+    pcache_init();
+    ata_init();
+    bcache_init();
+    fat_mount();
     init_mouse();
     setcolor(15, 0);
     clear();
@@ -89,8 +121,21 @@ static inline void test_syscall() {
 void kernel_main(void) {
     kernel_setup();
     draw_start();
-    
+
+    // Everything from here on is driven by interrupts. Halt instead of
+    // spinning, but let anything queued on this CPU run first. Stepping
+    // aside takes the lowest priority, or a plain yield would come straight
+    // back here past every task queued below TASK_PRIO_DEFAULT. Cyclone
+    // runs from the keyboard IRQ on this task, at its own priority again.
+    Task* self = task_current();
     while (1) {
-        
+        if (cpu_current()->nr_ready) {
+            int prio = self->base_prio;
+            task_set_priority(self->id, TASK_PRIO_LEVELS - 1);
+            yield();
+            task_set_priority(self->id, prio);
+        } else {
+            cpu_idle_halt();
+        }
     }
 }
@@ -6,6 +6,7 @@
 #include "time.h"
 #include "interrupts.h"
 #include "idt.h"
+#include "task.h"
 #include <stdint.h>
 
 extern int menu;
@@ -14,6 +15,8 @@ int load_cyclone = 0;
 #define MAX_SCANCODE 128
 static uint8_t key_state[MAX_SCANCODE] = {0};
 static char last_char = 0;
+static Task* keyboard_waiter = 0;   // Task blocked in keyboard_getchar
+static WaitQueue keyboard_wq = WAIT_QUEUE_INIT;
 
 int POINTER = 0;
 static int shift_down = 0;
@@ -102,6 +105,12 @@ void keyboard_callback() {
             char c = shift_down ? scancode_map_shift[code] : scancode_map[code];
             last_char = c;
 
+            // Interactive wakeup: let the reader jump ahead of background work
+            wake_up(&keyboard_wq);
+            if (keyboard_waiter) {
+                task_boost(keyboard_waiter);
+            }
+
             // Handle special logic
             if (menu) {
                 if (c == 's') {
@@ -133,13 +142,22 @@ void reset_keyboard_state() {
     register_interrupt_handler(33, keyboard_callback);
 }
 
+// Non-blocking: the pending character, or 0 if there is none
+char keyboard_poll() {
+    uint32_t flags = irq_save();
+    char c = last_char;
+    last_char = 0;
+    irq_restore(flags);
+    return c;
+}
+
 char keyboard_getchar() {
     char c = 0;
 
     // Wait for a new character from IRQ handler
-    while (!last_char) {
-        __asm__ __volatile__("hlt"); // Wait for interrupt
-    }
+    keyboard_waiter = task_current();
+    wait_event(keyboard_wq, last_char);
+    keyboard_waiter = 0;
 
     c = last_char;
     last_char = 0;
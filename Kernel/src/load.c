@@ -0,0 +1,119 @@
+
+#include "load.h"
+#include "smp.h"
+#include "cpu.h"
+#include "timer.h"
+#include "screen.h"
+
+// exp(-LOAD_FREQ / (TIMER_HZ * T)) in fixed point, T = 1, 5, 15 s
+static const uint32_t load_exp[3] = { 59299, 64238, 65101 };
+static uint32_t load_avg[3];
+
+static uint64_t load_sample_tsc;
+
+// Halt until the next interrupt, counting the time as idle. The
+// interrupt's own work is not idle: isr_handler closes the period.
+void cpu_idle_halt() {
+    __asm__ __volatile__ ("cli");
+    cpu_current()->idle_since = rdtsc();
+    __asm__ __volatile__ ("sti; hlt");
+    cpu_idle_exit();
+}
+
+void cpu_idle_exit() {
+    uint32_t flags = irq_save();
+    Cpu* cpu = cpu_current();
+    if (cpu->idle_since) {
+        cpu->idle_tsc += rdtsc() - cpu->idle_since;
+        cpu->idle_since = 0;
+    }
+    irq_restore(flags);
+}
+
+// Idle cycles so far, including a halt still in progress. Another CPU
+// may be updating them, so retry until two reads agree.
+static uint64_t cpu_idle_cycles(Cpu* cpu, uint64_t now) {
+    uint64_t idle, since;
+    do {
+        idle = cpu->idle_tsc;
+        since = cpu->idle_since;
+    } while (idle != cpu->idle_tsc);
+    return idle + (since && now > since ? now - since : 0);
+}
+
+// Tasks that want a CPU: everything queued, plus whatever each CPU runs
+// unless that is its idle task or it is halted
+static uint32_t load_active() {
+    uint32_t n = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* cpu = &cpus[i];
+        n += cpu->nr_ready;
+        if (cpu->current && cpu->current != cpu->idle && !cpu->idle_since) n++;
+    }
+    return n;
+}
+
+// Boot CPU timer: fold the active count into the averages, and once a
+// second work out how busy each CPU was
+void load_tick(uint32_t now) {
+    if (now % LOAD_FREQ == 0) {
+        uint64_t active = (uint64_t)load_active() << LOAD_FSHIFT;
+        for (int i = 0; i < 3; i++) {
+            uint64_t avg = (uint64_t)load_avg[i] * load_exp[i] + active * (LOAD_FIXED_1 - load_exp[i]);
+            load_avg[i] = (uint32_t)(avg >> LOAD_FSHIFT);
+        }
+    }
+
+    if (now % TIMER_HZ == 0) {
+        uint64_t tsc = rdtsc();
+        if (!load_sample_tsc) {
+            load_sample_tsc = tsc;   // First second starts now
+            return;
+        }
+        uint32_t total = (uint32_t)((tsc - load_sample_tsc) >> 8);
+        load_sample_tsc = tsc;
+        for (int i = 0; i < cpu_count; i++) {
+            Cpu* cpu = &cpus[i];
+            uint64_t idle_now = cpu_idle_cycles(cpu, tsc);
+            uint32_t idle = (uint32_t)((idle_now - cpu->idle_last) >> 8);
+            cpu->idle_last = idle_now;
+            uint32_t idle_pct = total >= 100 ? idle / (total / 100) : 0;
+            cpu->busy_pct = idle_pct >= 100 ? 0 : 100 - idle_pct;
+        }
+    }
+}
+
+void load_get_avg(uint32_t hundredths[3]) {
+    for (int i = 0; i < 3; i++) {
+        hundredths[i] = (uint32_t)(((uint64_t)load_avg[i] * 100 + LOAD_FIXED_1 / 2) >> LOAD_FSHIFT);
+    }
+}
+
+uint32_t load_cpu_busy(int cpu) {
+    if (cpu < 0 || cpu >= cpu_count) return 0;
+    return cpus[cpu].busy_pct;
+}
+
+static void put_hundredths(uint32_t v) {
+    putuint(v / 100);
+    putc('.');
+    if (v % 100 < 10) putc('0');
+    putuint(v % 100);
+}
+
+void load_print() {
+    uint32_t avg[3];
+    load_get_avg(avg);
+    puts("load average: ");
+    for (int i = 0; i < 3; i++) {
+        put_hundredths(avg[i]);
+        puts(i < 2 ? " " : "\n");
+    }
+    for (int i = 0; i < cpu_count; i++) {
+        puts("cpu ");
+        putint(i);
+        puts(": ");
+        putuint(load_cpu_busy(i));
+        puts("% busy\n");
+    }
+}
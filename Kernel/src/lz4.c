@@ -0,0 +1,197 @@
+#include "lz4.h"
+
+// Sequences are a token (literal count << 4 | match length - 4), more
+// length bytes when a nibble is 15, the literals, a 2-byte little-endian
+// offset back into the output and more match length bytes. The last
+// sequence is literals only. Decoders rely on the last 5 bytes being
+// literals and on no match starting in the last 12.
+#define MIN_MATCH     4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT   12
+#define HASH_LOG      10      // 2 KB of table on the stack
+#define NO_POS        0xFFFF
+
+static uint32_t read32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// A 4-bit length field that overflowed into 255-valued bytes
+static uint8_t* put_length(uint8_t* op, uint32_t n) {
+    for (n -= 15; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+static uint8_t* put_literals(uint8_t* op, uint8_t* token, const uint8_t* src, uint32_t n) {
+    *token = n >= 15 ? 15 << 4 : n << 4;
+    if (n >= 15) op = put_length(op, n);
+    while (n--) *op++ = *src++;
+    return op;
+}
+
+// Greedy compression of len bytes (at most LZ4_MAX_INPUT) into dst.
+// Returns the compressed size, or -1 if it doesn't fit in cap.
+int lz4_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap) {
+    if (len > LZ4_MAX_INPUT) return -1;
+    uint16_t table[1 << HASH_LOG];
+    for (uint32_t i = 0; i < (1 << HASH_LOG); i++) table[i] = NO_POS;
+
+    uint8_t* op = dst;
+    uint8_t* end = dst + cap;
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+    while (len > MATCH_LIMIT && ip < len - MATCH_LIMIT) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash4(seq);
+        uint32_t ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        uint32_t match = MIN_MATCH;
+        while (ip + match < len - LAST_LITERALS && src[ref + match] == src[ip + match]) match++;
+
+        uint32_t lit = ip - anchor;
+        uint32_t need = 1 + lit / 255 + 1 + lit + 2 + (match - MIN_MATCH) / 255 + 1;
+        if (need > (uint32_t)(end - op)) return -1;
+        uint8_t* token = op++;
+        op = put_literals(op, token, src + anchor, lit);
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+        if (match - MIN_MATCH >= 15) {
+            *token |= 15;
+            op = put_length(op, match - MIN_MATCH);
+        } else {
+            *token |= match - MIN_MATCH;
+        }
+        ip += match;
+        anchor = ip;
+    }
+
+    uint32_t lit = len - anchor;
+    if (1 + lit / 255 + 1 + lit > (uint32_t)(end - op)) return -1;
+    uint8_t* token = op++;
+    op = put_literals(op, token, src + anchor, lit);
+    return op - dst;
+}
+
+// Reads a length continued in 255-valued bytes; 0 if src runs out
+static int get_length(const uint8_t* src, uint32_t len, uint32_t* ip, uint32_t* n) {
+    uint8_t b;
+    do {
+        if (*ip >= len) return 0;
+        b = src[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 1;
+}
+
+// Decompress a block into at most cap bytes. Returns the size, or -1 for
+// a damaged block; nothing is read or written out of bounds either way.
+int lz4_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap) {
+    uint32_t ip = 0;
+    uint32_t op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        uint32_t lit = token >> 4;
+        if (lit == 15 && !get_length(src, len, &ip, &lit)) return -1;
+        if (lit > len - ip || lit > cap - op) return -1;
+        while (lit--) dst[op++] = src[ip++];
+        if (ip == len) break;
+
+        if (len - ip < 2) return -1;
+        uint32_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        uint32_t match = token & 15;
+        if (match == 15 && !get_length(src, len, &ip, &match)) return -1;
+        match += MIN_MATCH;
+        if (match > cap - op) return -1;
+        // Byte by byte: the match may overlap what it is copying
+        const uint8_t* from = dst + op - offset;
+        while (match--) dst[op++] = *from++;
+    }
+    return op;
+}
+
+static uint32_t pack_pages(uint32_t size) {
+    return (size + LZ4_PACK_PAGE - 1) / LZ4_PACK_PAGE;
+}
+
+static uint32_t page_len(uint32_t size, uint32_t index) {
+    uint32_t left = size - index * LZ4_PACK_PAGE;
+    return left < LZ4_PACK_PAGE ? left : LZ4_PACK_PAGE;
+}
+
+// The most lz4_pack can write for size bytes
+uint32_t lz4_pack_bound(uint32_t size) {
+    return sizeof(Lz4Pack) + (pack_pages(size) + 1) * sizeof(uint32_t) + size;
+}
+
+// Pack size bytes, held LZ4_PACK_PAGE at a time in pages[], into out
+// (lz4_pack_bound bytes). Returns the length of the pack.
+uint32_t lz4_pack(uint8_t* out, const uint8_t* const* pages, uint32_t size) {
+    Lz4Pack* p = (Lz4Pack*)out;
+    uint32_t n = pack_pages(size);
+    p->magic = LZ4_PACK_MAGIC;
+    p->size = size;
+    uint32_t pos = sizeof(Lz4Pack) + (n + 1) * sizeof(uint32_t);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t len = page_len(size, i);
+        p->offsets[i] = pos;
+        int packed = lz4_compress(pages[i], len, out + pos, len - 1);
+        if (packed < 0) {
+            for (uint32_t j = 0; j < len; j++) out[pos + j] = pages[i][j];
+            packed = len;
+        }
+        pos += packed;
+    }
+    p->offsets[n] = pos;
+    return pos;
+}
+
+// 0 if the len bytes at pack hold a pack whose offsets all stay inside
+// them, -1 if not. Blocks are checked as they are unpacked.
+int lz4_pack_check(const void* pack, uint32_t len) {
+    const Lz4Pack* p = (const Lz4Pack*)pack;
+    if (len < sizeof(Lz4Pack) + sizeof(uint32_t) || p->magic != LZ4_PACK_MAGIC) return -1;
+    uint32_t n = pack_pages(p->size);
+    if (n > (len - sizeof(Lz4Pack)) / sizeof(uint32_t) - 1) return -1;
+    if (p->offsets[0] != sizeof(Lz4Pack) + (n + 1) * sizeof(uint32_t) || p->offsets[n] > len) return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        if (p->offsets[i + 1] < p->offsets[i] || p->offsets[i + 1] - p->offsets[i] > page_len(p->size, i)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint32_t lz4_pack_size(const void* pack) {
+    return ((const Lz4Pack*)pack)->size;
+}
+
+uint32_t lz4_pack_len(const void* pack) {
+    const Lz4Pack* p = (const Lz4Pack*)pack;
+    return p->offsets[pack_pages(p->size)];
+}
+
+// Unpack page index into out (LZ4_PACK_PAGE bytes). Returns its length,
+// or -1 if the block is damaged or index is past the end.
+int lz4_pack_page(const void* pack, uint32_t index, uint8_t* out) {
+    const Lz4Pack* p = (const Lz4Pack*)pack;
+    if (index >= pack_pages(p->size)) return -1;
+    const uint8_t* block = (const uint8_t*)pack + p->offsets[index];
+    uint32_t len = p->offsets[index + 1] - p->offsets[index];
+    uint32_t want = page_len(p->size, index);
+    if (len == want) {
+        for (uint32_t i = 0; i < len; i++) out[i] = block[i];
+        return len;
+    }
+    return lz4_decompress(block, len, out, want) == (int)want ? (int)want : -1;
+}
@@ -0,0 +1,203 @@
+
+#include "mmap.h"
+#include "pcache.h"
+#include "paging.h"
+#include "process.h"
+#include "task.h"
+#include "pmm.h"
+#include "smp.h"
+#include "wait.h"
+
+// File mappings. mmap only records the range; pages are mapped on the
+// first touch, straight from the page cache, so every process mapping a
+// file and every read() of it share the same frames. Shared writable
+// pages are written to in place, and the dirty bits the CPU sets are
+// collected into the page cache, from every process mapping the file,
+// before pcache_sync writes it back (mmap_collect), and on munmap and
+// exit. Private writable mappings map the cached page copy-on-write.
+//
+// A process's table is only changed by its own task, or after it died
+// (mmap_release from process_reap). Mappings come and go under
+// sched_lock, which mmap_collect holds to look at other processes.
+
+static Mapping* find(Process* p, uint32_t addr) {
+    for (int i = 0; i < MMAP_MAX; i++) {
+        Mapping* m = &p->maps[i];
+        if (m->start && addr >= m->start && addr - m->start < m->pages * PAGE_SIZE) return m;
+    }
+    return NULL;
+}
+
+// The lowest free range of the mapping area that fits, 0 if none does
+static uint32_t place(Process* p, uint32_t pages) {
+    uint32_t size = pages * PAGE_SIZE;
+    uint32_t at = MMAP_BASE;
+    for (int moved = 1; moved; ) {
+        moved = 0;
+        if (size > MMAP_TOP - at) return 0;
+        for (int i = 0; i < MMAP_MAX; i++) {
+            Mapping* m = &p->maps[i];
+            if (m->start && m->start < at + size && at < m->start + m->pages * PAGE_SIZE) {
+                at = m->start + m->pages * PAGE_SIZE;
+                moved = 1;
+            }
+        }
+    }
+    return at;
+}
+
+// Dirty bits on shared writable pages become dirty pages in the cache.
+// Without clear the bits stay set, and the pages are found dirty again.
+static void harvest(Process* p, Mapping* m, int clear) {
+    if ((m->flags & (MMAP_WRITE | MMAP_SHARED)) != (MMAP_WRITE | MMAP_SHARED)) return;
+    for (uint32_t i = 0; i < m->pages; i++) {
+        uint32_t virt = m->start + i * PAGE_SIZE;
+        if (!paging_pte(p->page_dir, virt)) {
+            // No page table: nothing in this 4 MB was touched
+            i += 1023 - (virt / PAGE_SIZE) % 1024;
+            continue;
+        }
+        if (paging_test_dirty(p->page_dir, virt, clear)) pcache_set_dirty(m->file, m->first + i);
+    }
+}
+
+// Is p's address space loaded on a CPU other than this one?
+static int loaded_elsewhere(Process* p) {
+    Cpu* self = cpu_current();
+    for (int i = 0; i < cpu_count; i++) {
+        Task* t = cpus[i].current;
+        if (&cpus[i] != self && t && t->page_dir == p->page_dir) return 1;
+    }
+    return 0;
+}
+
+// Collect the dirty bits of every process's shared mappings of file
+// (all files for -1). sched_lock keeps address spaces from being loaded
+// or freed meanwhile; where one is running on another CPU, its bits
+// are only read, see paging_test_dirty.
+void mmap_collect(int file) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Process* procs = process_table();
+    for (int i = 0; i < MAX_PROCS; i++) {
+        Process* p = &procs[i];
+        if (p->state == PROC_FREE || !p->page_dir) continue;
+        int clear = !loaded_elsewhere(p);
+        for (int j = 0; j < MMAP_MAX; j++) {
+            Mapping* m = &p->maps[j];
+            if (m->start && (file < 0 || m->file == file)) harvest(p, m, clear);
+        }
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Map len bytes of path, from offset (page aligned), into the current
+// process. Returns the address, or 0.
+uint32_t mmap_map(const char* path, uint32_t len, uint32_t offset, uint32_t flags) {
+    Process* p = task_current()->proc;
+    if (!p || !len || len > MMAP_TOP - MMAP_BASE || offset % PAGE_SIZE) return 0;
+
+    Mapping* m = NULL;
+    for (int i = 0; i < MMAP_MAX && !m; i++) {
+        if (!p->maps[i].start) m = &p->maps[i];
+    }
+    uint32_t pages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t start = m ? place(p, pages) : 0;
+    if (!start) return 0;
+    int file = pcache_open(path);
+    if (file < 0) return 0;
+
+    m->pages = pages;
+    m->first = offset / PAGE_SIZE;
+    m->flags = flags | MMAP_READ;
+    m->file = file;
+    uint32_t irq = spin_lock_irqsave(&sched_lock);
+    m->start = start;
+    spin_unlock_irqrestore(&sched_lock, irq);
+    return start;
+}
+
+// Unmap the mapping that starts at addr. Dirty pages stay in the cache
+// until the next sync, or pcache's flush task.
+int mmap_unmap(uint32_t addr) {
+    Process* p = task_current()->proc;
+    Mapping* m = p ? find(p, addr) : NULL;
+    if (!m || m->start != addr) return -1;
+
+    Mapping gone = *m;
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    harvest(p, m, 1);
+    m->start = 0;
+    spin_unlock_irqrestore(&sched_lock, flags);
+    for (uint32_t i = 0; i < gone.pages; i++) {
+        paging_unmap(p->page_dir, gone.start + i * PAGE_SIZE);
+    }
+    pcache_close(gone.file);
+    return 0;
+}
+
+// Write back what has been written through the mapping around addr,
+// and through every other mapping of the file
+int mmap_sync(uint32_t addr) {
+    Process* p = task_current()->proc;
+    Mapping* m = p ? find(p, addr) : NULL;
+    if (!m) return -1;
+    return pcache_sync(m->file);
+}
+
+// A user access to a page that isn't mapped. Inside a mapping, map the
+// file page from the page cache, read-only, shared, or copy-on-write
+// for a private writable mapping. Reading the page in can wait for the
+// disk, which is only allowed if the access came with interrupts on.
+// Returns 1 if the access can be retried.
+int mmap_fault(uint32_t addr, int write, int can_sleep) {
+    Process* p = task_current()->proc;
+    Mapping* m = p ? find(p, addr) : NULL;
+    if (!m || (write && !(m->flags & MMAP_WRITE)) || !can_sleep) return 0;
+
+    // Exceptions come in with interrupts off
+    __asm__ __volatile__ ("sti");
+    uint32_t page = addr & ~(PAGE_SIZE - 1);
+    void* frame = pcache_get(m->file, m->first + (page - m->start) / PAGE_SIZE);
+    if (!frame) return 0;
+
+    uint32_t flags = PTE_USER;
+    if (m->flags & MMAP_SHARED) {
+        flags |= PTE_SHARED | (m->flags & MMAP_WRITE ? PTE_WRITE : 0);
+    } else if (m->flags & MMAP_WRITE) {
+        flags |= PTE_COW;   // The write faults again and gets its own copy
+    }
+    // The cache's reference on the frame becomes the mapping's
+    if (paging_map(p->page_dir, page, (uint32_t)frame, flags) < 0) {
+        pcache_put(frame);
+        return 0;
+    }
+    return 1;
+}
+
+// Would touching addr fault a page in? For checking syscall pointers.
+int mmap_covers(Process* p, uint32_t addr, int write) {
+    Mapping* m = p ? find(p, addr) : NULL;
+    return m && (!write || (m->flags & MMAP_WRITE));
+}
+
+// The child of a fork maps the same files. The page tables, shared
+// pages included, were cloned by paging_clone_dir.
+void mmap_fork(Process* child, Process* parent) {
+    for (int i = 0; i < MMAP_MAX; i++) {
+        child->maps[i] = parent->maps[i];
+        if (child->maps[i].start) pcache_hold(child->maps[i].file);
+    }
+}
+
+// Before the address space goes: keep what was written, drop the files.
+// The frames go with the page directory. sched_lock held; nothing runs
+// on the directory any more.
+void mmap_release(Process* p) {
+    for (int i = 0; i < MMAP_MAX; i++) {
+        Mapping* m = &p->maps[i];
+        if (!m->start) continue;
+        harvest(p, m, 0);
+        pcache_close(m->file);
+        m->start = 0;
+    }
+}
@@ -2,41 +2,32 @@
 #include "io.h"
 #include "screen.h"
 #include "interrupts.h"
+#include "async.h"
+#include "serial.h"
 
 #define MOUSE_DATA 0x60
 #define MOUSE_STATUS 0x64
 #define MOUSE_CMD 0x64
 
+#define MOUSE_TIMEOUT_TICKS 10   // 100 ms per controller/mouse response
+
 static int mouse_cycle = 0;
 static int8_t mouse_bytes[3];
 static int mouse_px_x, mouse_px_y;
 int mouse_x = 40, mouse_y = 12; // Start near center of 80x25
 uint8_t mouse_buttons = 0;
 
-static void mouse_wait(uint8_t type) {
-    uint32_t timeout = 100000;
-    if (type == 0) {
-        while (timeout--) {
-            if (inb(MOUSE_STATUS) & 1) return;
-        }
-    } else {
-        while (timeout--) {
-            if (!(inb(MOUSE_STATUS) & 2)) return;
-        }
-    }
-}
+// Handshake state. While probing, IRQ12 bytes are command replies,
+// not movement packets.
+static AsyncTask mouse_init_task;
+static int mouse_init_started = 0;
+static volatile int mouse_probing = 0;
+static volatile int mouse_reply_ready = 0;
+static volatile uint8_t mouse_reply;
+static uint8_t mouse_config;
 
-static void mouse_write(uint8_t value) {
-    mouse_wait(1);
-    outb(MOUSE_CMD, 0xD4);
-    mouse_wait(1);
-    outb(MOUSE_DATA, value);
-}
-
-static uint8_t mouse_read() {
-    mouse_wait(0);
-    return inb(MOUSE_DATA);
-}
+#define MOUSE_INPUT_EMPTY()  (!(inb(MOUSE_STATUS) & 2))
+#define MOUSE_OUTPUT_FULL()  (inb(MOUSE_STATUS) & 1)
 
 void mouse_handler() {
     uint8_t status = inb(MOUSE_STATUS);
@@ -44,6 +35,12 @@ void mouse_handler() {
 
     int8_t data = inb(MOUSE_DATA);
 
+    if (mouse_probing) {
+        mouse_reply = data;
+        mouse_reply_ready = 1;
+        return;
+    }
+
     switch (mouse_cycle) {
         case 0:
             mouse_bytes[0] = data;
@@ -79,32 +76,73 @@ void mouse_handler() {
     }
 }
 
-void init_mouse() {
-    uint8_t status;
+// Wait on the controller, abandoning the handshake if it never answers:
+// every wait restarts t->timed_out, so each one has to be checked
+#define MOUSE_WAIT(t, cond)                                         \
+    do {                                                            \
+        ASYNC_WAIT_UNTIL(t, cond, MOUSE_TIMEOUT_TICKS);             \
+        if ((t)->timed_out) goto timed_out;                         \
+    } while (0)
+
+// Wait for the controller's input buffer, then send a byte to the mouse
+// and wait for its ACK on IRQ12. Three suspension points, so it needs the
+// caller's fresh case numbers.
+#define MOUSE_SEND(t, value)                                        \
+    do {                                                            \
+        MOUSE_WAIT(t, MOUSE_INPUT_EMPTY());                         \
+        outb(MOUSE_CMD, 0xD4);                                      \
+        MOUSE_WAIT(t, MOUSE_INPUT_EMPTY());                         \
+        mouse_reply_ready = 0;                                      \
+        outb(MOUSE_DATA, (value));                                  \
+        ASYNC_WAIT_IRQ(t, 12, mouse_reply_ready, MOUSE_TIMEOUT_TICKS); \
+        if ((t)->timed_out) goto timed_out;                         \
+    } while (0)
+
+// The PS/2 handshake as a coroutine: each controller or mouse response
+// suspends it instead of spinning, so boot carries on meanwhile
+static int mouse_init_step(AsyncTask* t) {
+    ASYNC_BEGIN(t);
+
+    mouse_probing = 1;
+    register_interrupt_handler(44, mouse_handler);
 
     // Enable the auxiliary mouse device
-    mouse_wait(1);
+    MOUSE_WAIT(t, MOUSE_INPUT_EMPTY());
     outb(MOUSE_CMD, 0xA8);
 
     // Enable interrupts
-    mouse_wait(1);
+    MOUSE_WAIT(t, MOUSE_INPUT_EMPTY());
     outb(MOUSE_CMD, 0x20);
-    mouse_wait(0);
-    status = (inb(MOUSE_DATA) | 2);
-    mouse_wait(1);
+    MOUSE_WAIT(t, MOUSE_OUTPUT_FULL());
+    mouse_config = inb(MOUSE_DATA) | 2;
+    MOUSE_WAIT(t, MOUSE_INPUT_EMPTY());
     outb(MOUSE_CMD, 0x60);
-    mouse_wait(1);
-    outb(MOUSE_DATA, status);
+    MOUSE_WAIT(t, MOUSE_INPUT_EMPTY());
+    outb(MOUSE_DATA, mouse_config);
 
     // Tell mouse to use default settings
-    mouse_write(0xF6); mouse_read();
+    MOUSE_SEND(t, 0xF6);
 
     // Enable mouse
-    mouse_write(0xF4); mouse_read();
+    MOUSE_SEND(t, 0xF4);
+    mouse_probing = 0;
+    serial_puts("[mouse] initialized\n");
+    ASYNC_END(t);
+
+timed_out:
+    // Nothing was configured past the step that stalled; leave the
+    // mouse off rather than feed the handler half-set-up state
+    t->resume = 0;
+    mouse_probing = 0;
+    serial_puts("[mouse] controller did not respond, giving up\n");
+    return ASYNC_DONE;
+}
 
-    // Register handler
-    register_interrupt_handler(44, mouse_handler);
-    puts("Mouse initialized.\n");
+// Starts the handshake and returns; the async executor finishes it
+void init_mouse() {
+    if (mouse_init_started) return;   // kernel_setup can run more than once
+    mouse_init_started = 1;
+    async_spawn(&mouse_init_task, "mouse-init", mouse_init_step, 0);
 }
 
 void get_mouse_position(int* x, int* y) {
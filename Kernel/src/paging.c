@@ -0,0 +1,313 @@
+
+#include "paging.h"
+#include "pmm.h"
+#include "heap.h"
+#include "task.h"
+#include "mmap.h"
+#include "timepage.h"
+
+#define PDE_INDEX(v)  ((v) >> 22)
+#define PTE_INDEX(v)  (((v) >> 12) & 0x3FF)
+
+#define CR0_WP  (1u << 16)
+#define CR0_PG  (1u << 31)
+#define CR4_PSE (1u << 4)
+
+// The kernel's half of every address space. User page directories copy
+// these entries, so the kernel is mapped the same way everywhere.
+uint32_t kernel_page_dir[1024] __attribute__((aligned(PAGE_SIZE)));
+
+static inline uint32_t read_cr3() {
+    uint32_t cr3;
+    __asm__ __volatile__ ("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void invlpg(uint32_t virt) {
+    __asm__ __volatile__ ("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+static int user_pde(int i) {
+    return i >= (int)PDE_INDEX(USER_BASE) && i < (int)PDE_INDEX(USER_TOP);
+}
+
+// Turn paging on for this CPU with the kernel directory. WP makes the
+// kernel honour read-only user pages too.
+void paging_init_cpu() {
+    uint32_t cr0, cr4;
+    __asm__ __volatile__ ("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ __volatile__ ("mov %0, %%cr4" :: "r"(cr4 | CR4_PSE));
+    __asm__ __volatile__ ("mov %0, %%cr3" :: "r"(kernel_page_dir) : "memory");
+    __asm__ __volatile__ ("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__ ("mov %0, %%cr0" :: "r"(cr0 | CR0_PG | CR0_WP) : "memory");
+}
+
+void paging_init() {
+    static int initialized = 0;
+    if (initialized) return;   // kernel_setup can run more than once
+
+    for (int i = 0; i < 1024; i++) {
+        uint32_t flags = PTE_PRESENT | PTE_WRITE | PTE_LARGE;
+        if (user_pde(i)) {
+            kernel_page_dir[i] = 0;
+            continue;
+        }
+        if (i >= (int)PDE_INDEX(USER_TOP)) flags |= PTE_PCD | PTE_PWT;
+        kernel_page_dir[i] = ((uint32_t)i << 22) | flags;
+    }
+    paging_init_cpu();
+    initialized = 1;
+}
+
+void paging_switch(uint32_t* dir) {
+    if (!dir) dir = kernel_page_dir;
+    if (read_cr3() != (uint32_t)dir) {
+        __asm__ __volatile__ ("mov %0, %%cr3" :: "r"(dir) : "memory");
+    }
+}
+
+// The kernel mappings and an empty user half. Page frames are identity
+// mapped, so tables are edited through their physical address.
+static uint32_t* empty_dir() {
+    uint32_t* dir = (uint32_t*)pmm_alloc_page();
+    if (!dir) return NULL;
+    for (int i = 0; i < 1024; i++) {
+        dir[i] = user_pde(i) ? 0 : kernel_page_dir[i];
+    }
+    return dir;
+}
+
+// A fresh address space: the kernel mappings, and in the user half only
+// the time page, read-only. It lies in the kernel image, outside the
+// frames pmm counts references for, so sharing it costs nothing.
+uint32_t* paging_new_dir() {
+    uint32_t* dir = empty_dir();
+    if (dir && paging_map(dir, USER_TIMEPAGE, (uint32_t)&time_page, PTE_USER) < 0) {
+        paging_free_dir(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+// Drops every user page (frees those no one else maps), the page
+// tables and the directory itself
+void paging_free_dir(uint32_t* dir) {
+    if (!dir || dir == kernel_page_dir) return;
+    for (int i = PDE_INDEX(USER_BASE); i < (int)PDE_INDEX(USER_TOP); i++) {
+        if (!(dir[i] & PTE_PRESENT)) continue;
+        uint32_t* table = (uint32_t*)PTE_ADDR(dir[i]);
+        for (int j = 0; j < 1024; j++) {
+            if (table[j] & PTE_PRESENT) pmm_page_unref((void*)PTE_ADDR(table[j]));
+        }
+        pmm_free_page(table);
+    }
+    pmm_free_page(dir);
+}
+
+// fork(): a new directory sharing every user frame with src. Writable
+// pages turn read-only + PTE_COW in both, except shared file pages;
+// read-only ones (text) are simply shared. Page tables are copied,
+// never shared.
+uint32_t* paging_clone_dir(uint32_t* src) {
+    uint32_t* dir = empty_dir();   // src's tables bring the time page along
+    if (!dir) return NULL;
+
+    for (int i = PDE_INDEX(USER_BASE); i < (int)PDE_INDEX(USER_TOP); i++) {
+        if (!(src[i] & PTE_PRESENT)) continue;
+        uint32_t* table = (uint32_t*)pmm_alloc_page();
+        if (!table) {
+            paging_free_dir(dir);
+            return NULL;
+        }
+        uint32_t* src_table = (uint32_t*)PTE_ADDR(src[i]);
+        for (int j = 0; j < 1024; j++) {
+            uint32_t pte = src_table[j];
+            if (pte & PTE_PRESENT) {
+                if ((pte & PTE_WRITE) && !(pte & PTE_SHARED)) {
+                    pte = (pte & ~PTE_WRITE) | PTE_COW;
+                    src_table[j] = pte;
+                }
+                pmm_page_ref((void*)PTE_ADDR(pte));
+            }
+            table[j] = pte;
+        }
+        dir[i] = (uint32_t)table | (src[i] & 0xFFF);
+    }
+
+    // The parent lost write access to pages it may have cached
+    if (read_cr3() == (uint32_t)src) {
+        __asm__ __volatile__ ("mov %0, %%cr3" :: "r"(src) : "memory");
+    }
+    return dir;
+}
+
+// Page fault in user space. A missing page may belong to a mapped file
+// (mmap_fault). A write to a copy-on-write page gives the current task
+// its own copy (or just the page, if no one else maps it any more).
+// Returns 1 if the access can be retried. Also reached from ring 0,
+// when a syscall touches user memory.
+int paging_handle_fault(uint32_t err, int can_sleep) {
+    uint32_t addr;
+    __asm__ __volatile__ ("mov %%cr2, %0" : "=r"(addr));
+
+    Task* t = task_current();
+    if (!t || !t->page_dir || addr < USER_BASE || addr >= USER_TOP) return 0;
+    if (!(err & 0x1)) return mmap_fault(addr, err & 0x2, can_sleep);
+    if (!(err & 0x2)) return 0;   // Present + write from here on
+
+    uint32_t page = addr & ~(PAGE_SIZE - 1);
+    uint32_t* pte = paging_pte(t->page_dir, page);
+    if (!pte || !(*pte & PTE_COW)) return 0;
+
+    void* frame = (void*)PTE_ADDR(*pte);
+    uint32_t flags = (*pte & 0xFFF & ~PTE_COW) | PTE_WRITE;
+    if (pmm_page_refcount(frame) == 1) {
+        *pte = (uint32_t)frame | flags;
+    } else {
+        void* copy = pmm_alloc_page();
+        if (!copy) return 0;
+        memcpy(copy, frame, PAGE_SIZE);
+        *pte = (uint32_t)copy | flags;
+        pmm_page_unref(frame);
+    }
+    invlpg(page);
+    return 1;
+}
+
+// The entry mapping virt, or NULL if it has no page table yet
+uint32_t* paging_pte(uint32_t* dir, uint32_t virt) {
+    uint32_t pde = dir[PDE_INDEX(virt)];
+    if (!(pde & PTE_PRESENT) || (pde & PTE_LARGE)) return NULL;
+    return &((uint32_t*)PTE_ADDR(pde))[PTE_INDEX(virt)];
+}
+
+int paging_map(uint32_t* dir, uint32_t virt, uint32_t phys, uint32_t flags) {
+    if (virt < USER_BASE || virt >= USER_TOP) return -1;
+
+    uint32_t* pde = &dir[PDE_INDEX(virt)];
+    if (!(*pde & PTE_PRESENT)) {
+        uint32_t* table = (uint32_t*)pmm_alloc_page();
+        if (!table) return -1;
+        memset(table, 0, PAGE_SIZE);
+        // Permissions are decided per page; the directory allows everything
+        *pde = (uint32_t)table | PTE_PRESENT | PTE_WRITE | PTE_USER;
+    }
+
+    uint32_t* table = (uint32_t*)PTE_ADDR(*pde);
+    table[PTE_INDEX(virt)] = PTE_ADDR(phys) | (flags & 0xFFF) | PTE_PRESENT;
+    if (read_cr3() == (uint32_t)dir) invlpg(virt);
+    return 0;
+}
+
+// Drop the page at virt, if any, and the reference it held
+void paging_unmap(uint32_t* dir, uint32_t virt) {
+    uint32_t* pte = paging_pte(dir, virt);
+    if (!pte || !(*pte & PTE_PRESENT)) return;
+    void* frame = (void*)PTE_ADDR(*pte);
+    *pte = 0;
+    if (read_cr3() == (uint32_t)dir) invlpg(virt);
+    pmm_page_unref(frame);
+}
+
+// Was the page at virt written since the bit was last cleared? clear
+// resets it, which is only safe while no other CPU has dir loaded: its
+// TLB could hold the bit set, and it would never be set again.
+int paging_test_dirty(uint32_t* dir, uint32_t virt, int clear) {
+    uint32_t* pte = paging_pte(dir, virt);
+    if (!pte || (*pte & (PTE_PRESENT | PTE_DIRTY)) != (PTE_PRESENT | PTE_DIRTY)) return 0;
+    if (clear) {
+        *pte &= ~PTE_DIRTY;
+        if (read_cr3() == (uint32_t)dir) invlpg(virt);
+    }
+    return 1;
+}
+
+// Copy into another address space through the physical frames, so the
+// destination doesn't need to be writable or even the current one
+int paging_copy_to(uint32_t* dir, uint32_t virt, const void* src, uint32_t len) {
+    const uint8_t* from = (const uint8_t*)src;
+    while (len) {
+        uint32_t* pte = paging_pte(dir, virt);
+        if (!pte || !(*pte & PTE_PRESENT)) return -1;
+        uint32_t offset = virt & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - offset;
+        if (chunk > len) chunk = len;
+        memcpy((uint8_t*)PTE_ADDR(*pte) + offset, from, chunk);
+        virt += chunk;
+        from += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int user_ptr_ok(const void* ptr, uint32_t len, int write) {
+    Task* t = task_current();
+    if (!t || !t->page_dir) return 1;
+
+    uint32_t start = (uint32_t)ptr;
+    if (start < USER_BASE || start >= USER_TOP || len > USER_TOP - start) return 0;
+    if (len == 0) return 1;
+
+    uint32_t need = PTE_PRESENT | PTE_USER;
+    for (uint32_t page = start & ~(PAGE_SIZE - 1); page < start + len; page += PAGE_SIZE) {
+        uint32_t* pte = paging_pte(t->page_dir, page);
+        // Not there yet, but touching it maps a file page
+        if ((!pte || !(*pte & PTE_PRESENT)) && mmap_covers(t->proc, page, write)) continue;
+        if (!pte || (*pte & need) != need) return 0;
+        // Copy-on-write pages count as writable: the write faults and
+        // paging_handle_fault makes the copy
+        if (write && !(*pte & (PTE_WRITE | PTE_COW))) return 0;
+    }
+    return 1;
+}
+
+// Like user_ptr_ok, but only for pages that are there right now, and
+// already writable for a write: touching them can't fault. For callers
+// that can't take a fault, such as the timer.
+int user_ptr_mapped(const void* ptr, uint32_t len, int write) {
+    Task* t = task_current();
+    if (!t || !t->page_dir) return 1;
+
+    uint32_t start = (uint32_t)ptr;
+    if (start < USER_BASE || start >= USER_TOP || len > USER_TOP - start) return 0;
+
+    uint32_t need = PTE_PRESENT | PTE_USER | (write ? PTE_WRITE : 0);
+    for (uint32_t page = start & ~(PAGE_SIZE - 1); page < start + len; page += PAGE_SIZE) {
+        uint32_t* pte = paging_pte(t->page_dir, page);
+        if (!pte || (*pte & need) != need) return 0;
+    }
+    return 1;
+}
+
+// A NUL-terminated string of at most max bytes, all of it readable
+int user_str_ok(const char* str, uint32_t max) {
+    Task* t = task_current();
+    if (!t || !t->page_dir) return 1;
+
+    for (uint32_t i = 0; i < max; i++) {
+        // Check each page once, when the string first enters it
+        if (i == 0 || (((uint32_t)str + i) & (PAGE_SIZE - 1)) == 0) {
+            if (!user_ptr_ok(str + i, 1, 0)) return 0;
+        }
+        if (str[i] == '\0') return 1;
+    }
+    return 0;
+}
+
+// Touch every page of a range user_ptr_ok passed, so copy-on-write
+// copies and mapped file pages are in place before the caller takes a
+// lock and copies
+void user_prefault(const void* ptr, uint32_t len, int write) {
+    Task* t = task_current();
+    if (!t || !t->page_dir || len == 0) return;
+
+    uint32_t start = (uint32_t)ptr;
+    for (uint32_t page = start & ~(PAGE_SIZE - 1); page < start + len; page += PAGE_SIZE) {
+        volatile uint8_t* b = (volatile uint8_t*)(page < start ? start : page);
+        if (write) {
+            *b = *b;
+        } else {
+            (void)*b;
+        }
+    }
+}
@@ -0,0 +1,516 @@
+
+#include "pcache.h"
+#include "fs.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "string.h"
+#include "heap.h"
+#include "mmap.h"
+#include "task.h"
+#include "time.h"
+#include "timer.h"
+
+#define PCACHE_FLUSH_TICKS TIMER_HZ   // Writeback period for mapped writes, 1 s
+
+// One cache of file contents, keyed by path and page number. vfs_read
+// copies out of it and mmap maps its frames straight into processes, so
+// a page read in once is shared by every reader and mapper of the file.
+//
+// Each cached frame carries one reference for the cache; mappings, and
+// readers in the middle of a copy, add their own. A clean page with only
+// the cache's reference can be evicted. Pages get dirty through shared
+// writable mappings (mmap.c) and go back to the filesystem in
+// pcache_sync: on msync, from the flush task every PCACHE_FLUSH_TICKS,
+// and from eviction when nothing clean is left.
+//
+// Pages are read in without pc_lock: the slot is marked loading, and
+// anyone else after the same page sleeps on load_wq until it is ready.
+
+#define PAGE_FREE    0
+#define PAGE_LOADING 1
+#define PAGE_READY   2
+
+typedef struct {
+    char path[FS_PATH_MAX];    // Absolute and normalized; "" when unused
+    uint32_t hash;
+    uint32_t refs;             // pcache_open callers: mappings, reads
+    uint32_t pages;            // Slots holding its pages
+    uint32_t dirty;            // ... of which are dirty
+} CachedFile;
+
+typedef struct {
+    uint8_t* frame;
+    uint32_t index;            // Page number in the file
+    uint32_t used;             // use_clock at the last hit, for LRU
+    uint16_t file;
+    uint16_t next;             // Hash chain: slot + 1, 0 at the end
+    volatile uint8_t state;
+    uint8_t dirty;
+    volatile uint8_t stale;    // Changed while loading: read it again
+} CachedPage;
+
+static CachedFile files[PCACHE_FILES];
+static CachedPage pages[PCACHE_PAGES];
+static uint16_t buckets[PCACHE_BUCKETS];   // Slot + 1, 0 when empty
+static uint32_t use_clock = 0;
+static volatile uint32_t file_count = 0;   // Read without the lock as a fast path
+static PcacheStats stats;
+static spinlock_t pc_lock = SPINLOCK_INIT;
+static WaitQueue load_wq = WAIT_QUEUE_INIT;
+
+// ---- pc_lock held for all of these ----
+
+static uint32_t bucket_of(int id, uint32_t index) {
+    return (files[id].hash ^ (index * 2654435761u)) & (PCACHE_BUCKETS - 1);
+}
+
+static int file_find(const char* path, uint32_t hash) {
+    for (int i = 0; i < PCACHE_FILES; i++) {
+        if (files[i].path[0] && files[i].hash == hash && strcmp(files[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+static void file_release(int id) {
+    if (files[id].refs == 0 && files[id].pages == 0 && files[id].path[0]) {
+        files[id].path[0] = '\0';
+        file_count--;
+    }
+}
+
+static int page_find(int id, uint32_t index) {
+    for (uint16_t s = buckets[bucket_of(id, index)]; s; s = pages[s - 1].next) {
+        if (pages[s - 1].file == id && pages[s - 1].index == index) return s - 1;
+    }
+    return -1;
+}
+
+static void page_link(int s) {
+    uint32_t b = bucket_of(pages[s].file, pages[s].index);
+    pages[s].next = buckets[b];
+    buckets[b] = s + 1;
+    files[pages[s].file].pages++;
+}
+
+static void page_clean(CachedPage* p) {
+    if (!p->dirty) return;
+    p->dirty = 0;
+    files[p->file].dirty--;
+}
+
+// Out of the hash and off its file; the slot keeps its frame
+static void page_unlink(int s) {
+    CachedPage* p = &pages[s];
+    uint16_t* link = &buckets[bucket_of(p->file, p->index)];
+    while (*link != s + 1) link = &pages[*link - 1].next;
+    *link = p->next;
+    p->next = 0;
+    page_clean(p);
+    files[p->file].pages--;
+    file_release(p->file);
+}
+
+// Forget a page. Whoever still maps the frame keeps it.
+static void page_drop(int s) {
+    page_unlink(s);
+    pmm_page_unref(pages[s].frame);
+    pages[s].frame = NULL;
+    pages[s].state = PAGE_FREE;
+    stats.pages--;
+}
+
+static int evictable(const CachedPage* p) {
+    return p->state == PAGE_READY && !p->dirty && pmm_page_refcount(p->frame) == 1;
+}
+
+// The least recently used page no one maps or is copying from
+static int victim() {
+    int best = -1;
+    for (int s = 0; s < PCACHE_PAGES; s++) {
+        if (evictable(&pages[s]) && (best < 0 || (int32_t)(pages[s].used - pages[best].used) < 0)) best = s;
+    }
+    return best;
+}
+
+// A slot with a frame for a new page: a fresh one while under the
+// limit and memory lasts, else the LRU victim's. -1 if every page is
+// mapped, dirty or loading.
+static int claim() {
+    if (stats.pages < PCACHE_PAGES) {
+        for (int s = 0; s < PCACHE_PAGES; s++) {
+            if (pages[s].state != PAGE_FREE) continue;
+            pages[s].frame = (uint8_t*)pmm_alloc_page();
+            if (!pages[s].frame) break;
+            stats.pages++;
+            return s;
+        }
+    }
+    int s = victim();
+    if (s >= 0) {
+        page_unlink(s);
+        stats.evictions++;
+    }
+    return s;
+}
+
+// A slot for path. When the table is full, the clean, unmapped pages of
+// files no one has open go, which frees their slots.
+static int file_get(const char* path, uint32_t hash) {
+    int id = file_find(path, hash);
+    for (int pass = 0; id < 0 && pass < 2; pass++) {
+        for (int i = 0; i < PCACHE_FILES; i++) {
+            if (!files[i].path[0]) {
+                memcpy(files[i].path, path, strlen(path) + 1);
+                files[i].hash = hash;
+                files[i].refs = 0;
+                files[i].pages = 0;
+                files[i].dirty = 0;
+                file_count++;
+                return i;
+            }
+        }
+        for (int s = 0; s < PCACHE_PAGES; s++) {
+            if (evictable(&pages[s]) && files[pages[s].file].refs == 0) {
+                page_drop(s);
+                stats.evictions++;
+            }
+        }
+    }
+    return id;
+}
+
+// Drop every page of id (all files for -1). One still being read in is
+// marked stale instead, so its loader reads it again.
+static void forget(int id) {
+    for (int s = 0; s < PCACHE_PAGES; s++) {
+        CachedPage* p = &pages[s];
+        if (p->state == PAGE_FREE || (id >= 0 && p->file != id)) continue;
+        if (p->state == PAGE_LOADING) {
+            p->stale = 1;
+        } else {
+            page_drop(s);
+        }
+    }
+}
+
+// Read p's page of path into its frame while p is loading, again if
+// it changed meanwhile (stale). pc_lock is not held on entry; it is on
+// return, with *flags to restore. Returns what fs_read_at did.
+static int page_read(CachedPage* p, const char* path, uint32_t* flags) {
+    for (;;) {
+        p->stale = 0;
+        int n = fs_read_at(path, p->index * PAGE_SIZE, p->frame, PAGE_SIZE);
+        *flags = spin_lock_irqsave(&pc_lock);
+        if (!p->stale) return n;
+        spin_unlock_irqrestore(&pc_lock, *flags);
+    }
+}
+
+// ---- The interface ----
+
+int pcache_open(const char* path) {
+    char norm[FS_PATH_MAX];
+    if (fs_normalize("/", path, norm, FS_PATH_MAX) < 0) return -1;
+    uint32_t hash = fs_hash(norm);
+
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    int id = file_get(norm, hash);
+    if (id >= 0) files[id].refs++;
+    spin_unlock_irqrestore(&pc_lock, flags);
+    return id;
+}
+
+void pcache_hold(int id) {
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    files[id].refs++;
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+void pcache_close(int id) {
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    files[id].refs--;
+    file_release(id);
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+void* pcache_get(int id, uint32_t index) {
+    int synced = 0;
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&pc_lock);
+        int s = page_find(id, index);
+        if (s >= 0 && pages[s].state == PAGE_LOADING) {
+            spin_unlock_irqrestore(&pc_lock, flags);
+            CachedPage* p = &pages[s];
+            wait_event(load_wq, p->state != PAGE_LOADING);
+            continue;
+        }
+        if (s >= 0) {
+            CachedPage* p = &pages[s];
+            p->used = ++use_clock;
+            pmm_page_ref(p->frame);
+            stats.hits++;
+            spin_unlock_irqrestore(&pc_lock, flags);
+            return p->frame;
+        }
+
+        s = claim();
+        if (s < 0) {
+            // Only dirty pages left to evict: write them back, try again
+            spin_unlock_irqrestore(&pc_lock, flags);
+            if (synced++) return NULL;
+            pcache_sync(-1);
+            continue;
+        }
+        CachedPage* p = &pages[s];
+        p->file = id;
+        p->index = index;
+        p->state = PAGE_LOADING;
+        p->used = ++use_clock;
+        page_link(s);
+        stats.misses++;
+        char path[FS_PATH_MAX];
+        memcpy(path, files[id].path, FS_PATH_MAX);
+        spin_unlock_irqrestore(&pc_lock, flags);
+
+        int n = page_read(p, path, &flags);
+
+        void* frame = NULL;
+        if (n < 0) {
+            page_drop(s);
+        } else {
+            memset(p->frame + n, 0, PAGE_SIZE - n);   // Past the end of the file
+            p->state = PAGE_READY;
+            pmm_page_ref(p->frame);
+            frame = p->frame;
+        }
+        spin_unlock_irqrestore(&pc_lock, flags);
+        wake_up(&load_wq);
+        return frame;
+    }
+}
+
+void pcache_put(void* frame) {
+    pmm_page_unref(frame);
+}
+
+void pcache_set_dirty(int id, uint32_t index) {
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    int s = page_find(id, index);
+    if (s >= 0 && pages[s].state == PAGE_READY && !pages[s].dirty) {
+        pages[s].dirty = 1;
+        files[id].dirty++;
+    }
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+// Up to len bytes from offset: how many, 0 at the end, -1 for no such
+// file. What can't be cached is read straight from the filesystem. buf
+// is only written with no lock held.
+int pcache_read(const char* path, uint32_t offset, void* buf, uint32_t len) {
+    FsStat st;
+    if (fs_stat(path, &st) < 0 || st.type != FS_FILE) return -1;
+    if (offset >= st.size) return 0;
+    if (len > st.size - offset) len = st.size - offset;
+
+    int id = pcache_open(path);
+    uint32_t done = 0;
+    while (id >= 0 && done < len) {
+        uint32_t pos = offset + done;
+        uint8_t* frame = (uint8_t*)pcache_get(id, pos / PAGE_SIZE);
+        if (!frame) break;
+        uint32_t within = pos % PAGE_SIZE;
+        uint32_t chunk = PAGE_SIZE - within;
+        if (chunk > len - done) chunk = len - done;
+        memcpy((uint8_t*)buf + done, frame + within, chunk);
+        pcache_put(frame);
+        done += chunk;
+    }
+    if (id >= 0) pcache_close(id);
+    if (done < len) {
+        int n = fs_read_at(path, offset + done, (uint8_t*)buf + done, len - done);
+        if (n < 0) return done ? (int)done : -1;
+        done += n;
+    }
+    return (int)done;
+}
+
+// Write dirty pages back, up to the file's size as it is now (a mapping
+// can reach past the end), collecting what mappings wrote first. A page
+// is clean while it is written, so a write meanwhile dirties it again;
+// if the write fails, it is dirty again. -1 if any of the writes failed.
+int pcache_sync(int id) {
+    int err = 0;
+    mmap_collect(id);
+    for (int s = 0; s < PCACHE_PAGES; s++) {
+        uint32_t flags = spin_lock_irqsave(&pc_lock);
+        CachedPage* p = &pages[s];
+        if (p->state != PAGE_READY || !p->dirty || (id >= 0 && p->file != id)) {
+            spin_unlock_irqrestore(&pc_lock, flags);
+            continue;
+        }
+        page_clean(p);
+        pmm_page_ref(p->frame);
+        uint8_t* frame = p->frame;
+        uint32_t pos = p->index * PAGE_SIZE;
+        char path[FS_PATH_MAX];
+        memcpy(path, files[p->file].path, FS_PATH_MAX);
+        stats.writebacks++;
+        spin_unlock_irqrestore(&pc_lock, flags);
+
+        // Lands in pcache_update, which sees the bytes are already here
+        FsStat st;
+        int failed = 0;
+        if (fs_stat(path, &st) < 0) {
+            err = -1;   // Gone: nowhere to write it
+        } else if (pos < st.size) {
+            uint32_t n = st.size - pos < PAGE_SIZE ? st.size - pos : PAGE_SIZE;
+            failed = fs_write_at(path, pos, frame, n) < 0;
+        }
+        if (failed) {
+            err = -1;
+            flags = spin_lock_irqsave(&pc_lock);
+            if (p->state == PAGE_READY && p->frame == frame && !p->dirty) {
+                p->dirty = 1;
+                files[p->file].dirty++;
+            }
+            spin_unlock_irqrestore(&pc_lock, flags);
+        }
+        pcache_put(frame);
+    }
+    return err;
+}
+
+// The flush task: write back what mappings changed every period, so it
+// reaches the filesystem (and bflush the disk) without an msync
+static void pcache_flusher() {
+    sleep_t(PCACHE_FLUSH_TICKS);
+    if (file_count) pcache_sync(-1);
+}
+
+void pcache_init() {
+    static int started = 0;
+    if (started) return;   // kernel_setup can run more than once
+    started = 1;
+    register_task("pflush", pcache_flusher);
+}
+
+// path was written at offset: copy the new bytes into any cached pages,
+// so readers and mappings see them. Called by fs_write_at.
+void pcache_update(const char* path, uint32_t offset, const void* data, uint32_t len) {
+    if (!file_count || !len) return;
+    char norm[FS_PATH_MAX];
+    if (fs_normalize("/", path, norm, FS_PATH_MAX) < 0) return;
+    uint32_t hash = fs_hash(norm);
+
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    int id = file_find(norm, hash);
+    uint32_t end = offset + len;
+    for (uint32_t index = offset / PAGE_SIZE; id >= 0 && index <= (end - 1) / PAGE_SIZE; index++) {
+        int s = page_find(id, index);
+        if (s < 0) continue;
+        if (pages[s].state == PAGE_LOADING) {
+            pages[s].stale = 1;
+            continue;
+        }
+        uint32_t start = index * PAGE_SIZE;
+        uint32_t from = offset > start ? offset : start;
+        uint32_t to = end < start + PAGE_SIZE ? end : start + PAGE_SIZE;
+        uint8_t* dst = pages[s].frame + (from - start);
+        const uint8_t* src = (const uint8_t*)data + (from - offset);
+        if (dst != src) memcpy(dst, src, to - from);
+    }
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+// path is about to change in a way that keeps some of its contents
+// (append, truncate): write back what mappings changed first, so
+// pcache_invalidate has nothing to lose
+void pcache_flush(const char* path) {
+    if (!file_count) return;
+    char norm[FS_PATH_MAX];
+    if (fs_normalize("/", path, norm, FS_PATH_MAX) < 0) return;
+    uint32_t hash = fs_hash(norm);
+
+    // Dirty bits may still be in page tables only: sync whenever it's here
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    int id = file_find(norm, hash);
+    if (id >= 0) files[id].refs++;
+    spin_unlock_irqrestore(&pc_lock, flags);
+    if (id >= 0) {
+        pcache_sync(id);
+        pcache_close(id);
+    }
+}
+
+// path was replaced, cut, grown or removed. Pages no one maps are
+// dropped. A mapped page keeps its slot and is read again in place, so
+// the mapping and later faults keep sharing one frame that shows the
+// file as it is now. If the file is gone, it keeps the old bytes. Dirty
+// bytes still there, in the cache or in page tables, were overwritten
+// by the change, see pcache_flush.
+void pcache_invalidate(const char* path) {
+    if (!file_count) return;
+    char norm[FS_PATH_MAX];
+    if (fs_normalize("/", path, norm, FS_PATH_MAX) < 0) return;
+    uint32_t hash = fs_hash(norm);
+
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    int id = file_find(norm, hash);
+    if (id < 0) {
+        spin_unlock_irqrestore(&pc_lock, flags);
+        return;
+    }
+    files[id].refs++;   // Keeps the slot while the lock is dropped
+    spin_unlock_irqrestore(&pc_lock, flags);
+    mmap_collect(id);   // Only so the bits don't dirty the new contents
+    flags = spin_lock_irqsave(&pc_lock);
+    for (int s = 0; s < PCACHE_PAGES; s++) {
+        CachedPage* p = &pages[s];
+        if (p->state == PAGE_FREE || p->file != id) continue;
+        if (p->state == PAGE_LOADING) {
+            p->stale = 1;
+            continue;
+        }
+        page_clean(p);
+        if (pmm_page_refcount(p->frame) == 1) {
+            page_drop(s);
+            continue;
+        }
+
+        p->state = PAGE_LOADING;
+        spin_unlock_irqrestore(&pc_lock, flags);
+        int n = page_read(p, norm, &flags);
+        if (n >= 0) memset(p->frame + n, 0, PAGE_SIZE - n);
+        p->state = PAGE_READY;
+        spin_unlock_irqrestore(&pc_lock, flags);
+        wake_up(&load_wq);
+        flags = spin_lock_irqsave(&pc_lock);
+    }
+    files[id].refs--;
+    file_release(id);
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+// Everything, for when the tree is rebuilt: nothing in the cache belongs
+// to the new one. Mappings keep the frames they have.
+void pcache_drop() {
+    if (!file_count) return;
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    forget(-1);
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+void pcache_stats(PcacheStats* out) {
+    uint32_t flags = spin_lock_irqsave(&pc_lock);
+    *out = stats;
+    out->mapped = 0;
+    out->dirty = 0;
+    out->files = file_count;
+    for (int s = 0; s < PCACHE_PAGES; s++) {
+        if (pages[s].state != PAGE_READY) continue;
+        if (pmm_page_refcount(pages[s].frame) > 1) out->mapped++;
+        if (pages[s].dirty) out->dirty++;
+    }
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
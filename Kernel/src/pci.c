@@ -0,0 +1,45 @@
+#include "pci.h"
+#include "io.h"
+
+// Configuration mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+static uint32_t config_address(PciAddr dev, uint8_t offset) {
+    return 0x80000000u | ((uint32_t)dev.bus << 16) | ((uint32_t)dev.slot << 11) |
+           ((uint32_t)dev.func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read32(PciAddr dev, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write32(PciAddr dev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// First function of the given class, scanning every bus by brute force
+int pci_find_class(uint8_t class_code, uint8_t subclass, PciAddr* out) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t slot = 0; slot < 32; slot++) {
+            for (uint8_t func = 0; func < 8; func++) {
+                PciAddr dev = { (uint8_t)bus, slot, func };
+                uint32_t id = pci_read32(dev, 0);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (func == 0) break;   // No device in this slot
+                    continue;
+                }
+                uint32_t class_reg = pci_read32(dev, PCI_CLASS);
+                if ((class_reg >> 24) == class_code && ((class_reg >> 16) & 0xFF) == subclass) {
+                    *out = dev;
+                    return 0;
+                }
+                // Single-function devices only answer on function 0
+                if (func == 0 && !(pci_read32(dev, 0x0C) & 0x00800000)) break;
+            }
+        }
+    }
+    return -1;
+}
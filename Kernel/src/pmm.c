@@ -0,0 +1,160 @@
+
+#include "pmm.h"
+#include "heap.h"
+#include "spinlock.h"
+
+// One bit per frame, set = in use
+static uint32_t frame_bitmap[PMM_PAGES / 32];
+static size_t free_frames = 0;
+static size_t search_hint = 0;
+
+// Mappings per frame, for frames shared between address spaces
+// (copy-on-write, shared text). Set to 1 by the allocator.
+static uint16_t frame_refs[PMM_PAGES];
+
+// Frames are handed out from every CPU, and from interrupt context
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+static inline int frame_used(size_t i) {
+    return frame_bitmap[i / 32] & (1u << (i % 32));
+}
+
+static inline void frame_set(size_t i) {
+    frame_bitmap[i / 32] |= (1u << (i % 32));
+}
+
+static inline void frame_clear(size_t i) {
+    frame_bitmap[i / 32] &= ~(1u << (i % 32));
+}
+
+void pmm_init() {
+    static int initialized = 0;
+    if (initialized) return;   // kernel_setup can run more than once
+
+    memset(frame_bitmap, 0, sizeof(frame_bitmap));
+    free_frames = PMM_PAGES;
+    search_hint = 0;
+    initialized = 1;
+}
+
+static void* alloc_pages_locked(size_t count) {
+    if (count == 0 || count > free_frames) return NULL;
+
+    size_t run = 0;
+    for (size_t n = 0; n < PMM_PAGES; n++) {
+        size_t i = (search_hint + n) % PMM_PAGES;
+        if (i == 0) run = 0;   // Runs can't wrap around the end
+
+        // Skip whole words of used frames
+        if (run == 0 && (i % 32) == 0 && frame_bitmap[i / 32] == 0xFFFFFFFF) {
+            n += 31;
+            continue;
+        }
+
+        if (frame_used(i)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == count) {
+            size_t first = i + 1 - count;
+            for (size_t j = first; j <= i; j++) {
+                frame_set(j);
+                frame_refs[j] = 1;
+            }
+            free_frames -= count;
+            search_hint = (i + 1) % PMM_PAGES;
+            return (void*)(PMM_START + first * PAGE_SIZE);
+        }
+    }
+    return NULL;
+}
+
+void* pmm_alloc_pages(size_t count) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    void* pages = alloc_pages_locked(count);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return pages;
+}
+
+void* pmm_alloc_page() {
+    return pmm_alloc_pages(1);
+}
+
+void pmm_free_pages(void* page, size_t count) {
+    uint32_t addr = (uint32_t)page;
+    if (addr < PMM_START || addr >= PMM_END || (addr & (PAGE_SIZE - 1))) return;
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    size_t first = (addr - PMM_START) / PAGE_SIZE;
+    for (size_t i = first; i < first + count && i < PMM_PAGES; i++) {
+        if (frame_used(i)) {
+            frame_clear(i);
+            frame_refs[i] = 0;
+            free_frames++;
+        }
+    }
+    if (first < search_hint) search_hint = first;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_free_page(void* page) {
+    pmm_free_pages(page, 1);
+}
+
+// Keep the allocator away from [start, end), memory something else
+// already owns (a boot module). Parts outside the frame range are ignored.
+void pmm_reserve(uint32_t start, uint32_t end) {
+    if (start < PMM_START) start = PMM_START;
+    if (end > PMM_END) end = PMM_END;
+    if (start >= end) return;
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    for (size_t i = (start - PMM_START) / PAGE_SIZE; i < (end - PMM_START + PAGE_SIZE - 1) / PAGE_SIZE; i++) {
+        if (!frame_used(i)) {
+            frame_set(i);
+            frame_refs[i] = 1;
+            free_frames--;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+static int frame_index(void* page, size_t* index) {
+    uint32_t addr = (uint32_t)page;
+    if (addr < PMM_START || addr >= PMM_END || (addr & (PAGE_SIZE - 1))) return 0;
+    *index = (addr - PMM_START) / PAGE_SIZE;
+    return 1;
+}
+
+// One more mapping of an allocated frame
+void pmm_page_ref(void* page) {
+    size_t i;
+    if (!frame_index(page, &i)) return;
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (frame_used(i)) frame_refs[i]++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Drop a mapping; the last one frees the frame
+void pmm_page_unref(void* page) {
+    size_t i;
+    if (!frame_index(page, &i)) return;
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (frame_used(i) && --frame_refs[i] == 0) {
+        frame_clear(i);
+        free_frames++;
+        if (i < search_hint) search_hint = i;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+int pmm_page_refcount(void* page) {
+    size_t i;
+    if (!frame_index(page, &i)) return 0;
+    return frame_refs[i];
+}
+
+size_t pmm_free_count() {
+    return free_frames;
+}
@@ -0,0 +1,318 @@
+
+#include "process.h"
+#include "elf.h"
+#include "paging.h"
+#include "pmm.h"
+#include "fs.h"
+#include "task.h"
+#include "wait.h"
+#include "smp.h"
+#include "screen.h"
+#include "serial.h"
+#include "string.h"
+#include "heap.h"
+#include "ioring.h"
+#include "pcache.h"
+
+#define USER_CS 0x1B   // GDT user code (0x18), RPL 3
+#define USER_DS 0x23   // GDT user data (0x20), RPL 3
+
+extern void user_enter(uint32_t eip, uint32_t esp, uint16_t cs, uint16_t ds);
+extern void user_resume(SyscallFrame* frame);
+
+// Guarded by sched_lock, like the task table
+static Process procs[MAX_PROCS];
+static int next_pid = 1;
+static WaitQueue proc_exit_wq = WAIT_QUEUE_INIT;
+
+static Process* proc_find(int pid) {
+    for (int i = 0; i < MAX_PROCS; i++) {
+        if (procs[i].state != PROC_FREE && procs[i].pid == pid) return &procs[i];
+    }
+    return NULL;
+}
+
+// The task function of every process: drop to ring 3 and never come back.
+// The process leaves through process_exit, a fault, or task_kill.
+static void process_start() {
+    Process* p = task_current()->proc;
+    p->start_tsc = rdtsc();
+    user_enter(p->entry, p->user_stack, USER_CS, USER_DS);
+}
+
+// A forked child resumes right after the parent's int 0x80
+static void process_fork_start() {
+    Process* p = task_current()->proc;
+    SyscallFrame frame = p->fork_frame;
+    p->start_tsc = rdtsc();
+    user_resume(&frame);
+}
+
+// A free slot, zeroed and numbered. sched_lock held.
+static Process* proc_alloc() {
+    for (int i = 0; i < MAX_PROCS; i++) {
+        Process* p = &procs[i];
+        if (p->state == PROC_FREE) {
+            memset(p, 0, sizeof(Process));
+            p->pid = next_pid++;
+            p->state = PROC_RUNNING;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int map_user_stack(uint32_t* dir) {
+    for (int i = 1; i <= USER_STACK_PAGES; i++) {
+        void* frame = pmm_alloc_page();
+        if (!frame) return -1;
+        memset(frame, 0, PAGE_SIZE);
+        if (paging_map(dir, USER_TOP - i * PAGE_SIZE, (uint32_t)frame, PTE_USER | PTE_WRITE) < 0) {
+            pmm_free_page(frame);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const char* base_name(const char* path) {
+    const char* name = path;
+    for (const char* c = path; *c; c++) {
+        if (*c == '/') name = c + 1;
+    }
+    return name;
+}
+
+// Load an ELF executable from the filesystem into a new address space
+// and queue a task to run it. Returns the pid or a PROC_E* error.
+int process_spawn(const char* path, int detached) {
+    uint64_t spawn_tsc = rdtsc();
+    uint32_t size;
+    void* copy = NULL;
+    size_t copy_pages = 0;
+    const void* image = fs_read_static(path, &size);
+    if (!image) {
+        // A written file can change under us: load from a private copy,
+        // and don't let the text cache keep it
+        FsStat st;
+        if (fs_stat(path, &st) < 0) return PROC_ENOENT;
+        size = st.size;
+        copy_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (copy_pages == 0) return PROC_ENOEXEC;
+        copy = pmm_alloc_pages(copy_pages);
+        if (!copy) return PROC_ENOMEM;
+        int n = pcache_read(path, 0, copy, size);
+        if (n < 0) {
+            pmm_free_pages(copy, copy_pages);
+            return PROC_ENOENT;
+        }
+        size = (uint32_t)n;
+        image = copy;
+    }
+
+    uint32_t* dir = paging_new_dir();
+    if (!dir) {
+        if (copy) pmm_free_pages(copy, copy_pages);
+        return PROC_ENOMEM;
+    }
+
+    uint32_t entry;
+    int err = elf_load(image, size, dir, &entry, copy == NULL);
+    if (copy) pmm_free_pages(copy, copy_pages);
+    if (err == ELF_OK && map_user_stack(dir) < 0) err = ELF_NO_MEMORY;
+    if (err != ELF_OK) {
+        paging_free_dir(dir);
+        return err == ELF_NO_MEMORY ? PROC_ENOMEM : PROC_ENOEXEC;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Process* p = proc_alloc();
+    if (!p) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        paging_free_dir(dir);
+        return PROC_EAGAIN;
+    }
+
+    strncpy(p->name, base_name(path), sizeof(p->name) - 1);
+    p->page_dir = dir;
+    p->entry = entry;
+    p->user_stack = USER_TOP;
+    p->parent_pid = process_getpid();
+    p->detached = detached;
+    p->spawn_tsc = spawn_tsc;
+    int pid = p->pid;
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    // The task may run (and exit) on another CPU before this returns
+    int id = register_user_task(p->name, process_start, p, dir);
+    if (id < 0) {
+        flags = spin_lock_irqsave(&sched_lock);
+        p->state = PROC_FREE;
+        spin_unlock_irqrestore(&sched_lock, flags);
+        paging_free_dir(dir);
+        return PROC_ENOMEM;
+    }
+    return pid;
+}
+
+// Duplicate the calling process. The child gets a copy-on-write clone
+// of the address space and starts where the parent's syscall returns.
+int process_fork() {
+    Task* t = task_current();
+    Process* parent = t->proc;
+    if (!parent || !t->user_frame) return -1;
+
+    uint32_t* dir = paging_clone_dir(parent->page_dir);
+    if (!dir) return PROC_ENOMEM;
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Process* p = proc_alloc();
+    if (!p) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        paging_free_dir(dir);
+        return PROC_EAGAIN;
+    }
+    memcpy(p->name, parent->name, sizeof(p->name));
+    p->parent_pid = parent->pid;
+    p->page_dir = dir;
+    p->entry = parent->entry;
+    p->user_stack = parent->user_stack;
+    p->spawn_tsc = rdtsc();
+    p->fork_frame = *t->user_frame;
+    p->fork_frame.eax = 0;
+    p->fork_frame.edx = 0;
+    mmap_fork(p, parent);
+    int pid = p->pid;
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    if (register_user_task(p->name, process_fork_start, p, dir) < 0) {
+        flags = spin_lock_irqsave(&sched_lock);
+        mmap_release(p);
+        p->state = PROC_FREE;
+        spin_unlock_irqrestore(&sched_lock, flags);
+        paging_free_dir(dir);
+        return PROC_ENOMEM;
+    }
+    return pid;
+}
+
+// Record the exit and let waiters know. sched_lock held; the address
+// space is already gone. Children nobody can wait for any more are
+// detached, and freed if they already exited.
+static void process_finish(Process* p, int code) {
+    for (int i = 0; i < MAX_PROCS; i++) {
+        Process* c = &procs[i];
+        if (c->state == PROC_FREE || c->parent_pid != p->pid) continue;
+        c->parent_pid = 0;
+        c->detached = 1;
+        if (c->state == PROC_ZOMBIE) c->state = PROC_FREE;
+    }
+    p->exit_code = code;
+    p->exit_tsc = rdtsc();
+    p->page_dir = NULL;
+    p->state = p->detached ? PROC_FREE : PROC_ZOMBIE;
+    wake_up_locked(&proc_exit_wq);
+}
+
+// Block until pid, a child of the caller, exits, then free its slot
+int process_wait(int pid, ProcResult* result) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Process* p = proc_find(pid);
+    if (!p || p->detached || p->parent_pid != process_getpid()) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return -1;
+    }
+    while (p->state != PROC_ZOMBIE) {
+        wait_sleep(&proc_exit_wq);
+    }
+
+    if (result) {
+        result->exit_code = p->exit_code;
+        result->start_cycles = p->start_tsc ? p->start_tsc - p->spawn_tsc : 0;
+        result->run_cycles = p->start_tsc ? p->exit_tsc - p->start_tsc : 0;
+    }
+    p->state = PROC_FREE;
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return 0;
+}
+
+// The table itself, MAX_PROCS slots, for walking with sched_lock held
+Process* process_table() {
+    return procs;
+}
+
+int process_getpid() {
+    Process* p = task_current()->proc;
+    return p ? p->pid : 0;
+}
+
+// End the current process. Runs on its kernel stack, so the address
+// space can go as soon as we are off its page directory.
+void process_exit(int code) {
+    Task* t = task_current();
+    Process* p = t->proc;
+    if (!p) task_exit();
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    uint32_t* dir = p->page_dir;
+    t->proc = NULL;
+    t->page_dir = NULL;
+    paging_switch(NULL);
+    mmap_release(p);   // Under the lock, against mmap_collect
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    ioring_release(t);
+    paging_free_dir(dir);
+
+    flags = spin_lock_irqsave(&sched_lock);
+    process_finish(p, code);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    task_exit();
+}
+
+// A CPU exception in ring 3 takes down the process, not the kernel
+void process_fault(IsrFrame* frame) {
+    Process* p = task_current()->proc;
+    uint32_t cr2 = 0;
+    if (frame->int_no == 14) __asm__ __volatile__ ("mov %%cr2, %0" : "=r"(cr2));
+
+    serial_puts("[proc] ");
+    serial_puts(p ? p->name : "?");
+    serial_puts(" killed by exception ");
+    serial_putint(frame->int_no);
+    serial_puts(" at ");
+    serial_puthex(frame->eip);
+    if (frame->int_no == 14) {
+        serial_puts(", address ");
+        serial_puthex(cr2);
+    }
+    serial_puts("\n");
+
+    process_exit(PROC_EXIT_FAULT(frame->int_no));
+}
+
+// The task died without going through process_exit (task_kill).
+// Called from reap_tasks once no CPU can still be on its directory.
+void process_reap(Process* p) {
+    mmap_release(p);
+    paging_free_dir(p->page_dir);
+    process_finish(p, PROC_EXIT_KILLED);
+}
+
+void process_print() {
+    static const char* state_names[] = { "free", "running", "zombie" };
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    for (int i = 0; i < MAX_PROCS; i++) {
+        Process* p = &procs[i];
+        if (p->state == PROC_FREE) continue;
+        putint(p->pid);
+        puts("  task ");
+        putint(p->task_id);
+        puts("  ");
+        puts(state_names[p->state]);
+        puts("  ");
+        puts(p->name);
+        putc('\n');
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
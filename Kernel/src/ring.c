@@ -0,0 +1,87 @@
+
+#include "ring.h"
+#include "atomic.h"
+
+// x86 keeps stores in order and loads in order, so publishing a slot
+// only needs the compiler not to reorder around the index update.
+
+int spsc_init(SpscRing* ring, void** slots, uint32_t capacity) {
+    if (!capacity || (capacity & (capacity - 1))) return -1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = capacity - 1;
+    ring->slots = slots;
+    return 0;
+}
+
+// Returns 0 when full
+int spsc_push(SpscRing* ring, void* item) {
+    uint32_t tail = ring->tail;
+    if (tail - ring->head > ring->mask) return 0;
+    ring->slots[tail & ring->mask] = item;
+    barrier();
+    ring->tail = tail + 1;
+    return 1;
+}
+
+// Returns 0 when empty
+int spsc_pop(SpscRing* ring, void** item) {
+    uint32_t head = ring->head;
+    if (head == ring->tail) return 0;
+    barrier();
+    *item = ring->slots[head & ring->mask];
+    barrier();
+    ring->head = head + 1;
+    return 1;
+}
+
+uint32_t spsc_count(const SpscRing* ring) {
+    return ring->tail - ring->head;
+}
+
+int mpsc_init(MpscRing* ring, MpscSlot* slots, uint32_t capacity) {
+    if (!capacity || (capacity & (capacity - 1))) return -1;
+    ring->tail = 0;
+    ring->head = 0;
+    ring->mask = capacity - 1;
+    ring->slots = slots;
+    for (uint32_t i = 0; i < capacity; i++) {
+        slots[i].seq = i;   // Free for the producer that claims position i
+    }
+    return 0;
+}
+
+int mpsc_push(MpscRing* ring, void* item) {
+    uint32_t pos = ring->tail;
+    MpscSlot* slot;
+    while (1) {
+        slot = &ring->slots[pos & ring->mask];
+        int32_t diff = (int32_t)(slot->seq - pos);
+        if (diff == 0) {
+            uint32_t seen = __sync_val_compare_and_swap(&ring->tail, pos, pos + 1);
+            if (seen == pos) break;
+            pos = seen;
+        } else if (diff < 0) {
+            return 0;   // Full: the consumer hasn't freed this slot yet
+        } else {
+            pos = ring->tail;   // Another producer took it
+        }
+    }
+
+    slot->item = item;
+    barrier();
+    slot->seq = pos + 1;   // Filled
+    return 1;
+}
+
+int mpsc_pop(MpscRing* ring, void** item) {
+    uint32_t head = ring->head;
+    MpscSlot* slot = &ring->slots[head & ring->mask];
+    if ((int32_t)(slot->seq - (head + 1)) < 0) return 0;   // Empty or still being written
+    barrier();
+    *item = slot->item;
+    barrier();
+    slot->seq = head + ring->mask + 1;   // Free for the next lap
+    ring->head = head + 1;
+    return 1;
+}
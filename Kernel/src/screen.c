@@ -159,6 +159,19 @@ void putint(int num) {
     puts(str);
 }
 
+void putuint(uint32_t num) {
+    char str[11];
+    int i = 0;
+    do {
+        str[i++] = '0' + (num % 10);
+        num /= 10;
+    } while (num);
+
+    while (i--) {
+        putc(str[i]);
+    }
+}
+
 void puthex(uint32_t n) {
     puts("0x");
     char hex_chars[] = "0123456789ABCDEF";
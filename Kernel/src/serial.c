@@ -0,0 +1,54 @@
+
+#include "serial.h"
+#include "io.h"
+
+#define COM1 0x3F8
+
+static int serial_ready = 0;
+
+void serial_init() {
+    outb(COM1 + 1, 0x00);    // Disable interrupts
+    outb(COM1 + 3, 0x80);    // Enable DLAB (set baud rate divisor)
+    outb(COM1 + 0, 0x03);    // Divisor 3 = 38400 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03);    // 8 bits, no parity, one stop bit
+    outb(COM1 + 2, 0xC7);    // Enable FIFO, clear them, 14-byte threshold
+    outb(COM1 + 4, 0x0B);    // RTS/DSR set
+    serial_ready = 1;
+}
+
+void serial_putc(char c) {
+    if (!serial_ready) return;
+    if (c == '\n') serial_putc('\r');
+
+    // Wait for the transmit holding register to empty
+    while (!(inb(COM1 + 5) & 0x20)) {}
+    outb(COM1, c);
+}
+
+void serial_puts(const char* str) {
+    while (*str) {
+        serial_putc(*str++);
+    }
+}
+
+void serial_putint(uint32_t num) {
+    char buf[11];
+    int i = 0;
+
+    do {
+        buf[i++] = '0' + (num % 10);
+        num /= 10;
+    } while (num);
+
+    while (i--) {
+        serial_putc(buf[i]);
+    }
+}
+
+void serial_puthex(uint32_t num) {
+    serial_puts("0x");
+    for (int i = 7; i >= 0; i--) {
+        serial_putc("0123456789ABCDEF"[(num >> (i * 4)) & 0xF]);
+    }
+}
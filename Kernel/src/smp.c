@@ -0,0 +1,194 @@
+
+#include "smp.h"
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "heap.h"
+#include "idt.h"
+#include "interrupts.h"
+#include "ioring.h"
+#include "load.h"
+#include "pmm.h"
+#include "paging.h"
+#include "screen.h"
+#include "syscall.h"
+#include "time.h"
+
+#define TRAMPOLINE_ADDR   0x8000
+#define SMP_CALIBRATE_TICKS 10
+#define SMP_AP_TIMEOUT_MS 100
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) GdtPointer;
+
+extern uint64_t gdt_start[];
+extern void gdt_load(GdtPointer* ptr, uint16_t gs_sel, uint16_t tss_sel);
+
+extern char trampoline_start[], trampoline_end[];
+extern uint32_t trampoline_stack, trampoline_entry, trampoline_arg;
+
+_Static_assert(offsetof(Cpu, current) == 4, "task_current() reads gs:4");
+
+Cpu cpus[MAX_CPUS];
+volatile int cpu_count = 1;
+
+static int smp_started = 0;
+static uint32_t lapic_ticks = 0;   // LAPIC timer counts per scheduler tick
+
+static uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    uint32_t low = (limit & 0xFFFF) | ((base & 0xFFFF) << 16);
+    uint32_t high = ((base >> 16) & 0xFF) | ((uint32_t)access << 8) |
+                    (limit & 0xF0000) | ((uint32_t)flags << 20) | (base & 0xFF000000);
+    return ((uint64_t)high << 32) | low;
+}
+
+// Build and load this CPU's GDT. Rewriting the TSS descriptor also clears
+// its busy bit, so this can run again on a CPU that already did ltr.
+static void cpu_load_gdt(Cpu* cpu) {
+    for (int i = 0; i < 5; i++) {
+        cpu->gdt[i] = gdt_start[i];
+    }
+    cpu->tss.ss0 = 0x10;
+    cpu->tss.iomap_base = sizeof(Tss);
+    cpu->gdt[5] = gdt_entry((uint32_t)&cpu->tss, sizeof(Tss) - 1, 0x89, 0x0);
+    cpu->gdt[6] = gdt_entry((uint32_t)cpu, sizeof(Cpu) - 1, 0x92, 0x4);
+
+    GdtPointer ptr = { sizeof(cpu->gdt) - 1, (uint32_t)cpu->gdt };
+    gdt_load(&ptr, CPU_GS_SELECTOR, CPU_TSS_SELECTOR);
+}
+
+// Replaces gdt_install on the boot CPU; cpu_current() works from here on
+void smp_init_bsp() {
+    uint32_t flags = irq_save();
+    Cpu* cpu = &cpus[0];
+    cpu->self = cpu;
+    cpu->index = 0;
+    cpu->online = 1;
+    cpu_load_gdt(cpu);
+    irq_restore(flags);
+}
+
+static void udelay(uint32_t us) {
+    uint32_t per_us = time_tsc_per_us();
+    if (!per_us) per_us = 1000;
+    uint64_t end = rdtsc() + (uint64_t)us * per_us;
+    while (rdtsc() < end) {
+        __asm__ __volatile__ ("pause");
+    }
+}
+
+// Each AP's scheduler tick; the boot CPU keeps the PIT (timer_callback)
+static void apic_timer_handler() {
+    ioring_poll();   // Poll-mode rings of processes running here
+    task_tick();
+}
+
+// Nothing to do: task_preempt() on the way out does the work
+static void resched_handler() {
+}
+
+// First C code on an application processor, on its boot stack
+static void ap_main(Cpu* cpu) {
+    paging_init_cpu();
+    cpu_load_gdt(cpu);
+    idt_reload();
+    lapic_init(0, 0);
+    syscall_init_cpu();
+    task_init_cpu(cpu);
+    lapic_timer_start(lapic_ticks);
+    cpu->online = 1;
+
+    // This context is now the CPU's idle task
+    while (1) {
+        cpu_idle_halt();
+    }
+}
+
+static volatile uint32_t* trampoline_var(uint32_t* sym) {
+    return (volatile uint32_t*)((char*)sym - trampoline_start + TRAMPOLINE_ADDR);
+}
+
+static int smp_boot_ap(uint8_t apic_id) {
+    Cpu* cpu = &cpus[cpu_count];
+    void* stack = pmm_alloc_pages(TASK_STACK_PAGES);
+    if (!stack) return -1;
+
+    cpu->self = cpu;
+    cpu->index = cpu_count;
+    cpu->apic_id = apic_id;
+    cpu->boot_stack = stack;
+    cpu->online = 0;
+
+    *trampoline_var(&trampoline_stack) = (uint32_t)stack + TASK_STACK_PAGES * PAGE_SIZE;
+    *trampoline_var(&trampoline_entry) = (uint32_t)ap_main;
+    *trampoline_var(&trampoline_arg) = (uint32_t)cpu;
+
+    // INIT, then up to two STARTUPs, as the MP spec asks
+    lapic_send_init(apic_id);
+    udelay(10000);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_sipi(apic_id, TRAMPOLINE_ADDR >> 12);
+        udelay(200);
+    }
+    for (int ms = 0; ms < SMP_AP_TIMEOUT_MS && !cpu->online; ms++) {
+        udelay(1000);
+    }
+
+    if (!cpu->online) {
+        pmm_free_pages(stack, TASK_STACK_PAGES);
+        return -1;
+    }
+    cpu_count++;
+    return 0;
+}
+
+// Find the other CPUs in the MADT and start them one at a time
+// (they share the trampoline's stack/entry slots)
+void smp_init() {
+    if (smp_started) return;   // kernel_setup can run more than once
+    smp_started = 1;
+
+    AcpiMadtInfo madt;
+    if (acpi_parse_madt(&madt) < 0) {
+        puts("[smp] no MADT, staying on one CPU\n");
+        return;
+    }
+
+    lapic_init(madt.lapic_address, 1);
+    if (!lapic_available) {
+        puts("[smp] no local APIC, staying on one CPU\n");
+        return;
+    }
+    cpus[0].apic_id = lapic_id();
+    register_interrupt_handler(APIC_TIMER_VECTOR, apic_timer_handler);
+    register_interrupt_handler(APIC_RESCHED_VECTOR, resched_handler);
+    lapic_ticks = lapic_timer_calibrate(SMP_CALIBRATE_TICKS);
+
+    memcpy((void*)TRAMPOLINE_ADDR, trampoline_start, trampoline_end - trampoline_start);
+
+    for (int i = 0; i < madt.cpu_count && cpu_count < MAX_CPUS; i++) {
+        if (madt.apic_ids[i] == cpus[0].apic_id) continue;
+        if (smp_boot_ap(madt.apic_ids[i]) < 0) {
+            puts("[smp] APIC ");
+            putint(madt.apic_ids[i]);
+            puts(" did not start\n");
+        }
+    }
+}
+
+void smp_print() {
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* cpu = &cpus[i];
+        puts("cpu ");
+        putint(i);
+        puts("  apic ");
+        putint(cpu->apic_id);
+        puts("  ready ");
+        putint(cpu->nr_ready);
+        puts("  running ");
+        puts(cpu->current ? cpu->current->name : "-");
+        putc('\n');
+    }
+}
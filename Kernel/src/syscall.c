@@ -3,86 +3,336 @@
 #include "time.h"
 #include "keyboard.h"
 #include "logo.h"
+#include "cpu.h"
+#include "ioring.h"
+#include "load.h"
+#include "smp.h"
+#include "paging.h"
+#include "process.h"
+#include "task.h"
+#include "vfs.h"
+#include "mmap.h"
+#include "heap.h"
+#include "irqstat.h"
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+extern void sysenter_entry();
+extern void sysenter_user_entry();
+extern int64_t sysenter_call(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6);
+extern int64_t int80_call(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6);
 
 static syscall_func_t syscall_table[MAX_SYSCALLS] = { 0 };
 
+static int sysenter_enabled = 0;
+
 void register_syscall(int num, syscall_func_t func) {
     if (num < MAX_SYSCALLS) {
         syscall_table[num] = func;
     }
 }
 
-void syscall_handler() {
-    uint32_t num, a1, a2, a3;
-
-    asm volatile (
-        "" : "=a"(num), "=b"(a1), "=c"(a2), "=d"(a3)
-    );
+int64_t syscall_dispatch(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+                         uint32_t a4, uint32_t a5, uint32_t a6) {
+    // Both entry paths arrive with interrupts off, but getchar and sleep block
+    __asm__ __volatile__ ("sti");
 
     if (num < MAX_SYSCALLS && syscall_table[num]) {
-        syscall_table[num](a1, a2, a3);
-    } else {
-        puts("Invalid syscall\n");
+        return syscall_table[num](a1, a2, a3, a4, a5, a6);
+    }
+    puts("Invalid syscall\n");
+    return -1;
+}
+
+// Ring 3 gets here from isr128 or sysenter_user_entry, with the same frame
+void syscall_handler(SyscallFrame* frame) {
+    uint64_t entry_tsc = rdtsc();
+    // fork needs the caller's registers to start the child from
+    if (frame->cs & 3) task_current()->user_frame = frame;
+
+    int64_t ret = syscall_dispatch(frame->eax, frame->ebx, frame->ecx, frame->edx,
+                                   frame->esi, frame->edi, frame->ebp);
+
+    // popa in isr128 hands these back to the caller
+    frame->eax = (uint32_t)ret;
+    frame->edx = (uint32_t)((uint64_t)ret >> 32);
+
+    // Neither entry goes through isr_handler, so syscalls are counted here,
+    // under 0x80. Calls that block count the time they slept.
+    irqstat_record(0x80, rdtsc() - entry_tsc);
+    if (frame->cs & 3) task_kill_point();
+}
+
+int64_t syscall_int80(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    return int80_call(num, a1, a2, a3, a4, a5, a6);
+}
+
+// While a process's task runs, sysenter goes to the ring 3 entry, so
+// kernel code running on its behalf takes int 0x80 instead
+static int sysenter_usable() {
+    return sysenter_enabled && !cpu_current()->sysenter_user;
+}
+
+int64_t syscall_sysenter(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    if (!sysenter_usable()) {
+        return int80_call(num, a1, a2, a3, a4, a5, a6);
     }
+    return sysenter_call(num, a1, a2, a3, a4, a5, a6);
+}
+
+int64_t syscall6(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    if (sysenter_usable()) {
+        return sysenter_call(num, a1, a2, a3, a4, a5, a6);
+    }
+    return int80_call(num, a1, a2, a3, a4, a5, a6);
 }
 
 int syscall(int num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
-    int ret;
-    asm volatile (
-        "int $0x80"
-        : "=a"(ret)
-        : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3)
-    );
-    return ret;
+    return (int)syscall6(num, arg1, arg2, arg3, 0, 0, 0);
 }
 
-static int syscall_write(uint32_t a1, uint32_t a2, uint32_t a3) {
-    (void)a2; (void)a3;
+int syscall_has_sysenter() {
+    return sysenter_enabled;
+}
+
+static void sysenter_init() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 11))) {   // SEP: SYSENTER/SYSEXIT supported
+        puts("[syscall] sysenter not supported, using int 0x80\n");
+        return;
+    }
+
+    // The ring 3 entry loads esp0 from here, which task switches keep
+    // pointing at the running task's stack
+    Cpu* cpu = cpu_current();
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)&cpu->tss.esp0);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+    cpu->sysenter_user = 0;
+    sysenter_enabled = 1;
+}
+
+// sysenter_entry serves ring 0 callers on their own stack, which a ring 3
+// caller must never get to pick. While a process runs, sysenter lands in
+// sysenter_user_entry instead, on the task's kernel stack.
+void syscall_set_user(int user) {
+    Cpu* cpu = cpu_current();
+    if (!sysenter_enabled || cpu->sysenter_user == user) return;
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)(user ? sysenter_user_entry : sysenter_entry));
+    cpu->sysenter_user = user;
+}
+
+static int64_t syscall_write(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    if (!user_str_ok((const char*)a1, 4096)) return -1;
     puts((const char*)a1);
     return 0;
 }
 
-static int syscall_time(uint32_t a1, uint32_t a2, uint32_t a3) {
-    (void)a1; (void)a2; (void)a3;
-    extern int tick_count;
+static int64_t syscall_time(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    extern volatile uint32_t tick_count;
     return tick_count;
 }
 
-static int syscall_clear(uint32_t a1, uint32_t a2, uint32_t a3) {
-    (void)a1; (void)a2; (void)a3;
+static int64_t syscall_clear(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
     clear();
     return 0;
 }
 
-static int syscall_cursor(uint32_t x, uint32_t y, uint32_t unused) {
-    (void)unused;
+static int64_t syscall_cursor(uint32_t x, uint32_t y, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a3; (void)a4; (void)a5; (void)a6;
     move_cursor(x, y);
     return 0;
 }
 
-static int syscall_draw_logo(uint32_t version, uint32_t a2, uint32_t a3) {
-    (void)a2; (void)a3;
+static int64_t syscall_draw_logo(uint32_t version, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
     draw_logo((int)version);
     return 0;
 }
 
-static int syscall_getchar(uint32_t a1, uint32_t a2, uint32_t a3) {
-    (void)a1; (void)a2; (void)a3;
-    return (int)keyboard_getchar();
+static int64_t syscall_getchar(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return (unsigned char)keyboard_getchar();
 }
 
-static int syscall_putchar(uint32_t ch, uint32_t a2, uint32_t a3) {
-    (void)a2; (void)a3;
+static int64_t syscall_putchar(uint32_t ch, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
     putc((char)ch);
     return 0;
 }
 
-static int syscall_sleep(uint32_t ticks, uint32_t a2, uint32_t a3) {
-    (void)a2; (void)a3;
+static int64_t syscall_sleep(uint32_t ticks, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
     sleep(ticks);
     return 0;
 }
 
+// Raw TSC, the one clock that needs all 64 bits
+static int64_t syscall_cycles(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return (int64_t)rdtsc();
+}
+
+// Rings check their own pointers, against the owner's address space
+static int64_t syscall_ring_setup(uint32_t ring, uint32_t flags, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a3; (void)a4; (void)a5; (void)a6;
+    return ioring_register((IoRing*)ring, flags);
+}
+
+static int64_t syscall_enter(uint32_t id, uint32_t to_submit, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a3; (void)a4; (void)a5; (void)a6;
+    return ioring_enter((int)id, to_submit);
+}
+
+static int64_t syscall_ring_exit(uint32_t id, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return ioring_unregister((int)id);
+}
+
+// Fills out[3] with the 1/5/15 s load averages in hundredths,
+// returns the number of CPUs
+static int64_t syscall_loadavg(uint32_t out, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    if (out) {
+        if (!user_ptr_ok((void*)out, 3 * sizeof(uint32_t), 1)) return -1;
+        load_get_avg((uint32_t*)out);
+    }
+    return cpu_count;
+}
+
+static int64_t syscall_exit(uint32_t code, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    process_exit((int)code);
+    return 0;
+}
+
+// Returns the child's pid in the parent and 0 in the child
+static int64_t syscall_fork(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return process_fork();
+}
+
+// Blocks until pid exits and returns its exit code
+static int64_t syscall_wait(uint32_t pid, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    ProcResult r;
+    if (process_wait((int)pid, &r) < 0) return -1;
+    return r.exit_code;
+}
+
+static int64_t syscall_getpid(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return process_getpid();
+}
+
+// File I/O copies straight between user memory and the page cache or
+// filesystem, VFS_CHUNK at a time. Each chunk is faulted in first
+// (copy-on-write copies, mapped file pages), so no filesystem lock is
+// ever held across a fault.
+
+// Returns the descriptor
+static int64_t syscall_open(uint32_t path, uint32_t flags, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a3; (void)a4; (void)a5; (void)a6;
+    if (!user_str_ok((const char*)path, FS_PATH_MAX)) return -1;
+    return vfs_open((const char*)path, flags);
+}
+
+// Bytes read, 0 at the end of the file
+static int64_t syscall_read(uint32_t fd, uint32_t buf, uint32_t len, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a4; (void)a5; (void)a6;
+    if (!user_ptr_ok((void*)buf, len, 1)) return -1;
+
+    uint32_t done = 0;
+    int failed = 0;
+    while (done < len) {
+        uint32_t chunk = len - done < VFS_CHUNK ? len - done : VFS_CHUNK;
+        user_prefault((uint8_t*)buf + done, chunk, 1);
+        int n = vfs_read((int)fd, (uint8_t*)buf + done, chunk);
+        if (n < 0) {
+            failed = done == 0;
+            break;
+        }
+        done += n;
+        if ((uint32_t)n < chunk) break;   // End of the file
+    }
+    return failed ? -1 : (int64_t)done;
+}
+
+// Bytes written
+static int64_t syscall_write_fd(uint32_t fd, uint32_t buf, uint32_t len, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a4; (void)a5; (void)a6;
+    if (!user_ptr_ok((const void*)buf, len, 0)) return -1;
+
+    uint32_t done = 0;
+    int failed = 0;
+    while (done < len) {
+        uint32_t chunk = len - done < VFS_CHUNK ? len - done : VFS_CHUNK;
+        user_prefault((const uint8_t*)buf + done, chunk, 0);
+        if (vfs_write((int)fd, (const uint8_t*)buf + done, chunk) < 0) {
+            failed = done == 0;
+            break;
+        }
+        done += chunk;
+    }
+    return failed ? -1 : (int64_t)done;
+}
+
+// Returns the new offset
+static int64_t syscall_lseek(uint32_t fd, uint32_t offset, uint32_t whence, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a4; (void)a5; (void)a6;
+    return vfs_lseek((int)fd, (int32_t)offset, (int)whence);
+}
+
+static int64_t syscall_close(uint32_t fd, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return vfs_close((int)fd);
+}
+
+// Fills in an FsStat
+static int64_t syscall_stat(uint32_t path, uint32_t out, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a3; (void)a4; (void)a5; (void)a6;
+    if (!user_str_ok((const char*)path, FS_PATH_MAX) || !user_ptr_ok((void*)out, sizeof(FsStat), 1)) return -1;
+    FsStat st;
+    if (fs_stat((const char*)path, &st) < 0) return -1;
+    memcpy((void*)out, &st, sizeof(st));
+    return 0;
+}
+
+// The next entry of a directory opened with SYSCALL_OPEN: 1, or 0 at the end
+static int64_t syscall_readdir(uint32_t fd, uint32_t out, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a3; (void)a4; (void)a5; (void)a6;
+    if (!user_ptr_ok((void*)out, sizeof(VfsDirent), 1)) return -1;
+    VfsDirent* e = (VfsDirent*)malloc(sizeof(VfsDirent));
+    if (!e) return -1;
+    int r = vfs_readdir((int)fd, e);
+    if (r > 0) memcpy((void*)out, e, sizeof(VfsDirent));
+    free(e);
+    return r;
+}
+
+// Map len bytes of an open file from offset; returns the address, 0 on failure
+static int64_t syscall_mmap(uint32_t fd, uint32_t len, uint32_t offset, uint32_t flags, uint32_t a5, uint32_t a6) {
+    (void)a5; (void)a6;
+    return vfs_mmap((int)fd, len, offset, flags);
+}
+
+static int64_t syscall_munmap(uint32_t addr, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return mmap_unmap(addr);
+}
+
+// Write back what was written through the mapping around addr
+static int64_t syscall_msync(uint32_t addr, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6) {
+    (void)a2; (void)a3; (void)a4; (void)a5; (void)a6;
+    return mmap_sync(addr);
+}
+
 void syscall_init() {
     syscall_table[SYSCALL_WRITE]     = syscall_write;
     syscall_table[SYSCALL_TIME]      = syscall_time;
@@ -92,4 +342,30 @@ void syscall_init() {
     syscall_table[SYSCALL_GETCHAR]   = syscall_getchar;
     syscall_table[SYSCALL_PUTCHAR]   = syscall_putchar;
     syscall_table[SYSCALL_SLEEP]     = syscall_sleep;
-}
\ No newline at end of file
+    syscall_table[SYSCALL_CYCLES]    = syscall_cycles;
+    syscall_table[SYSCALL_RING_SETUP] = syscall_ring_setup;
+    syscall_table[SYSCALL_ENTER]     = syscall_enter;
+    syscall_table[SYSCALL_RING_EXIT] = syscall_ring_exit;
+    syscall_table[SYSCALL_LOADAVG]   = syscall_loadavg;
+    syscall_table[SYSCALL_EXIT]      = syscall_exit;
+    syscall_table[SYSCALL_GETPID]    = syscall_getpid;
+    syscall_table[SYSCALL_FORK]      = syscall_fork;
+    syscall_table[SYSCALL_WAIT]      = syscall_wait;
+    syscall_table[SYSCALL_OPEN]      = syscall_open;
+    syscall_table[SYSCALL_READ]      = syscall_read;
+    syscall_table[SYSCALL_WRITE_FD]  = syscall_write_fd;
+    syscall_table[SYSCALL_LSEEK]     = syscall_lseek;
+    syscall_table[SYSCALL_CLOSE]     = syscall_close;
+    syscall_table[SYSCALL_STAT]      = syscall_stat;
+    syscall_table[SYSCALL_READDIR]   = syscall_readdir;
+    syscall_table[SYSCALL_MMAP]      = syscall_mmap;
+    syscall_table[SYSCALL_MUNMAP]    = syscall_munmap;
+    syscall_table[SYSCALL_MSYNC]     = syscall_msync;
+
+    sysenter_init();
+}
+
+// SYSENTER MSRs are per CPU; each application processor sets its own
+void syscall_init_cpu() {
+    sysenter_init();
+}
@@ -2,43 +2,598 @@
 
 #include "task.h"
 #include "screen.h" // for putf, etc.
-#include "time.h"  // if you want to sleep
+#include "heap.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "smp.h"
+#include "apic.h"
+#include "load.h"
+#include "paging.h"
+#include "process.h"
+#include "syscall.h"
+#include "vfs.h"
+#include "ioring.h"
 
-#define MAX_TASKS 8
+#define TASK_TABLE_INITIAL 8
 
-static Task tasks[MAX_TASKS];
-static int task_count = 0;
-static int current_task = -1;
+extern void switch_context(uint32_t* old_esp, uint32_t new_esp);
+
+// Guards the task table, every CPU's run queue and every wait queue.
+// Taken with interrupts off and held across switch_context: whoever we
+// switch to releases it (schedule() or task_entry()).
+spinlock_t sched_lock = SPINLOCK_INIT;
+
+// Grows on demand; slots of reaped tasks are reused
+static Task** tasks = NULL;
+static int task_capacity = 0;
+static int next_id = 0;
+
+static uint32_t timeslice = TASK_DEFAULT_SLICE;
+static int dead_tasks = 0;
+
+// Timed sleepers, sorted by wake_tick
+static WaitQueue sleepers = WAIT_QUEUE_INIT;
+
+// Each CPU has one FIFO per priority level plus a bitmap of the
+// non-empty ones. A running task is never on a run queue.
+static void rq_push(Cpu* cpu, Task* t) {
+    int p = t->prio;
+    t->cpu = cpu->index;
+    t->rq_next = NULL;
+    t->rq_prev = cpu->rq_tail[p];
+    if (cpu->rq_tail[p]) {
+        cpu->rq_tail[p]->rq_next = t;
+    } else {
+        cpu->rq_head[p] = t;
+    }
+    cpu->rq_tail[p] = t;
+    cpu->rq_bitmap |= (1u << p);
+    cpu->nr_ready++;
+}
+
+static void rq_remove(Task* t) {
+    Cpu* cpu = &cpus[t->cpu];
+    int p = t->prio;
+    if (t->rq_prev) {
+        t->rq_prev->rq_next = t->rq_next;
+    } else {
+        cpu->rq_head[p] = t->rq_next;
+    }
+    if (t->rq_next) {
+        t->rq_next->rq_prev = t->rq_prev;
+    } else {
+        cpu->rq_tail[p] = t->rq_prev;
+    }
+    t->rq_next = t->rq_prev = NULL;
+    if (!cpu->rq_head[p]) cpu->rq_bitmap &= ~(1u << p);
+    cpu->nr_ready--;
+}
+
+// Most urgent ready task: lowest set bit (one bsf), then the queue head
+static Task* rq_pick(Cpu* cpu) {
+    if (!cpu->rq_bitmap) return NULL;
+    int p = __builtin_ctz(cpu->rq_bitmap);
+    return cpu->rq_head[p];
+}
+
+// Our queue is empty: take the most urgent movable task from the
+// CPU with the longest queue
+static Task* rq_steal(Cpu* self) {
+    Cpu* busiest = NULL;
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* c = &cpus[i];
+        if (c == self || !c->nr_ready) continue;
+        if (!busiest || c->nr_ready > busiest->nr_ready) busiest = c;
+    }
+    if (!busiest) return NULL;
+
+    uint32_t bits = busiest->rq_bitmap;
+    while (bits) {
+        int p = __builtin_ctz(bits);
+        for (Task* t = busiest->rq_head[p]; t; t = t->rq_next) {
+            if (!t->pinned) return t;
+        }
+        bits &= bits - 1;
+    }
+    return NULL;
+}
+
+// Make cpu reschedule on its way out of the next interrupt, sending it
+// one if it isn't us
+static void cpu_kick(Cpu* cpu) {
+    cpu->need_resched = 1;
+    if (cpu != cpu_current()) {
+        lapic_send_ipi(cpu->apic_id, APIC_RESCHED_VECTOR);
+    }
+}
+
+static int cpu_is_idle(Cpu* cpu) {
+    return cpu->online && cpu->current == cpu->idle && !cpu->nr_ready;
+}
+
+// Queue a runnable task, preferring the CPU it last ran on unless another
+// one is sitting idle, and preempt that CPU if t is more urgent
+static void rq_enqueue(Task* t) {
+    Cpu* target = &cpus[t->cpu];
+    if (!t->pinned && !cpu_is_idle(target)) {
+        for (int i = 0; i < cpu_count; i++) {
+            if (cpu_is_idle(&cpus[i])) {
+                target = &cpus[i];
+                break;
+            }
+        }
+    }
+
+    rq_push(target, t);
+    if (target->current == target->idle || t->prio < target->current->prio) {
+        cpu_kick(target);
+    }
+}
+
+static int task_slot() {
+    for (int i = 0; i < task_capacity; i++) {
+        if (!tasks[i]) return i;
+    }
+
+    int new_capacity = task_capacity ? task_capacity * 2 : TASK_TABLE_INITIAL;
+    Task** grown = (Task**)realloc(tasks, new_capacity * sizeof(Task*));
+    if (!grown) return -1;
+    for (int i = task_capacity; i < new_capacity; i++) grown[i] = NULL;
+
+    int slot = task_capacity;
+    tasks = grown;
+    task_capacity = new_capacity;
+    return slot;
+}
+
+static Task* task_new(const char* name, task_func func) {
+    int slot = task_slot();
+    if (slot < 0) return NULL;
+
+    Task* t = (Task*)calloc(1, sizeof(Task));
+    if (!t) return NULL;
+
+    t->id = next_id++;
+    t->name = name;
+    t->function = func;
+    t->state = TASK_READY;
+    t->slice = timeslice;
+    t->base_prio = TASK_PRIO_DEFAULT;
+    t->prio = TASK_PRIO_DEFAULT;
+    t->cpu = cpu_current()->index;
+    tasks[slot] = t;
+    return t;
+}
+
+// First thing a new task runs, via the ret in switch_context
+static void task_entry() {
+    spin_unlock(&sched_lock);
+    __asm__ __volatile__ ("sti");
+    Task* self = task_current();
+    while (!self->kill_pending) {
+        self->function();
+    }
+    task_exit();
+}
+
+// A task with its own stack and an initial frame, not yet queued
+static Task* task_create(const char* name, task_func func) {
+    Task* t = task_new(name, func);
+    if (!t) return NULL;
+
+    t->stack = pmm_alloc_pages(TASK_STACK_PAGES);
+    if (!t->stack) {
+        t->state = TASK_DEAD;
+        dead_tasks++;
+        return NULL;
+    }
+
+    // Initial frame in the layout switch_context pops
+    uint32_t* sp = (uint32_t*)((uint8_t*)t->stack + TASK_STACK_PAGES * PAGE_SIZE);
+    *--sp = 0;                      // Return address for task_entry (never used)
+    *--sp = (uint32_t)task_entry;   // ret target
+    *--sp = 0;                      // ebp
+    *--sp = 0;                      // ebx
+    *--sp = 0;                      // esi
+    *--sp = 0;                      // edi
+    *--sp = 0x002;                  // eflags, interrupts off until task_entry
+    t->esp = (uint32_t)sp;
+    return t;
+}
+
+static void task_idle() {
+    cpu_idle_halt();
+}
 
 void init_tasks() {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].name = 0;
-        tasks[i].function = 0;
-        tasks[i].active = 0;
+    if (tasks) return;   // kernel_setup can run more than once
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Cpu* cpu = cpu_current();
+
+    // Task 0 is whatever is running right now: the boot stack, kernel_main,
+    // Cyclone. It stays on the boot CPU, where the PIC delivers its input.
+    Task* boot = task_new("kernel", 0);
+    boot->state = TASK_RUNNING;
+    boot->pinned = 1;
+    boot->run_start = rdtsc();
+    cpu->current = boot;
+
+    Task* idle = task_create("idle", task_idle);
+    idle->base_prio = idle->prio = TASK_PRIO_LEVELS - 1;
+    idle->pinned = 1;
+    cpu->idle = idle;
+
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// An application processor adopts its boot context as its idle task
+void task_init_cpu(Cpu* cpu) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* idle = task_new("idle", 0);
+    idle->state = TASK_RUNNING;
+    idle->base_prio = idle->prio = TASK_PRIO_LEVELS - 1;
+    idle->pinned = 1;
+    idle->cpu = cpu->index;
+    idle->run_start = rdtsc();
+    cpu->idle = idle;
+    cpu->current = idle;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+int register_task(const char* name, task_func func) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* t = task_create(name, func);
+    if (t) rq_enqueue(t);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return t ? t->id : -1;
+}
+
+// A task that runs in its own address space. schedule_locked() loads
+// page_dir and points the TSS at the task's stack for ring 3 entries.
+// It starts with the open files of the task creating it.
+int register_user_task(const char* name, task_func func, struct Process* proc, uint32_t* page_dir) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* t = task_create(name, func);
+    if (t) {
+        t->proc = proc;
+        t->page_dir = page_dir;
+        vfs_inherit(t, task_current());
+        proc->task_id = t->id;
+        rq_enqueue(t);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return t ? t->id : -1;
+}
+
+static int task_on_cpu(Task* t) {
+    for (int i = 0; i < cpu_count; i++) {
+        if (cpus[i].current == t) return 1;
     }
+    return 0;
 }
 
-void register_task(const char* name, task_func func) {
-    if (task_count < MAX_TASKS) {
-        tasks[task_count].name = name;
-        tasks[task_count].function = func;
-        tasks[task_count].active = 1;
-        task_count++;
+// Free dead tasks. Never one that is still current somewhere: that CPU
+// may still be on its stack.
+static void reap_tasks() {
+    if (!dead_tasks) return;
+    for (int i = 0; i < task_capacity; i++) {
+        Task* t = tasks[i];
+        if (t && t->state == TASK_DEAD && !task_on_cpu(t)) {
+            ioring_release(t);
+            if (t->proc) process_reap(t->proc);
+            vfs_release(t);
+            if (t->stack) pmm_free_pages(t->stack, TASK_STACK_PAGES);
+            free(t);
+            tasks[i] = NULL;
+            dead_tasks--;
+        }
+    }
+}
+
+// Pick the next task for this CPU and switch to it. Called and
+// returns with sched_lock held and interrupts off.
+static void schedule_locked() {
+    Cpu* cpu = cpu_current();
+    cpu->need_resched = 0;
+
+    Task* prev = cpu->current;
+    if (prev->state == TASK_RUNNING) {
+        prev->state = TASK_READY;
+        if (prev != cpu->idle) rq_push(cpu, prev);
+    }
+
+    Task* t = rq_pick(cpu);
+    if (!t) t = rq_steal(cpu);
+    if (t) {
+        rq_remove(t);
+    } else {
+        t = cpu->idle;
+    }
+    t->state = TASK_RUNNING;
+    t->cpu = cpu->index;
+    if (t->slice == 0) t->slice = timeslice;
+
+    if (t == prev) return;
+
+    uint64_t now = rdtsc();
+    prev->runtime += now - prev->run_start;
+    if (prev->state == TASK_READY) {
+        prev->nivcsw++;
+    } else {
+        prev->nvcsw++;
+    }
+    t->run_start = now;
+    t->switches++;
+    if (t->wake_tsc) {
+        uint64_t lat64 = now - t->wake_tsc;
+        uint32_t lat = (lat64 >> 32) ? 0xFFFFFFFF : (uint32_t)lat64;
+        t->lat_total += lat;
+        t->lat_count++;
+        if (lat > t->lat_max) t->lat_max = lat;
+        t->wake_tsc = 0;
     }
+
+    // Interrupts from ring 3 land on the top of the task's own stack
+    if (t->stack) cpu->tss.esp0 = (uint32_t)t->stack + TASK_STACK_PAGES * PAGE_SIZE;
+    paging_switch(t->page_dir);
+    syscall_set_user(t->page_dir != NULL);
+
+    cpu->current = t;
+    switch_context(&prev->esp, t->esp);
+
+    // Back on our own stack, possibly much later and on another CPU
+    reap_tasks();
+}
+
+void schedule() {
+    if (!task_current()) return;
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    schedule_locked();
+    spin_unlock_irqrestore(&sched_lock, flags);
 }
 
 void yield() {
-    run_next_task();
+    schedule();
 }
 
 void run_next_task() {
-    if (task_count == 0) return;
+    schedule();
+}
 
-    for (int i = 0; i < task_count; i++) {
-        current_task = (current_task + 1) % task_count;
-        if (tasks[current_task].active) {
-            tasks[current_task].function();
-            break;
-        }
+// Timer interrupt: charge this CPU's task one tick. A used-up slice
+// also ends any interactive boost. An idle CPU checks for work to
+// steal every tick.
+void task_tick() {
+    Cpu* cpu = cpu_current();
+    Task* t = cpu->current;
+    if (!t) return;
+
+    if (t == cpu->idle) {
+        if (cpu_count > 1) cpu->need_resched = 1;
+        return;
+    }
+
+    if (t->slice > 0) t->slice--;
+    if (t->slice == 0) {
+        spin_lock(&sched_lock);
+        t->prio = t->base_prio;
+        spin_unlock(&sched_lock);
+        cpu->need_resched = 1;
+    }
+}
+
+// Called on the way out of an interrupt, after EOI
+void task_preempt() {
+    if (cpu_current()->need_resched) {
+        schedule();
+    }
+}
+
+static Task* task_find(int id) {
+    if (!tasks) return NULL;
+    for (int i = 0; i < task_capacity; i++) {
+        if (tasks[i] && tasks[i]->id == id) return tasks[i];
+    }
+    return NULL;
+}
+
+static void task_set_prio(Task* t, int prio) {
+    if (t->state == TASK_READY) {
+        rq_remove(t);
+        t->prio = prio;
+        rq_push(&cpus[t->cpu], t);
+
+        Cpu* cpu = &cpus[t->cpu];
+        if (cpu->current && t->prio < cpu->current->prio) cpu_kick(cpu);
+    } else {
+        t->prio = prio;
+    }
+}
+
+int task_set_priority(int id, int prio) {
+    if (prio < 0 || prio >= TASK_PRIO_LEVELS) return -1;
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* t = task_find(id);
+    int ok = t && t != cpus[t->cpu].idle && t->state != TASK_DEAD;
+    if (ok) {
+        t->base_prio = prio;
+        task_set_prio(t, prio);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return ok ? 0 : -1;
+}
+
+// Input arrived for t: run it ahead of CPU-bound work for one fresh slice
+void task_boost(Task* t) {
+    if (!t) return;
+
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    if (t->state != TASK_DEAD) {
+        int boosted = t->base_prio > TASK_PRIO_BOOST ? t->base_prio - TASK_PRIO_BOOST : 0;
+        t->slice = timeslice;
+        if (boosted < t->prio) task_set_prio(t, boosted);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Put the current task to sleep; the caller has queued it somewhere,
+// holds sched_lock and disabled interrupts. Returns once task_wake()
+// ran for it, with the lock held again.
+void task_block() {
+    task_current()->state = TASK_BLOCKED;
+    schedule_locked();
+}
+
+void task_wake_locked(Task* t) {
+    if (!t || t->state != TASK_BLOCKED) return;
+
+    t->state = TASK_READY;
+    t->wake_tsc = rdtsc();
+    rq_enqueue(t);
+}
+
+void task_wake(Task* t) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    task_wake_locked(t);
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+void task_sleep_until(uint32_t tick) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* self = task_current();
+
+    self->wake_tick = tick;
+    self->waitq = &sleepers;
+
+    // Keep the list sorted so the timer only ever looks at the head
+    Task* prev = NULL;
+    Task* cur = sleepers.head;
+    while (cur && (int32_t)(cur->wake_tick - tick) <= 0) {
+        prev = cur;
+        cur = cur->wait_next;
     }
-}
\ No newline at end of file
+    self->wait_next = cur;
+    if (prev) {
+        prev->wait_next = self;
+    } else {
+        sleepers.head = self;
+    }
+    if (!cur) sleepers.tail = self;
+
+    task_block();
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Timer interrupt: wake exactly the sleepers whose deadline passed
+void task_timer_wake(uint32_t now) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* t;
+    while ((t = sleepers.head) && (int32_t)(now - t->wake_tick) >= 0) {
+        sleepers.head = t->wait_next;
+        if (!sleepers.head) sleepers.tail = NULL;
+        t->wait_next = NULL;
+        t->waitq = NULL;
+        task_wake_locked(t);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+void task_exit() {
+    __asm__ __volatile__ ("cli");
+    spin_lock(&sched_lock);
+    task_current()->state = TASK_DEAD;
+    dead_tasks++;
+    schedule_locked();
+    while (1) {}   // Never resumed
+}
+
+// Ask a task to exit. It does so itself, at a point where it holds no
+// lock or busy flag: between two calls of its task function, or on its
+// way back to ring 3 (task_kill_point). Stopping it anywhere else could
+// leave a driver or the page cache owned by a task that is gone. A task
+// that is asleep or waiting goes once it wakes up.
+int task_kill(int id) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* t = task_find(id);
+    if (!t || !t->stack || t == cpus[t->cpu].idle || t->state == TASK_DEAD) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return -1;
+    }
+
+    t->kill_pending = 1;
+    // Running elsewhere: the interrupt gets it to the check soon
+    if (t->state == TASK_RUNNING && t != task_current()) cpu_kick(&cpus[t->cpu]);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return 0;
+}
+
+// Interrupt and syscall exits call this when they return to ring 3,
+// where the task holds nothing
+void task_kill_point() {
+    if (task_current()->kill_pending) task_exit();
+}
+
+void task_set_timeslice(uint32_t ticks) {
+    timeslice = ticks ? ticks : 1;
+}
+
+uint32_t task_get_timeslice() {
+    return timeslice;
+}
+
+// One load through gs, so it can't be torn by a migration
+Task* task_current() {
+    Task* t;
+    __asm__ __volatile__ ("mov %%gs:4, %0" : "=r"(t));
+    return t;
+}
+
+void task_print() {
+    static const char* state_names[] = { "ready", "running", "dead", "blocked" };
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    for (int i = 0; i < task_capacity; i++) {
+        Task* t = tasks[i];
+        if (!t) continue;
+        putint(t->id);
+        puts("  cpu ");
+        putint(t->cpu);
+        puts("  prio ");
+        putint(t->prio);
+        puts("  ");
+        puts(state_names[t->state]);
+        puts("  ");
+        puts(t->name);
+        putc('\n');
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Copy up to max tasks' accounting for top and friends; returns how many
+int task_stats(TaskStats* out, int max) {
+    int n = 0;
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    uint64_t now = rdtsc();
+    for (int i = 0; i < task_capacity && n < max; i++) {
+        Task* t = tasks[i];
+        if (!t) continue;
+        TaskStats* s = &out[n++];
+        s->id = t->id;
+        s->name = t->name;
+        s->state = t->state;
+        s->cpu = t->cpu;
+        s->prio = t->prio;
+        s->runtime = t->runtime;
+        if (t->state == TASK_RUNNING) s->runtime += now - t->run_start;
+        s->lat_total = t->lat_total;
+        s->lat_max = t->lat_max;
+        s->lat_count = t->lat_count;
+        s->switches = t->switches;
+        s->nvcsw = t->nvcsw;
+        s->nivcsw = t->nivcsw;
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return n;
+}
@@ -5,6 +5,31 @@
 #include "kernel.h"
 #include "fs.h"
 #include "time.h"
+#include "syscall.h"
+#include "cpu.h"
+#include "ioring.h"
+#include "timepage.h"
+#include "task.h"
+#include "wait.h"
+#include "smp.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "seqlock.h"
+#include "atomic.h"
+#include "ring.h"
+#include "async.h"
+#include "process.h"
+#include "paging.h"
+#include "timer.h"
+#include "initrd.h"
+#include "ata.h"
+#include "bcache.h"
+#include "blkq.h"
+#include "fat.h"
+#include "vfs.h"
+#include "pcache.h"
+#include "lz4.h"
+#include "zcache.h"
 
 extern int load_cyclone;
 
@@ -17,7 +42,13 @@ void test_0div() {
 
 void test_fs() {
     fs_init();
-    fs_debug_list();
+    FsIter it = { 0 };
+    FsDirent e;
+    while (fs_readdir("/Saved", &it, &e)) {
+        puts("-> /Saved/");
+        puts(e.name);
+        newline();
+    }
 
     const char* content = fs_read("/Saved/hello.txt");
     if (content) {
@@ -234,6 +265,1283 @@ void string_and_heap_test() {
     free(c);
 }
 
+#define BENCH_SYSCALL_ITERATIONS 10000
+
+typedef int64_t (*syscall_path_t)(int, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+static uint32_t bench_syscall_path(syscall_path_t path) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_SYSCALL_ITERATIONS; i++) {
+        path(SYSCALL_TIME, 0, 0, 0, 0, 0, 0);
+    }
+    return (uint32_t)div64_32(rdtsc() - start, BENCH_SYSCALL_ITERATIONS);
+}
+
+void test_syscall_bench() {
+    if (!syscall_has_sysenter()) {
+        puts("[bench] sysenter unavailable, int 0x80 only\n");
+    }
+
+    // Warm up caches and the TLB before measuring
+    bench_syscall_path(syscall_int80);
+    bench_syscall_path(syscall_sysenter);
+
+    uint32_t int80 = bench_syscall_path(syscall_int80);
+    uint32_t fast = bench_syscall_path(syscall_sysenter);
+
+    puts("[bench] int 0x80 : "); putuint(int80); puts(" cycles/call\n");
+    puts("[bench] sysenter : "); putuint(fast); puts(" cycles/call\n");
+    if (fast) {
+        puts("[bench] speedup  : "); putuint((int80 * 10) / fast / 10);
+        putc('.'); putuint((int80 * 10) / fast % 10); puts("x\n");
+    }
+
+    // The same from ring 3, which is where the calls really come from
+    ProcResult r;
+    int pid = process_spawn("/Apps/sysbench", 0);
+    if (pid < 0 || process_wait(pid, &r) < 0) {
+        puts("[bench] could not run /Apps/sysbench\n");
+    } else if (r.exit_code != 0) {
+        puts("[bench] ring 3 entry paths disagree\n");
+    }
+}
+
+void test_syscall_abi() {
+    extern volatile uint32_t tick_count;
+
+    int64_t t1 = syscall_int80(SYSCALL_TIME, 0, 0, 0, 0, 0, 0);
+    int64_t t2 = syscall_sysenter(SYSCALL_TIME, 0, 0, 0, 0, 0, 0);
+    puts("[abi] int 0x80 time = "); putint((int)t1); putc('\n');
+    puts("[abi] sysenter time = "); putint((int)t2); putc('\n');
+    puts((t1 <= t2 && t2 <= tick_count) ? "[abi] SYSCALL_TIME ok\n" : "[abi] SYSCALL_TIME wrong\n");
+
+    uint64_t before = rdtsc();
+    uint64_t c1 = (uint64_t)syscall_int80(SYSCALL_CYCLES, 0, 0, 0, 0, 0, 0);
+    uint64_t c2 = (uint64_t)syscall_sysenter(SYSCALL_CYCLES, 0, 0, 0, 0, 0, 0);
+    uint64_t after = rdtsc();
+    puts("[abi] cycles high = "); puthex((uint32_t)(c2 >> 32)); putc('\n');
+    puts((before <= c1 && c1 <= c2 && c2 <= after) ? "[abi] 64-bit return ok\n" : "[abi] 64-bit return wrong\n");
+
+    uint32_t avg[3] = { ~0u, ~0u, ~0u };
+    int ncpu = syscall(SYSCALL_LOADAVG, (uint32_t)avg, 0, 0);
+    puts("[abi] loadavg: "); putuint(avg[0]); putc(' '); putuint(avg[1]); putc(' ');
+    putuint(avg[2]); puts(" hundredths, "); putint(ncpu); puts(" CPUs\n");
+    puts(ncpu == cpu_count && avg[2] != ~0u ? "[abi] SYSCALL_LOADAVG ok\n" : "[abi] SYSCALL_LOADAVG wrong\n");
+}
+
+#define BENCH_RING_CHARS 192
+
+static IoRing bench_ring;
+static IoRing spare_rings[MAX_IORINGS];
+
+void test_ioring() {
+    const char* pattern = "hoot";
+    int traps = 0;
+
+    // One trap per character
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_RING_CHARS; i++) {
+        syscall(SYSCALL_PUTCHAR, pattern[i & 3], 0, 0);
+        traps++;
+    }
+    uint32_t direct = (uint32_t)(rdtsc() - start);
+    puts("\n[ring] putchar: "); putint(traps); puts(" traps, ");
+    putuint(direct / 1000); puts("k cycles\n");
+
+    // Same output through the ring, one trap per full batch
+    int id = ioring_setup(&bench_ring, 0);
+    if (id < 0) {
+        puts("[ring] setup failed\n");
+        return;
+    }
+
+    traps = 0;
+    start = rdtsc();
+    for (int i = 0; i < BENCH_RING_CHARS; i++) {
+        IoSqe* sqe = ioring_get_sqe(&bench_ring);
+        if (!sqe) {
+            ioring_submit(&bench_ring, id);
+            traps++;
+            while (ioring_peek_cqe(&bench_ring)) ioring_cqe_seen(&bench_ring);
+            sqe = ioring_get_sqe(&bench_ring);
+        }
+        ioring_prep(sqe, IORING_OP_PUTCHAR, pattern[i & 3], 0, 0);
+    }
+    ioring_submit(&bench_ring, id);
+    traps++;
+    uint32_t batched = (uint32_t)(rdtsc() - start);
+    while (ioring_peek_cqe(&bench_ring)) ioring_cqe_seen(&bench_ring);
+    ioring_exit(id);
+    puts("\n[ring] batched: "); putint(traps); puts(" traps, ");
+    putuint(batched / 1000); puts("k cycles\n");
+
+    // Poll mode: the timer drains the ring, the task never traps
+    IoRing* polled = (IoRing*)malloc(sizeof(IoRing));
+    int pid = polled ? ioring_setup(polled, IORING_SETUP_POLL) : -1;
+    if (pid < 0) {
+        puts("[ring] poll setup failed\n");
+        return;
+    }
+    IoSqe* sqe = ioring_get_sqe(polled);
+    ioring_prep(sqe, IORING_OP_WRITE, (uint32_t)"[ring] written by the kernel, no trap\n", 0, 0);
+    sqe->user_data = 42;
+    ioring_submit(polled, pid);
+
+    IoCqe* cqe;
+    while (!(cqe = ioring_peek_cqe(polled))) {
+        __asm__ __volatile__ ("sti; hlt");
+    }
+    puts(cqe->user_data == 42 ? "[ring] poll completion ok\n" : "[ring] poll completion wrong\n");
+    ioring_cqe_seen(polled);
+    ioring_exit(pid);
+    free(polled);
+
+    // The same from ring 3. It exits with a ring still registered, which
+    // must be dropped once it is reaped: then every slot is free again.
+    ProcResult r;
+    pid = process_spawn("/Apps/ringtest", 0);
+    if (pid < 0 || process_wait(pid, &r) < 0) {
+        puts("[ring] could not run /Apps/ringtest\n");
+        return;
+    }
+    sleep_t(2);
+    int ids[MAX_IORINGS];
+    int got = 0;
+    for (int i = 0; i < MAX_IORINGS; i++) {
+        ids[i] = ioring_setup(&spare_rings[i], 0);
+        if (ids[i] >= 0) got++;
+    }
+    for (int i = 0; i < MAX_IORINGS; i++) {
+        if (ids[i] >= 0) ioring_exit(ids[i]);
+    }
+    puts(r.exit_code == 0 ? "[ring] ring 3 exited ok\n" : "[ring] ring 3 exited with an error\n");
+    puts(got == MAX_IORINGS ? "[ring] exited process's ring dropped ok\n" : "[ring] exited process's ring leaked\n");
+}
+
+void test_timepage() {
+    uint64_t ticks = timepage_ticks(&time_page);
+    int sys_ticks = syscall(SYSCALL_TIME, 0, 0, 0);
+    puts("[time] page ticks = "); putuint((uint32_t)ticks);
+    puts(", syscall ticks = "); putint(sys_ticks); putc('\n');
+
+    uint64_t a = timepage_ns(&time_page);
+    sleep_t(3);
+    uint64_t b = timepage_ns(&time_page);
+    puts("[time] 3 ticks measured as "); putuint((uint32_t)div64_32(b - a, 1000)); puts(" us\n");
+    puts("[time] TSC per tick = "); putuint(time_page.tsc_per_tick); putc('\n');
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_SYSCALL_ITERATIONS; i++) {
+        timepage_ns(&time_page);
+    }
+    uint32_t page = (uint32_t)div64_32(rdtsc() - start, BENCH_SYSCALL_ITERATIONS);
+    uint32_t trap = bench_syscall_path(syscall6);
+    puts("[time] page read: "); putuint(page); puts(" cycles, syscall: ");
+    putuint(trap); puts(" cycles\n");
+}
+
+static WaitQueue test_wq = WAIT_QUEUE_INIT;
+static volatile int test_wq_flag = 0;
+static volatile int test_wq_wakeups = 0;
+
+static void test_waiter_task() {
+    wait_event(test_wq, test_wq_flag);
+    test_wq_flag = 0;
+    test_wq_wakeups++;
+}
+
+void test_wait_queue() {
+    int id = register_task("waiter", test_waiter_task);
+    if (id < 0) {
+        puts("[wait] could not spawn waiter\n");
+        return;
+    }
+
+    sleep_t(2);
+    puts("[wait] before wake_up: "); putint(test_wq_wakeups); puts(" wakeups\n");
+
+    for (int i = 0; i < 3; i++) {
+        test_wq_flag = 1;
+        wake_up(&test_wq);
+        sleep_t(1);
+    }
+    puts("[wait] after 3 wake_ups: "); putint(test_wq_wakeups); puts(" wakeups\n");
+    puts(test_wq_wakeups == 3 ? "[wait] ok\n" : "[wait] wrong wakeup count\n");
+
+    extern volatile uint32_t tick_count;
+    uint32_t start = tick_count;
+    sleep_t(5);
+    puts("[wait] sleep_t(5) took "); putuint(tick_count - start); puts(" ticks\n");
+
+    // The waiter goes at its next safe point, once it is woken
+    task_kill(id);
+    test_wq_flag = 1;
+    wake_up(&test_wq);
+}
+
+#define BENCH_CSUM_BYTES  (4 * 1024 * 1024)
+#define BENCH_CSUM_CHUNK  (64 * 1024)
+#define BENCH_CSUM_PASSES 4
+#define BENCH_CSUM_JOBS   (BENCH_CSUM_PASSES * (BENCH_CSUM_BYTES / BENCH_CSUM_CHUNK))
+
+static const uint32_t* csum_buf;
+static volatile uint32_t csum_next_job;
+static volatile uint32_t csum_total;
+static volatile int csum_finished;
+static WaitQueue csum_wq = WAIT_QUEUE_INIT;
+
+// Fletcher-style sum of one chunk; chunk sums are added, so the result
+// doesn't depend on which worker took which chunk
+static uint32_t csum_chunk(uint32_t job) {
+    const uint32_t* p = csum_buf + (job % (BENCH_CSUM_BYTES / BENCH_CSUM_CHUNK)) * (BENCH_CSUM_CHUNK / 4);
+    uint32_t a = 1, b = 0;
+    for (int i = 0; i < BENCH_CSUM_CHUNK / 4; i++) {
+        a += p[i];
+        b += a;
+    }
+    return a ^ (b << 1);
+}
+
+static void csum_worker() {
+    uint32_t sum = 0;
+    uint32_t job;
+    while ((job = __sync_fetch_and_add(&csum_next_job, 1)) < BENCH_CSUM_JOBS) {
+        sum += csum_chunk(job);
+    }
+    __sync_fetch_and_add(&csum_total, sum);
+    __sync_fetch_and_add(&csum_finished, 1);
+    wake_up(&csum_wq);
+    task_exit();
+}
+
+void test_parallel_checksum() {
+    uint32_t* buf = (uint32_t*)pmm_alloc_pages(BENCH_CSUM_BYTES / PAGE_SIZE);
+    if (!buf) {
+        puts("[smp] no memory for the buffer\n");
+        return;
+    }
+    for (uint32_t i = 0; i < BENCH_CSUM_BYTES / 4; i++) {
+        buf[i] = i * 2654435761u;
+    }
+    csum_buf = buf;
+
+    uint64_t start = rdtsc();
+    uint32_t expected = 0;
+    for (uint32_t job = 0; job < BENCH_CSUM_JOBS; job++) {
+        expected += csum_chunk(job);
+    }
+    uint32_t serial = (uint32_t)((rdtsc() - start) >> 10);
+
+    int workers = cpu_count;
+    csum_next_job = 0;
+    csum_total = 0;
+    csum_finished = 0;
+
+    start = rdtsc();
+    for (int i = 0; i < workers; i++) {
+        if (register_task("csum", csum_worker) < 0) {
+            workers = i;
+            break;
+        }
+    }
+    wait_event(csum_wq, csum_finished == workers);
+    uint32_t parallel = (uint32_t)((rdtsc() - start) >> 10);
+
+    puts("[smp] CPUs online: "); putint(cpu_count); putc('\n');
+    puts("[smp] 1 task    : "); putuint(serial); puts(" kcycles\n");
+    puts("[smp] "); putint(workers); puts(" workers : "); putuint(parallel); puts(" kcycles\n");
+    if (parallel) {
+        puts("[smp] speedup   : "); putuint((serial * 10) / parallel / 10);
+        putc('.'); putuint((serial * 10) / parallel % 10); puts("x\n");
+    }
+    puts(csum_total == expected ? "[smp] checksum ok\n" : "[smp] checksum mismatch\n");
+
+    pmm_free_pages(buf, BENCH_CSUM_BYTES / PAGE_SIZE);
+}
+
+#define STRESS_ITERATIONS 20000
+#define STRESS_RING_SIZE  256
+
+static spinlock_t stress_spin = SPINLOCK_INIT;
+static ticketlock_t stress_ticket = TICKETLOCK_INIT;
+static seqlock_t stress_seq = SEQLOCK_INIT;
+static volatile uint32_t stress_spin_count;
+static volatile uint32_t stress_ticket_count;
+static atomic_t stress_atomic;
+static atomic_t stress_next_worker;
+static atomic_t stress_finished;
+static atomic_t stress_errors;
+static volatile uint32_t stress_seq_a, stress_seq_b;
+
+static MpscSlot stress_mpsc_slots[STRESS_RING_SIZE];
+static MpscRing stress_mpsc;
+static void* stress_spsc_slots[STRESS_RING_SIZE];
+static SpscRing stress_spsc;
+
+static void stress_worker() {
+    int me = atomic_fetch_add(&stress_next_worker, 1);
+
+    for (uint32_t i = 1; i <= STRESS_ITERATIONS; i++) {
+        // Non-atomic increments: only correct if the locks exclude
+        spin_lock(&stress_spin);
+        stress_spin_count = stress_spin_count + 1;
+        spin_unlock(&stress_spin);
+
+        ticket_lock(&stress_ticket);
+        stress_ticket_count = stress_ticket_count + 1;
+        ticket_unlock(&stress_ticket);
+
+        atomic_inc(&stress_atomic);
+
+        while (!mpsc_push(&stress_mpsc, (void*)i)) cpu_relax();
+        if (me == 0) {
+            while (!spsc_push(&stress_spsc, (void*)i)) cpu_relax();
+        }
+
+        if ((i & 15) == 0) {
+            uint32_t flags = write_seqlock_irqsave(&stress_seq);
+            stress_seq_a = i;
+            stress_seq_b = ~i;
+            write_sequnlock_irqrestore(&stress_seq, flags);
+        } else {
+            uint32_t seq, a, b;
+            do {
+                seq = read_seqbegin(&stress_seq);
+                a = stress_seq_a;
+                b = stress_seq_b;
+            } while (read_seqretry(&stress_seq, seq));
+            if (b != ~a) atomic_inc(&stress_errors);
+        }
+
+        if ((i & 63) == 0) {
+            uint8_t* p = malloc(32);
+            if (!p) continue;
+            memset(p, me, 32);
+            for (int k = 0; k < 32; k++) {
+                if (p[k] != (uint8_t)me) atomic_inc(&stress_errors);
+            }
+            free(p);
+        }
+    }
+
+    atomic_inc(&stress_finished);
+    task_exit();
+}
+
+static void stress_report(const char* name, uint32_t got, uint32_t want) {
+    puts("[sync] "); puts(name); puts(": "); putuint(got);
+    puts(got == want ? " ok\n" : " WRONG\n");
+}
+
+void test_sync_stress() {
+    int workers = cpu_count + 1;   // At least one CPU is shared, so preemption is in the mix
+    stress_spin_count = 0;
+    stress_ticket_count = 0;
+    stress_seq_a = 0;
+    stress_seq_b = ~0u;
+    atomic_set(&stress_atomic, 0);
+    atomic_set(&stress_next_worker, 0);
+    atomic_set(&stress_finished, 0);
+    atomic_set(&stress_errors, 0);
+    mpsc_init(&stress_mpsc, stress_mpsc_slots, STRESS_RING_SIZE);
+    spsc_init(&stress_spsc, stress_spsc_slots, STRESS_RING_SIZE);
+
+    for (int i = 0; i < workers; i++) {
+        if (register_task("stress", stress_worker) < 0) {
+            puts("[sync] could not spawn workers\n");
+            return;
+        }
+    }
+
+    // Single consumer for both rings
+    uint64_t mpsc_sum = 0;
+    uint32_t spsc_expect = 1;
+    int spsc_in_order = 1;
+    while (1) {
+        int done = atomic_read(&stress_finished) == workers;
+        int got = 0;
+        void* item;
+        while (mpsc_pop(&stress_mpsc, &item)) {
+            mpsc_sum += (uint32_t)item;
+            got = 1;
+        }
+        while (spsc_pop(&stress_spsc, &item)) {
+            if ((uint32_t)item != spsc_expect) spsc_in_order = 0;
+            spsc_expect++;
+            got = 1;
+        }
+        if (done && !got) break;
+        if (!got) yield();
+    }
+
+    uint32_t total = workers * STRESS_ITERATIONS;
+    uint64_t want_sum = (uint64_t)workers * ((uint64_t)STRESS_ITERATIONS * (STRESS_ITERATIONS + 1) / 2);
+    puts("[sync] "); putint(workers); puts(" workers on "); putint(cpu_count); puts(" CPUs\n");
+    stress_report("spinlock", stress_spin_count, total);
+    stress_report("ticket lock", stress_ticket_count, total);
+    stress_report("atomic", (uint32_t)atomic_read(&stress_atomic), total);
+    puts(mpsc_sum == want_sum ? "[sync] mpsc ring: sum ok\n" : "[sync] mpsc ring: sum WRONG\n");
+    puts(spsc_in_order && spsc_expect == STRESS_ITERATIONS + 1 ?
+         "[sync] spsc ring: in order\n" : "[sync] spsc ring: WRONG order\n");
+    stress_report("seqlock/heap errors", (uint32_t)atomic_read(&stress_errors), 0);
+}
+
+#define ASYNC_TEST_TASKS 16
+#define ASYNC_TEST_ROUNDS 3
+
+static AsyncTask async_test_tasks[ASYNC_TEST_TASKS];
+static AsyncTask async_irq_task;
+static atomic_t async_test_wakeups;
+static atomic_t async_test_done;
+static volatile uint32_t async_irq_target;
+
+static int async_test_round[ASYNC_TEST_TASKS];
+
+// Sleeps (index % 4) + 1 ticks, three times. The loop counter lives
+// outside the function: locals don't survive a suspension.
+static int async_test_sleeper(AsyncTask* t) {
+    int i = (int)t->data;
+    ASYNC_BEGIN(t);
+    for (async_test_round[i] = 0; async_test_round[i] < ASYNC_TEST_ROUNDS; async_test_round[i]++) {
+        ASYNC_WAIT_TIMEOUT(t, (i & 3) + 1);
+        atomic_inc(&async_test_wakeups);
+    }
+    atomic_inc(&async_test_done);
+    ASYNC_END(t);
+}
+
+// Woken by every timer IRQ until the condition holds
+static int async_test_irq_waiter(AsyncTask* t) {
+    extern volatile uint32_t tick_count;
+    ASYNC_BEGIN(t);
+    ASYNC_WAIT_IRQ(t, 0, (int32_t)(tick_count - async_irq_target) >= 0, 50);
+    puts(t->timed_out ? "[async] irq wait timed out\n" : "[async] irq wait ok\n");
+    atomic_inc(&async_test_done);
+    ASYNC_END(t);
+}
+
+void test_async() {
+    extern volatile uint32_t tick_count;
+    atomic_set(&async_test_wakeups, 0);
+    atomic_set(&async_test_done, 0);
+
+    uint32_t start = tick_count;
+    for (int i = 0; i < ASYNC_TEST_TASKS; i++) {
+        async_spawn(&async_test_tasks[i], "sleeper", async_test_sleeper, (void*)i);
+    }
+    async_irq_target = tick_count + 5;
+    async_spawn(&async_irq_task, "irq-waiter", async_test_irq_waiter, 0);
+
+    while (atomic_read(&async_test_done) < ASYNC_TEST_TASKS + 1 && tick_count - start < 100) {
+        sleep_t(1);
+    }
+
+    puts("[async] "); putint(ASYNC_TEST_TASKS); puts(" coroutines, ");
+    putint(atomic_read(&async_test_wakeups)); puts(" timed wakeups in ");
+    putuint(tick_count - start); puts(" ticks on one executor thread\n");
+    puts(atomic_read(&async_test_wakeups) == ASYNC_TEST_TASKS * ASYNC_TEST_ROUNDS ?
+         "[async] ok\n" : "[async] wrong wakeup count\n");
+}
+
+#define USER_TEST_PROCS 8
+
+void test_user_process() {
+    ProcResult r;
+
+    int pid = process_spawn("/Apps/hello", 0);
+    if (pid < 0 || process_wait(pid, &r) < 0) {
+        puts("[user] could not run /Apps/hello\n");
+        return;
+    }
+    puts(r.exit_code == 0 ? "[user] hello exited ok\n" : "[user] hello exited with an error\n");
+
+    // Kernel memory is supervisor-only: the write must kill just this process
+    pid = process_spawn("/Apps/fault", 0);
+    if (pid >= 0 && process_wait(pid, &r) == 0) {
+        puts(r.exit_code == PROC_EXIT_FAULT(14) ? "[user] fault killed by page fault ok\n"
+                                                : "[user] fault was not stopped\n");
+    }
+
+    puts(process_spawn("/Saved/hello.txt", 0) == PROC_ENOEXEC ? "[user] non-ELF rejected ok\n"
+                                                               : "[user] non-ELF not rejected\n");
+
+    // The text cache (elf.c) keeps hello's and fault's text frames from
+    // now on, so leaks are counted from here, once both are reaped
+    sleep_t(2);
+    size_t frames_before = pmm_free_count();
+
+    // Several copies at once, each in its own address space at the same addresses
+    int pids[USER_TEST_PROCS];
+    for (int i = 0; i < USER_TEST_PROCS; i++) {
+        pids[i] = process_spawn("/Apps/hello", 0);
+    }
+    uint64_t start_total = 0;
+    int ok = 0;
+    for (int i = 0; i < USER_TEST_PROCS; i++) {
+        if (pids[i] >= 0 && process_wait(pids[i], &r) == 0 && r.exit_code == 0) {
+            start_total += r.start_cycles;
+            ok++;
+        }
+    }
+    puts("[user] "); putint(ok); puts("/"); putint(USER_TEST_PROCS);
+    puts(" concurrent runs ok, average start ");
+    putuint(ok ? time_cycles_to_us(div64_32(start_total, ok)) : 0); puts(" us\n");
+
+    // Exited tasks' stacks go back at the next reap
+    sleep_t(2);
+    puts(pmm_free_count() == frames_before ? "[user] no frames leaked\n" : "[user] frames leaked\n");
+}
+
+#define SHARE_TEST_PROCS  10
+#define SHARE_TEST_TABLES 4   // Directory, text, time page and stack page tables
+#define SHARE_TEST_DATA   1   // sleeper's .data/.bss, at least crt0's usys_sysenter
+
+void test_fork_cow() {
+    ProcResult r;
+    int pid = process_spawn("/Apps/forktest", 0);
+    if (pid < 0 || process_wait(pid, &r) < 0) {
+        puts("[fork] could not run /Apps/forktest\n");
+        return;
+    }
+    puts(r.exit_code == 0 ? "[fork] copy-on-write ok\n" : "[fork] copy-on-write wrong\n");
+
+    // Warm the text cache, then see what each further copy costs while
+    // they all sleep
+    pid = process_spawn("/Apps/sleeper", 0);
+    if (pid >= 0) process_wait(pid, &r);
+    sleep_t(2);
+
+    size_t before = pmm_free_count();
+    int pids[SHARE_TEST_PROCS];
+    for (int i = 0; i < SHARE_TEST_PROCS; i++) {
+        pids[i] = process_spawn("/Apps/sleeper", 0);
+    }
+    sleep_t(10);
+    size_t used = before - pmm_free_count();
+
+    puts("[fork] "); putint(SHARE_TEST_PROCS); puts(" sleepers use ");
+    putuint(used); puts(" frames, ");
+    putuint(used / SHARE_TEST_PROCS); puts(" per copy (kernel stack ");
+    putint(TASK_STACK_PAGES); puts(", user stack "); putint(USER_STACK_PAGES);
+    puts(", text shared)\n");
+    size_t bound = TASK_STACK_PAGES + USER_STACK_PAGES + SHARE_TEST_TABLES + SHARE_TEST_DATA;
+    puts(used / SHARE_TEST_PROCS <= bound ? "[fork] per-copy cost ok\n" : "[fork] per-copy cost wrong\n");
+
+    for (int i = 0; i < SHARE_TEST_PROCS; i++) {
+        if (pids[i] >= 0) process_wait(pids[i], &r);
+    }
+}
+
+#define FS_TEST_FILES 2000
+#define FS_TEST_NAME  16
+
+void test_fs_table() {
+    // Names live in frames: 2000 of them would eat most of the heap
+    size_t pages = (FS_TEST_FILES * FS_TEST_NAME + PAGE_SIZE - 1) / PAGE_SIZE;
+    char* names = (char*)pmm_alloc_pages(pages);
+    if (!names) {
+        puts("[fs] out of memory\n");
+        return;
+    }
+
+    uint32_t base = fs_count();
+    int added = 0;
+    for (int i = 0; i < FS_TEST_FILES; i++) {
+        char* name = names + i * FS_TEST_NAME;
+        strcpy(name, "/Tmp/f");
+        int_to_ascii(i, name + 6);
+        added += fs_add(name, "x");
+    }
+    puts("[fs] added "); putint(added); puts(" files, table holds ");
+    putuint(fs_count()); putc('\n');
+
+    uint64_t start = rdtsc();
+    int found = 0;
+    FsStat st;
+    for (int i = 0; i < FS_TEST_FILES; i++) {
+        found += fs_stat(names + i * FS_TEST_NAME, &st) == 0 && st.size == 1;
+    }
+    uint32_t per_lookup = (uint32_t)div64_32(rdtsc() - start, FS_TEST_FILES);
+    puts("[fs] "); putint(found); puts(" lookups ok, ");
+    putuint(per_lookup); puts(" cycles each\n");
+
+    int removed = 0;
+    for (int i = 0; i < FS_TEST_FILES; i += 2) {
+        removed += fs_remove(names + i * FS_TEST_NAME) == 0;
+    }
+    int gone = 0, kept = 0;
+    for (int i = 0; i < FS_TEST_FILES; i++) {
+        int present = fs_stat(names + i * FS_TEST_NAME, &st) == 0;
+        if (i % 2) kept += present; else gone += !present;
+    }
+    puts(removed == FS_TEST_FILES / 2 && gone == FS_TEST_FILES / 2 && kept == FS_TEST_FILES / 2 ?
+         "[fs] remove ok\n" : "[fs] remove wrong\n");
+
+    for (int i = 1; i < FS_TEST_FILES; i += 2) {
+        fs_remove(names + i * FS_TEST_NAME);
+    }
+    puts(fs_count() == base ? "[fs] table back to its old size\n" : "[fs] entries left over\n");
+    pmm_free_pages(names, pages);
+}
+
+#define LOG_APPENDS 1024
+#define LOG_LINE    64
+#define LOG_WINDOW  128
+
+void test_fs_write() {
+    const char* log = "/Saved/log.txt";
+    FsStat st;
+    if (fs_stat(log, &st) < 0) {
+        puts("[fs] no log file\n");
+        return;
+    }
+    uint32_t base = st.size;
+
+    char line[LOG_LINE];
+    memset(line, '.', LOG_LINE - 1);
+    line[LOG_LINE - 1] = '\n';
+
+    // Appending only touches the tail, so the last appends to a 64 KB
+    // file should cost about what the first ones did
+    uint64_t first = 0, last = 0;
+    int failed = 0;
+    for (int i = 0; i < LOG_APPENDS; i++) {
+        int_to_ascii(i, line);
+        uint64_t start = rdtsc();
+        failed += fs_append(log, line, LOG_LINE) < 0;
+        uint64_t cycles = rdtsc() - start;
+        if (i < LOG_WINDOW) first += cycles;
+        if (i >= LOG_APPENDS - LOG_WINDOW) last += cycles;
+    }
+    fs_stat(log, &st);
+    puts("[fs] "); putint(LOG_APPENDS - failed); puts(" appends, log is ");
+    putuint(st.size); puts(" bytes in "); putuint(st.pages); puts(" pages\n");
+    puts("[fs] first appends "); putuint((uint32_t)div64_32(first, LOG_WINDOW));
+    puts(" cycles, last "); putuint((uint32_t)div64_32(last, LOG_WINDOW)); puts("\n");
+
+    // A line that straddles a page boundary reads back whole
+    char buf[LOG_LINE];
+    int ok = st.size == base + LOG_APPENDS * LOG_LINE;
+    for (int i = 0; i < LOG_APPENDS && ok; i += 97) {
+        char expect[12];
+        int_to_ascii(i, expect);
+        int n = fs_read_at(log, base + i * LOG_LINE, buf, LOG_LINE);
+        ok = n == LOG_LINE && strncmp(buf, expect, strlen(expect)) == 0 && buf[LOG_LINE - 1] == '\n';
+    }
+    ok = ok && fs_read_at(log, st.size, buf, LOG_LINE) == 0;
+    puts(ok ? "[fs] read_at ok\n" : "[fs] read_at wrong\n");
+
+    // Back to the original log; the freed tail must not come back
+    fs_truncate(log, base);
+    fs_truncate(log, base + 16);
+    fs_read_at(log, base, buf, 16);
+    int zeroed = 1;
+    for (int i = 0; i < 16; i++) zeroed &= buf[i] == 0;
+    fs_truncate(log, base);
+    fs_stat(log, &st);
+    const char* content = fs_read(log);
+    ok = zeroed && st.size == base && st.pages == 1 && content && strlen(content) == base;
+    puts(ok ? "[fs] truncate ok\n" : "[fs] truncate wrong\n");
+}
+
+
+#define DIR_DEPTH   8
+#define DIR_LOOKUPS 1000
+
+// Average cycles for one uncached fs_stat of path
+static uint32_t time_lookup(const char* path) {
+    FsStat st;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < DIR_LOOKUPS; i++) {
+        fs_dcache_drop();
+        fs_stat(path, &st);
+    }
+    return (uint32_t)div64_32(rdtsc() - start, DIR_LOOKUPS);
+}
+
+void test_fs_dirs() {
+    char path[FS_PATH_MAX];
+    char norm[FS_PATH_MAX];
+    int ok = fs_normalize("/Saved", "../Apps/./hello", norm, sizeof(norm)) == 0 && strcmp(norm, "/Apps/hello") == 0 &&
+             fs_normalize("/a/b", "..//..", norm, sizeof(norm)) == 0 && strcmp(norm, "/") == 0 &&
+             fs_normalize("/", "x//y/", norm, sizeof(norm)) == 0 && strcmp(norm, "/x/y") == 0;
+    puts(ok ? "[fs] normalize ok\n" : "[fs] normalize wrong\n");
+
+    // /Tmp/d/d/d... with a file at every level
+    strcpy(path, "/Tmp");
+    ok = 1;
+    for (int i = 0; i < DIR_DEPTH; i++) {
+        strcat(path, "/d");
+        ok &= fs_mkdir(path) == 0;
+    }
+    ok &= fs_mkdir(path) < 0 && fs_mkdir("/Tmp/none/d") < 0 && !fs_add("/Tmp/none/f", "x");
+    strcat(path, "/f");
+    ok &= fs_add(path, "deep");
+    const char* content = fs_read(path);
+    ok &= content && strcmp(content, "deep") == 0;
+    puts(ok ? "[fs] mkdir ok\n" : "[fs] mkdir wrong\n");
+
+    // Cost follows the depth, not how many files there are
+    uint32_t shallow = time_lookup("/Tmp/d");
+    uint32_t deep = time_lookup(path);
+    uint32_t before = fs_count();
+    char name[16];
+    for (int i = 0; i < 500; i++) {
+        strcpy(name, "/Tmp/n");
+        int_to_ascii(i, name + 6);
+        fs_add(name, "");
+    }
+    uint32_t deep_full = time_lookup(path);
+    puts("[fs] lookup depth 2: "); putuint(shallow);
+    puts(" cycles, depth "); putint(DIR_DEPTH + 2); puts(": "); putuint(deep);
+    puts(", with 500 more files: "); putuint(deep_full); puts("\n");
+
+    uint32_t hits, misses, hits2, misses2;
+    FsStat st;
+    fs_dcache_stats(&hits, &misses);
+    uint64_t start = rdtsc();
+    for (int i = 0; i < DIR_LOOKUPS; i++) fs_stat(path, &st);
+    uint32_t cached = (uint32_t)div64_32(rdtsc() - start, DIR_LOOKUPS);
+    fs_dcache_stats(&hits2, &misses2);
+    puts("[fs] cached: "); putuint(cached); puts(" cycles, ");
+    putuint(hits2 - hits); puts(" hits, "); putuint(misses2 - misses); puts(" misses\n");
+
+    // Directories only go once they are empty
+    ok = fs_remove("/Tmp/d") < 0;
+    for (int i = 0; i < 500; i++) {
+        strcpy(name, "/Tmp/n");
+        int_to_ascii(i, name + 6);
+        fs_remove(name);
+    }
+    fs_remove(path);
+    for (int i = DIR_DEPTH; i > 0; i--) {
+        path[strlen(path) - 2] = '\0';
+        ok &= fs_remove(path) == 0;
+    }
+    ok &= fs_count() == before - DIR_DEPTH - 1 && fs_stat("/Tmp/d", &st) < 0;
+    puts(ok ? "[fs] remove ok\n" : "[fs] remove wrong\n");
+}
+
+
+void test_initrd() {
+    const InitrdInfo* info = initrd_info();
+    if (!info->start) {
+        puts("[initrd] no initrd module, check grub.cfg\n");
+        return;
+    }
+    puts("[initrd] module at "); puthex(info->start);
+    puts(", "); putuint(info->size); puts(" bytes, ");
+    putuint(info->files); puts(" files, "); putuint(info->dirs); puts(" directories\n");
+
+    // Served straight out of the module
+    uint32_t size;
+    const char* motd = (const char*)fs_read_static("/Saved/motd.txt", &size);
+    int inside = motd && (uint32_t)motd >= info->start && (uint32_t)motd + size <= info->start + info->size;
+    puts(inside ? "[initrd] motd.txt is zero-copy\n" : "[initrd] motd.txt missing or copied\n");
+
+    char buf[129];
+    int n = fs_read_at("/Saved/motd.txt", 0, buf, sizeof(buf) - 1);
+    if (n > 0) {
+        buf[n] = '\0';
+        puts(buf);
+    }
+
+    // fs_read needs a terminator, but must not copy the file out of the module
+    const char* text = fs_read("/Saved/motd.txt");
+    int same = inside && text && fs_read_static("/Saved/motd.txt", &size) == motd && strncmp(text, motd, size) == 0;
+    puts(same ? "[initrd] fs_read kept motd.txt zero-copy\n" : "[initrd] fs_read copied motd.txt\n");
+}
+
+
+#define BC_SECTORS 64
+#define BC_REPEAT  16
+
+void test_block_cache() {
+    const AtaDrive* d = ata_drive();
+    if (!d->present) {
+        puts("[disk] no disk, attach one with -drive file=disk.img,format=raw\n");
+        return;
+    }
+    puts("[disk] "); puts(d->model); puts(", "); putuint(d->sectors); puts(" sectors, ");
+    puts(d->dma ? "DMA\n" : "PIO\n");
+
+    // First pass comes from the disk, the rest from the cache only
+    bcache_drop();
+    AtaStats before, after;
+    ata_stats(&before);
+    uint64_t start = rdtsc();
+    int ok = 1;
+    for (int i = 0; i < BC_SECTORS && ok; i++) {
+        Buf* b = bread(i);
+        ok = b != NULL;
+        if (b) brelse(b);
+    }
+    uint32_t cold = (uint32_t)div64_32(rdtsc() - start, BC_SECTORS);
+
+    start = rdtsc();
+    for (int r = 0; r < BC_REPEAT && ok; r++) {
+        for (int i = 0; i < BC_SECTORS && ok; i++) {
+            Buf* b = bread(i);
+            ok = b != NULL;
+            if (b) brelse(b);
+        }
+    }
+    uint32_t hot = (uint32_t)div64_32(rdtsc() - start, BC_SECTORS * BC_REPEAT);
+    ata_stats(&after);
+    puts("[disk] cold read "); putuint(cold); puts(" cycles, cached "); putuint(hot);
+    puts(", device reads "); putuint(after.reads - before.reads); puts("\n");
+    puts(ok && after.sectors_read - before.sectors_read == BC_SECTORS ?
+         "[disk] hot blocks never hit the device\n" : "[disk] cache missed\n");
+
+    // Write the last sector through the cache, read it back from the
+    // disk, then put the old contents back
+    uint32_t lba = d->sectors - 1;
+    static uint8_t saved[ATA_SECTOR_SIZE];
+    Buf* b = bread(lba);
+    if (!b) {
+        puts("[disk] read failed\n");
+        return;
+    }
+    memcpy(saved, b->data, ATA_SECTOR_SIZE);
+    for (int i = 0; i < ATA_SECTOR_SIZE; i++) b->data[i] = (uint8_t)(i ^ 0x5A);
+    bdirty(b);
+    brelse(b);
+    bcache_drop();
+
+    b = bread(lba);
+    ok = b != NULL;
+    for (int i = 0; ok && i < ATA_SECTOR_SIZE; i++) ok = b->data[i] == (uint8_t)(i ^ 0x5A);
+    if (b) {
+        memcpy(b->data, saved, ATA_SECTOR_SIZE);
+        bdirty(b);
+        brelse(b);
+    }
+    puts(ok && bsync() == 0 ? "[disk] write back ok\n" : "[disk] write back wrong\n");
+}
+
+
+#define BQ_SECTORS 1024
+#define BQ_DIRTY   64
+
+void test_block_queue() {
+    const AtaDrive* d = ata_drive();
+    if (!d->present || d->sectors < BQ_SECTORS) {
+        puts("[blkq] needs a disk of at least 512 KB\n");
+        return;
+    }
+
+    // A sequential scan: read-ahead should turn it into a few big reads
+    bcache_drop();
+    AtaStats a0, a1;
+    BcacheStats c0, c1;
+    BlkStats q0, q1;
+    ata_stats(&a0);
+    bcache_stats(&c0);
+    blk_stats(&q0);
+    uint64_t start = rdtsc();
+    int ok = 1;
+    for (uint32_t i = 0; i < BQ_SECTORS && ok; i++) {
+        Buf* b = bread(i);
+        ok = b != NULL;
+        if (b) brelse(b);
+    }
+    uint64_t cycles = rdtsc() - start;
+    ata_stats(&a1);
+    bcache_stats(&c1);
+    blk_stats(&q1);
+    puts("[blkq] "); putuint(BQ_SECTORS); puts(" sequential sectors in ");
+    putuint(a1.reads - a0.reads); puts(" disk reads, ");
+    putuint((uint32_t)div64_32(cycles, BQ_SECTORS)); puts(" cycles each\n");
+    puts("[blkq] read-ahead "); putuint(c1.ra_sectors - c0.ra_sectors); puts(" sectors, ");
+    putuint(c1.ra_hits - c0.ra_hits); puts(" used, window "); putuint(c1.ra_window); puts("\n");
+    puts(ok && a1.reads - a0.reads < BQ_SECTORS / 8 ? "[blkq] read-ahead ok\n" : "[blkq] read-ahead wrong\n");
+
+    // Dirty a run of sectors back to front (same contents, so nothing
+    // changes on disk); writeback should merge them into one command
+    for (int i = BQ_DIRTY - 1; i >= 0; i--) {
+        Buf* b = bread(i);
+        if (!b) break;
+        bdirty(b);
+        brelse(b);
+    }
+    ata_stats(&a0);
+    blk_stats(&q0);
+    ok = bsync() == 0;
+    ata_stats(&a1);
+    blk_stats(&q1);
+    puts("[blkq] "); putuint(BQ_DIRTY); puts(" dirty sectors written in ");
+    putuint(a1.writes - a0.writes); puts(" commands, ");
+    putuint(q1.back_merges + q1.front_merges + q1.joins - q0.back_merges - q0.front_merges - q0.joins);
+    puts(" merges, max depth "); putuint(q1.max_depth); puts("\n");
+    puts(ok && a1.writes - a0.writes == 1 ? "[blkq] write merging ok\n" : "[blkq] write merging wrong\n");
+}
+
+#define FT_SIZE  20000   // Several clusters at any common cluster size
+#define FT_SEEKS 64
+
+void test_fat() {
+    if (!fat_mounted()) {
+        puts("[fat] nothing mounted, format disk.img with mkfs.fat -F 16\n");
+        return;
+    }
+    static uint8_t data[FT_SIZE], back[FT_SIZE];
+    FatStats s0, s1;
+    fat_stats(&s0);
+    puts("[fat] FAT"); putuint(s0.type); puts(", "); putuint(s0.cluster_size);
+    puts("-byte clusters, "); putuint(s0.free); puts(" free\n");
+
+    fs_remove("/Disk/fattest/data.bin");
+    fs_remove("/Disk/fattest");
+    fat_stats(&s0);
+    uint32_t free_before = s0.free;
+    int ok = fs_mkdir("/Disk/fattest") == 0;
+    for (int i = 0; i < FT_SIZE; i++) data[i] = (uint8_t)(i * 7 + (i >> 8));
+    ok = ok && fs_write("/Disk/fattest/data.bin", data, FT_SIZE) == 0;
+    ok = ok && fs_read_at("/Disk/FATTEST/DATA.BIN", 0, back, FT_SIZE) == FT_SIZE;
+    ok = ok && memcmp(data, back, FT_SIZE) == 0;
+    puts(ok ? "[fat] write, read back ok\n" : "[fat] write, read back wrong\n");
+
+    // Scattered reads: the chain is walked once, then every seek is an index
+    fat_stats(&s0);
+    uint64_t start = rdtsc();
+    int seeks_ok = 1;
+    for (int i = 0; i < FT_SEEKS && seeks_ok; i++) {
+        uint32_t off = (uint32_t)(i * 7919) % (FT_SIZE - 16);
+        seeks_ok = fs_read_at("/Disk/fattest/data.bin", off, back, 16) == 16 && memcmp(back, data + off, 16) == 0;
+    }
+    uint32_t cycles = (uint32_t)div64_32(rdtsc() - start, FT_SEEKS);
+    fat_stats(&s1);
+    puts("[fat] "); putuint(FT_SEEKS); puts(" seeks, "); putuint(cycles); puts(" cycles each, chain walks ");
+    putuint(s1.chain_misses - s0.chain_misses); puts(", directory scans "); putuint(s1.dir_misses - s0.dir_misses); puts("\n");
+    puts(seeks_ok && s1.chain_misses == s0.chain_misses ? "[fat] cached seeks ok\n" : "[fat] cached seeks wrong\n");
+
+    // Shrink, append, then list and clean up: every cluster comes back
+    ok = fs_truncate("/Disk/fattest/data.bin", 100) == 0;
+    ok = ok && fs_append("/Disk/fattest/data.bin", data + 100, 50) == 0;
+    FsStat st;
+    ok = ok && fs_stat("/Disk/fattest/data.bin", &st) == 0 && st.size == 150;
+    ok = ok && fs_read_at("/Disk/fattest/data.bin", 0, back, FT_SIZE) == 150 && memcmp(data, back, 150) == 0;
+    FsIter it = { 0 };
+    FsDirent e;
+    int listed = 0;
+    while (fs_readdir("/Disk/fattest", &it, &e)) listed += strcmp(e.name, "data.bin") == 0;
+    ok = ok && listed == 1;
+
+    // Names that aren't 8.3 get long name entries; both aliases are NOTES-~N.TXT
+    int lfn_ok = fs_write("/Disk/fattest/notes-2024.txt", data, 10) == 0;
+    lfn_ok = lfn_ok && fs_write("/Disk/fattest/Notes-2025 draft.txt", data, 20) == 0;
+    lfn_ok = lfn_ok && fs_stat("/Disk/fattest/NOTES-2024.TXT", &st) == 0 && st.size == 10;
+    lfn_ok = lfn_ok && fs_stat("/Disk/fattest/notes-2025 DRAFT.txt", &st) == 0 && st.size == 20;
+    memset(&it, 0, sizeof(it));
+    listed = 0;
+    while (fs_readdir("/Disk/fattest", &it, &e)) {
+        listed += strcmp(e.name, "notes-2024.txt") == 0 || strcmp(e.name, "Notes-2025 draft.txt") == 0;
+    }
+    lfn_ok = lfn_ok && listed == 2;
+    lfn_ok = lfn_ok && fs_remove("/Disk/fattest/notes-2024.txt") == 0 &&
+             fs_remove("/Disk/fattest/Notes-2025 draft.txt") == 0;
+    puts(lfn_ok ? "[fat] long names ok\n" : "[fat] long names wrong\n");
+    ok = ok && lfn_ok;
+
+    ok = ok && fs_remove("/Disk/fattest") < 0;   // Not empty
+    ok = ok && fs_remove("/Disk/fattest/data.bin") == 0 && fs_remove("/Disk/fattest") == 0;
+    ok = ok && fs_stat("/Disk/fattest", &st) < 0 && bsync() == 0;
+    fat_stats(&s1);
+    puts(ok && s1.free == free_before ? "[fat] truncate, append, remove ok\n" : "[fat] truncate, append, remove wrong\n");
+}
+
+#define VT_SIZE  (256 * 1024)
+#define VT_PIECE 4096
+
+// Stream VT_SIZE bytes through a descriptor and back, one piece at a
+// time. Returns cycles per KB for the round trip, 0 on a mismatch.
+static uint32_t stream_file(const char* path) {
+    static uint8_t piece[VT_PIECE];
+    int fd = vfs_open(path, VFS_READ | VFS_WRITE | VFS_CREATE | VFS_TRUNC);
+    if (fd < 0) return 0;
+
+    uint64_t start = rdtsc();
+    int ok = 1;
+    for (uint32_t off = 0; off < VT_SIZE && ok; off += VT_PIECE) {
+        for (uint32_t i = 0; i < VT_PIECE; i++) piece[i] = (uint8_t)((off + i) * 13 + (off >> 12));
+        ok = vfs_write(fd, piece, VT_PIECE) == VT_PIECE;
+    }
+    ok = ok && vfs_lseek(fd, 0, VFS_SEEK_SET) == 0;
+    uint32_t total = 0;
+    int n = 0;
+    while (ok && (n = vfs_read(fd, piece, VT_PIECE)) > 0) {
+        for (int i = 0; i < n && ok; i++) {
+            uint32_t at = total + i;
+            ok = piece[i] == (uint8_t)(at * 13 + ((at & ~(VT_PIECE - 1)) >> 12));
+        }
+        total += n;
+    }
+    uint64_t cycles = rdtsc() - start;
+    vfs_close(fd);
+    fs_remove(path);
+    if (!ok || n < 0 || total != VT_SIZE) return 0;
+    return (uint32_t)div64_32(cycles, VT_SIZE / 1024);
+}
+
+void test_vfs() {
+    vfs_print_mounts();
+    puts("\n");
+
+    // Through the tree, then through the FAT volume if there is one
+    uint32_t ram = stream_file("/Tmp/vfstest.bin");
+    puts("[vfs] ramfs: "); puts(ram ? "ok, " : "wrong, "); putuint(ram); puts(" cycles/KB\n");
+    if (fat_mounted()) {
+        uint32_t disk = stream_file("/Disk/vfstest.bin");
+        puts("[vfs] FAT:   "); puts(disk ? "ok, " : "wrong, "); putuint(disk); puts(" cycles/KB\n");
+    }
+
+    // Seeks, append mode and the descriptor rules
+    int fd = vfs_open("/Tmp/seek.txt", VFS_READ | VFS_WRITE | VFS_CREATE | VFS_TRUNC);
+    char buf[16];
+    int ok = fd >= 0 && vfs_write(fd, "0123456789", 10) == 10;
+    ok = ok && vfs_lseek(fd, -4, VFS_SEEK_END) == 6 && vfs_read(fd, buf, sizeof(buf)) == 4 && memcmp(buf, "6789", 4) == 0;
+    ok = ok && vfs_read(fd, buf, sizeof(buf)) == 0 && vfs_lseek(fd, -11, VFS_SEEK_END) < 0;
+    ok = ok && vfs_close(fd) == 0 && vfs_close(fd) < 0;
+    fd = vfs_open("/Tmp/seek.txt", VFS_WRITE | VFS_APPEND);
+    ok = ok && fd >= 0 && vfs_write(fd, "ab", 2) == 2 && vfs_read(fd, buf, 1) < 0 && vfs_close(fd) == 0;
+    ok = ok && fs_read_at("/Tmp/seek.txt", 8, buf, sizeof(buf)) == 4 && memcmp(buf, "89ab", 4) == 0;
+    ok = ok && vfs_open("/Tmp/missing.txt", VFS_READ) < 0 && vfs_open("/Tmp", VFS_WRITE) < 0;
+    fs_remove("/Tmp/seek.txt");
+    puts(ok ? "[vfs] seek, append, close ok\n" : "[vfs] seek, append, close wrong\n");
+
+    // The initrd, read-only, as it is in the module
+    if (initrd_info()->start) {
+        fd = vfs_open(INITRD_MOUNT "/Saved/motd.txt", VFS_READ);
+        uint32_t size;
+        const char* motd = (const char*)fs_read_static("/Saved/motd.txt", &size);
+        ok = fd >= 0 && motd && size >= 8 && vfs_read(fd, buf, 8) == 8 && memcmp(buf, motd, 8) == 0;
+        vfs_close(fd);
+        ok = ok && vfs_open(INITRD_MOUNT "/Saved/new.txt", VFS_WRITE | VFS_CREATE) < 0;
+        puts(ok ? "[vfs] " INITRD_MOUNT " ok\n" : "[vfs] " INITRD_MOUNT " wrong\n");
+    }
+
+    // Directories list through readdir
+    fd = vfs_open("/Apps", VFS_READ);
+    VfsDirent e;
+    int apps = 0;
+    while (fd >= 0 && vfs_readdir(fd, &e) > 0) apps++;
+    vfs_close(fd);
+    puts("[vfs] /Apps has "); putuint(apps); puts(" entries\n");
+
+    // The same from ring 3, through the syscalls
+    ProcResult r;
+    int pid = process_spawn("/Apps/files", 0);
+    if (pid < 0 || process_wait(pid, &r) < 0) {
+        puts("[vfs] could not run /Apps/files\n");
+    } else {
+        puts(r.exit_code == 0 ? "[vfs] user descriptors ok\n" : "[vfs] user descriptors wrong\n");
+    }
+}
+
+#define MT_DISK_SIZE (10 * 1024 * 1024)
+#define MT_RAM_SIZE  (1024 * 1024)
+#define MT_PIECE     (16 * 1024)
+#define MT_SHARED    "/Tmp/shared.bin"
+
+// Byte i of the dataset, as user/mapper.c expects it
+static uint8_t mt_byte(uint32_t i) {
+    return (uint8_t)(i * 31 + (i >> 12));
+}
+
+static void print_pcache(const char* when) {
+    PcacheStats s;
+    pcache_stats(&s);
+    puts("[mmap] cache "); puts(when); puts(": "); putuint(s.pages); puts(" pages, ");
+    putuint(s.mapped); puts(" mapped, "); putuint(s.hits); puts(" hits, "); putuint(s.misses);
+    puts(" misses, "); putuint(s.evictions); puts(" evicted, "); putuint(s.writebacks); puts(" written back\n");
+}
+
+// One read() pass over path; cycles per MB, 0 if the data is wrong
+static uint32_t read_pass(const char* path, uint32_t size) {
+    static uint8_t piece[MT_PIECE];
+    int fd = vfs_open(path, VFS_READ);
+    if (fd < 0) return 0;
+    uint64_t start = rdtsc();
+    uint32_t total = 0;
+    int n, ok = 1;
+    while (ok && (n = vfs_read(fd, piece, MT_PIECE)) > 0) {
+        for (int i = 0; i < n && ok; i++) ok = piece[i] == mt_byte(total + i);
+        total += n;
+    }
+    uint64_t cycles = rdtsc() - start;
+    vfs_close(fd);
+    return ok && total == size ? (uint32_t)div64_32(cycles, size >> 20) : 0;
+}
+
+void test_mmap() {
+    // The dataset: 10 MB on the disk, or 1 MB in /Tmp without one
+    static uint8_t piece[MT_PIECE];
+    const char* path = fat_mounted() ? "/Disk/dataset.bin" : "/Tmp/dataset.bin";
+    uint32_t size = fat_mounted() ? MT_DISK_SIZE : MT_RAM_SIZE;
+    fs_remove("/Tmp/dataset.bin");
+    int fd = vfs_open(path, VFS_WRITE | VFS_CREATE | VFS_TRUNC);
+    int ok = fd >= 0;
+    for (uint32_t off = 0; off < size && ok; off += MT_PIECE) {
+        for (uint32_t i = 0; i < MT_PIECE; i++) piece[i] = mt_byte(off + i);
+        ok = vfs_write(fd, piece, MT_PIECE) == MT_PIECE;
+    }
+    vfs_close(fd);
+    if (!ok) {
+        puts("[mmap] could not write "); puts(path); puts("\n");
+        return;
+    }
+    puts("[mmap] "); puts(path); puts(", "); putuint(size >> 20); puts(" MB\n");
+
+    // read() through the cache; a second pass hits if the file fits
+    uint32_t cold = read_pass(path, size);
+    uint32_t warm = read_pass(path, size);
+    puts("[mmap] read(): "); putuint(cold); puts(" then "); putuint(warm); puts(" cycles/MB\n");
+    print_pcache("after read()");
+
+    // Two zeroed pages for the shared mapping test
+    ok = fs_write(MT_SHARED, "", 0) == 0 && fs_truncate(MT_SHARED, 2 * PAGE_SIZE) == 0;
+
+    ProcResult r;
+    int pid = ok ? process_spawn("/Apps/mapper", 0) : -1;
+    if (pid < 0 || process_wait(pid, &r) < 0) {
+        puts("[mmap] could not run /Apps/mapper\n");
+    } else {
+        puts("[mmap] mapped scan and checks: "); putuint((uint32_t)div64_32(r.run_cycles, size >> 20));
+        puts(" cycles/MB, exit "); putint(r.exit_code); puts(r.exit_code == 0 ? " ok\n" : " wrong\n");
+    }
+    print_pcache("after mmap");
+
+    // msync wrote the parent's page and the child's, which its exit handed over
+    char buf[8];
+    ok = fs_read_at(MT_SHARED, 0, buf, 7) == 7 && memcmp(buf, "parent", 7) == 0;
+    ok = ok && fs_read_at(MT_SHARED, PAGE_SIZE, buf, 6) == 6 && memcmp(buf, "child", 6) == 0;
+    puts(ok ? "[mmap] shared writes reached the file\n" : "[mmap] shared writes lost\n");
+
+    // The mapper's child wrote "live" and sleeps with it still mapped and
+    // dirty; growing the file collects it before reading the pages again
+    sleep_t(TIMER_HZ / 2);
+    ok = fs_truncate(MT_SHARED, 3 * PAGE_SIZE) == 0;
+    ok = ok && fs_read_at(MT_SHARED, 100, buf, 5) == 5 && memcmp(buf, "live", 5) == 0;
+    puts(ok ? "[mmap] live mapping's writes kept across a truncate\n" : "[mmap] live mapping's writes lost\n");
+
+    // A mapper's dirty page survives an append, and sees a rewrite in place
+    int id = pcache_open(MT_SHARED);
+    uint8_t* frame = id >= 0 ? (uint8_t*)pcache_get(id, 0) : NULL;
+    ok = frame != NULL;
+    if (ok) {
+        memcpy(frame, "mapped", 7);
+        pcache_set_dirty(id, 0);
+        ok = fs_append(MT_SHARED, "!", 1) == 0 && fs_read_at(MT_SHARED, 0, buf, 7) == 7 && memcmp(buf, "mapped", 7) == 0;
+        ok = ok && fs_write(MT_SHARED, "fresh", 6) == 0 && memcmp(frame, "fresh", 6) == 0;
+        uint8_t* again = (uint8_t*)pcache_get(id, 0);
+        ok = ok && again == frame;
+        if (again) pcache_put(again);
+        pcache_put(frame);
+    }
+    if (id >= 0) pcache_close(id);
+    puts(ok ? "[mmap] mapped page kept across changes ok\n" : "[mmap] mapped page kept across changes wrong\n");
+
+    fs_remove(MT_SHARED);
+    fs_remove(path);
+}
+
+#define LZ_SIZE   (64 * 1024)
+#define LZ_PATH   "/Tmp/packed.txt"
+#define LZ_STATIC "/Tmp/static.txt"
+
+// Log-like text: repetitive, but not a single repeated string
+static void lz_text(uint8_t* buf, uint32_t size) {
+    static const char* words[] = { "read ", "write ", "sync ", "evict ", "fault " };
+    uint32_t n = 0;
+    for (uint32_t line = 0; n < size; line++) {
+        const char* parts[3] = { "[fs] ", words[line % 5], words[(line / 5) % 5] };
+        for (int p = 0; p < 3; p++) {
+            for (const char* c = parts[p]; *c && n < size; c++) buf[n++] = *c;
+        }
+        for (uint32_t d = 100000; d && n < size; d /= 10) buf[n++] = '0' + line / d % 10;
+        if (n < size) buf[n++] = '\n';
+    }
+}
+
+// Does path read back as expected, whole and in odd-sized pieces from
+// odd offsets?
+static int lz_check(const char* path, const uint8_t* expect, uint32_t size) {
+    static uint8_t buf[LZ_SIZE];
+    if (fs_read_at(path, 0, buf, size) != (int)size || memcmp(buf, expect, size) != 0) return 0;
+    for (uint32_t off = 7; off < size; off += 5003) {
+        uint32_t len = off % 6000 + 1;
+        if (len > size - off) len = size - off;
+        if (fs_read_at(path, off, buf, len) != (int)len || memcmp(buf, expect + off, len) != 0) return 0;
+    }
+    return 1;
+}
+
+static uint32_t lz_packed(const char* path) {
+    FsStat st;
+    return fs_stat(path, &st) == 0 ? st.packed : 0;
+}
+
+void test_lz4() {
+    static uint8_t text[LZ_SIZE];
+    static uint8_t noise[LZ_SIZE];
+    lz_text(text, LZ_SIZE);
+    for (uint32_t i = 0; i < LZ_SIZE; i++) noise[i] = (uint8_t)((i * 2654435761u) >> 13);
+
+    // Compressing a file and reading it back
+    int ok = fs_write(LZ_PATH, text, LZ_SIZE) == 0 && fs_compress(LZ_PATH, 1) == 1;
+    uint32_t packed = lz_packed(LZ_PATH);
+    puts("[lz4] "); putuint(LZ_SIZE); puts(" bytes of text packed into "); putuint(packed);
+    puts(" ("); putuint(packed * 100 / LZ_SIZE); puts("%)\n");
+    ok = ok && packed && lz_check(LZ_PATH, text, LZ_SIZE);
+    puts(ok ? "[lz4] reads ok\n" : "[lz4] reads wrong\n");
+
+    // Rereading one page comes from the LRU
+    ZcacheStats before, after;
+    char c;
+    zcache_stats(&before);
+    fs_read_at(LZ_PATH, 100, &c, 1);
+    fs_read_at(LZ_PATH, 200, &c, 1);
+    zcache_stats(&after);
+    puts(after.hits - before.hits >= 1 ? "[lz4] rereads hit\n" : "[lz4] rereads missed\n");
+
+    // A write in place unpacks the file; rewriting it packs it again
+    ok = fs_write_at(LZ_PATH, 5000, "PATCH", 5) == 0 && lz_packed(LZ_PATH) == 0;
+    memcpy(text + 5000, "PATCH", 5);
+    ok = ok && lz_check(LZ_PATH, text, LZ_SIZE);
+    ok = ok && fs_write(LZ_PATH, text, LZ_SIZE) == 0 && lz_packed(LZ_PATH) != 0 && lz_check(LZ_PATH, text, LZ_SIZE);
+    puts(ok ? "[lz4] unpack on write ok\n" : "[lz4] unpack on write wrong\n");
+
+    // Data that doesn't shrink stays as it is
+    ok = fs_write(LZ_PATH, noise, LZ_SIZE) == 0 && lz_packed(LZ_PATH) == 0 && lz_check(LZ_PATH, noise, LZ_SIZE);
+    puts(ok ? "[lz4] noise left alone\n" : "[lz4] noise packed\n");
+    fs_remove(LZ_PATH);
+
+    // A borrowed pack, the way packed initrd members are added
+    static uint8_t pack[LZ_SIZE + PAGE_SIZE];
+    const uint8_t* pages[LZ_SIZE / LZ4_PACK_PAGE];
+    for (uint32_t i = 0; i < LZ_SIZE / LZ4_PACK_PAGE; i++) pages[i] = text + i * LZ4_PACK_PAGE;
+    uint32_t len = lz4_pack(pack, pages, LZ_SIZE);
+    ok = lz4_pack_check(pack, len) == 0 && fs_add_packed(LZ_STATIC, pack) && lz_check(LZ_STATIC, text, LZ_SIZE);
+    ok = ok && fs_append(LZ_STATIC, "!", 1) == 0 && lz_packed(LZ_STATIC) == 0;
+    puts(ok ? "[lz4] static pack ok\n" : "[lz4] static pack wrong\n");
+    fs_remove(LZ_STATIC);
+
+    // A damaged block is an error, not the end of the file
+    ((Lz4Pack*)pack)->offsets[1] = ((Lz4Pack*)pack)->offsets[0] + 1;
+    ok = fs_add_packed(LZ_STATIC, pack) && fs_read_at(LZ_STATIC, 0, &c, 1) < 0;
+    puts(ok ? "[lz4] damaged pack fails reads\n" : "[lz4] damaged pack read as data\n");
+    fs_remove(LZ_STATIC);
+    if (initrd_info()->start) {
+        puts("[lz4] initrd: "); putuint(initrd_info()->packed); puts(" of ");
+        putuint(initrd_info()->files); puts(" files packed\n");
+    }
+
+    // Unpacking speed, from the page LRU's own counters
+    zcache_stats(&after);
+    puts("[lz4] unpacked "); putuint((uint32_t)(after.unpacked >> 10)); puts(" KB in ");
+    putuint(time_cycles_to_us(after.cycles)); puts(" us, "); putuint(after.files); puts(" packs left\n");
+}
+
 void test(int testnum) {
     clear();
     puts("Press 'q' to return to main menu\n");
@@ -267,6 +1575,86 @@ void test(int testnum) {
             puts("[test]: string and heap test\n");
             string_and_heap_test();
             break;
+        case 7:
+            puts("[test]: syscall entry benchmark\n");
+            test_syscall_bench();
+            break;
+        case 8:
+            puts("[test]: syscall return ABI test\n");
+            test_syscall_abi();
+            break;
+        case 9:
+            puts("[test]: batched syscall ring test\n");
+            test_ioring();
+            break;
+        case 10:
+            puts("[test]: shared time page test\n");
+            test_timepage();
+            break;
+        case 11:
+            puts("[test]: wait queue test\n");
+            test_wait_queue();
+            break;
+        case 12:
+            puts("[test]: SMP parallel checksum\n");
+            test_parallel_checksum();
+            break;
+        case 13:
+            puts("[test]: concurrency primitives stress test\n");
+            test_sync_stress();
+            break;
+        case 14:
+            puts("[test]: async executor test\n");
+            test_async();
+            break;
+        case 15:
+            puts("[test]: ring 3 process test\n");
+            test_user_process();
+            break;
+        case 16:
+            puts("[test]: fork and shared text test\n");
+            test_fork_cow();
+            break;
+        case 17:
+            puts("[test]: filesystem hash table test\n");
+            test_fs_table();
+            break;
+        case 18:
+            puts("[test]: writable file test\n");
+            test_fs_write();
+            break;
+        case 19:
+            puts("[test]: directory tree test\n");
+            test_fs_dirs();
+            break;
+        case 20:
+            puts("[test]: initrd test\n");
+            test_initrd();
+            break;
+        case 21:
+            puts("[test]: disk and block cache test\n");
+            test_block_cache();
+            break;
+        case 22:
+            puts("[test]: block queue and read-ahead test\n");
+            test_block_queue();
+            break;
+        case 23:
+            puts("[test]: FAT filesystem test\n");
+            test_fat();
+            break;
+        case 24:
+            puts("[test]: VFS and file descriptor test\n");
+            test_vfs();
+            break;
+        case 25:
+            puts("[test]: mmap and page cache test\n");
+            test_mmap();
+            break;
+        case 26:
+            puts("[test]: LZ4 compression test\n");
+            test_lz4();
+            break;
         default:
             setcolor(0,15);
             puts("test not found\n");
@@ -281,4 +1669,4 @@ void test(int testnum) {
             draw_start();
         }
     }
-}
\ No newline at end of file
+}
@@ -2,6 +2,13 @@
 #include "timer.h"
 #include "kernel.h"
 #include "screen.h"
+#include "ioring.h"
+#include "timepage.h"
+#include "task.h"
+#include "async.h"
+#include "load.h"
+#include "cpu.h"
+#include "ata.h"
 #include <stdint.h>
 
 volatile uint32_t tick_count = 0;
@@ -9,33 +16,48 @@ extern int menu;
 
 void timer_callback() {
     tick_count++;
+    timepage_tick();
+    task_timer_wake(tick_count);
     if (menu) {
         draw_uptime();
     }
-
+    ioring_poll();
+    async_tick(tick_count);
+    load_tick(tick_count);
+    ata_tick(tick_count);
+    task_tick();
 }
 void sleep(uint32_t seconds) {
-    __asm__ __volatile__ ("sti");
-    uint32_t start = tick_count;
-    while ((tick_count - start) < (seconds * 100)) {
-        // 18.2 Hz by default if PIT isn't configured.
-        // Replace 18 with real frequency if configured.
-    }
+    sleep_t(seconds * TIMER_HZ);
 }
+
 void sleep_ms(uint32_t miliseconds) {
-    __asm__ __volatile__ ("sti");
-    uint32_t start = tick_count;
-    while ((tick_count - start) < (miliseconds / 10)) {
-        // 18.2 Hz by default if PIT isn't configured.
-        // Replace 18 with real frequency if configured.
-    }
+    sleep_t(miliseconds * TIMER_HZ / 1000);
 }
 
+// Blocks the calling task on the timer's sleep list instead of spinning
 void sleep_t(uint32_t ticks) {
     __asm__ __volatile__ ("sti");
     uint32_t start = tick_count;
     while ((tick_count - start) < (ticks)) {
-        // 18.2 Hz by default if PIT isn't configured.
-        // Replace 18 with real frequency if configured.
+        if (task_current()) {
+            task_sleep_until(start + ticks);
+        } else {
+            __asm__ __volatile__ ("hlt");
+        }
     }
-}
\ No newline at end of file
+}
+
+// TSC cycles per microsecond, from the time page's calibration. 0 until
+// the first ticks have measured it.
+uint32_t time_tsc_per_us() {
+    return time_page.tsc_per_tick / (1000000 / TIMER_HZ);
+}
+
+// Cycles as microseconds, saturating at 32 bits; 0 before calibration
+uint32_t time_cycles_to_us(uint64_t cycles) {
+    uint32_t per_us = time_tsc_per_us();
+    if (!per_us) return 0;
+    uint64_t us = div64_32(cycles, per_us);
+    return (us >> 32) ? 0xFFFFFFFF : (uint32_t)us;
+}
@@ -0,0 +1,36 @@
+
+#include "timepage.h"
+#include "cpu.h"
+
+TimePage time_page;
+
+void timepage_init(uint32_t hz) {
+    time_page.seq = 0;
+    time_page.hz = hz;
+    time_page.ticks = 0;
+    time_page.tsc_at_tick = rdtsc();
+    time_page.tsc_per_tick = 0;
+    time_page.ns_mult = 0;
+    time_page.ns_per_tick = 1000000000u / hz;
+}
+
+// Timer interrupt: advance the tick and refine the TSC calibration
+void timepage_tick() {
+    uint64_t now = rdtsc();
+    uint64_t delta64 = now - time_page.tsc_at_tick;
+    uint32_t delta = (delta64 >> 32) ? 0xFFFFFFFF : (uint32_t)delta64;
+
+    // Smooth over interrupt jitter: new = 7/8 old + 1/8 sample
+    uint32_t per_tick = time_page.tsc_per_tick;
+    per_tick = per_tick ? per_tick - (per_tick >> 3) + (delta >> 3) : delta;
+    if (!per_tick) per_tick = 1;
+
+    time_page.seq++;
+    __asm__ __volatile__ ("" ::: "memory");
+    time_page.ticks++;
+    time_page.tsc_at_tick = now;
+    time_page.tsc_per_tick = per_tick;
+    time_page.ns_mult = div64_32((uint64_t)time_page.ns_per_tick << 32, per_tick);
+    __asm__ __volatile__ ("" ::: "memory");
+    time_page.seq++;
+}
@@ -0,0 +1,234 @@
+
+#include "vfs.h"
+#include "task.h"
+#include "spinlock.h"
+#include "heap.h"
+#include "string.h"
+#include "screen.h"
+#include "pcache.h"
+#include "mmap.h"
+
+// The ramfs tree is the root filesystem. Other volumes are mounted over
+// one of its directories; fs_* calls for paths below a mount point are
+// handed to that volume's operations, longest mount path first.
+//
+// Descriptors sit on top of the fs_* calls: a File keeps the normalized
+// path and an offset. Reads copy out of the page cache, which mappings
+// of the same file share; writes are one fs_write_at at the offset,
+// which updates any cached pages. Only the pages in use are resident: a
+// file streams through whatever buffer the caller brings.
+
+typedef struct {
+    char path[VFS_MOUNT_PATH];
+    uint32_t len;
+    const VfsOps* ops;
+} Mount;
+
+static Mount mounts[VFS_MAX_MOUNTS];
+static uint32_t mount_count = 0;
+static spinlock_t mount_lock = SPINLOCK_INIT;
+
+// Guards File refs. A task's descriptor slots are only changed by the
+// task itself, or while it can't run (vfs_inherit, vfs_release).
+static spinlock_t files_lock = SPINLOCK_INIT;
+
+// Mount ops over the directory path, creating it in the tree. Mounting
+// the same path again replaces the ops, since kernel_setup can run more
+// than once.
+int vfs_mount(const char* path, const VfsOps* ops) {
+    uint32_t len = strlen(path);
+    if (path[0] != '/' || len < 2 || len >= VFS_MOUNT_PATH) return -1;
+
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
+    uint32_t i = 0;
+    while (i < mount_count && strcmp(mounts[i].path, path) != 0) i++;
+    int ok = i < VFS_MAX_MOUNTS;
+    if (ok) {
+        memcpy(mounts[i].path, path, len + 1);
+        mounts[i].len = len;
+        mounts[i].ops = ops;
+        if (i == mount_count) mount_count++;
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+
+    if (!ok) return -1;
+    fs_mount_point(path);
+    return 0;
+}
+
+// The volume mounted over path, if any. *inner is the path inside it
+// ("/" for the mount point itself), normalized into buf. NULL for paths
+// that stay in the tree.
+const VfsOps* vfs_route(const char* path, char* buf, const char** inner) {
+    if (!mount_count || fs_normalize("/", path, buf, FS_PATH_MAX) < 0) return NULL;
+
+    const VfsOps* ops = NULL;
+    uint32_t best = 0;
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
+    for (uint32_t i = 0; i < mount_count; i++) {
+        Mount* m = &mounts[i];
+        if (m->len > best && strncmp(buf, m->path, m->len) == 0 && (buf[m->len] == '\0' || buf[m->len] == '/')) {
+            best = m->len;
+            ops = m->ops;
+        }
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+
+    if (ops) *inner = buf[best] ? buf + best : "/";
+    return ops;
+}
+
+void vfs_print_mounts() {
+    puts("/  ramfs");
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
+    for (uint32_t i = 0; i < mount_count; i++) {
+        puts("\n");
+        puts(mounts[i].path);
+        puts("  ");
+        puts(mounts[i].ops->name);
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+}
+
+// ---- Descriptors ----
+
+static File* fd_get(int fd) {
+    if (fd < 0 || fd >= TASK_MAX_FILES) return NULL;
+    return task_current()->files[fd];
+}
+
+static void file_put(File* f) {
+    uint32_t flags = spin_lock_irqsave(&files_lock);
+    int last = --f->refs == 0;
+    spin_unlock_irqrestore(&files_lock, flags);
+    if (last) free(f);
+}
+
+// Resolve, create or truncate as the flags say
+static int file_setup(File* f, const char* path, uint32_t flags) {
+    FsStat st;
+    if (fs_normalize("/", path, f->path, FS_PATH_MAX) < 0) return -1;
+    if (fs_stat(f->path, &st) < 0) {
+        if (!(flags & VFS_CREATE) || fs_append(f->path, "", 0) < 0) return -1;
+        if (fs_stat(f->path, &st) < 0) return -1;
+    }
+    if (st.type == FS_DIR && (flags & (VFS_WRITE | VFS_TRUNC | VFS_APPEND))) return -1;
+    if ((flags & VFS_TRUNC) && (!(flags & VFS_WRITE) || fs_truncate(f->path, 0) < 0)) return -1;
+    f->refs = 1;
+    f->flags = flags;
+    f->type = st.type;
+    return 0;
+}
+
+// Returns the lowest free descriptor
+int vfs_open(const char* path, uint32_t flags) {
+    File* f = (File*)calloc(1, sizeof(File));
+    if (!f) return -1;
+    if (file_setup(f, path, flags) == 0) {
+        Task* t = task_current();
+        for (int fd = 0; fd < TASK_MAX_FILES; fd++) {
+            if (!t->files[fd]) {
+                t->files[fd] = f;
+                return fd;
+            }
+        }
+    }
+    free(f);
+    return -1;
+}
+
+// Bytes read, 0 at the end of the file
+int vfs_read(int fd, void* buf, uint32_t len) {
+    File* f = fd_get(fd);
+    if (!f || !(f->flags & VFS_READ) || f->type != FS_FILE) return -1;
+    int n = pcache_read(f->path, f->offset, buf, len);
+    if (n > 0) f->offset += n;
+    return n;
+}
+
+// Writing past the end zero-fills the gap
+int vfs_write(int fd, const void* buf, uint32_t len) {
+    File* f = fd_get(fd);
+    if (!f || !(f->flags & VFS_WRITE)) return -1;
+    if (len > 0x7FFFFFFF) len = 0x7FFFFFFF;
+    if (f->flags & VFS_APPEND) {
+        FsStat st;
+        if (fs_stat(f->path, &st) < 0) return -1;
+        f->offset = st.size;
+    }
+    if (fs_write_at(f->path, f->offset, buf, len) < 0) return -1;
+    f->offset += len;
+    return (int)len;
+}
+
+// Returns the new offset. Seeking past the end is allowed; the next
+// write fills the gap.
+int vfs_lseek(int fd, int32_t offset, int whence) {
+    File* f = fd_get(fd);
+    if (!f || f->type != FS_FILE) return -1;
+
+    int64_t base;
+    if (whence == VFS_SEEK_SET) {
+        base = 0;
+    } else if (whence == VFS_SEEK_CUR) {
+        base = f->offset;
+    } else if (whence == VFS_SEEK_END) {
+        FsStat st;
+        if (fs_stat(f->path, &st) < 0) return -1;
+        base = st.size;
+    } else {
+        return -1;
+    }
+    int64_t pos = base + offset;
+    if (pos < 0 || pos > 0x7FFFFFFF) return -1;
+    f->offset = (uint32_t)pos;
+    return (int)pos;
+}
+
+// 1 with the next entry in out, 0 when there are no more
+int vfs_readdir(int fd, VfsDirent* out) {
+    File* f = fd_get(fd);
+    if (!f || f->type != FS_DIR) return -1;
+    FsDirent e;
+    if (!fs_readdir(f->path, &f->iter, &e)) return 0;
+    strncpy(out->name, e.name, FS_NAME_MAX - 1);
+    out->name[FS_NAME_MAX - 1] = '\0';
+    out->type = e.type;
+    out->size = e.size;
+    return 1;
+}
+
+// Map an open file into the current process, see mmap_map. Shared
+// writable mappings need a descriptor open for writing.
+uint32_t vfs_mmap(int fd, uint32_t len, uint32_t offset, uint32_t flags) {
+    File* f = fd_get(fd);
+    if (!f || f->type != FS_FILE || !(f->flags & VFS_READ)) return 0;
+    if ((flags & MMAP_SHARED) && (flags & MMAP_WRITE) && !(f->flags & VFS_WRITE)) return 0;
+    return mmap_map(f->path, len, offset, flags);
+}
+
+int vfs_close(int fd) {
+    File* f = fd_get(fd);
+    if (!f) return -1;
+    task_current()->files[fd] = NULL;
+    file_put(f);
+    return 0;
+}
+
+void vfs_inherit(Task* child, Task* parent) {
+    if (!parent) return;
+    uint32_t flags = spin_lock_irqsave(&files_lock);
+    for (int fd = 0; fd < TASK_MAX_FILES; fd++) {
+        File* f = parent->files[fd];
+        if (f) f->refs++;
+        child->files[fd] = f;
+    }
+    spin_unlock_irqrestore(&files_lock, flags);
+}
+
+void vfs_release(Task* t) {
+    for (int fd = 0; fd < TASK_MAX_FILES; fd++) {
+        if (t->files[fd]) file_put(t->files[fd]);
+        t->files[fd] = NULL;
+    }
+}
@@ -0,0 +1,67 @@
+
+#include "wait.h"
+#include "task.h"
+#include "cpu.h"
+
+void wait_queue_init(WaitQueue* wq) {
+    wq->head = 0;
+    wq->tail = 0;
+}
+
+void wait_sleep(WaitQueue* wq) {
+    Task* t = task_current();
+    if (!t) {
+        // No scheduler yet: just wait for the next interrupt
+        spin_unlock(&sched_lock);
+        __asm__ __volatile__ ("sti; hlt; cli");
+        spin_lock(&sched_lock);
+        return;
+    }
+
+    t->wait_next = 0;
+    t->waitq = wq;
+    if (wq->tail) {
+        wq->tail->wait_next = t;
+    } else {
+        wq->head = t;
+    }
+    wq->tail = t;
+
+    task_block();
+}
+
+static Task* wait_pop(WaitQueue* wq) {
+    Task* t = wq->head;
+    if (!t) return 0;
+    wq->head = t->wait_next;
+    if (!wq->head) wq->tail = 0;
+    t->wait_next = 0;
+    t->waitq = 0;
+    return t;
+}
+
+// For callers that already hold sched_lock
+int wake_up_locked(WaitQueue* wq) {
+    int woken = 0;
+    Task* t;
+    while ((t = wait_pop(wq))) {
+        task_wake_locked(t);
+        woken++;
+    }
+    return woken;
+}
+
+int wake_up(WaitQueue* wq) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    int woken = wake_up_locked(wq);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return woken;
+}
+
+int wake_up_one(WaitQueue* wq) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    Task* t = wait_pop(wq);
+    if (t) task_wake_locked(t);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return t ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+#include "zcache.h"
+#include "lz4.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "heap.h"
+#include "wait.h"
+
+// Packed files are unpacked a page at a time into a handful of buffers,
+// least recently used reused first, so sequential reads unpack each page
+// once and a file's hot pages stay unpacked.
+//
+// zc_lock only covers the bookkeeping. A page is unpacked into a slot
+// claimed as loading, and copied out of one held with a reference, both
+// with the lock dropped; neither slot can be reused meanwhile. Readers
+// after a page being unpacked, or finding every buffer held, sleep on
+// zc_wq until something changes.
+
+typedef struct {
+    const void* pack;          // NULL when unused
+    uint32_t index;
+    uint32_t len;
+    uint32_t used;             // use_clock at the last hit
+    uint32_t refs;             // Readers copying out, or its unpacker
+    uint8_t loading;           // Being unpacked: no one else reads it yet
+} ZcacheSlot;
+
+static ZcacheSlot slots[ZCACHE_PAGES];
+static uint8_t buffers[ZCACHE_PAGES][PAGE_SIZE];
+static uint32_t use_clock = 0;
+static ZcacheStats stats;
+static spinlock_t zc_lock = SPINLOCK_INIT;
+static WaitQueue zc_wq = WAIT_QUEUE_INIT;
+static volatile uint32_t zc_gen = 0;   // Bumped when a slot loads or is let go
+static uint32_t zc_waiting = 0;        // Sleepers on zc_wq
+
+// zc_lock held. Something a sleeper may be waiting for happened; the
+// caller wakes zc_wq once the lock is dropped if this returns 1.
+static int changed() {
+    zc_gen++;
+    return zc_waiting != 0;
+}
+
+// The slot holding page index of pack, unpacked if need be, with a
+// reference for the caller to drop with page_put; NULL if the block is
+// damaged.
+static ZcacheSlot* page_get(const void* pack, uint32_t index) {
+    int waited = 0;
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&zc_lock);
+        if (waited) zc_waiting--;
+        ZcacheSlot* found = NULL;
+        ZcacheSlot* victim = NULL;
+        for (int i = 0; i < ZCACHE_PAGES && !found; i++) {
+            ZcacheSlot* s = &slots[i];
+            if (s->pack == pack && s->index == index) {
+                found = s;
+            } else if (!s->refs && (!victim || (victim->pack && (!s->pack || s->used < victim->used)))) {
+                victim = s;
+            }
+        }
+        if (found && !found->loading) {
+            stats.hits++;
+            found->refs++;
+            found->used = ++use_clock;
+            spin_unlock_irqrestore(&zc_lock, flags);
+            return found;
+        }
+        if (found || !victim) {
+            // Someone else is unpacking it, or every buffer is held
+            uint32_t gen = zc_gen;
+            zc_waiting++;
+            waited = 1;
+            spin_unlock_irqrestore(&zc_lock, flags);
+            wait_event(zc_wq, zc_gen != gen);
+            continue;
+        }
+
+        victim->pack = pack;
+        victim->index = index;
+        victim->used = ++use_clock;
+        victim->refs = 1;
+        victim->loading = 1;
+        stats.misses++;
+        spin_unlock_irqrestore(&zc_lock, flags);
+
+        uint64_t start = rdtsc();
+        int len = lz4_pack_page(pack, index, buffers[victim - slots]);
+        uint64_t cycles = rdtsc() - start;
+
+        flags = spin_lock_irqsave(&zc_lock);
+        stats.cycles += cycles;
+        victim->loading = 0;
+        if (len < 0) {
+            victim->pack = NULL;
+            victim->refs = 0;
+            victim = NULL;
+        } else {
+            stats.unpacked += len;
+            victim->len = len;
+        }
+        int wake = changed();
+        spin_unlock_irqrestore(&zc_lock, flags);
+        if (wake) wake_up(&zc_wq);
+        return victim;
+    }
+}
+
+static void page_put(ZcacheSlot* s) {
+    uint32_t flags = spin_lock_irqsave(&zc_lock);
+    s->refs--;
+    int wake = changed();
+    spin_unlock_irqrestore(&zc_lock, flags);
+    if (wake) wake_up(&zc_wq);
+}
+
+// Copy up to len bytes of the unpacked file from offset. Returns how
+// many, or -1 if the pack is damaged. Can sleep while another reader
+// unpacks the same page.
+int zcache_read(const void* pack, uint32_t offset, void* buf, uint32_t len) {
+    uint32_t size = lz4_pack_size(pack);
+    if (offset >= size) return 0;
+    if (len > size - offset) len = size - offset;
+
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t within = (offset + done) % LZ4_PACK_PAGE;
+        uint32_t chunk = LZ4_PACK_PAGE - within;
+        if (chunk > len - done) chunk = len - done;
+        ZcacheSlot* s = page_get(pack, (offset + done) / LZ4_PACK_PAGE);
+        if (!s) return -1;
+        memcpy((uint8_t*)buf + done, buffers[s - slots] + within, chunk);
+        page_put(s);
+        done += chunk;
+    }
+    return (int)len;
+}
+
+// A pack the filesystem now holds, for the compression ratio
+void zcache_add(const void* pack) {
+    uint32_t flags = spin_lock_irqsave(&zc_lock);
+    stats.files++;
+    stats.raw_bytes += lz4_pack_size(pack);
+    stats.packed_bytes += lz4_pack_len(pack);
+    spin_unlock_irqrestore(&zc_lock, flags);
+}
+
+// The pack is going away: drop its pages and take it out of the totals.
+// Its file's lock keeps readers of it out, so none of them holds a slot.
+void zcache_forget(const void* pack) {
+    uint32_t flags = spin_lock_irqsave(&zc_lock);
+    for (int i = 0; i < ZCACHE_PAGES; i++) {
+        if (slots[i].pack == pack) slots[i].pack = NULL;
+    }
+    stats.files--;
+    stats.raw_bytes -= lz4_pack_size(pack);
+    stats.packed_bytes -= lz4_pack_len(pack);
+    spin_unlock_irqrestore(&zc_lock, flags);
+}
+
+void zcache_stats(ZcacheStats* out) {
+    uint32_t flags = spin_lock_irqsave(&zc_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&zc_lock, flags);
+}
@@ -0,0 +1,121 @@
+// Host tool: copy a ustar archive, LZ4-packing every regular file that
+// comes out at least one tar block smaller. Packed members get typeflag
+// TAR_LZ4 and the pack as their contents (see include/lz4.h); the kernel
+// unpacks them as they are read.
+//
+//   mkinitrd in.tar out.tar
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "initrd.h"
+#include "lz4.h"
+
+static uint32_t octal(const char* s, uint32_t len) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++) {
+        n = n * 8 + (s[i] - '0');
+    }
+    return n;
+}
+
+static uint32_t blocks(uint32_t size) {
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK;
+}
+
+static void set_checksum(TarHeader* h) {
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    const uint8_t* b = (const uint8_t*)h;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < TAR_BLOCK; i++) sum += b[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);   // NUL, then the space left over
+}
+
+static void write_member(FILE* out, const TarHeader* h, const uint8_t* data, uint32_t size) {
+    static const uint8_t zero[TAR_BLOCK];
+    fwrite(h, TAR_BLOCK, 1, out);
+    fwrite(data, 1, size, out);
+    fwrite(zero, 1, blocks(size) * TAR_BLOCK - size, out);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s in.tar out.tar\n", argv[0]);
+        return 2;
+    }
+    FILE* in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    long len = ftell(in);
+    rewind(in);
+    uint8_t* tar = malloc(len);
+    if (!tar || fread(tar, 1, len, in) != (size_t)len) {
+        fprintf(stderr, "%s: could not read\n", argv[1]);
+        return 1;
+    }
+    fclose(in);
+
+    FILE* out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    uint32_t files = 0, packed = 0, raw_bytes = 0, packed_bytes = 0;
+    long pos = 0;
+    while (pos + TAR_BLOCK <= len) {
+        TarHeader h;
+        memcpy(&h, tar + pos, TAR_BLOCK);
+        if (h.name[0] == '\0') break;
+        uint32_t size = octal(h.size, sizeof(h.size));
+        const uint8_t* data = tar + pos + TAR_BLOCK;
+        if (size > len - pos - TAR_BLOCK) {
+            fprintf(stderr, "%s: truncated member %.100s\n", argv[1], h.name);
+            return 1;
+        }
+        pos += TAR_BLOCK + blocks(size) * TAR_BLOCK;
+
+        if (h.typeflag != TAR_FILE && h.typeflag != TAR_OLDFILE) {
+            write_member(out, &h, data, size);
+            continue;
+        }
+        files++;
+        raw_bytes += size;
+
+        uint32_t pages = (size + LZ4_PACK_PAGE - 1) / LZ4_PACK_PAGE;
+        const uint8_t** page = malloc((pages + 1) * sizeof(*page));
+        uint8_t* pack = malloc(lz4_pack_bound(size));
+        if (!page || !pack) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (uint32_t i = 0; i < pages; i++) page[i] = data + i * LZ4_PACK_PAGE;
+        uint32_t n = lz4_pack(pack, page, size);
+        if (blocks(n) < blocks(size)) {
+            h.typeflag = TAR_LZ4;
+            snprintf(h.size, sizeof(h.size), "%011o", n);
+            set_checksum(&h);
+            write_member(out, &h, pack, n);
+            packed++;
+            packed_bytes += n;
+        } else {
+            write_member(out, &h, data, size);
+            packed_bytes += size;
+        }
+        free(page);
+        free(pack);
+    }
+
+    // The two zero blocks that end an archive
+    static const uint8_t zero[2 * TAR_BLOCK];
+    fwrite(zero, 1, sizeof(zero), out);
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("mkinitrd: %u files, %u packed, %u -> %u bytes\n", files, packed, raw_bytes, packed_bytes);
+    return 0;
+}
@@ -0,0 +1,11 @@
+
+#include "usys.h"
+
+// Pokes kernel memory. The page fault must kill this process and
+// nothing else.
+int main() {
+    uputs("fault: writing to the kernel image...\n");
+    *(volatile uint32_t*)0x100000 = 0xDEADBEEF;
+    uputs("fault: still alive, memory protection is broken\n");
+    return 1;
+}
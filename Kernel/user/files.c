@@ -0,0 +1,59 @@
+#include "usys.h"
+
+#define PATH  "/Tmp/files.dat"
+#define SIZE  (64 * 1024)
+
+// Stream buffer; the file never has to fit in it
+static uint8_t buf[1024];
+
+// Writes a file bigger than any buffer here through a descriptor, reads
+// it back in pieces, then lists /Apps
+int main() {
+    int ok = 1;
+
+    int fd = uopen(PATH, VFS_READ | VFS_WRITE | VFS_CREATE | VFS_TRUNC);
+    if (fd < 0) {
+        uputs("files: can't open " PATH "\n");
+        return 1;
+    }
+    for (uint32_t off = 0; off < SIZE; off += sizeof(buf)) {
+        for (uint32_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)((off + i) * 7);
+        if (uwrite(fd, buf, sizeof(buf)) != (int)sizeof(buf)) ok = 0;
+    }
+
+    FsStat st;
+    if (ustat(PATH, &st) < 0 || st.size != SIZE) ok = 0;
+
+    // Back to the start and check every byte as it streams past
+    if (ulseek(fd, 0, VFS_SEEK_SET) != 0) ok = 0;
+    uint32_t total = 0;
+    int n;
+    while ((n = uread(fd, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (buf[i] != (uint8_t)((total + i) * 7)) ok = 0;
+        }
+        total += n;
+    }
+    if (n < 0 || total != SIZE) ok = 0;
+
+    // Seeking from the end lands on the last byte
+    if (ulseek(fd, -1, VFS_SEEK_END) != SIZE - 1 || uread(fd, buf, 1) != 1 || buf[0] != (uint8_t)((SIZE - 1) * 7)) ok = 0;
+    uclose(fd);
+
+    int dir = uopen("/Apps", VFS_READ);
+    if (dir < 0) {
+        ok = 0;
+    } else {
+        VfsDirent e;
+        uputs("files: /Apps has");
+        while (ureaddir(dir, &e) > 0) {
+            uputs(" ");
+            uputs(e.name);
+        }
+        uputs("\n");
+        uclose(dir);
+    }
+
+    uputs(ok ? "files: streamed a file through descriptors\n" : "files: descriptor I/O broken\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+
+#include "usys.h"
+
+#define CHILDREN 4
+
+// Lives on a data page that fork shares copy-on-write
+static int counter = 100;
+
+// Each child bumps its own copy of counter; the parent's must not move
+int main() {
+    int pids[CHILDREN];
+    for (int i = 0; i < CHILDREN; i++) {
+        pids[i] = ufork();
+        if (pids[i] == 0) {
+            counter += i + 1;
+            return counter;
+        }
+    }
+
+    int ok = 1;
+    for (int i = 0; i < CHILDREN; i++) {
+        if (pids[i] < 0 || uwait(pids[i]) != 100 + i + 1) ok = 0;
+    }
+    if (counter != 100) ok = 0;
+
+    uputs(ok ? "forktest: children had their own copies\n" : "forktest: copy-on-write broken\n");
+    return ok ? 0 : 1;
+}
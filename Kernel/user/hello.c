@@ -0,0 +1,19 @@
+
+#include "usys.h"
+
+// The first ring 3 program: says hello, shows it really is in ring 3
+// and reads the clock from the time page (a fault there would kill it)
+int main() {
+    uint16_t cs;
+    __asm__ __volatile__ ("mov %%cs, %0" : "=r"(cs));
+
+    uputs("Hello from user space! pid ");
+    uputint(ugetpid());
+    uputs(", ring ");
+    uputint(cs & 3);
+    uputs(", up ");
+    const TimePage* tp = utimepage();
+    uputint((uint32_t)timepage_ticks(tp) * (1000 / tp->hz));
+    uputs(" ms\n");
+    return 0;
+}
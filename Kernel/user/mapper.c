@@ -0,0 +1,100 @@
+#include "usys.h"
+
+#define WINDOW (1024 * 1024)
+#define SHARED "/Tmp/shared.bin"
+
+// Exit code bits, one per check that failed
+#define BAD_DATASET 1
+#define BAD_SHARED  2
+#define BAD_PRIVATE 4
+#define BAD_SYNC    8
+
+// What test 25 wrote at byte i of the dataset
+static uint8_t expect(uint32_t i) {
+    return (uint8_t)(i * 31 + (i >> 12));
+}
+
+static void copy(char* dst, const char* src) {
+    while ((*dst++ = *src++)) {}
+}
+
+static int same(const char* a, const char* b) {
+    while (*b && *a == *b) a++, b++;
+    return *b == '\0';
+}
+
+// Read the whole dataset through mappings, a window at a time: the pages
+// come straight from the page cache, nothing is copied
+static int scan_dataset() {
+    int fd = uopen("/Disk/dataset.bin", VFS_READ);
+    if (fd < 0) fd = uopen("/Tmp/dataset.bin", VFS_READ);
+    if (fd < 0) return BAD_DATASET;
+
+    int bad = 0;
+    uint32_t size = (uint32_t)ulseek(fd, 0, VFS_SEEK_END);
+    for (uint32_t off = 0; off < size && !bad; off += WINDOW) {
+        uint32_t len = size - off < WINDOW ? size - off : WINDOW;
+        const uint8_t* p = (const uint8_t*)ummap(fd, len, off, MMAP_READ);
+        if (!p) {
+            bad = BAD_DATASET;
+            break;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            if (p[i] != expect(off + i)) bad = BAD_DATASET;
+        }
+        umunmap((void*)p);
+    }
+    uclose(fd);
+    return bad;
+}
+
+// A shared mapping sees the writes of a forked child; a private one
+// keeps its own
+static int shared_and_private() {
+    int fd = uopen(SHARED, VFS_READ | VFS_WRITE);
+    if (fd < 0) return BAD_SHARED;
+    char* shared = (char*)ummap(fd, 2 * 4096, 0, MMAP_READ | MMAP_WRITE | MMAP_SHARED);
+    char* priv = (char*)ummap(fd, 4096, 0, MMAP_READ | MMAP_WRITE);
+    if (!shared || !priv) return BAD_SHARED;
+
+    int bad = 0;
+    int pid = ufork();
+    if (pid == 0) {
+        copy(shared + 4096, "child");
+        uexit(0);
+    }
+    if (pid < 0 || uwait(pid) != 0 || !same(shared + 4096, "child")) bad |= BAD_SHARED;
+
+    copy(shared, "parent");
+    priv[0] = 'X';
+    if (shared[0] != 'p' || !same(priv, "Xarent")) bad |= BAD_PRIVATE;
+
+    if (umsync(shared) < 0) bad |= BAD_SYNC;
+    umunmap(priv);
+    umunmap(shared);
+    uclose(fd);
+    return bad;
+}
+
+// Leave a child behind that wrote through a shared mapping and neither
+// msyncs nor exits for a while. Test 25 changes the file meanwhile, and
+// the write must make it in first.
+static void leave_live_write() {
+    int fd = uopen(SHARED, VFS_READ | VFS_WRITE);
+    char* shared = fd >= 0 ? (char*)ummap(fd, 4096, 0, MMAP_READ | MMAP_WRITE | MMAP_SHARED) : 0;
+    if (!shared) return;
+    if (ufork() == 0) {
+        copy(shared + 100, "live");
+        usleep(2);
+        uexit(0);
+    }
+    umunmap(shared);
+    uclose(fd);
+}
+
+int main() {
+    int bad = scan_dataset() | shared_and_private();
+    uputs(bad ? "mapper: mappings broken\n" : "mapper: dataset scanned, shared pages ok\n");
+    leave_live_write();
+    return bad;
+}
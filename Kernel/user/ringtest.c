@@ -0,0 +1,63 @@
+
+#include "usys.h"
+
+#define RING_CHARS 48
+
+// In the process's own memory, as any ring from ring 3 is
+static IoRing ring;
+static IoRing polled;
+
+// Drains one completion; -2 if there is none
+static int reap(IoRing* r) {
+    IoCqe* cqe = ioring_peek_cqe(r);
+    if (!cqe) return -2;
+    int result = cqe->result;
+    ioring_cqe_seen(r);
+    return result;
+}
+
+// Output through a ring from ring 3: a batch for one trap, a bad pointer
+// that must fail alone, and a poll-mode ring that never traps. The poll
+// ring is left registered for the kernel to drop when we exit.
+int main() {
+    int ok = 1;
+    int id = uring_setup(&ring, 0);
+    if (id < 0) {
+        uputs("[ring] ring 3: setup failed\n");
+        return 1;
+    }
+
+    ioring_prep(ioring_get_sqe(&ring), IORING_OP_WRITE, (uint32_t)"[ring] ring 3: ", 0, 0);
+    for (int i = 0; i < RING_CHARS; i++) {
+        ioring_prep(ioring_get_sqe(&ring), IORING_OP_PUTCHAR, "owl!"[i & 3], 0, 0);
+    }
+    ioring_prep(ioring_get_sqe(&ring), IORING_OP_WRITE, 0x100000, 4, 0);   // Kernel memory
+    ioring_prep(ioring_get_sqe(&ring), IORING_OP_PUTCHAR, '\n', 0, 0);
+    if (uring_submit(&ring, id) != RING_CHARS + 3) ok = 0;
+
+    if (reap(&ring) != 15) ok = 0;
+    for (int i = 0; i < RING_CHARS; i++) {
+        if (reap(&ring) != 0) ok = 0;
+    }
+    if (reap(&ring) != -1) ok = 0;
+    if (reap(&ring) != 0) ok = 0;
+
+    // Someone else's slot, or a free one
+    if (uring_exit((id + 1) % MAX_IORINGS) != -1) ok = 0;
+    if (uring_exit(id) != 0) ok = 0;
+
+    int pid = uring_setup(&polled, IORING_SETUP_POLL);
+    if (pid < 0) return 1;
+    ioring_prep(ioring_get_sqe(&polled), IORING_OP_WRITE, (uint32_t)"[ring] ring 3 poll: no trap\n", 0, 0);
+    uring_submit(&polled, pid);
+
+    const TimePage* tp = utimepage();
+    uint64_t end = timepage_ticks(tp) + tp->hz;
+    int result;
+    while ((result = reap(&polled)) == -2 && timepage_ticks(tp) < end) {
+    }
+    if (result < 0) ok = 0;
+
+    uputs(ok ? "[ring] ring 3 ok\n" : "[ring] ring 3 wrong\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+
+#include "usys.h"
+
+// Does nothing for a second. Lets tests see what a running copy costs.
+int main() {
+    usleep(1);
+    return 0;
+}
@@ -0,0 +1,40 @@
+
+#include "usys.h"
+
+#define BENCH_CALLS 10000
+
+typedef int (*usys_path_t)(int, uint32_t, uint32_t, uint32_t, uint32_t);
+
+static uint32_t urdtsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+static uint32_t bench(usys_path_t path) {
+    uint32_t start = urdtsc();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        path(SYSCALL_GETPID, 0, 0, 0, 0);
+    }
+    return (urdtsc() - start) / BENCH_CALLS;
+}
+
+// Both ways into the kernel from ring 3, as test 7 does from ring 0.
+// Exits 1 if they disagree.
+int main() {
+    if (!usys_sysenter) {
+        uputs("[bench] ring 3: sysenter unavailable\n");
+        return 0;
+    }
+    if (usys_fast(SYSCALL_GETPID, 0, 0, 0, 0) != usys_int80(SYSCALL_GETPID, 0, 0, 0, 0)) return 1;
+
+    // Warm up caches and the TLB before measuring
+    bench(usys_int80);
+    bench(usys_fast);
+
+    uint32_t int80 = bench(usys_int80);
+    uint32_t fast = bench(usys_fast);
+    uputs("[bench] ring 3 int 0x80 : "); uputint(int80); uputs(" cycles/call\n");
+    uputs("[bench] ring 3 sysenter : "); uputint(fast); uputs(" cycles/call\n");
+    return 0;
+}
@@ -0,0 +1,162 @@
+
+#ifndef USYS_H
+#define USYS_H
+
+#include <stdint.h>
+#include "syscall.h"
+#include "vfs.h"
+#include "mmap.h"
+#include "timepage.h"
+#include "ioring.h"
+
+// The syscall ABI from ring 3: eax = number, ebx/ecx/edx/esi = args,
+// the result in eax. usys() takes sysenter when the CPU has it (crt0.S
+// checks) and int 0x80 otherwise.
+extern int usys_sysenter;
+
+// int 0x80. The result comes back in edx:eax, so edx doesn't survive.
+static inline int usys_int80(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4) {
+    int ret;
+    __asm__ __volatile__ ("int $0x80"
+                          : "=a"(ret), "+d"(a3)
+                          : "a"(num), "b"(a1), "c"(a2), "S"(a4)
+                          : "memory");
+    return ret;
+}
+
+// sysenter. edi carries the return address and ebp the stack, and
+// sysexit hands them back in edx and ecx, so none of those survive.
+static inline int usys_fast(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4) {
+    int ret;
+    uint32_t ret_eip;
+    __asm__ __volatile__ ("push %%ebp\n\t"
+                          "mov %%esp, %%ebp\n\t"
+                          "mov $1f, %%edi\n\t"
+                          "sysenter\n"
+                          "1:\n\t"
+                          "pop %%ebp"
+                          : "=a"(ret), "+c"(a2), "+d"(a3), "=D"(ret_eip)
+                          : "a"(num), "b"(a1), "S"(a4)
+                          : "memory");
+    return ret;
+}
+
+static inline int usys4(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4) {
+    if (usys_sysenter) return usys_fast(num, a1, a2, a3, a4);
+    return usys_int80(num, a1, a2, a3, a4);
+}
+
+static inline int usys(int num, uint32_t a1, uint32_t a2, uint32_t a3) {
+    return usys4(num, a1, a2, a3, 0);
+}
+
+// The kernel's clock page, mapped read-only: time without a syscall
+static inline const TimePage* utimepage() {
+    return (const TimePage*)USER_TIMEPAGE;
+}
+
+static inline uint64_t uclock_ns() {
+    return timepage_ns(utimepage());
+}
+
+static inline void uputs(const char* s) {
+    usys(SYSCALL_WRITE, (uint32_t)s, 0, 0);
+}
+
+static inline void uputc(char c) {
+    usys(SYSCALL_PUTCHAR, (uint32_t)c, 0, 0);
+}
+
+static inline int ugetpid() {
+    return usys(SYSCALL_GETPID, 0, 0, 0);
+}
+
+static inline void uexit(int code) {
+    usys(SYSCALL_EXIT, (uint32_t)code, 0, 0);
+}
+
+static inline int ufork() {
+    return usys(SYSCALL_FORK, 0, 0, 0);
+}
+
+static inline int uwait(int pid) {
+    return usys(SYSCALL_WAIT, (uint32_t)pid, 0, 0);
+}
+
+static inline void usleep(uint32_t seconds) {
+    usys(SYSCALL_SLEEP, seconds, 0, 0);
+}
+
+// Files: flags and structs as in vfs.h, -1 on failure
+static inline int uopen(const char* path, uint32_t flags) {
+    return usys(SYSCALL_OPEN, (uint32_t)path, flags, 0);
+}
+
+static inline int uread(int fd, void* buf, uint32_t len) {
+    return usys(SYSCALL_READ, (uint32_t)fd, (uint32_t)buf, len);
+}
+
+static inline int uwrite(int fd, const void* buf, uint32_t len) {
+    return usys(SYSCALL_WRITE_FD, (uint32_t)fd, (uint32_t)buf, len);
+}
+
+static inline int ulseek(int fd, int32_t offset, int whence) {
+    return usys(SYSCALL_LSEEK, (uint32_t)fd, (uint32_t)offset, (uint32_t)whence);
+}
+
+static inline int uclose(int fd) {
+    return usys(SYSCALL_CLOSE, (uint32_t)fd, 0, 0);
+}
+
+static inline int ustat(const char* path, FsStat* st) {
+    return usys(SYSCALL_STAT, (uint32_t)path, (uint32_t)st, 0);
+}
+
+static inline int ureaddir(int fd, VfsDirent* out) {
+    return usys(SYSCALL_READDIR, (uint32_t)fd, (uint32_t)out, 0);
+}
+
+// Mappings: flags as in mmap.h. NULL on failure.
+static inline void* ummap(int fd, uint32_t len, uint32_t offset, uint32_t flags) {
+    return (void*)usys4(SYSCALL_MMAP, (uint32_t)fd, len, offset, flags);
+}
+
+static inline int umunmap(void* addr) {
+    return usys(SYSCALL_MUNMAP, (uint32_t)addr, 0, 0);
+}
+
+static inline int umsync(void* addr) {
+    return usys(SYSCALL_MSYNC, (uint32_t)addr, 0, 0);
+}
+
+// Submission rings (ioring.h): many calls for one trap, or none at all
+// with IORING_SETUP_POLL. -1 on failure.
+static inline int uring_setup(IoRing* ring, uint32_t flags) {
+    return usys(SYSCALL_RING_SETUP, (uint32_t)ring, flags, 0);
+}
+
+static inline int uring_submit(IoRing* ring, int id) {
+    uint32_t pending = ioring_publish(ring);
+    if (ring->flags & IORING_SETUP_POLL) return (int)pending;
+    return usys(SYSCALL_ENTER, (uint32_t)id, 0, 0);
+}
+
+static inline int uring_exit(int id) {
+    return usys(SYSCALL_RING_EXIT, (uint32_t)id, 0, 0);
+}
+
+static inline void uputint(int n) {
+    char buf[12];
+    int i = 0;
+    if (n < 0) {
+        uputc('-');
+        n = -n;
+    }
+    do {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+    while (i--) uputc(buf[i]);
+}
+
+#endif